@@ -0,0 +1,176 @@
+/* -*-mode:c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+  Copyright (c) 2018 Rian Hunter
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+
+#include <wasmjit/arena.h>
+
+#include <wasmjit/sys.h>
+
+#define ARENA_ALIGN 16
+#define ARENA_MIN_CHUNK_SIZE (16 * 1024)
+#define ARENA_MAX_CHUNK_SIZE (4 * 1024 * 1024)
+
+struct WasmJITArenaChunk {
+	struct WasmJITArenaChunk *next;
+	size_t size;
+	size_t used;
+	char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+void wasmjit_arena_init(struct WasmJITArena *arena)
+{
+	arena->chunks = NULL;
+	arena->next_chunk_size = ARENA_MIN_CHUNK_SIZE;
+}
+
+static struct WasmJITArenaChunk *new_chunk(struct WasmJITArena *arena,
+					   size_t size)
+{
+	struct WasmJITArenaChunk *chunk;
+	size_t chunk_size, total;
+	int oversized;
+
+	chunk_size = arena->next_chunk_size;
+	if (chunk_size < ARENA_MIN_CHUNK_SIZE)
+		chunk_size = ARENA_MIN_CHUNK_SIZE;
+
+	oversized = chunk_size < size;
+	if (oversized)
+		chunk_size = size;
+
+	if (__builtin_add_overflow(chunk_size, sizeof(*chunk), &total))
+		return NULL;
+
+	chunk = malloc(total);
+	if (!chunk)
+		return NULL;
+
+	chunk->size = chunk_size;
+	chunk->used = 0;
+
+	if (oversized && arena->chunks) {
+		/* keep bumping from the current chunk afterwards */
+		chunk->next = arena->chunks->next;
+		arena->chunks->next = chunk;
+	} else {
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+		if (!oversized && chunk_size < ARENA_MAX_CHUNK_SIZE)
+			arena->next_chunk_size = chunk_size * 2;
+	}
+
+	return chunk;
+}
+
+void *wasmjit_arena_alloc(struct WasmJITArena *arena, size_t size)
+{
+	struct WasmJITArenaChunk *chunk;
+	size_t aligned;
+	void *ret;
+
+	if (!size)
+		size = 1;
+
+	if (__builtin_add_overflow(size, ARENA_ALIGN - 1, &aligned))
+		return NULL;
+	aligned &= ~(size_t)(ARENA_ALIGN - 1);
+
+	chunk = arena->chunks;
+	if (!chunk || chunk->size - chunk->used < aligned) {
+		chunk = new_chunk(arena, aligned);
+		if (!chunk)
+			return NULL;
+	}
+
+	ret = &chunk->data[chunk->used];
+	chunk->used += aligned;
+
+	return ret;
+}
+
+void *wasmjit_arena_calloc(struct WasmJITArena *arena,
+			   size_t nmemb, size_t elt_size)
+{
+	size_t size;
+	void *ret;
+
+	if (__builtin_umull_overflow(nmemb, elt_size, &size))
+		return NULL;
+
+	ret = wasmjit_arena_alloc(arena, size);
+	if (ret)
+		memset(ret, 0, size);
+
+	return ret;
+}
+
+void *wasmjit_arena_dup(struct WasmJITArena *arena,
+			const void *buf, size_t size)
+{
+	void *ret;
+
+	ret = wasmjit_arena_alloc(arena, size);
+	if (ret)
+		memcpy(ret, buf, size);
+
+	return ret;
+}
+
+/* moves every allocation of from into arena, from is left empty */
+void wasmjit_arena_adopt(struct WasmJITArena *arena,
+			 struct WasmJITArena *from)
+{
+	struct WasmJITArenaChunk *last;
+
+	if (!from->chunks)
+		return;
+
+	last = from->chunks;
+	while (last->next)
+		last = last->next;
+
+	/* keep bumping from the current chunk of arena */
+	if (arena->chunks) {
+		last->next = arena->chunks->next;
+		arena->chunks->next = from->chunks;
+	} else {
+		last->next = NULL;
+		arena->chunks = from->chunks;
+	}
+
+	wasmjit_arena_init(from);
+}
+
+void wasmjit_arena_free(struct WasmJITArena *arena)
+{
+	struct WasmJITArenaChunk *chunk = arena->chunks;
+
+	while (chunk) {
+		struct WasmJITArenaChunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+
+	wasmjit_arena_init(arena);
+}
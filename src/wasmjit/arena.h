@@ -0,0 +1,50 @@
+/* -*-mode:c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+  Copyright (c) 2018 Rian Hunter
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+
+#ifndef __WASMJIT__ARENA_H__
+#define __WASMJIT__ARENA_H__
+
+#include <wasmjit/sys.h>
+
+/*
+  A bump allocator, everything allocated from an arena is released at
+  once by wasmjit_arena_free(). A zeroed struct is an empty arena.
+ */
+struct WasmJITArena {
+	struct WasmJITArenaChunk *chunks;
+	size_t next_chunk_size;
+};
+
+void wasmjit_arena_init(struct WasmJITArena *arena);
+void *wasmjit_arena_alloc(struct WasmJITArena *arena, size_t size);
+void *wasmjit_arena_calloc(struct WasmJITArena *arena,
+			   size_t nmemb, size_t elt_size);
+void *wasmjit_arena_dup(struct WasmJITArena *arena,
+			const void *buf, size_t size);
+void wasmjit_arena_adopt(struct WasmJITArena *arena,
+			 struct WasmJITArena *from);
+void wasmjit_arena_free(struct WasmJITArena *arena);
+
+#endif
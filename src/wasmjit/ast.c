@@ -31,150 +31,88 @@ void init_instruction(struct Instr *instr)
 	memset(instr, 0, sizeof(*instr));
 }
 
-void free_instruction(struct Instr *instr)
+void expand_compact_instruction(const struct CompactCode *code, size_t idx,
+				struct Instr *instr)
 {
-	switch (instr->opcode) {
+	const struct CompactInstr *record = &code->instrs[idx];
+
+	init_instruction(instr);
+	instr->opcode = record->opcode;
+
+	switch (record->opcode) {
 	case OPCODE_BLOCK:
-	case OPCODE_LOOP: {
-		struct BlockLoopExtra *block =
-			instr->opcode == OPCODE_BLOCK
-			? &instr->data.block : &instr->data.loop;
-		if (block->instructions) {
-			free_instructions(block->instructions,
-					  block->n_instructions);
-		}
+	case OPCODE_LOOP:
+		instr->data.block.blocktype = record->aux;
 		break;
-	};
-	case OPCODE_IF: {
-		if (instr->data.if_.instructions_then) {
-			free_instructions(instr->data.if_.instructions_then,
-					  instr->data.if_.n_instructions_then);
-		}
-		if (instr->data.if_.instructions_else) {
-			free_instructions(instr->data.if_.instructions_else,
-					  instr->data.if_.n_instructions_else);
-		}
+	case OPCODE_IF:
+		instr->data.if_.blocktype = record->aux;
 		break;
-	}
-	case OPCODE_BR_TABLE: {
-		if (instr->data.br_table.labelidxs) {
-			free(instr->data.br_table.labelidxs);
+	case OPCODE_BR:
+	case OPCODE_BR_IF:
+		instr->data.br.labelidx = record->a;
+		break;
+	case OPCODE_BR_TABLE:
+		instr->data.br_table.n_labelidxs = record->b;
+		instr->data.br_table.labelidxs =
+			&code->br_table_targets[record->a];
+		instr->data.br_table.labelidx =
+			code->br_table_targets[record->a + record->b];
+		break;
+	case OPCODE_CALL:
+		instr->data.call.funcidx = record->a;
+		break;
+	case OPCODE_CALL_INDIRECT:
+		instr->data.call_indirect.typeidx = record->a;
+		break;
+	case OPCODE_GET_LOCAL:
+	case OPCODE_SET_LOCAL:
+	case OPCODE_TEE_LOCAL:
+		instr->data.get_local.localidx = record->a;
+		break;
+	case OPCODE_GET_GLOBAL:
+	case OPCODE_SET_GLOBAL:
+		instr->data.get_global.globalidx = record->a;
+		break;
+	case OPCODE_MISC_PREFIX:
+		instr->data.misc.opcode = record->aux;
+		break;
+	case OPCODE_ATOMIC_PREFIX:
+		instr->data.atomic.opcode = record->aux;
+		instr->data.atomic.memarg.align = record->a;
+		instr->data.atomic.memarg.offset = record->b;
+		break;
+	case OPCODE_I32_CONST:
+		instr->data.i32_const.value = record->a;
+		break;
+	case OPCODE_I64_CONST:
+		instr->data.i64_const.value = record->b;
+		break;
+	case OPCODE_F32_CONST:
+		memcpy(&instr->data.f32_const.value, &record->a,
+		       sizeof(instr->data.f32_const.value));
+		break;
+	case OPCODE_F64_CONST:
+		memcpy(&instr->data.f64_const.value, &record->b,
+		       sizeof(instr->data.f64_const.value));
+		break;
+	default:
+		if (record->opcode >= OPCODE_I32_LOAD &&
+		    record->opcode <= OPCODE_I64_STORE32) {
+			instr->data.i32_load.align = record->a;
+			instr->data.i32_load.offset = record->b;
 		}
 		break;
 	}
-	}
-}
-
-void free_instructions(struct Instr *instructions, size_t n_instructions)
-{
-	size_t i;
-	for (i = 0; i < n_instructions; ++i) {
-		free_instruction(&instructions[i]);
-	}
-	free(instructions);
 }
 
 void wasmjit_init_module(struct Module *module)
 {
 	memset(module, 0, sizeof(*module));
+	wasmjit_arena_init(&module->arena);
 }
 
 void wasmjit_free_module(struct Module *module)
 {
-	if (module->type_section.types) {
-		free(module->type_section.types);
-	}
-
-	if (module->import_section.imports) {
-		uint32_t i;
-		for (i = 0; i < module->import_section.n_imports; ++i) {
-			free(module->import_section.imports[i].name);
-			free(module->import_section.imports[i].module);
-		}
-		free(module->import_section.imports);
-	}
-
-	if (module->function_section.typeidxs) {
-		free(module->function_section.typeidxs);
-	}
-
-	if (module->table_section.tables) {
-		free(module->table_section.tables);
-	}
-
-	if (module->memory_section.memories) {
-		free(module->memory_section.memories);
-	}
-
-	if (module->global_section.globals) {
-		uint32_t i;
-		for (i = 0; i < module->global_section.n_globals; ++i) {
-			free_instructions(module->global_section.globals[i].instructions,
-					  module->global_section.globals[i].n_instructions);
-		}
-		free(module->global_section.globals);
-	}
-
-	if (module->export_section.exports) {
-		uint32_t i;
-		for (i = 0; i < module->export_section.n_exports; ++i) {
-			if (module->export_section.exports[i].name) {
-				free(module->export_section.exports[i].name);
-			}
-		}
-		free(module->export_section.exports);
-	}
-
-
-	if (module->element_section.elements) {
-		uint32_t i;
-		for (i = 0; i < module->element_section.n_elements; ++i) {
-			struct ElementSectionElement *element =
-			    &module->element_section.elements[i];
-
-			if (element->instructions) {
-				free_instructions(element->instructions,
-						  element->n_instructions);
-			}
-
-			if (element->funcidxs) {
-				free(element->funcidxs);
-			}
-		}
-		free(module->element_section.elements);
-	}
-
-	if (module->code_section.codes) {
-		uint32_t i;
-		for (i = 0; i < module->code_section.n_codes; ++i) {
-			struct CodeSectionCode *code = &module->code_section.codes[i];
-
-			if (code->locals) {
-				free(code->locals);
-			}
-
-			if (code->instructions) {
-				free_instructions(code->instructions,
-						  code->n_instructions);
-			}
-		}
-		free(module->code_section.codes);
-	}
-
-	if (module->data_section.datas) {
-		uint32_t i;
-		for (i = 0; i < module->data_section.n_datas; ++i) {
-			struct DataSectionData *data = &module->data_section.datas[i];
-
-			if (data->instructions) {
-				free_instructions(data->instructions,
-						  data->n_instructions);
-			}
-
-			if (data->buf) {
-				free(data->buf);
-			}
-		}
-		free(module->data_section.datas);
-	}
+	wasmjit_arena_free(&module->arena);
+	memset(module, 0, sizeof(*module));
 }
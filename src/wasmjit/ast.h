@@ -25,6 +25,8 @@
 #ifndef __WASMJIT__WASMBIN_H__
 #define __WASMJIT__WASMBIN_H__
 
+#include <wasmjit/arena.h>
+
 #include <wasmjit/sys.h>
 
 enum {
@@ -216,6 +218,54 @@ enum {
 	OPCODE_I64_REINTERPRET_F64 = 0xBD,
 	OPCODE_F32_REINTERPRET_I32 = 0xBE,
 	OPCODE_F64_REINTERPRET_I64 = 0xBF,
+
+	/* followed by an OPCODE_MISC_* LEB128 */
+	OPCODE_MISC_PREFIX = 0xFC,
+
+	/* Threads proposal, followed by an OPCODE_ATOMIC_* byte */
+	OPCODE_ATOMIC_PREFIX = 0xFE,
+};
+
+/* bulk memory proposal, only the operations on memory 0 */
+enum {
+	OPCODE_MISC_MEMORY_COPY = 0x0A,
+	OPCODE_MISC_MEMORY_FILL = 0x0B,
+};
+
+enum {
+	OPCODE_ATOMIC_NOTIFY = 0x00,
+	OPCODE_ATOMIC_I32_WAIT = 0x01,
+	OPCODE_ATOMIC_I64_WAIT = 0x02,
+	OPCODE_ATOMIC_FENCE = 0x03,
+
+	OPCODE_ATOMIC_I32_LOAD = 0x10,
+	OPCODE_ATOMIC_I64_LOAD = 0x11,
+	OPCODE_ATOMIC_I32_LOAD8_U = 0x12,
+	OPCODE_ATOMIC_I32_LOAD16_U = 0x13,
+	OPCODE_ATOMIC_I64_LOAD8_U = 0x14,
+	OPCODE_ATOMIC_I64_LOAD16_U = 0x15,
+	OPCODE_ATOMIC_I64_LOAD32_U = 0x16,
+	OPCODE_ATOMIC_I32_STORE = 0x17,
+	OPCODE_ATOMIC_I64_STORE = 0x18,
+	OPCODE_ATOMIC_I32_STORE8 = 0x19,
+	OPCODE_ATOMIC_I32_STORE16 = 0x1A,
+	OPCODE_ATOMIC_I64_STORE8 = 0x1B,
+	OPCODE_ATOMIC_I64_STORE16 = 0x1C,
+	OPCODE_ATOMIC_I64_STORE32 = 0x1D,
+
+	/*
+	  each read-modify-write operation comes in seven
+	  variants, in this order: i32, i64, i32_8u, i32_16u,
+	  i64_8u, i64_16u, i64_32u
+	*/
+	OPCODE_ATOMIC_RMW_ADD = 0x1E,
+	OPCODE_ATOMIC_RMW_SUB = 0x25,
+	OPCODE_ATOMIC_RMW_AND = 0x2C,
+	OPCODE_ATOMIC_RMW_OR = 0x33,
+	OPCODE_ATOMIC_RMW_XOR = 0x3A,
+	OPCODE_ATOMIC_RMW_XCHG = 0x41,
+	OPCODE_ATOMIC_RMW_CMPXCHG = 0x48,
+	OPCODE_ATOMIC_LAST = 0x4F,
 };
 
 enum {
@@ -285,6 +335,7 @@ struct GlobalType {
 
 struct Limits {
 	uint32_t min, max;
+	uint8_t shared;
 };
 
 #define FUNC_TYPE_N_OUTPUTS(ft) ((ft)->output_type == VALTYPE_NULL ? 0 : 1)
@@ -354,6 +405,13 @@ struct Instr {
 		    i32_store, i64_store, f32_store, f64_store,
 		    i32_store8, i32_store16, i64_store8, i64_store16,
 		    i64_store32;
+		struct AtomicExtra {
+			uint8_t opcode;
+			struct LoadStoreExtra memarg;
+		} atomic;
+		struct {
+			uint8_t opcode;
+		} misc;
 		struct {
 			uint32_t value;
 		} i32_const;
@@ -370,8 +428,39 @@ struct Instr {
 };
 
 void init_instruction(struct Instr *instr);
-void free_instruction(struct Instr *instr);
-void free_instructions(struct Instr *instructions, size_t n_instructions);
+
+/*
+  Fixed size record for one instruction of a compact body, see
+  WASMJIT_PARSE_FLAGS_COMPACT_CODE. Records are stored in body order
+  including the ELSE_TERMINAL and BLOCK_TERMINAL markers, so walking
+  a body is a linear scan.
+
+  aux holds the blocktype of block, loop and if and the sub-opcode of
+  atomics and bulk memory operations. a and b hold the immediates:
+  - block, loop, if: record index of the matching else (0 if none)
+    and of the matching end
+  - br_table: start of its targets in the side table and their
+    count, the default target follows them
+  - memory accesses: align and offset
+  - i64 and f64 constants: the value's bits in b
+  - everything else with an immediate: the immediate in a
+ */
+struct CompactInstr {
+	uint8_t opcode;
+	uint8_t aux;
+	uint32_t a;
+	uint64_t b;
+};
+
+struct CompactCode {
+	size_t n_instrs;
+	struct CompactInstr *instrs;
+	uint32_t *br_table_targets;
+};
+
+/* the Instr equivalent of a record, blocks have no nested lists */
+void expand_compact_instruction(const struct CompactCode *code, size_t idx,
+				struct Instr *instr);
 
 #define TypeSectionType FuncType
 
@@ -459,6 +548,11 @@ struct CodeSection {
 		} *locals;
 		size_t n_instructions;
 		struct Instr *instructions;
+		/* undecoded expression, see WASMJIT_PARSE_FLAGS_RAW_CODE */
+		const char *body;
+		size_t body_size;
+		/* see WASMJIT_PARSE_FLAGS_COMPACT_CODE */
+		struct CompactCode compact;
 	} *codes;
 };
 
@@ -469,10 +563,36 @@ struct DataSection {
 		size_t n_instructions;
 		struct Instr *instructions;
 		uint32_t buf_size;
-		char *buf;
+		const char *buf;
 	} *datas;
 };
 
+/*
+  A custom section in the order it appeared. buf points into the
+  input when parsed with WASMJIT_PARSE_FLAGS_BORROW_INPUT, otherwise
+  it is a copy.
+*/
+struct CustomSection {
+	char *name;
+	uint32_t buf_size;
+	const char *buf;
+	struct CustomSection *next;
+};
+
+/*
+  Index of the function subsection of the "name" custom section,
+  built on first lookup. names are sorted by funcidx.
+*/
+struct FunctionNames {
+	int built;
+	size_t n_names;
+	struct FunctionName {
+		uint32_t funcidx;
+		uint32_t name_size;
+		const char *name;
+	} *names;
+};
+
 struct Module {
 	struct TypeSection type_section;
 	struct ImportSection import_section;
@@ -485,6 +605,10 @@ struct Module {
 	struct ElementSection element_section;
 	struct CodeSection code_section;
 	struct DataSection data_section;
+	struct CustomSection *custom_sections;
+	struct FunctionNames function_names;
+	/* backs every allocation reachable from the sections above */
+	struct WasmJITArena arena;
 };
 
 void wasmjit_init_module(struct Module *module);
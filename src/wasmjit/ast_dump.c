@@ -23,6 +23,7 @@
  */
 
 #include <wasmjit/ast.h>
+#include <wasmjit/parse.h>
 
 #include <inttypes.h>
 #include <stdint.h>
@@ -177,3 +178,36 @@ void dump_instructions(const struct Instr *instructions,
 		dump_instruction(&instructions[i], indent);
 	}
 }
+
+void dump_compact_instructions(const struct CompactCode *code, int indent)
+{
+	size_t i;
+	int depth = indent;
+
+	for (i = 0; i < code->n_instrs; ++i) {
+		struct Instr instruction;
+
+		switch (code->instrs[i].opcode) {
+		case ELSE_TERMINAL:
+			/* an empty else branch is not printed */
+			if (i + 1 < code->n_instrs &&
+			    code->instrs[i + 1].opcode != BLOCK_TERMINAL)
+				printf("%*selse\n", (depth - 1) * 2, "");
+			continue;
+		case BLOCK_TERMINAL:
+			depth -= 1;
+			continue;
+		}
+
+		expand_compact_instruction(code, i, &instruction);
+		dump_instruction(&instruction, depth);
+
+		switch (instruction.opcode) {
+		case OPCODE_BLOCK:
+		case OPCODE_LOOP:
+		case OPCODE_IF:
+			depth += 1;
+			break;
+		}
+	}
+}
@@ -33,4 +33,6 @@ void dump_instruction(const struct Instr *instructions,
 void dump_instructions(const struct Instr *instructions, size_t n_instructions,
 		       int indent);
 
+void dump_compact_instructions(const struct CompactCode *code, int indent);
+
 #endif
@@ -25,7 +25,9 @@
 #include <wasmjit/compile.h>
 
 #include <wasmjit/ast.h>
+#include <wasmjit/parse.h>
 #include <wasmjit/util.h>
+#include <wasmjit/validate.h>
 #include <wasmjit/vector.h>
 #include <wasmjit/runtime.h>
 
@@ -290,10 +292,8 @@ static int emit_br_code(struct SizedBuffer *output,
 }
 
 struct InstructionMD {
-	const struct Instr *initiator;
-	size_t cont;
-	const struct Instr *instructions;
-	size_t n_instructions;
+	uint8_t opcode;
+	uint8_t blocktype;
 	union {
 		struct {
 			size_t label_idx;
@@ -310,6 +310,133 @@ struct InstructionMD {
 	} data;
 };
 
+struct ControlStack {
+	size_t n_elts;
+	struct InstructionMD *elts;
+};
+
+static DEFINE_VECTOR_GROW(control, struct ControlStack);
+static DEFINE_VECTOR_TRUNCATE(control, struct ControlStack);
+
+/*
+  Yields a function body one instruction at a time, either decoding
+  straight from the code section bytes, expanding compact records or
+  walking an already parsed Instr tree. All produce the same flat
+  sequence, including the ELSE_TERMINAL and BLOCK_TERMINAL markers, so
+  the compiler only needs a single control stack.
+ */
+struct InstructionSource {
+	struct ParseState *pstate;
+	const struct CompactCode *compact;
+	size_t pos;
+	struct Instr instr;
+	struct InstructionFrames {
+		size_t n_elts;
+		struct InstructionFrame {
+			const struct Instr *instructions;
+			size_t n_instructions;
+			size_t cont;
+			const struct Instr *instructions_else;
+			size_t n_instructions_else;
+		} *elts;
+	} frames;
+};
+
+static DEFINE_VECTOR_GROW(frames, struct InstructionFrames);
+static DEFINE_VECTOR_TRUNCATE(frames, struct InstructionFrames);
+
+static int push_frame(struct InstructionSource *src,
+		      const struct Instr *instructions,
+		      size_t n_instructions,
+		      const struct Instr *instructions_else,
+		      size_t n_instructions_else)
+{
+	struct InstructionFrame *frame;
+
+	if (!frames_grow(&src->frames, 1))
+		return 0;
+
+	frame = &src->frames.elts[src->frames.n_elts - 1];
+	frame->instructions = instructions;
+	frame->n_instructions = n_instructions;
+	frame->cont = 0;
+	frame->instructions_else = instructions_else;
+	frame->n_instructions_else = n_instructions_else;
+
+	return 1;
+}
+
+static int next_instruction(struct InstructionSource *src,
+			    const struct Instr **out)
+{
+	struct InstructionFrame *frame;
+
+	if (src->pstate) {
+		init_instruction(&src->instr);
+		if (!read_instruction(src->pstate, &src->instr))
+			return 0;
+		*out = &src->instr;
+		return 1;
+	}
+
+	if (src->compact) {
+		if (src->pos >= src->compact->n_instrs)
+			return 0;
+		expand_compact_instruction(src->compact, src->pos++,
+					   &src->instr);
+		*out = &src->instr;
+		return 1;
+	}
+
+	if (!src->frames.n_elts)
+		return 0;
+
+	frame = &src->frames.elts[src->frames.n_elts - 1];
+
+	if (frame->cont < frame->n_instructions) {
+		const struct Instr *instruction =
+			&frame->instructions[frame->cont++];
+
+		switch (instruction->opcode) {
+		case OPCODE_BLOCK:
+		case OPCODE_LOOP:
+			if (!push_frame(src,
+					instruction->data.block.instructions,
+					instruction->data.block.n_instructions,
+					NULL, 0))
+				return 0;
+			break;
+		case OPCODE_IF:
+			if (!push_frame(src,
+					instruction->data.if_.instructions_then,
+					instruction->data.if_.n_instructions_then,
+					instruction->data.if_.instructions_else,
+					instruction->data.if_.n_instructions_else))
+				return 0;
+			break;
+		}
+
+		*out = instruction;
+		return 1;
+	}
+
+	if (frame->n_instructions_else) {
+		frame->instructions = frame->instructions_else;
+		frame->n_instructions = frame->n_instructions_else;
+		frame->cont = 0;
+		frame->instructions_else = NULL;
+		frame->n_instructions_else = 0;
+		src->instr.opcode = ELSE_TERMINAL;
+	} else {
+		if (!frames_truncate(&src->frames, src->frames.n_elts - 1))
+			return 0;
+		src->instr.opcode = BLOCK_TERMINAL;
+	}
+
+	*out = &src->instr;
+	return 1;
+}
+
 #define TRAP_SIZE 17
 static int emit_trap(struct SizedBuffer *output,
 		     struct MemoryReferences *memrefs,
@@ -319,36 +446,732 @@ static int emit_trap(struct SizedBuffer *output,
 #ifndef NDEBUG
 	size_t offset;
 
-	offset = output->n_elts;
-#endif
+	offset = output->n_elts;
+#endif
+
+	/* mov $reason, %edi */
+	OUTS("\xbf");
+	encode_le_uint32_t(reason, buf);
+	if (!output_buf(output, buf, sizeof(uint32_t)))
+		goto error;
+
+	/* mov $const, %rax */
+	OUTS("\x48\xb8");
+	OUTNULL(8);
+	{
+		size_t memref_idx;
+		memref_idx = memrefs->n_elts;
+		if (!memrefs_grow(memrefs, 1))
+			goto error;
+
+		memrefs->elts[memref_idx].type =
+			MEMREF_TRAP;
+		memrefs->elts[memref_idx].code_offset =
+			output->n_elts - 8;
+	}
+
+	/* call *%rax */
+	OUTS("\xff\xd0");
+
+#ifndef NDEBUG
+	assert(output->n_elts - offset == TRAP_SIZE);
+#endif
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+static int emit_interrupt_check(struct SizedBuffer *output,
+				struct MemoryReferences *memrefs,
+				size_t cur_stack_depth)
+{
+	char buf[sizeof(uint64_t)];
+
+	/* movq $const, %rax */
+	OUTS("\x48\xb8");
+	OUTNULL(8);
+	{
+		size_t memref_idx;
+
+		memref_idx = memrefs->n_elts;
+		if (!memrefs_grow(memrefs, 1))
+			goto error;
+
+		memrefs->elts[memref_idx].type = MEMREF_INTERRUPT;
+		memrefs->elts[memref_idx].code_offset = output->n_elts - 8;
+	}
+
+#ifdef WASMJIT_INTERRUPT_FLAG_FS_RELATIVE
+	(void)cur_stack_depth;
+
+	/* LOGIC: if (ctx->interrupted) trap() */
+
+	/* cmpl $0, %fs:(%rax) */
+	if (!output_buf(output, "\x64\x83\x38\x00", 4))
+		goto error;
+
+	/* je AFTER_TRAP */
+	OUTS("\x74");
+	OUTB(TRAP_SIZE);
+	if (!emit_trap(output, memrefs, WASMJIT_TRAP_INTERRUPTED))
+		goto error;
+#else
+	/* align to 16 bytes */
+	if (cur_stack_depth % 2)
+		/* sub $8, %rsp */
+		OUTS("\x48\x83\xec\x08");
+
+	/* call *%rax */
+	OUTS("\xff\xd0");
+
+	if (cur_stack_depth % 2)
+		/* add $8, %rsp */
+		OUTS("\x48\x83\xc4\x08");
+#endif
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+/*
+  Pushes the arguments of a call to ft that do not fit in registers
+  from the operand stack, which holds them first-to-last with the last
+  on top. The SysV ABI wants the first spilled argument at the lowest
+  address, i.e. pushed last, which is also how wasmjit_compile_function()
+  and host function trampolines lay out their incoming arguments.
+  aligned is the padding already pushed below the arguments.
+*/
+static int emit_spilled_call_args(struct SizedBuffer *output,
+				  const struct FuncType *ft,
+				  int aligned, size_t n_stack)
+{
+	char buf[sizeof(uint32_t)];
+	size_t i, n_ints = 0, n_floats = 0, n_pushed = 0;
+
+	for (i = 0; i < ft->n_inputs; ++i) {
+		if (ft->input_types[i] == VALTYPE_I32 ||
+		    ft->input_types[i] == VALTYPE_I64)
+			n_ints += 1;
+		else
+			n_floats += 1;
+	}
+
+	for (i = ft->n_inputs; i-- > 0;) {
+		if (ft->input_types[i] == VALTYPE_I32 ||
+		    ft->input_types[i] == VALTYPE_I64) {
+			if (--n_ints < 6)
+				continue;
+		} else {
+			if (--n_floats < 8)
+				continue;
+		}
+
+		/* each push moves the rest of the operands up by 8 */
+		OUTS("\xff\xb4\x24");	/* push N(%rsp) */
+		encode_le_uint32_t((ft->n_inputs - i - 1 +
+				    n_pushed + aligned) * 8,
+				   buf);
+		if (!output_buf(output, buf, sizeof(uint32_t)))
+			goto error;
+		n_pushed += 1;
+	}
+
+	assert(n_pushed == n_stack);
+	(void)n_stack;
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+/* access size and result type of each of the seven variants of an
+   atomic load, store or read-modify-write operation */
+static const uint8_t atomic_variant_size[] = {4, 8, 1, 2, 1, 2, 4};
+static const unsigned atomic_variant_type[] = {
+	STACK_I32, STACK_I64, STACK_I32, STACK_I32,
+	STACK_I64, STACK_I64, STACK_I64,
+};
+
+static int emit_atomic_address(struct SizedBuffer *output,
+			       struct MemoryReferences *memrefs,
+			       const struct LoadStoreExtra *memarg,
+			       size_t mem_size)
+{
+	char buf[sizeof(uint64_t)];
+
+	/* NB: expects ea in %rsi, leaves the host address in %rsi */
+
+	/* add <VAL>, %rsi */
+	OUTS("\x48\x81\xc6");
+	encode_le_uint32_t(mem_size + memarg->offset, buf);
+	if (!output_buf(output, buf, sizeof(uint32_t)))
+		goto error;
+
+	/* movq $const, %rax */
+	OUTS("\x48\xb8");
+	OUTNULL(8);
+	{
+		size_t memref_idx;
+
+		memref_idx = memrefs->n_elts;
+		if (!memrefs_grow(memrefs, 1))
+			goto error;
+
+		memrefs->elts[memref_idx].type = MEMREF_MEM;
+		memrefs->elts[memref_idx].code_offset = output->n_elts - 8;
+		memrefs->elts[memref_idx].idx = 0;
+	}
+
+	/* LOGIC: if ea > size then trap() */
+
+	/* cmp size_offset(%rax), %rsi */
+	OUTS("\x48\x3b\x70");
+	OUTB(offsetof(struct MemInst, size));
+
+	/* jle AFTER_TRAP: */
+	OUTS("\x7e");
+	OUTB(TRAP_SIZE);
+	if (!emit_trap(output, memrefs, WASMJIT_TRAP_MEMORY_OVERFLOW))
+		goto error;
+
+	/* mov data_off(%rax), %rax */
+	OUTS("\x48\x8b\x40");
+	OUTB(offsetof(struct MemInst, data));
+
+	/* lea -mem_size(%rax, %rsi), %rsi */
+	OUTS("\x48\x8d\x74\x30");
+	OUTB(-(intmax_t) mem_size);
+
+	/* LOGIC: if ea % mem_size then trap() */
+
+	/* NB: memory data is allocated with at least 8-byte
+	   alignment so checking the host address is enough */
+	if (mem_size > 1) {
+		/* test $(mem_size - 1), %sil */
+		OUTS("\x40\xf6\xc6");
+		OUTB(mem_size - 1);
+
+		/* jz AFTER_TRAP: */
+		OUTS("\x74");
+		OUTB(TRAP_SIZE);
+		if (!emit_trap(output, memrefs,
+			       WASMJIT_TRAP_UNALIGNED_ATOMIC))
+			goto error;
+	}
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+static int emit_zero_extend_rax(struct SizedBuffer *output, size_t mem_size)
+{
+	switch (mem_size) {
+	case 1:
+		/* movzbl %al, %eax */
+		OUTS("\x0f\xb6\xc0");
+		break;
+	case 2:
+		/* movzwl %ax, %eax */
+		OUTS("\x0f\xb7\xc0");
+		break;
+	case 4:
+		/* mov %eax, %eax */
+		OUTS("\x89\xc0");
+		break;
+	default:
+		break;
+	}
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+static int emit_atomic_load_rax(struct SizedBuffer *output, size_t mem_size)
+{
+	switch (mem_size) {
+	case 1:
+		/* movzbl (%rsi), %eax */
+		OUTS("\x0f\xb6\x06");
+		break;
+	case 2:
+		/* movzwl (%rsi), %eax */
+		OUTS("\x0f\xb7\x06");
+		break;
+	case 4:
+		/* mov (%rsi), %eax */
+		OUTS("\x8b\x06");
+		break;
+	case 8:
+		/* mov (%rsi), %rax */
+		OUTS("\x48\x8b\x06");
+		break;
+	}
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+static int emit_bulk_memory(struct SizedBuffer *output,
+			    struct MemoryReferences *memrefs,
+			    struct StaticStack *sstack,
+			    uint8_t op)
+{
+	char buf[sizeof(uint64_t)];
+	size_t i;
+
+	/* LOGIC: n = pop_stack(); src_or_val = pop_stack(); dst = pop_stack() */
+	for (i = 0; i < 3; ++i) {
+		assert(peek_stack(sstack) == STACK_I32);
+		if (!pop_stack(sstack))
+			goto error;
+	}
+
+	/* pop %rcx */
+	OUTS("\x59");
+	/* pop %rax */
+	OUTS("\x58");
+	/* pop %rdi */
+	OUTS("\x5f");
+
+	/* mov %ecx, %ecx */
+	OUTS("\x89\xc9");
+	/* mov %edi, %edi */
+	OUTS("\x89\xff");
+	if (op == OPCODE_MISC_MEMORY_COPY)
+		/* mov %eax, %esi */
+		OUTS("\x89\xc6");
+
+	/* movq $const, %rdx */
+	OUTS("\x48\xba");
+	OUTNULL(8);
+	{
+		size_t memref_idx;
+
+		memref_idx = memrefs->n_elts;
+		if (!memrefs_grow(memrefs, 1))
+			goto error;
+
+		memrefs->elts[memref_idx].type = MEMREF_MEM;
+		memrefs->elts[memref_idx].code_offset = output->n_elts - 8;
+		memrefs->elts[memref_idx].idx = 0;
+	}
+
+	/* LOGIC: if dst + n > size then trap() */
+
+	/* lea (%rdi, %rcx), %r8 */
+	OUTS("\x4c\x8d\x04\x0f");
+	/* cmp size_offset(%rdx), %r8 */
+	OUTS("\x4c\x3b\x42");
+	OUTB(offsetof(struct MemInst, size));
+	/* jbe AFTER_TRAP: */
+	OUTS("\x76");
+	OUTB(TRAP_SIZE);
+	if (!emit_trap(output, memrefs, WASMJIT_TRAP_MEMORY_OVERFLOW))
+		goto error;
+
+	if (op == OPCODE_MISC_MEMORY_COPY) {
+		/* LOGIC: if src + n > size then trap() */
+
+		/* lea (%rsi, %rcx), %r8 */
+		OUTS("\x4c\x8d\x04\x0e");
+		/* cmp size_offset(%rdx), %r8 */
+		OUTS("\x4c\x3b\x42");
+		OUTB(offsetof(struct MemInst, size));
+		/* jbe AFTER_TRAP: */
+		OUTS("\x76");
+		OUTB(TRAP_SIZE);
+		if (!emit_trap(output, memrefs, WASMJIT_TRAP_MEMORY_OVERFLOW))
+			goto error;
+	}
+
+	/* mov data_off(%rdx), %rdx */
+	OUTS("\x48\x8b\x52");
+	OUTB(offsetof(struct MemInst, data));
+
+	/* add %rdx, %rdi */
+	OUTS("\x48\x01\xd7");
+
+	if (op == OPCODE_MISC_MEMORY_FILL) {
+		/* rep stosb */
+		OUTS("\xf3\xaa");
+		return 1;
+	}
+
+	/* add %rdx, %rsi */
+	OUTS("\x48\x01\xd6");
+
+	/* LOGIC: if dst - src < n then the ranges overlap with dst
+	   above src and the copy has to run backwards */
+
+	/* mov %rdi, %rax */
+	OUTS("\x48\x89\xf8");
+	/* sub %rsi, %rax */
+	OUTS("\x48\x29\xf0");
+	/* cmp %rcx, %rax */
+	OUTS("\x48\x39\xc8");
+	/* jb BACKWARDS: */
+	OUTS("\x72\x04");
+
+	/* rep movsb */
+	OUTS("\xf3\xa4");
+	/* jmp DONE: */
+	OUTS("\xeb\x0e");
+
+	/* BACKWARDS: */
+	/* lea -1(%rdi, %rcx), %rdi */
+	OUTS("\x48\x8d\x7c\x0f\xff");
+	/* lea -1(%rsi, %rcx), %rsi */
+	OUTS("\x48\x8d\x74\x0e\xff");
+	/* std */
+	OUTS("\xfd");
+	/* rep movsb */
+	OUTS("\xf3\xa4");
+	/* cld */
+	OUTS("\xfc");
+
+	/* DONE: */
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+static int emit_atomic(struct SizedBuffer *output,
+		       struct MemoryReferences *memrefs,
+		       size_t n_frame_locals,
+		       struct StaticStack *sstack,
+		       const struct AtomicExtra *extra)
+{
+	char buf[sizeof(uint64_t)];
+	uint8_t op = extra->opcode;
+	size_t mem_size, variant;
+	unsigned valtype;
+
+	switch (op) {
+	case OPCODE_ATOMIC_FENCE:
+		/* mfence */
+		OUTS("\x0f\xae\xf0");
+		return 1;
+	case OPCODE_ATOMIC_NOTIFY:
+	case OPCODE_ATOMIC_I32_WAIT:
+	case OPCODE_ATOMIC_I64_WAIT: {
+		size_t cur_stack_depth;
+
+		/* LOGIC: push_stack(wait(ea, expected, timeout)) or
+		   push_stack(notify(ea, count)) */
+
+		if (op == OPCODE_ATOMIC_NOTIFY) {
+			mem_size = 4;
+		} else {
+			mem_size = op == OPCODE_ATOMIC_I64_WAIT ? 8 : 4;
+
+			/* pop %rdx */
+			assert(peek_stack(sstack) == STACK_I64);
+			if (!pop_stack(sstack))
+				goto error;
+			OUTS("\x5a");
+		}
+
+		/* pop %rdi */
+		assert(peek_stack(sstack) ==
+		       (op == OPCODE_ATOMIC_I64_WAIT ? STACK_I64 : STACK_I32));
+		if (!pop_stack(sstack))
+			goto error;
+		OUTS("\x5f");
+
+		/* pop %rsi */
+		assert(peek_stack(sstack) == STACK_I32);
+		if (!pop_stack(sstack))
+			goto error;
+		OUTS("\x5e");
+
+		if (!emit_atomic_address(output, memrefs, &extra->memarg,
+					 mem_size))
+			goto error;
+
+		/* xchg %rsi, %rdi */
+		OUTS("\x48\x87\xf7");
+
+		if (op != OPCODE_ATOMIC_NOTIFY) {
+			/* LOGIC: if !mem->shared then trap() */
+
+			/* movq $const, %rax */
+			OUTS("\x48\xb8");
+			OUTNULL(8);
+			{
+				size_t memref_idx;
+
+				memref_idx = memrefs->n_elts;
+				if (!memrefs_grow(memrefs, 1))
+					goto error;
+
+				memrefs->elts[memref_idx].type = MEMREF_MEM;
+				memrefs->elts[memref_idx].code_offset =
+					output->n_elts - 8;
+				memrefs->elts[memref_idx].idx = 0;
+			}
+
+			/* cmpl $0, shared_offset(%rax) */
+			OUTS("\x83\x78");
+			OUTB(offsetof(struct MemInst, shared));
+			OUTB(0);
+
+			/* jne AFTER_TRAP: */
+			OUTS("\x75");
+			OUTB(TRAP_SIZE);
+			if (!emit_trap(output, memrefs,
+				       WASMJIT_TRAP_UNSHARED_WAIT))
+				goto error;
+
+			/* mov $is64, %ecx */
+			OUTS("\xb9");
+			encode_le_uint32_t(op == OPCODE_ATOMIC_I64_WAIT, buf);
+			if (!output_buf(output, buf, sizeof(uint32_t)))
+				goto error;
+		}
+
+		/* movq $const, %rax */
+		OUTS("\x48\xb8");
+		OUTNULL(8);
+		{
+			size_t memref_idx;
+
+			memref_idx = memrefs->n_elts;
+			if (!memrefs_grow(memrefs, 1))
+				goto error;
+
+			memrefs->elts[memref_idx].type =
+				op == OPCODE_ATOMIC_NOTIFY
+				? MEMREF_ATOMIC_NOTIFY
+				: MEMREF_ATOMIC_WAIT;
+			memrefs->elts[memref_idx].code_offset =
+				output->n_elts - 8;
+		}
+
+		cur_stack_depth = n_frame_locals + stack_depth(sstack);
+
+		/* align to 16 bytes */
+		if (cur_stack_depth % 2)
+			/* sub $8, %rsp */
+			OUTS("\x48\x83\xec\x08");
+
+		/* call *%rax */
+		OUTS("\xff\xd0");
+
+		if (cur_stack_depth % 2)
+			/* add $8, %rsp */
+			OUTS("\x48\x83\xc4\x08");
+
+		/* push %rax */
+		OUTS("\x50");
+		if (!push_stack(sstack, STACK_I32))
+			goto error;
+
+		return 1;
+	}
+	default:
+		break;
+	}
+
+	if (op >= OPCODE_ATOMIC_RMW_ADD)
+		variant = (op - OPCODE_ATOMIC_RMW_ADD) % 7;
+	else if (op >= OPCODE_ATOMIC_I32_STORE)
+		variant = op - OPCODE_ATOMIC_I32_STORE;
+	else
+		variant = op - OPCODE_ATOMIC_I32_LOAD;
 
-	/* mov $reason, %edi */
-	OUTS("\xbf");
-	encode_le_uint32_t(reason, buf);
-	if (!output_buf(output, buf, sizeof(uint32_t)))
+	mem_size = atomic_variant_size[variant];
+	valtype = atomic_variant_type[variant];
+
+	if (op >= OPCODE_ATOMIC_RMW_CMPXCHG) {
+		/* pop %rdx */
+		assert(peek_stack(sstack) == valtype);
+		if (!pop_stack(sstack))
+			goto error;
+		OUTS("\x5a");
+	}
+
+	if (op >= OPCODE_ATOMIC_I32_STORE) {
+		/* pop %rdi */
+		assert(peek_stack(sstack) == valtype);
+		if (!pop_stack(sstack))
+			goto error;
+		OUTS("\x5f");
+	}
+
+	/* pop %rsi */
+	assert(peek_stack(sstack) == STACK_I32);
+	if (!pop_stack(sstack))
 		goto error;
+	OUTS("\x5e");
 
-	/* mov $const, %rax */
-	OUTS("\x48\xb8");
-	OUTNULL(8);
-	{
-		size_t memref_idx;
-		memref_idx = memrefs->n_elts;
-		if (!memrefs_grow(memrefs, 1))
+	if (!emit_atomic_address(output, memrefs, &extra->memarg, mem_size))
+		goto error;
+
+	if (op < OPCODE_ATOMIC_I32_STORE) {
+		/* NB: plain loads are sequentially consistent on x86 */
+		if (!emit_atomic_load_rax(output, mem_size))
 			goto error;
+	} else if (op < OPCODE_ATOMIC_RMW_ADD) {
+		/* NB: xchg is implicitly locked, a plain mov
+		   would need a trailing mfence */
+		switch (mem_size) {
+		case 1:
+			/* xchg %dil, (%rsi) */
+			OUTS("\x40\x86\x3e");
+			break;
+		case 2:
+			/* xchg %di, (%rsi) */
+			OUTS("\x66\x87\x3e");
+			break;
+		case 4:
+			/* xchg %edi, (%rsi) */
+			OUTS("\x87\x3e");
+			break;
+		case 8:
+			/* xchg %rdi, (%rsi) */
+			OUTS("\x48\x87\x3e");
+			break;
+		}
 
-		memrefs->elts[memref_idx].type =
-			MEMREF_TRAP;
-		memrefs->elts[memref_idx].code_offset =
-			output->n_elts - 8;
+		return 1;
+	} else if (op < OPCODE_ATOMIC_RMW_AND ||
+		   (op >= OPCODE_ATOMIC_RMW_XCHG &&
+		    op < OPCODE_ATOMIC_RMW_CMPXCHG)) {
+		if (op >= OPCODE_ATOMIC_RMW_SUB && op < OPCODE_ATOMIC_RMW_AND)
+			/* neg %rdi */
+			OUTS("\x48\xf7\xdf");
+
+		/* mov %rdi, %rax */
+		OUTS("\x48\x89\xf8");
+
+		if (op >= OPCODE_ATOMIC_RMW_XCHG) {
+			switch (mem_size) {
+			case 1:
+				/* xchg %al, (%rsi) */
+				OUTS("\x86\x06");
+				break;
+			case 2:
+				/* xchg %ax, (%rsi) */
+				OUTS("\x66\x87\x06");
+				break;
+			case 4:
+				/* xchg %eax, (%rsi) */
+				OUTS("\x87\x06");
+				break;
+			case 8:
+				/* xchg %rax, (%rsi) */
+				OUTS("\x48\x87\x06");
+				break;
+			}
+		} else {
+			switch (mem_size) {
+			case 1:
+				/* lock xadd %al, (%rsi) */
+				OUTS("\xf0\x0f\xc0\x06");
+				break;
+			case 2:
+				/* lock xadd %ax, (%rsi) */
+				OUTS("\x66\xf0\x0f\xc1\x06");
+				break;
+			case 4:
+				/* lock xadd %eax, (%rsi) */
+				OUTS("\xf0\x0f\xc1\x06");
+				break;
+			case 8:
+				/* lock xadd %rax, (%rsi) */
+				OUTS("\xf0\x48\x0f\xc1\x06");
+				break;
+			}
+		}
+	} else if (op < OPCODE_ATOMIC_RMW_XCHG) {
+		size_t loop_offset;
+
+		/* LOGIC: do { old = *ea; } while (!cas(ea, old, old OP v)) */
+
+		if (!emit_atomic_load_rax(output, mem_size))
+			goto error;
+
+		loop_offset = output->n_elts;
+
+		/* mov %rax, %rcx */
+		OUTS("\x48\x89\xc1");
+
+		if (op < OPCODE_ATOMIC_RMW_OR)
+			/* and %rdi, %rcx */
+			OUTS("\x48\x21\xf9");
+		else if (op < OPCODE_ATOMIC_RMW_XOR)
+			/* or %rdi, %rcx */
+			OUTS("\x48\x09\xf9");
+		else
+			/* xor %rdi, %rcx */
+			OUTS("\x48\x31\xf9");
+
+		switch (mem_size) {
+		case 1:
+			/* lock cmpxchg %cl, (%rsi) */
+			OUTS("\xf0\x0f\xb0\x0e");
+			break;
+		case 2:
+			/* lock cmpxchg %cx, (%rsi) */
+			OUTS("\x66\xf0\x0f\xb1\x0e");
+			break;
+		case 4:
+			/* lock cmpxchg %ecx, (%rsi) */
+			OUTS("\xf0\x0f\xb1\x0e");
+			break;
+		case 8:
+			/* lock cmpxchg %rcx, (%rsi) */
+			OUTS("\xf0\x48\x0f\xb1\x0e");
+			break;
+		}
+
+		/* jne LOOP */
+		OUTS("\x75");
+		OUTB(-(intmax_t) (output->n_elts + 1 - loop_offset));
+	} else {
+		/* mov %rdi, %rax */
+		OUTS("\x48\x89\xf8");
+
+		switch (mem_size) {
+		case 1:
+			/* lock cmpxchg %dl, (%rsi) */
+			OUTS("\xf0\x0f\xb0\x16");
+			break;
+		case 2:
+			/* lock cmpxchg %dx, (%rsi) */
+			OUTS("\x66\xf0\x0f\xb1\x16");
+			break;
+		case 4:
+			/* lock cmpxchg %edx, (%rsi) */
+			OUTS("\xf0\x0f\xb1\x16");
+			break;
+		case 8:
+			/* lock cmpxchg %rdx, (%rsi) */
+			OUTS("\xf0\x48\x0f\xb1\x16");
+			break;
+		}
 	}
 
-	/* call *%rax */
-	OUTS("\xff\xd0");
+	if (!emit_zero_extend_rax(output, mem_size))
+		goto error;
 
-#ifndef NDEBUG
-	assert(output->n_elts - offset == TRAP_SIZE);
-#endif
+	/* push %rax */
+	OUTS("\x50");
+	if (!push_stack(sstack, valtype))
+		goto error;
 
 	return 1;
 
@@ -801,9 +1624,11 @@ static int wasmjit_compile_instruction(const struct FuncType *func_types,
 				OUTS("\x48\x83\xec\x08");
 		}
 
+		if (!emit_spilled_call_args(output, ft, aligned, n_stack))
+			goto error;
+
 		n_movs = 0;
 		n_xmm_movs = 0;
-		n_stack = 0;
 		for (i = 0; i < ft->n_inputs; ++i) {
 			static const char *const movs[] = {
 				"\x48\x8b\xbc\x24",	/* mov N(%rsp), %rdi */
@@ -862,10 +1687,8 @@ static int wasmjit_compile_instruction(const struct FuncType *func_types,
 				OUTS(f64_movs[n_xmm_movs]);
 				n_xmm_movs += 1;
 			} else {
-				stack_offset =
-					(i - (ft->n_inputs - 1) + n_stack + aligned) * 8;
-				OUTS("\xff\xb4\x24");	/* push N(%rsp) */
-				n_stack += 1;
+				/* already pushed above */
+				continue;
 			}
 
 			encode_le_uint32_t(stack_offset, buf);
@@ -1409,6 +2232,16 @@ static int wasmjit_compile_instruction(const struct FuncType *func_types,
 
 		break;
 	}
+	case OPCODE_MISC_PREFIX:
+		if (!emit_bulk_memory(output, memrefs, sstack,
+				      instruction->data.misc.opcode))
+			goto error;
+		break;
+	case OPCODE_ATOMIC_PREFIX:
+		if (!emit_atomic(output, memrefs, n_frame_locals, sstack,
+				 &instruction->data.atomic))
+			goto error;
+		break;
 	case OPCODE_I32_CONST:
 		/* mov $value, %eax */
 		OUTS("\xb8");
@@ -2043,322 +2876,403 @@ static int wasmjit_compile_instructions(const struct FuncType *func_types,
 					size_t n_locals,
 					size_t n_frame_locals,
 					struct StaticStack *sstack,
-					const struct Instr *instructions,
-					size_t n_instructions,
+					struct InstructionSource *src,
+					struct FunctionValidator *validator,
 					size_t *max_stack)
 {
 	int ret;
-	size_t i;
-	size_t stack_sz;
-	struct InstructionMD *stack;
-
-	stack_sz = 1;
-	stack = malloc(stack_sz * sizeof(stack[0]));
-	if (!stack)
-		goto error;
-
-	stack[0].instructions = instructions;
-	stack[0].n_instructions = n_instructions;
-	stack[0].initiator = NULL;
-	stack[0].cont = 0;
+	struct ControlStack ctl = { 0, NULL };
+	/* set after an unconditional branch until the enclosing block ends */
+	int dead = 0;
+	size_t dead_depth = 0;
 
 	if (max_stack) {
 		*max_stack = 0;
 	}
 
-	while (stack_sz) {
-		struct InstructionMD imd, *new_stack;
+	while (1) {
+		struct InstructionMD *imd;
+		const struct Instr *instruction;
 
-		/* pop instruction stream off stack */
-
-		stack_sz -= 1;
-		memcpy(&imd, &stack[stack_sz], sizeof(imd));
-		new_stack = realloc(stack, stack_sz * sizeof(stack[0]));
-		if (!new_stack && stack_sz)
+		if (!next_instruction(src, &instruction)) {
+			if (validator->why)
+				snprintf(validator->why, validator->why_size,
+					 "malformed instruction");
 			goto error;
-		stack = new_stack;
-
-		for (i = imd.cont; i < imd.n_instructions; ++i) {
-			struct InstructionMD imd2;
-			const struct Instr *instruction = &imd.instructions[i];
+		}
 
-			if (WASMJIT_DEBUG_STACK) {
-				/* mov %rsp, %rax */
-				OUTS("\x48\x89\xe0");
-				/* add $const, %rax */
-				OUTS("\x48\x05");
-				OUTB(0); OUTB(0); OUTB(0); OUTB(0);
-				encode_le_uint32_t(8 * stack_depth(sstack),
-						   &output->elts[output->n_elts - 4]);
-				/* cmp %rax, %rbx */
-				OUTS("\x48\x39\xc3");
-				/* je +1 */
-				OUTS("\x74\x01");
-				/* int 13 */
-				OUTS("\xcc");
-			}
+		if (!wasmjit_validate_instruction(validator, instruction))
+			goto error;
 
+		/*
+		  the rest of a block after br, br_table, return or
+		  unreachable never runs and its stack is polymorphic,
+		  so it is only validated, not compiled
+		*/
+		if (dead) {
 			switch (instruction->opcode) {
 			case OPCODE_BLOCK:
-			case OPCODE_LOOP: {
-				size_t arity;
+			case OPCODE_LOOP:
+			case OPCODE_IF:
+				dead_depth += 1;
+				continue;
+			case ELSE_TERMINAL:
+				if (dead_depth)
+					continue;
+				break;
+			case BLOCK_TERMINAL:
+				if (dead_depth) {
+					dead_depth -= 1;
+					continue;
+				}
+				break;
+			default:
+				continue;
+			}
+			dead = 0;
+		}
+
+		if (instruction->opcode == ELSE_TERMINAL) {
+			if (!ctl.n_elts)
+				goto error;
 
+			imd = &ctl.elts[ctl.n_elts - 1];
+			if (imd->opcode != OPCODE_IF || imd->data.if_.did_else)
+				goto error;
 
 #ifdef DEBUG_COMPILE
-					const char *result = "";
-					if (instruction->data.if_.blocktype != VALTYPE_NULL) {
-						result = wasmjit_valtype_repr(instruction->data.if_.blocktype);
-					}
-					if (instruction->opcode == OPCODE_BLOCK) {
-						printf("%*sblock %s\n", (int)stack_sz * 2, "", result);
-					} else {
-						assert(instruction->opcode == OPCODE_LOOP);
-						printf("%*sloop\n", (int)stack_sz * 2, "");
-					}
+			printf("%*selse\n", (int)(ctl.n_elts - 1) * 2, "");
 #endif
 
-				if (instruction->opcode == OPCODE_BLOCK) {
-					arity = instruction->data.block.blocktype !=
-						VALTYPE_NULL ? 1 : 0;
-				} else {
-					assert(instruction->opcode == OPCODE_LOOP);
-					arity = 0;
-				}
+			imd->data.if_.jump_to_after_else_offset = output->n_elts + 1;
+			/* jmp after_else_offset */
+			OUTS("\xe9\x90\x90\x90\x90");
 
-				imd2.data.block.label_idx = labels->n_elts;
-				INC_LABELS();
+			/* fix up jump_to_else_offset */
+			imd->data.if_.jump_to_else_offset = output->n_elts - imd->data.if_.jump_to_else_offset;
+			encode_le_uint32_t(imd->data.if_.jump_to_else_offset - 4,
+					   &output->elts[output->n_elts - imd->data.if_.jump_to_else_offset]);
 
-				imd2.data.block.stack_idx = sstack->n_elts;
-				if (!stack_grow(sstack, 1))
-					goto error;
+			/* reset stack */
+			if (!stack_truncate(sstack, imd->data.if_.stack_idx + 1))
+				goto error;
 
-				{
-					struct StackElt *elt =
-						&sstack->elts[imd2.data.block.stack_idx];
-					elt->type = STACK_LABEL;
-					elt->data.label.arity = arity;
-					elt->data.label.continuation_idx = imd2.data.block.label_idx;
-				}
+			imd->data.if_.did_else = 1;
+			continue;
+		}
 
-				imd2.data.block.output_idx = output->n_elts;
+		if (instruction->opcode == BLOCK_TERMINAL) {
+			size_t j;
+			size_t arity;
 
-				imd2.instructions = instruction->data.block.instructions;
-				imd2.n_instructions = instruction->data.block.n_instructions;
+			/* end of the function body */
+			if (!ctl.n_elts) {
+				/* after a return the stack may hold anything,
+				   the epilogue expects just the result */
+				if (!stack_truncate(sstack, 0))
+					goto error;
+				if (FUNC_TYPE_N_OUTPUTS(type) &&
+				    !push_stack(sstack, FUNC_TYPE_OUTPUT_TYPES(type)[0]))
+					goto error;
 				break;
 			}
-			case OPCODE_IF: {
-				int arity =
-					instruction->data.if_.blocktype !=
-					VALTYPE_NULL ? 1 : 0;
-
-#ifdef DEBUG_COMPILE
-					const char *result = "";
-					if (instruction->data.if_.blocktype != VALTYPE_NULL) {
-						result = wasmjit_valtype_repr(instruction->data.if_.blocktype);
-					}
-					printf("%*sif %s\n", (int)stack_sz * 2, "", result);
-#endif
 
-				/* test top of stack */
-				assert(peek_stack(sstack) == STACK_I32);
-				pop_stack(sstack);
-				/* pop %rax */
-				OUTS("\x58");
+			/* do footer logic */
+			imd = &ctl.elts[ctl.n_elts - 1];
+			arity = imd->blocktype != VALTYPE_NULL ? 1 : 0;
 
-				/* if not true jump to else case */
-				/* test %eax, %eax */
-				OUTS("\x85\xc0");
+			switch (imd->opcode) {
+			case OPCODE_BLOCK:
+			case OPCODE_LOOP:
+				/* fix up static stack */
+				/* remove label and push output types */
+				if (!stack_truncate(sstack, imd->data.block.stack_idx + arity))
+					goto error;
 
-				imd2.data.if_.jump_to_else_offset = output->n_elts + 2;
-				/* je else_offset */
-				OUTS("\x0f\x84\x90\x90\x90\x90");
+				for (j = 0; j < arity; ++j) {
+					sstack->elts[imd->data.block.stack_idx + j].type = imd->blocktype;
+				}
 
-				/* output then case */
-				imd2.data.if_.label_idx = labels->n_elts;
-				INC_LABELS();
+				if (imd->opcode == OPCODE_BLOCK) {
+					labels->elts[imd->data.block.label_idx] =
+						output->n_elts;
+				} else {
+					labels->elts[imd->data.block.label_idx] =
+						imd->data.block.output_idx;
+				}
+				break;
+			case OPCODE_IF:
+				if (!imd->data.if_.did_else) {
+					/* fix up jump_to_else_offset */
+					imd->data.if_.jump_to_else_offset = output->n_elts - imd->data.if_.jump_to_else_offset;
+					encode_le_uint32_t(imd->data.if_.jump_to_else_offset - 4,
+							   &output->elts[output->n_elts - imd->data.if_.jump_to_else_offset]);
+				} else {
+					/* fix up jump_to_after_else_offset */
+					imd->data.if_.jump_to_after_else_offset = output->n_elts - imd->data.if_.jump_to_after_else_offset;
+					encode_le_uint32_t(imd->data.if_.jump_to_after_else_offset - 4,
+							   &output->elts[output->n_elts - imd->data.if_.jump_to_after_else_offset]);
+				}
 
-				imd2.data.if_.stack_idx = sstack->n_elts;
-				if (!stack_grow(sstack, 1))
+				/* fix up static stack */
+				/* remove label and push output types */
+				if (!stack_truncate(sstack, imd->data.if_.stack_idx + arity))
 					goto error;
 
-				{
-					struct StackElt *elt =
-						&sstack->elts[imd2.data.if_.stack_idx];
-					elt->type = STACK_LABEL;
-					elt->data.label.arity = arity;
-					elt->data.label.continuation_idx = imd2.data.if_.label_idx;
+				for (j = 0; j < arity; ++j) {
+					sstack->elts[imd->data.if_.stack_idx + j].type = imd->blocktype;
 				}
 
-				imd2.data.if_.did_else = 0;
-
-				imd2.instructions = instruction->data.if_.instructions_then;
-				imd2.n_instructions = instruction->data.if_.n_instructions_then;
+				/* set labels position */
+				labels->elts[imd->data.if_.label_idx] = output->n_elts;
 				break;
-			}
 			default:
-#ifdef DEBUG_COMPILE
-					dump_instruction(instruction, stack_sz);
-#endif
-				if (!wasmjit_compile_instruction(func_types,
-								 module_types,
-								 type,
-								 output,
-								 branches,
-								 memrefs,
-								 locals_md,
-								 n_locals,
-								 n_frame_locals,
-								 sstack,
-								 instruction,
-								 !!max_stack))
-					goto error;
+				assert(0);
 				break;
 			}
 
-			if (max_stack) {
-				size_t n_values;
-				n_values = stack_depth(sstack);
-				*max_stack = MMAX(*max_stack, n_values);
+			if (!control_truncate(&ctl, ctl.n_elts - 1))
+				goto error;
+			continue;
+		}
+
+		if (WASMJIT_DEBUG_STACK) {
+			/* mov %rsp, %rax */
+			OUTS("\x48\x89\xe0");
+			/* add $const, %rax */
+			OUTS("\x48\x05");
+			OUTB(0); OUTB(0); OUTB(0); OUTB(0);
+			encode_le_uint32_t(8 * stack_depth(sstack),
+					   &output->elts[output->n_elts - 4]);
+			/* cmp %rax, %rbx */
+			OUTS("\x48\x39\xc3");
+			/* je +1 */
+			OUTS("\x74\x01");
+			/* int 13 */
+			OUTS("\xcc");
+		}
+
+		switch (instruction->opcode) {
+		case OPCODE_BLOCK:
+		case OPCODE_LOOP: {
+			size_t arity;
+
+#ifdef DEBUG_COMPILE
+			const char *result = "";
+			if (instruction->data.block.blocktype != VALTYPE_NULL) {
+				result = wasmjit_valtype_repr(instruction->data.block.blocktype);
+			}
+			if (instruction->opcode == OPCODE_BLOCK) {
+				printf("%*sblock %s\n", (int)ctl.n_elts * 2, "", result);
+			} else {
+				assert(instruction->opcode == OPCODE_LOOP);
+				printf("%*sloop\n", (int)ctl.n_elts * 2, "");
+			}
+#endif
+
+			if (instruction->opcode == OPCODE_BLOCK) {
+				arity = instruction->data.block.blocktype !=
+					VALTYPE_NULL ? 1 : 0;
+			} else {
+				assert(instruction->opcode == OPCODE_LOOP);
+				arity = 0;
 			}
 
-			if (instruction->opcode == OPCODE_BLOCK ||
-			    instruction->opcode == OPCODE_LOOP ||
-			    instruction->opcode == OPCODE_IF) {
-				/* push onto stack, break loop */
+			if (!control_grow(&ctl, 1))
+				goto error;
+			imd = &ctl.elts[ctl.n_elts - 1];
 
-				stack_sz += 2;
-				new_stack = realloc(stack, stack_sz * sizeof(stack[0]));
-				if (!new_stack)
-					goto error;
-				stack = new_stack;
+			imd->opcode = instruction->opcode;
+			imd->blocktype = instruction->data.block.blocktype;
 
-				imd.cont = i + 1;
-				memcpy(&stack[stack_sz - 2], &imd, sizeof(imd));
+			imd->data.block.label_idx = labels->n_elts;
+			INC_LABELS();
 
-				imd2.initiator = instruction;
-				imd2.cont = 0;
-				memcpy(&stack[stack_sz - 1], &imd2, sizeof(imd2));
+			imd->data.block.stack_idx = sstack->n_elts;
+			if (!stack_grow(sstack, 1))
+				goto error;
 
-				break;
+			{
+				struct StackElt *elt =
+					&sstack->elts[imd->data.block.stack_idx];
+				elt->type = STACK_LABEL;
+				elt->data.label.arity = arity;
+				elt->data.label.continuation_idx = imd->data.block.label_idx;
 			}
-		}
 
-		if (i != imd.n_instructions)
-			continue;
+			imd->data.block.output_idx = output->n_elts;
 
-		/* do footer logic */
-		if (imd.initiator) {
-			const struct Instr *instruction = imd.initiator;
-			switch (instruction->opcode) {
-			case OPCODE_BLOCK:
-			case OPCODE_LOOP: {
-				size_t j;
-				size_t arity =
-					instruction->data.block.blocktype !=
-					VALTYPE_NULL ? 1 : 0;
+			/* NB: branches to a loop label land here, so
+			   this also covers every back-edge */
+			if (instruction->opcode == OPCODE_LOOP && max_stack &&
+			    !emit_interrupt_check(output, memrefs,
+						  n_frame_locals +
+						  stack_depth(sstack)))
+				goto error;
+			break;
+		}
+		case OPCODE_IF: {
+			int arity =
+				instruction->data.if_.blocktype !=
+				VALTYPE_NULL ? 1 : 0;
 
-				/* fix up static stack */
-				/* remove label and push output types */
-				if (!stack_truncate(sstack, imd.data.block.stack_idx + arity))
-					goto error;
+#ifdef DEBUG_COMPILE
+			const char *result = "";
+			if (instruction->data.if_.blocktype != VALTYPE_NULL) {
+				result = wasmjit_valtype_repr(instruction->data.if_.blocktype);
+			}
+			printf("%*sif %s\n", (int)ctl.n_elts * 2, "", result);
+#endif
 
-				for (j = 0; j < arity; ++j) {
-					sstack->elts[imd.data.if_.stack_idx + j].type = instruction->data.block.blocktype;
-				}
+			if (!control_grow(&ctl, 1))
+				goto error;
+			imd = &ctl.elts[ctl.n_elts - 1];
 
-				switch (instruction->opcode) {
-				case OPCODE_BLOCK:
-					labels->elts[imd.data.block.label_idx] =
-						output->n_elts;
-					break;
-				case OPCODE_LOOP:
-					labels->elts[imd.data.block.label_idx] =
-						imd.data.block.output_idx;
-					break;
-				default:
-					assert(0);
-					break;
-				}
+			imd->opcode = instruction->opcode;
+			imd->blocktype = instruction->data.if_.blocktype;
 
-				break;
-			}
-			case OPCODE_IF: {
-				size_t arity =
-					instruction->data.if_.blocktype !=
-					VALTYPE_NULL ? 1 : 0;
+			/* test top of stack */
+			assert(peek_stack(sstack) == STACK_I32);
+			pop_stack(sstack);
+			/* pop %rax */
+			OUTS("\x58");
 
-				if (!imd.data.if_.did_else) {
-					/* if (else_exist) {
-					   jump after else
-					   }
-					*/
-					if (instruction->data.if_.n_instructions_else) {
-						imd.data.if_.jump_to_after_else_offset = output->n_elts + 1;
-						/* jmp after_else_offset */
-						OUTS("\xe9\x90\x90\x90\x90");
-					}
+			/* if not true jump to else case */
+			/* test %eax, %eax */
+			OUTS("\x85\xc0");
 
-					/* fix up jump_to_else_offset */
-					imd.data.if_.jump_to_else_offset = output->n_elts - imd.data.if_.jump_to_else_offset;
-					encode_le_uint32_t(imd.data.if_.jump_to_else_offset - 4,
-							   &output->elts[output->n_elts - imd.data.if_.jump_to_else_offset]);
+			imd->data.if_.jump_to_else_offset = output->n_elts + 2;
+			/* je else_offset */
+			OUTS("\x0f\x84\x90\x90\x90\x90");
 
-				} else {
-					/* fix up jump_to_after_else_offset */
-					imd.data.if_.jump_to_after_else_offset = output->n_elts - imd.data.if_.jump_to_after_else_offset;
-					encode_le_uint32_t(imd.data.if_.jump_to_after_else_offset - 4,
-							   &output->elts[output->n_elts - imd.data.if_.jump_to_after_else_offset]);
-				}
+			/* output then case */
+			imd->data.if_.label_idx = labels->n_elts;
+			INC_LABELS();
+
+			imd->data.if_.stack_idx = sstack->n_elts;
+			if (!stack_grow(sstack, 1))
+				goto error;
 
-				if (!imd.data.if_.did_else &&
-				    instruction->data.if_.n_instructions_else) {
-					/* if (else_exist) {
-					   output else case
-					   }
-					*/
+			{
+				struct StackElt *elt =
+					&sstack->elts[imd->data.if_.stack_idx];
+				elt->type = STACK_LABEL;
+				elt->data.label.arity = arity;
+				elt->data.label.continuation_idx = imd->data.if_.label_idx;
+			}
 
+			imd->data.if_.did_else = 0;
+			break;
+		}
+		default:
 #ifdef DEBUG_COMPILE
-						printf("%*selse\n", (int)(stack_sz - 1) * 2, "");
+			dump_instruction(instruction, ctl.n_elts);
 #endif
+			if (!wasmjit_compile_instruction(func_types,
+							 module_types,
+							 type,
+							 output,
+							 branches,
+							 memrefs,
+							 locals_md,
+							 n_locals,
+							 n_frame_locals,
+							 sstack,
+							 instruction,
+							 !!max_stack))
+				goto error;
 
-					/* reset stack */
-					if (!stack_truncate(sstack, imd.data.if_.stack_idx + 1))
-						goto error;
-
-					/* push else chain onto stack */
-					stack_sz += 1;
-					new_stack = realloc(stack, stack_sz * sizeof(stack[0]));
-					if (!new_stack)
-						goto error;
-					stack = new_stack;
-
-					imd.cont = 0;
-					imd.instructions = instruction->data.if_.instructions_else;
-					imd.n_instructions = instruction->data.if_.n_instructions_else;
-					imd.data.if_.did_else = 1;
-
-					memcpy(&stack[stack_sz - 1],
-					       &imd,
-					       sizeof(imd));
-				} else {
-					size_t j;
+			if (instruction->opcode == OPCODE_UNREACHABLE ||
+			    instruction->opcode == OPCODE_BR ||
+			    instruction->opcode == OPCODE_BR_TABLE ||
+			    instruction->opcode == OPCODE_RETURN)
+				dead = 1;
+			break;
+		}
 
-					/* fix up static stack */
-					/* remove label and push output types */
-					if (!stack_truncate(sstack, imd.data.if_.stack_idx + arity))
-						goto error;
+		if (max_stack) {
+			size_t n_values;
+			n_values = stack_depth(sstack);
+			*max_stack = MMAX(*max_stack, n_values);
+		}
+	}
 
-					for (j = 0; j < arity; ++j) {
-						sstack->elts[imd.data.if_.stack_idx + j].type = instruction->data.if_.blocktype;
-					}
+	/* the final end must also be the last byte of the body */
+	if (src->pstate && src->pstate->amt_left) {
+		if (validator->why)
+			snprintf(validator->why, validator->why_size,
+				 "trailing bytes after the end of the function");
+		goto error;
+	}
 
-					/* set labels position */
-					labels->elts[imd.data.if_.label_idx] = output->n_elts;
-				}
-				break;
-			}
-			}
+	ret = 1;
+
+	if (0) {
+	error:
+		ret = 0;
+	}
+
+	if (ctl.elts)
+		free(ctl.elts);
+
+	return ret;
+}
+
+int wasmjit_validate_function(const struct FuncType *func_types,
+			      size_t n_func_types,
+			      const struct ModuleTypes *module_types,
+			      const struct FuncType *type,
+			      const struct CodeSectionCode *code,
+			      char *why, size_t why_size)
+{
+	struct ParseState body_pstate;
+	struct WasmJITArena body_arena;
+	struct InstructionSource src;
+	struct FunctionValidator validator;
+	const struct Instr *instruction;
+	int ret;
+
+	wasmjit_arena_init(&body_arena);
+	src.pstate = NULL;
+	src.compact = NULL;
+	src.pos = 0;
+	init_instruction(&src.instr);
+	src.frames.n_elts = 0;
+	src.frames.elts = NULL;
+
+	if (!wasmjit_validator_init(&validator, func_types, n_func_types,
+				    module_types, type, code,
+				    why, why_size))
+		goto error;
+
+	if (code->body) {
+		if (!init_pstate(&body_pstate, code->body, code->body_size))
+			goto error;
+		body_pstate.arena = &body_arena;
+		src.pstate = &body_pstate;
+	} else if (code->compact.instrs) {
+		src.compact = &code->compact;
+	} else if (!push_frame(&src, code->instructions,
+			       code->n_instructions, NULL, 0)) {
+		goto error;
+	}
+
+	while (!wasmjit_validator_done(&validator)) {
+		if (!next_instruction(&src, &instruction)) {
+			if (why)
+				snprintf(why, why_size, "malformed instruction");
+			goto error;
 		}
+
+		if (!wasmjit_validate_instruction(&validator, instruction))
+			goto error;
+	}
+
+	if (src.pstate && src.pstate->amt_left) {
+		if (why)
+			snprintf(why, why_size,
+				 "trailing bytes after the end of the function");
+		goto error;
 	}
 
 	ret = 1;
@@ -2368,19 +3282,24 @@ static int wasmjit_compile_instructions(const struct FuncType *func_types,
 		ret = 0;
 	}
 
-	if (stack)
-		free(stack);
+	wasmjit_arena_free(&body_arena);
+	wasmjit_validator_free(&validator);
+
+	if (src.frames.elts)
+		free(src.frames.elts);
 
 	return ret;
 }
 
 char *wasmjit_compile_function(const struct FuncType *func_types,
+			       size_t n_func_types,
 			       const struct ModuleTypes *module_types,
 			       const struct FuncType *type,
 			       const struct CodeSectionCode *code,
 			       struct MemoryReferences *memrefs,
 			       size_t *out_size,
-			       size_t *stack_usage)
+			       size_t *stack_usage,
+			       char *why, size_t why_size)
 {
 	char buf[sizeof(uint32_t)];
 	struct SizedBuffer outputv = { 0, NULL };
@@ -2389,10 +3308,28 @@ char *wasmjit_compile_function(const struct FuncType *func_types,
 	struct StaticStack sstack = { 0, NULL };
 	struct LabelContinuations labels = { 0, NULL };
 	struct LocalsMD *locals_md = NULL;
+	struct ParseState body_pstate;
+	struct WasmJITArena body_arena;
+	struct InstructionSource src;
+	struct FunctionValidator validator;
 	size_t n_frame_locals;
 	size_t n_locals;
 	char *out;
 
+	wasmjit_arena_init(&body_arena);
+	if (!wasmjit_validator_init(&validator, func_types, n_func_types,
+				    module_types, type, code,
+				    why, why_size)) {
+		wasmjit_validator_free(&validator);
+		return NULL;
+	}
+	src.pstate = NULL;
+	src.compact = NULL;
+	src.pos = 0;
+	init_instruction(&src.instr);
+	src.frames.n_elts = 0;
+	src.frames.elts = NULL;
+
 	{
 		size_t i;
 		n_locals = type->n_inputs;
@@ -2560,6 +3497,10 @@ char *wasmjit_compile_function(const struct FuncType *func_types,
 		}
 	}
 
+	if (stack_usage &&
+	    !emit_interrupt_check(output, memrefs, n_frame_locals))
+		goto error;
+
 	if (WASMJIT_DEBUG_STACK) {
 		/* push %rbx */
 		OUTS("\x53");
@@ -2567,11 +3508,23 @@ char *wasmjit_compile_function(const struct FuncType *func_types,
 		OUTS("\x48\x89\xe3");
 	}
 
+	if (code->body) {
+		if (!init_pstate(&body_pstate, code->body, code->body_size))
+			goto error;
+		/* holds br_table targets until the function is done */
+		body_pstate.arena = &body_arena;
+		src.pstate = &body_pstate;
+	} else if (code->compact.instrs) {
+		src.compact = &code->compact;
+	} else if (!push_frame(&src, code->instructions,
+			       code->n_instructions, NULL, 0)) {
+		goto error;
+	}
+
 	if (!wasmjit_compile_instructions(func_types, module_types, type,
 					  output, &labels, &branches, memrefs,
 					  locals_md, n_locals, n_frame_locals, &sstack,
-					  code->instructions, code->n_instructions,
-					  stack_usage))
+					  &src, &validator, stack_usage))
 		goto error;
 
 	if (stack_usage) {
@@ -2668,6 +3621,13 @@ char *wasmjit_compile_function(const struct FuncType *func_types,
 		free(locals_md);
 	}
 
+	wasmjit_arena_free(&body_arena);
+	wasmjit_validator_free(&validator);
+
+	if (src.frames.elts) {
+		free(src.frames.elts);
+	}
+
 	if (branches.elts) {
 		free(branches.elts);
 	}
@@ -30,9 +30,13 @@
 #include <wasmjit/sys.h>
 
 struct ModuleTypes {
+	size_t n_functypes;
 	struct FuncType *functypes;
+	size_t n_tabletypes;
 	struct TableType *tabletypes;
+	size_t n_memorytypes;
 	struct MemoryType *memorytypes;
+	size_t n_globaltypes;
 	struct GlobalType *globaltypes;
 };
 
@@ -48,19 +52,32 @@ struct MemoryReferences {
 			MEMREF_RESOLVE_INDIRECT_CALL,
 			MEMREF_TRAP,
 			MEMREF_STACK_TOP,
+			MEMREF_ATOMIC_WAIT,
+			MEMREF_ATOMIC_NOTIFY,
+			MEMREF_INTERRUPT,
 		} type;
 		size_t code_offset;
 		size_t idx;
 	} *elts;
 };
 
+/* type checks code without compiling it */
+int wasmjit_validate_function(const struct FuncType *func_types,
+			      size_t n_func_types,
+			      const struct ModuleTypes *module_types,
+			      const struct FuncType *type,
+			      const struct CodeSectionCode *code,
+			      char *why, size_t why_size);
+
 char *wasmjit_compile_function(const struct FuncType *func_types,
+			       size_t n_func_types,
 			       const struct ModuleTypes *module_types,
 			       const struct FuncType *type,
 			       const struct CodeSectionCode *code,
 			       struct MemoryReferences *memrefs,
 			       size_t *out_size,
-			       size_t *stack_usage);
+			       size_t *stack_usage,
+			       char *why, size_t why_size);
 
 char *wasmjit_compile_hostfunc(struct FuncType *type,
 			       void *hostfunc,
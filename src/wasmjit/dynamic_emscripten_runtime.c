@@ -25,70 +25,15 @@
 #include <wasmjit/runtime.h>
 #include <wasmjit/emscripten_runtime.h>
 #include <wasmjit/util.h>
-#include <wasmjit/compile.h>
 
 #include <wasmjit/sys.h>
 
-static struct FuncInst *alloc_func(struct ModuleInst *module, void *_fptr,
-				   wasmjit_valtype_t _output, size_t n_inputs,
-				   wasmjit_valtype_t *inputs)
-{
-	void *tmp_unmapped = NULL;
-	struct FuncInst *tmp_func = NULL;
-
-	tmp_func = calloc(1, sizeof(struct FuncInst));
-	if (!tmp_func)
-		goto error;
-	tmp_func->module_inst = module;
-	tmp_func->type.n_inputs = n_inputs;
-	memcpy(tmp_func->type.input_types, inputs, n_inputs);
-	tmp_func->type.output_type = _output;
-	tmp_unmapped =
-		wasmjit_compile_hostfunc(&tmp_func->type, _fptr,
-					 tmp_func,
-					 &tmp_func->compiled_code_size);
-	if (!tmp_unmapped)
-		goto error;
-	tmp_func->compiled_code =
-		wasmjit_map_code_segment(tmp_func->compiled_code_size);
-	if (!tmp_func->compiled_code)
-		goto error;
-	memcpy(tmp_func->compiled_code, tmp_unmapped,
-	       tmp_func->compiled_code_size);
-	if (!wasmjit_mark_code_segment_executable(tmp_func->compiled_code,
-						  tmp_func->compiled_code_size))
-		goto error;
-	tmp_unmapped =
-		wasmjit_compile_invoker(&tmp_func->type,
-					tmp_func->compiled_code,
-					&tmp_func->invoker_size);
-	if (!tmp_unmapped)
-		goto error;
-	tmp_func->invoker =
-		wasmjit_map_code_segment(tmp_func->invoker_size);
-	memcpy(tmp_func->invoker, tmp_unmapped,
-	       tmp_func->invoker_size);
-	if (!wasmjit_mark_code_segment_executable(tmp_func->invoker,
-						  tmp_func->invoker_size))
-		goto error;
-
-	if (0) {
-	error:
-		if (tmp_func)
-			wasmjit_free_func_inst(tmp_func);
-		tmp_func = NULL;
-	}
-
-	if (tmp_unmapped)
-		free(tmp_unmapped);
-
-	return tmp_func;
-}
-
 struct NamedModule *wasmjit_instantiate_emscripten_runtime(uint32_t static_bump,
 							   int has_table,
 							   size_t tablemin,
 							   size_t tablemax,
+							   int syscall_stats,
+							   int shared_memory,
 							   size_t *amt)
 {
 	struct {
@@ -137,7 +82,10 @@ struct NamedModule *wasmjit_instantiate_emscripten_runtime(uint32_t static_bump,
 			module->private_data = calloc(1, sizeof(struct EmscriptenContext)); \
 			if (!module->private_data)			\
 				goto error;				\
-			module->free_private_data = &free;		\
+			module->free_private_data = &wasmjit_emscripten_free_context; \
+			if (syscall_stats &&				\
+			    wasmjit_emscripten_enable_syscall_stats(module->private_data)) \
+				goto error;				\
 		}							\
 		if (start_func) {					\
 			wasmjit_invoke_function(start_func, NULL, NULL); \
@@ -160,7 +108,7 @@ struct NamedModule *wasmjit_instantiate_emscripten_runtime(uint32_t static_bump,
 #define DEFINE_WASM_FUNCTION(_name, _fptr, _output, n, ...)	  \
 	{							  \
 		wasmjit_valtype_t inputs[] = { __VA_ARGS__ };		\
-		tmp_func = alloc_func(module, _fptr, _output, n, inputs); \
+		tmp_func = wasmjit_alloc_host_func(module, _fptr, _output, n, inputs); \
 		if (!tmp_func)						\
 			goto error;					\
 		LVECTOR_GROW(&module->funcs, 1);			\
@@ -175,7 +123,7 @@ struct NamedModule *wasmjit_instantiate_emscripten_runtime(uint32_t static_bump,
 
 #define DEFINE_WASM_START_FUNCTION(fptr)				\
 	do {								\
-		start_func = alloc_func(module, fptr, VALTYPE_NULL, 0, NULL); \
+		start_func = wasmjit_alloc_host_func(module, fptr, VALTYPE_NULL, 0, NULL); \
 		if (!start_func)					\
 			goto error;					\
 	} while (0);
@@ -219,6 +167,7 @@ struct NamedModule *wasmjit_instantiate_emscripten_runtime(uint32_t static_bump,
 		tmp_mem_buf = NULL;				\
 		tmp_mem->size = (_min) * WASM_PAGE_SIZE;	\
 		tmp_mem->max = (_max) * WASM_PAGE_SIZE;		\
+		tmp_mem->shared = shared_memory;		\
 		LVECTOR_GROW(&module->mems, 1);			\
 		module->mems.elts[module->mems.n_elts - 1] = tmp_mem; \
 		tmp_mem = NULL;					\
@@ -250,6 +199,13 @@ struct NamedModule *wasmjit_instantiate_emscripten_runtime(uint32_t static_bump,
 		module->exports.elts[module->exports.n_elts - 1].value.global = module->globals.elts[module->globals.n_elts - 1]; \
 	}
 
+#define DEFINE_EMSCRIPTEN_SYSCALL(_n)					\
+	DEFINE_WASM_FUNCTION(___syscall ## _n,				\
+			     syscall_stats				\
+			     ? &wasmjit_emscripten_counted____syscall ## _n \
+			     : &wasmjit_emscripten____syscall ## _n,	\
+			     VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
+
 #include <wasmjit/emscripten_runtime_def.h>
 
 	if (0) {
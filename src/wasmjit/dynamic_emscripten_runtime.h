@@ -31,6 +31,8 @@ struct NamedModule *wasmjit_instantiate_emscripten_runtime(uint32_t static_bump,
 							   int has_table,
 							   size_t tablemin,
 							   size_t tablemax,
+							   int syscall_stats,
+							   int shared_memory,
 							   size_t *amt);
 
 #endif
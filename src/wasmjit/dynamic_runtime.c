@@ -23,6 +23,7 @@
  */
 
 #include <wasmjit/runtime.h>
+#include <wasmjit/compile.h>
 
 #include <wasmjit/sys.h>
 
@@ -32,7 +33,9 @@
 
 #include <wasmjit/ktls.h>
 
+#include <linux/list.h>
 #include <linux/mm.h>
+#include <linux/mutex.h>
 #include <linux/sched/task_stack.h>
 
 void *wasmjit_map_code_segment(size_t code_size)
@@ -55,33 +58,142 @@ int wasmjit_unmap_code_segment(void *code, size_t code_size)
 	return 1;
 }
 
-jmp_buf *wasmjit_get_jmp_buf(void)
+struct WasmJITThreadContext *wasmjit_get_thread_context(void)
 {
-	return wasmjit_get_ktls()->jmp_buf;
+	return &wasmjit_get_ktls()->ctx;
 }
 
-int wasmjit_set_jmp_buf(jmp_buf *jmpbuf)
+/*
+  As in user space below: waiters are linked under wait_lock, which
+  notify also takes, so a store and notify can't slip between the
+  compare and the sleep, and notify can limit and count its wakeups.
+*/
+
+struct Waiter {
+	struct list_head link;
+	void *addr;
+	int woken;
+};
+
+static DEFINE_MUTEX(wait_lock);
+static LIST_HEAD(wait_list);
+
+uint32_t wasmjit_atomic_wait(void *addr, uint64_t expected,
+			     int64_t timeout, int is64)
 {
-	wasmjit_get_ktls()->jmp_buf = jmpbuf;
-	return 1;
+	struct Waiter self;
+	long ret;
+
+	mutex_lock(&wait_lock);
+
+	if (is64
+	    ? READ_ONCE(*(uint64_t *)addr) != expected
+	    : READ_ONCE(*(uint32_t *)addr) != (uint32_t)expected) {
+		mutex_unlock(&wait_lock);
+		return 1;
+	}
+
+	self.addr = addr;
+	self.woken = 0;
+	list_add_tail(&self.link, &wait_list);
+
+	mutex_unlock(&wait_lock);
+
+	if (timeout < 0)
+		wait_var_event_killable(&self.woken, READ_ONCE(self.woken));
+	else
+		wait_var_event_timeout(&self.woken, READ_ONCE(self.woken),
+				       nsecs_to_jiffies(timeout));
+
+	mutex_lock(&wait_lock);
+	if (self.woken) {
+		ret = 0;
+	} else {
+		/* timed out or killed, we are still linked */
+		list_del(&self.link);
+		ret = 2;
+	}
+	mutex_unlock(&wait_lock);
+
+	return ret;
 }
 
-void *wasmjit_stack_top(void)
+uint32_t wasmjit_atomic_notify(void *addr, uint32_t count)
 {
-	return wasmjit_get_ktls()->stack_top;
+	struct Waiter *waiter, *tmp;
+	uint32_t woken = 0;
+
+	mutex_lock(&wait_lock);
+
+	list_for_each_entry_safe(waiter, tmp, &wait_list, link) {
+		if (woken == count)
+			break;
+		if (waiter->addr != addr)
+			continue;
+
+		list_del(&waiter->link);
+		/* NB: pairs with the condition check in wait_var_event() */
+		smp_store_mb(waiter->woken, 1);
+		wake_up_var(&waiter->woken);
+		woken += 1;
+	}
+
+	mutex_unlock(&wait_lock);
+
+	return woken;
 }
 
-int wasmjit_set_stack_top(void *stack_top)
+void wasmjit_check_interrupt(void)
+{
+	if (wasmjit_get_thread_context()->interrupted)
+		wasmjit_trap(WASMJIT_TRAP_INTERRUPTED);
+}
+
+/* every context is embedded in the KernelThreadLocal of its ioctl */
+
+static enum hrtimer_restart wasmjit_deadline_expired(struct hrtimer *timer)
+{
+	struct KernelThreadLocal *ktls =
+		container_of(timer, struct KernelThreadLocal, deadline);
+
+	ktls->ctx.interrupted = 1;
+	return HRTIMER_NORESTART;
+}
+
+int wasmjit_set_deadline(struct WasmJITThreadContext *ctx, uint64_t timeout_ns)
 {
-	wasmjit_get_ktls()->stack_top = stack_top;
+	struct KernelThreadLocal *ktls =
+		container_of(ctx, struct KernelThreadLocal, ctx);
+
+	hrtimer_cancel(&ktls->deadline);
+	ktls->deadline.function = wasmjit_deadline_expired;
+	hrtimer_start(&ktls->deadline, ns_to_ktime(timeout_ns),
+		      HRTIMER_MODE_REL);
 	return 1;
 }
 
-#else
+void wasmjit_clear_deadline(struct WasmJITThreadContext *ctx)
+{
+	struct KernelThreadLocal *ktls =
+		container_of(ctx, struct KernelThreadLocal, ctx);
+
+	/* waits for a running callback, nothing sets the flag after this */
+	hrtimer_cancel(&ktls->deadline);
+	ctx->interrupted = 0;
+}
 
-#include <wasmjit/tls.h>
+#else
 
+#include <pthread.h>
 #include <sys/mman.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
 void *wasmjit_map_code_segment(size_t code_size)
 {
@@ -104,57 +216,617 @@ int wasmjit_unmap_code_segment(void *code, size_t code_size)
 	return !munmap(code, code_size);
 }
 
-wasmjit_tls_key_t jmp_buf_key;
+static __thread struct WasmJITThreadContext thread_ctx
+__attribute__((tls_model("initial-exec")));
 
-__attribute__((constructor))
-static void _init_jmp_buf(void)
+struct WasmJITThreadContext *wasmjit_get_thread_context(void)
 {
-	wasmjit_init_tls_key(&jmp_buf_key, NULL);
+	return &thread_ctx;
 }
 
-jmp_buf *wasmjit_get_jmp_buf(void)
+#if defined(_POSIX_CLOCK_SELECTION) && _POSIX_CLOCK_SELECTION >= 0
+/* timeouts are relative, they must not move with the wall clock */
+#define RUNTIME_CLOCK CLOCK_MONOTONIC
+#define RUNTIME_SETCLOCK
+#else
+#define RUNTIME_CLOCK CLOCK_REALTIME
+#endif
+
+/* makes a condition variable whose timed waits use RUNTIME_CLOCK */
+static int init_runtime_cond(pthread_cond_t *cond)
 {
-	jmp_buf *toret;
+	pthread_condattr_t attr;
 	int ret;
-	ret = wasmjit_get_tls_key(jmp_buf_key, &toret);
-	if (!ret) return NULL;
-	return toret;
+
+	if (pthread_condattr_init(&attr))
+		return 0;
+#ifdef RUNTIME_SETCLOCK
+	if (pthread_condattr_setclock(&attr, RUNTIME_CLOCK)) {
+		pthread_condattr_destroy(&attr);
+		return 0;
+	}
+#endif
+	ret = pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+	return !ret;
 }
 
-int wasmjit_set_jmp_buf(jmp_buf *jmpbuf)
+static void runtime_clock_after(struct timespec *when, uint64_t ns)
 {
-	return wasmjit_set_tls_key(jmp_buf_key, jmpbuf);
+	clock_gettime(RUNTIME_CLOCK, when);
+	when->tv_sec += ns / 1000000000;
+	when->tv_nsec += ns % 1000000000;
+	if (when->tv_nsec >= 1000000000) {
+		when->tv_sec += 1;
+		when->tv_nsec -= 1000000000;
+	}
 }
 
-wasmjit_tls_key_t stack_top_key;
+/*
+  Waiters queue in a bucket picked by address. The value is compared
+  under the bucket lock and notify takes the same lock, so a store and
+  notify can't fall between the compare and the sleep, whatever the
+  width of the wait. Notify unlinks the waiters it wakes, which gives
+  FIFO order and an exact count.
+
+  On Linux a waiter sleeps on a futex, the wake_token of its own
+  thread context rather than the guest word: that serves 64-bit waits
+  too, never wakes a thread that wasn't picked, and lets
+  wasmjit_interrupt() end the wait of one thread. Elsewhere the
+  bucket has a condition variable and waits can't be interrupted.
+*/
+
+#if defined(__linux__) && defined(SYS_futex) && \
+	defined(FUTEX_WAIT_BITSET_PRIVATE) && defined(RUNTIME_SETCLOCK)
+/* NB: FUTEX_WAIT_BITSET timeouts are absolute on CLOCK_MONOTONIC */
+#define HAVE_FUTEX
+#endif
 
-__attribute__((constructor))
-static void _init_stack_top(void)
+#define WAIT_BUCKETS 64
+
+struct Waiter {
+	struct Waiter *next;
+	void *addr;
+	struct WasmJITThreadContext *ctx;
+	int woken;
+};
+
+static struct WaitBucket {
+	pthread_mutex_t lock;
+#ifndef HAVE_FUTEX
+	pthread_cond_t cond;
+#endif
+	struct Waiter *waiters;
+} wait_buckets[WAIT_BUCKETS];
+
+static pthread_once_t wait_buckets_once = PTHREAD_ONCE_INIT;
+static int wait_buckets_ready;
+
+static void init_wait_buckets(void)
 {
-	wasmjit_init_tls_key(&stack_top_key, NULL);
+	size_t i;
+
+	for (i = 0; i < WAIT_BUCKETS; ++i) {
+		if (pthread_mutex_init(&wait_buckets[i].lock, NULL))
+			return;
+#ifndef HAVE_FUTEX
+		if (!init_runtime_cond(&wait_buckets[i].cond))
+			return;
+#endif
+	}
+
+	wait_buckets_ready = 1;
 }
 
-void *wasmjit_stack_top(void)
+static struct WaitBucket *get_wait_bucket(void *addr)
+{
+	if (pthread_once(&wait_buckets_once, init_wait_buckets) ||
+	    !wait_buckets_ready)
+		return NULL;
+	/* NB: waited addresses are at least 4-byte aligned */
+	return &wait_buckets[((uintptr_t) addr >> 2) % WAIT_BUCKETS];
+}
+
+#ifdef HAVE_FUTEX
+
+/*
+  The token only says "look again", woken and interrupted say why.
+  Setting it before the wake means a sleeper that checked those flags
+  just before can't miss it: the futex compare fails instead.
+*/
+static void unpark(struct WasmJITThreadContext *ctx)
+{
+	__atomic_store_n(&ctx->wake_token, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &ctx->wake_token, FUTEX_WAKE_PRIVATE, 1,
+		NULL, NULL, 0);
+}
+
+/* called and returns with the bucket locked, 0 on timeout */
+static int park(struct WaitBucket *bucket, struct WasmJITThreadContext *ctx,
+		const struct timespec *when)
+{
+	int timedout = 0;
+
+	pthread_mutex_unlock(&bucket->lock);
+	if (!__atomic_exchange_n(&ctx->wake_token, 0, __ATOMIC_SEQ_CST) &&
+	    syscall(SYS_futex, &ctx->wake_token, FUTEX_WAIT_BITSET_PRIVATE, 0,
+		    when, NULL, FUTEX_BITSET_MATCH_ANY) < 0)
+		timedout = errno == ETIMEDOUT;
+	pthread_mutex_lock(&bucket->lock);
+
+	return !timedout;
+}
+
+#else
+
+static int park(struct WaitBucket *bucket, struct WasmJITThreadContext *ctx,
+		const struct timespec *when)
+{
+	(void)ctx;
+	if (!when)
+		return !pthread_cond_wait(&bucket->cond, &bucket->lock);
+	return pthread_cond_timedwait(&bucket->cond, &bucket->lock,
+				      when) != ETIMEDOUT;
+}
+
+#endif
+
+uint32_t wasmjit_atomic_wait(void *addr, uint64_t expected,
+			     int64_t timeout, int is64)
+{
+	struct WasmJITThreadContext *ctx = wasmjit_get_thread_context();
+	struct WaitBucket *bucket;
+	struct Waiter self, **waiterp;
+	struct timespec when;
+	uint32_t ret;
+
+	bucket = get_wait_bucket(addr);
+	if (!bucket)
+		wasmjit_trap(WASMJIT_TRAP_ABORT);
+
+	if (timeout >= 0)
+		runtime_clock_after(&when, timeout);
+
+	pthread_mutex_lock(&bucket->lock);
+
+	if (is64
+	    ? __atomic_load_n((uint64_t *)addr, __ATOMIC_SEQ_CST) != expected
+	    : __atomic_load_n((uint32_t *)addr, __ATOMIC_SEQ_CST) != (uint32_t)expected) {
+		pthread_mutex_unlock(&bucket->lock);
+		return 1;
+	}
+
+	self.next = NULL;
+	self.addr = addr;
+	self.ctx = ctx;
+	self.woken = 0;
+	for (waiterp = &bucket->waiters; *waiterp; waiterp = &(*waiterp)->next)
+		;
+	*waiterp = &self;
+
+	while (!self.woken && !ctx->interrupted) {
+		if (!park(bucket, ctx, timeout < 0 ? NULL : &when))
+			break;
+	}
+
+	if (self.woken) {
+		ret = 0;
+	} else {
+		/* timed out or interrupted, we are still linked */
+		for (waiterp = &bucket->waiters; *waiterp != &self;
+		     waiterp = &(*waiterp)->next)
+			;
+		*waiterp = self.next;
+		ret = 2;
+	}
+
+	pthread_mutex_unlock(&bucket->lock);
+
+	if (!self.woken && ctx->interrupted)
+		wasmjit_trap(WASMJIT_TRAP_INTERRUPTED);
+
+	return ret;
+}
+
+uint32_t wasmjit_atomic_notify(void *addr, uint32_t count)
+{
+	struct WaitBucket *bucket;
+	struct Waiter **waiterp;
+	uint32_t woken = 0;
+
+	bucket = get_wait_bucket(addr);
+	if (!bucket)
+		/* nobody could have waited */
+		return 0;
+
+	pthread_mutex_lock(&bucket->lock);
+
+	waiterp = &bucket->waiters;
+	while (*waiterp && woken < count) {
+		struct Waiter *waiter = *waiterp;
+
+		if (waiter->addr == addr) {
+			*waiterp = waiter->next;
+			waiter->woken = 1;
+#ifdef HAVE_FUTEX
+			/* NB: it relocks the bucket before returning,
+			   so waiter stays valid until we unlock */
+			unpark(waiter->ctx);
+#endif
+			woken += 1;
+		} else {
+			waiterp = &waiter->next;
+		}
+	}
+
+#ifndef HAVE_FUTEX
+	if (woken)
+		pthread_cond_broadcast(&bucket->cond);
+#endif
+
+	pthread_mutex_unlock(&bucket->lock);
+
+	return woken;
+}
+
+#ifdef WASMJIT_INTERRUPT_FLAG_FS_RELATIVE
+
+uintptr_t wasmjit_interrupt_flag_fs_offset(void)
+{
+	uintptr_t tp;
+
+	/* NB: initial-exec TLS is at the same offset from the thread
+	   pointer in every thread */
+	__asm__("mov %%fs:0, %0" : "=r" (tp));
+	return (uintptr_t) &thread_ctx.interrupted - tp;
+}
+
+#else
+
+void wasmjit_check_interrupt(void)
+{
+	if (thread_ctx.interrupted)
+		wasmjit_trap(WASMJIT_TRAP_INTERRUPTED);
+}
+
+#endif
+
+/* a single watchdog thread turns expired deadlines into interrupts */
+
+struct Deadlines {
+	size_t n_elts;
+	struct Deadline {
+		struct WasmJITThreadContext *ctx;
+		struct timespec when;
+	} *elts;
+};
+
+static DEFINE_VECTOR_GROW(deadlines, struct Deadlines);
+
+static pthread_mutex_t watchdog_lock = PTHREAD_MUTEX_INITIALIZER;
+/* initialized with the watchdog, to wait on RUNTIME_CLOCK */
+static pthread_cond_t watchdog_cond;
+static struct Deadlines watchdog_deadlines;
+static int watchdog_started;
+
+static int timespec_before(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec < b->tv_sec ||
+		(a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec));
+}
+
+static void remove_deadline(size_t i)
+{
+	struct Deadlines *dl = &watchdog_deadlines;
+	dl->elts[i] = dl->elts[dl->n_elts - 1];
+	dl->n_elts -= 1;
+}
+
+static void *watchdog_thread(void *arg)
+{
+	struct Deadlines *dl = &watchdog_deadlines;
+
+	(void)arg;
+
+	pthread_mutex_lock(&watchdog_lock);
+	for (;;) {
+		size_t i, next = SIZE_MAX;
+		struct timespec now;
+
+		clock_gettime(RUNTIME_CLOCK, &now);
+
+		i = 0;
+		while (i < dl->n_elts) {
+			if (!timespec_before(&now, &dl->elts[i].when)) {
+				wasmjit_interrupt(dl->elts[i].ctx);
+				remove_deadline(i);
+				continue;
+			}
+
+			if (next == SIZE_MAX ||
+			    timespec_before(&dl->elts[i].when, &dl->elts[next].when))
+				next = i;
+			i += 1;
+		}
+
+		if (next == SIZE_MAX) {
+			pthread_cond_wait(&watchdog_cond, &watchdog_lock);
+		} else {
+			struct timespec when = dl->elts[next].when;
+			pthread_cond_timedwait(&watchdog_cond, &watchdog_lock, &when);
+		}
+	}
+
+	return NULL;
+}
+
+int wasmjit_set_deadline(struct WasmJITThreadContext *ctx, uint64_t timeout_ns)
 {
-	jmp_buf *toret;
+	struct Deadlines *dl = &watchdog_deadlines;
+	struct timespec when;
+	size_t i;
 	int ret;
-	ret = wasmjit_get_tls_key(stack_top_key, &toret);
-	if (!ret) return NULL;
-	return toret;
+
+	runtime_clock_after(&when, timeout_ns);
+
+	pthread_mutex_lock(&watchdog_lock);
+
+	if (!watchdog_started) {
+		pthread_t thread;
+		pthread_attr_t attr;
+
+		if (!init_runtime_cond(&watchdog_cond))
+			goto error;
+
+		if (pthread_attr_init(&attr)) {
+			pthread_cond_destroy(&watchdog_cond);
+			goto error;
+		}
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		ret = pthread_create(&thread, &attr, watchdog_thread, NULL);
+		pthread_attr_destroy(&attr);
+		if (ret) {
+			pthread_cond_destroy(&watchdog_cond);
+			goto error;
+		}
+		watchdog_started = 1;
+	}
+
+	for (i = 0; i < dl->n_elts; ++i) {
+		if (dl->elts[i].ctx == ctx)
+			break;
+	}
+
+	if (i == dl->n_elts) {
+		if (!deadlines_grow(dl, 1))
+			goto error;
+		dl->elts[i].ctx = ctx;
+	}
+	dl->elts[i].when = when;
+
+	pthread_cond_signal(&watchdog_cond);
+
+	ret = 1;
+
+	if (0) {
+	error:
+		ret = 0;
+	}
+
+	pthread_mutex_unlock(&watchdog_lock);
+
+	return ret;
+}
+
+void wasmjit_clear_deadline(struct WasmJITThreadContext *ctx)
+{
+	struct Deadlines *dl = &watchdog_deadlines;
+	size_t i;
+
+	pthread_mutex_lock(&watchdog_lock);
+	for (i = 0; i < dl->n_elts; ++i) {
+		if (dl->elts[i].ctx == ctx) {
+			remove_deadline(i);
+			break;
+		}
+	}
+	/* the watchdog only sets the flag under the lock, so an
+	   expiry that raced with the guest returning is dropped here */
+	ctx->interrupted = 0;
+	pthread_mutex_unlock(&watchdog_lock);
+}
+
+#endif
+
+jmp_buf *wasmjit_get_jmp_buf(void)
+{
+	return wasmjit_get_thread_context()->jmp_buf;
+}
+
+int wasmjit_set_jmp_buf(jmp_buf *jmpbuf)
+{
+	wasmjit_get_thread_context()->jmp_buf = jmpbuf;
+	return 1;
+}
+
+void *wasmjit_stack_top(void)
+{
+	return wasmjit_get_thread_context()->stack_top;
 }
 
 int wasmjit_set_stack_top(void *stack_top)
 {
-	return wasmjit_set_tls_key(stack_top_key, stack_top);
+	wasmjit_get_thread_context()->stack_top = stack_top;
+	return 1;
 }
 
+#if !defined(__KERNEL__) && defined(__x86_64__) && defined(__ELF__)
+
+/*
+  Entering wasm from the host does not need setjmp(): the only way
+  out of compiled code other than a normal return is a call to
+  wasmjit_trap(), so it is enough to record the stack pointer of the
+  entry frame after it has pushed the callee-saved registers. On trap
+  we reset %rsp to that point and run the same epilogue as a normal
+  return, with the trap reason as the return value.
+
+  The saved stack pointer lives in the thread context, so the fast
+  path does no library calls at all.
+*/
+
+#define WASMJIT_USE_ENTRY_FRAME
+
+__attribute__((visibility("hidden")))
+int wasmjit_enter_invoker(void **entry_sp,
+			  union ValueUnion (*invoker)(union ValueUnion *),
+			  union ValueUnion *values,
+			  union ValueUnion *out);
+
+__attribute__((visibility("hidden"), noreturn))
+void wasmjit_unwind_to_entry(void *entry_sp, int reason);
+
+__asm__(
+	".text\n"
+	".globl wasmjit_enter_invoker\n"
+	".hidden wasmjit_enter_invoker\n"
+	".type wasmjit_enter_invoker,@function\n"
+	"wasmjit_enter_invoker:\n"
+	"	push %rbp\n"
+	"	mov %rsp, %rbp\n"
+	"	push %rbx\n"
+	"	push %r12\n"
+	"	push %r13\n"
+	"	push %r14\n"
+	"	push %r15\n"
+	"	push %rcx\n"		/* out, also realigns the stack */
+	"	mov %rsp, (%rdi)\n"
+	"	mov %rdx, %rdi\n"
+	"	call *%rsi\n"
+	"	pop %rcx\n"
+	"	test %rcx, %rcx\n"
+	"	jz 1f\n"
+	"	mov %rax, (%rcx)\n"	/* union ValueUnion is INTEGER class */
+	"1:\n"
+	"	xor %eax, %eax\n"
+	"wasmjit_enter_invoker_epilogue:\n"
+	"	pop %r15\n"
+	"	pop %r14\n"
+	"	pop %r13\n"
+	"	pop %r12\n"
+	"	pop %rbx\n"
+	"	pop %rbp\n"
+	"	ret\n"
+	".size wasmjit_enter_invoker, .-wasmjit_enter_invoker\n"
+	"\n"
+	".globl wasmjit_unwind_to_entry\n"
+	".hidden wasmjit_unwind_to_entry\n"
+	".type wasmjit_unwind_to_entry,@function\n"
+	"wasmjit_unwind_to_entry:\n"
+	"	lea 8(%rdi), %rsp\n"
+	"	mov %esi, %eax\n"
+	"	jmp wasmjit_enter_invoker_epilogue\n"
+	".size wasmjit_unwind_to_entry, .-wasmjit_unwind_to_entry\n"
+	);
+
 #endif
 
 __attribute__((noreturn))
 void wasmjit_trap(int reason)
 {
+	struct WasmJITThreadContext *ctx;
+
 	assert(reason);
-	longjmp(*wasmjit_get_jmp_buf(), reason);
+
+	ctx = wasmjit_get_thread_context();
+
+	if (reason == WASMJIT_TRAP_INTERRUPTED)
+		ctx->interrupted = 0;
+
+	/* an explicitly installed trap context is always innermost */
+#ifdef WASMJIT_USE_ENTRY_FRAME
+	if (!ctx->jmp_buf) {
+		assert(ctx->entry_sp);
+		wasmjit_unwind_to_entry(ctx->entry_sp, reason);
+	}
+#endif
+	longjmp(*ctx->jmp_buf, reason);
+}
+
+void wasmjit_interrupt(struct WasmJITThreadContext *ctx)
+{
+	ctx->interrupted = 1;
+#ifdef HAVE_FUTEX
+	/* also ends a wait it is sleeping in */
+	unpark(ctx);
+#endif
+}
+
+void wasmjit_trap_context_install(struct WasmJITTrapContext *ctx)
+{
+	struct WasmJITThreadContext *tctx = wasmjit_get_thread_context();
+	ctx->prev = tctx->jmp_buf;
+	tctx->jmp_buf = &ctx->jmpbuf;
+}
+
+void wasmjit_trap_context_uninstall(struct WasmJITTrapContext *ctx)
+{
+	wasmjit_get_thread_context()->jmp_buf = ctx->prev;
+}
+
+struct FuncInst *wasmjit_alloc_host_func(struct ModuleInst *module, void *_fptr,
+					 wasmjit_valtype_t _output, size_t n_inputs,
+					 wasmjit_valtype_t *inputs)
+{
+	void *tmp_unmapped = NULL;
+	struct FuncInst *tmp_func = NULL;
+
+	tmp_func = calloc(1, sizeof(struct FuncInst));
+	if (!tmp_func)
+		goto error;
+	tmp_func->module_inst = module;
+	tmp_func->type.n_inputs = n_inputs;
+	memcpy(tmp_func->type.input_types, inputs, n_inputs);
+	tmp_func->type.output_type = _output;
+	tmp_unmapped =
+		wasmjit_compile_hostfunc(&tmp_func->type, _fptr,
+					 tmp_func,
+					 &tmp_func->compiled_code_size);
+	if (!tmp_unmapped)
+		goto error;
+	tmp_func->compiled_code =
+		wasmjit_map_code_segment(tmp_func->compiled_code_size);
+	if (!tmp_func->compiled_code)
+		goto error;
+	memcpy(tmp_func->compiled_code, tmp_unmapped,
+	       tmp_func->compiled_code_size);
+	if (!wasmjit_mark_code_segment_executable(tmp_func->compiled_code,
+						  tmp_func->compiled_code_size))
+		goto error;
+	tmp_unmapped =
+		wasmjit_compile_invoker(&tmp_func->type,
+					tmp_func->compiled_code,
+					&tmp_func->invoker_size);
+	if (!tmp_unmapped)
+		goto error;
+	tmp_func->invoker =
+		wasmjit_map_code_segment(tmp_func->invoker_size);
+	memcpy(tmp_func->invoker, tmp_unmapped,
+	       tmp_func->invoker_size);
+	if (!wasmjit_mark_code_segment_executable(tmp_func->invoker,
+						  tmp_func->invoker_size))
+		goto error;
+
+	if (0) {
+	error:
+		if (tmp_func)
+			wasmjit_free_func_inst(tmp_func);
+		tmp_func = NULL;
+	}
+
+	if (tmp_unmapped)
+		free(tmp_unmapped);
+
+	return tmp_func;
 }
 
 int wasmjit_invoke_function(struct FuncInst *funcinst,
@@ -163,23 +835,34 @@ int wasmjit_invoke_function(struct FuncInst *funcinst,
 {
 	union ValueUnion lout;
 	int ret;
+	struct WasmJITThreadContext *ctx;
+#ifndef WASMJIT_USE_ENTRY_FRAME
 	jmp_buf jmpbuf;
+#endif
+
+	ctx = wasmjit_get_thread_context();
 
-	if (wasmjit_get_jmp_buf()) {
+	if (ctx->jmp_buf || ctx->entry_sp) {
+		lout = wasmjit_invoke_function_raw(funcinst, values);
+		if (out)
+			*out = lout;
+		return 0;
+	}
+
+#ifdef WASMJIT_USE_ENTRY_FRAME
+	ret = wasmjit_enter_invoker(&ctx->entry_sp, funcinst->invoker,
+				    values, out);
+	ctx->entry_sp = NULL;
+#else
+	ctx->jmp_buf = &jmpbuf;
+	if (!(ret = setjmp(jmpbuf))) {
 		lout = wasmjit_invoke_function_raw(funcinst, values);
 		if (out)
 			*out = lout;
 		ret = 0;
-	} else {
-		wasmjit_set_jmp_buf(&jmpbuf);
-		if (!(ret = setjmp(jmpbuf))) {
-			lout = wasmjit_invoke_function_raw(funcinst, values);
-			if (out)
-				*out = lout;
-			ret = 0;
-		}
-		wasmjit_set_jmp_buf(NULL);
 	}
+	ctx->jmp_buf = NULL;
+#endif
 
 	return ret;
 }
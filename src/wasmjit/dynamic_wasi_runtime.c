@@ -0,0 +1,126 @@
+/* -*-mode:c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+  Copyright (c) 2018 Rian Hunter
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+#include <wasmjit/runtime.h>
+#include <wasmjit/wasi_runtime.h>
+#include <wasmjit/util.h>
+
+#include <wasmjit/sys.h>
+
+struct NamedModule *wasmjit_instantiate_wasi_runtime(size_t *amt)
+{
+	struct {
+		size_t n_elts;
+		struct NamedModule *elts;
+	} modules = {0, NULL};
+	struct FuncInst *tmp_func = NULL;
+	struct ModuleInst *module = NULL;
+	struct NamedModule *ret;
+
+#define LVECTOR_GROW(sstack, n_elts)		      \
+	do {					      \
+		if (!VECTOR_GROW((sstack), (n_elts))) \
+			goto error;		      \
+	}					      \
+	while (0)
+
+#define START_MODULE()						\
+	{							\
+		module = calloc(1, sizeof(struct ModuleInst));	\
+		if (!module)					\
+			goto error;				\
+		module->private_data = calloc(1, sizeof(struct WASIContext)); \
+		if (!module->private_data)			\
+			goto error;				\
+		module->free_private_data = &free;		\
+	}
+
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+#define END_MODULE()							\
+	{								\
+		LVECTOR_GROW(&modules, 1);				\
+		modules.elts[modules.n_elts - 1].name = strdup(XSTR(CURRENT_MODULE)); \
+		modules.elts[modules.n_elts - 1].module = module;	\
+		module = NULL;						\
+	}
+
+#define START_TABLE_DEFS()
+#define END_TABLE_DEFS()
+#define START_MEMORY_DEFS()
+#define END_MEMORY_DEFS()
+#define START_GLOBAL_DEFS()
+#define END_GLOBAL_DEFS()
+#define START_FUNCTION_DEFS()
+#define END_FUNCTION_DEFS()
+
+#define DEFINE_WASM_FUNCTION(_name, _fptr, _output, n, ...)	  \
+	{							  \
+		wasmjit_valtype_t inputs[] = { __VA_ARGS__ };		\
+		tmp_func = wasmjit_alloc_host_func(module, _fptr, _output, n, inputs); \
+		if (!tmp_func)						\
+			goto error;					\
+		LVECTOR_GROW(&module->funcs, 1);			\
+		module->funcs.elts[module->funcs.n_elts - 1] = tmp_func; \
+		tmp_func = NULL;					\
+									\
+		LVECTOR_GROW(&module->exports, 1);			\
+		module->exports.elts[module->exports.n_elts - 1].name = strdup(#_name); \
+		module->exports.elts[module->exports.n_elts - 1].type = IMPORT_DESC_TYPE_FUNC; \
+		module->exports.elts[module->exports.n_elts - 1].value.func = module->funcs.elts[module->funcs.n_elts - 1]; \
+	}
+
+#include <wasmjit/wasi_runtime_def.h>
+
+	if (0) {
+	error:
+		ret = NULL;
+
+		if (modules.elts) {
+			size_t i;
+			for (i = 0; i < modules.n_elts; i++) {
+				struct NamedModule *nm = &modules.elts[i];
+				free(nm->name);
+				wasmjit_free_module_inst(nm->module);
+			}
+			free(modules.elts);
+		}
+	}
+	else {
+		ret = modules.elts;
+		if (amt) {
+			*amt = modules.n_elts;
+		}
+	}
+
+	if (module) {
+		wasmjit_free_module_inst(module);
+	}
+	if (tmp_func) {
+		wasmjit_free_func_inst(tmp_func);
+	}
+
+	return ret;
+}
@@ -23,6 +23,7 @@
  */
 
 #include <wasmjit/compile.h>
+#include <wasmjit/instantiate.h>
 #include <wasmjit/vector.h>
 #include <wasmjit/util.h>
 #include <wasmjit/runtime.h>
@@ -821,6 +822,11 @@ void *wasmjit_output_elf_relocatable(const char *module_name,
 	if (!module_types.memorytypes)
 		goto error;
 
+	module_types.n_functypes = module_funcs.n_elts;
+	module_types.n_tabletypes = module_tables.n_elts;
+	module_types.n_memorytypes = module_mems.n_elts;
+	module_types.n_globaltypes = module_globals.n_elts;
+
 	for (i = 0; i < module_funcs.n_elts; ++i) {
 		module_types.functypes[i] = module_funcs.elts[i].type;
 	}
@@ -852,12 +858,16 @@ void *wasmjit_output_elf_relocatable(const char *module_name,
 		LVECTOR_GROW(memrefs, 1);
 
 		code = wasmjit_compile_function(module->type_section.types,
+						module->type_section.n_types,
 						&module_types,
 						ft,
-						&module->code_section.codes[i],
+						wasmjit_module_code(module,
+								    &module_types,
+								    i, 0, NULL, 0),
 						memrefs,
 						&code_size,
-						NULL);
+						NULL,
+						NULL, 0);
 		if (!code)
 			goto error;
 
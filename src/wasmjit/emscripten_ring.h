@@ -0,0 +1,110 @@
+/* -*-mode:c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+  Copyright (c) 2018 Rian Hunter
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+#ifndef __WASMJIT__EMSCRIPTEN_RING_H__
+#define __WASMJIT__EMSCRIPTEN_RING_H__
+
+/*
+  Guest ABI of the batched syscall ring. Emscripten guests include
+  this header and call wasmjit_ring_enter(), which the host provides
+  as the _wasmjit_ring_enter import.
+
+  The guest fills submission entries in a ring in its own memory and
+  hands a batch over with a single call. The host consumes up to
+  to_submit entries, fewer if the completion queue fills up, and
+  returns once each consumed entry has posted its completion. On
+  Linux the batch is submitted to an io_uring with one system call,
+  elsewhere, or when io_uring is unavailable, the entries run one
+  after another on the calling thread.
+
+  Entries may run concurrently and complete in any order, match
+  completions by user_data. Entries that depend on each other are
+  chained with EM_RING_SQE_LINK: the next entry only starts after
+  this one has completed, and if this one fails the rest of the chain
+  completes with -ECANCELED without running. On io_uring a short read
+  or write ends the chain too. Chains end with the batch.
+
+  All fields are little-endian, addresses are offsets into the
+  guest's linear memory. The indices are free running and wrap
+  modulo entries.
+*/
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#endif
+
+struct em_ring {
+	uint32_t entries; /* a power of two */
+	uint32_t sq_head; /* advanced by the host */
+	uint32_t sq_tail; /* advanced by the guest */
+	uint32_t cq_head; /* advanced by the guest */
+	uint32_t cq_tail; /* advanced by the host */
+	uint32_t sqes; /* entries * struct em_ring_sqe */
+	uint32_t cqes; /* entries * struct em_ring_cqe */
+};
+
+struct em_ring_sqe {
+	uint8_t opcode;
+	uint8_t flags;
+	uint8_t pad[2];
+	int32_t fd;
+	uint32_t addr;
+	uint32_t len;
+	/* file offset, or EM_RING_NO_OFFSET for the current position;
+	   the address of addrlen for EM_RING_OP_ACCEPT */
+	uint64_t off;
+	uint64_t user_data;
+};
+
+struct em_ring_cqe {
+	uint64_t user_data;
+	/* what the syscall returns, or a negative errno */
+	int32_t res;
+	uint32_t flags;
+};
+
+enum {
+	EM_RING_OP_NOP,
+	EM_RING_OP_READ,
+	EM_RING_OP_WRITE,
+	EM_RING_OP_READV,
+	EM_RING_OP_WRITEV,
+	EM_RING_OP_ACCEPT,
+	EM_RING_OP_CLOSE,
+};
+
+/* em_ring_sqe.flags */
+#define EM_RING_SQE_LINK 1
+
+#define EM_RING_NO_OFFSET UINT64_MAX
+#define EM_RING_MAX_ENTRIES 32768
+
+#ifdef __EMSCRIPTEN__
+/* returns the number of entries consumed, or a negative errno */
+int wasmjit_ring_enter(struct em_ring *ring, uint32_t to_submit);
+#endif
+
+#endif
@@ -30,10 +30,37 @@
 #include <wasmjit/emscripten_runtime.h>
 
 #include <wasmjit/emscripten_runtime_sys.h>
+#include <wasmjit/emscripten_ring.h>
 #include <wasmjit/util.h>
 #include <wasmjit/runtime.h>
 #include <wasmjit/sys.h>
 
+#if defined(__linux__) && !defined(__KERNEL__) && defined(__has_include)
+#if __has_include(<linux/openat2.h>)
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#ifdef SYS_openat2
+#define HAVE_OPENAT2
+#endif
+#endif
+#if __has_include(<linux/io_uring.h>)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+/* the flags of the 5.6 interface, which has every ring opcode */
+#if defined(SYS_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS) && \
+	defined(IO_URING_OP_SUPPORTED)
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#ifndef __KERNEL__
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 #define STATIC_ASSERT(COND,MSG) typedef char static_assertion_##MSG[(COND)?1:-1]
 #define COMPILE_TIME_ASSERT3(X,L) STATIC_ASSERT(X,static_assertion_at_line_##L)
 #define COMPILE_TIME_ASSERT2(X,L) COMPILE_TIME_ASSERT3(X,L)
@@ -185,20 +212,56 @@ static size_t wasmjit_emscripten_copy_from_user(struct MemInst *meminst,
 	return 0;
 }
 
+/*
+  Length of the guest string at user_ptr, looking at no more than max
+  bytes. Returns -EM_EFAULT if memory ends before the terminator and
+  -EM_ENAMETOOLONG if max does. memchr() is vectorized in both libc
+  and the kernel, unlike a byte loop with a bounds check per byte.
+*/
+static long wasmjit_emscripten_strnlen(struct MemInst *meminst,
+				       uint32_t user_ptr,
+				       size_t max)
+{
+	const char *start, *end;
+	size_t avail;
+
+	if (user_ptr >= meminst->size)
+		return -EM_EFAULT;
+
+	avail = meminst->size - user_ptr;
+	start = meminst->data + user_ptr;
+	end = memchr(start, 0, avail < max ? avail : max);
+	if (end)
+		return end - start;
+
+	return avail < max ? -EM_EFAULT : -EM_ENAMETOOLONG;
+}
+
 static int _wasmjit_emscripten_check_string(struct FuncInst *funcinst,
 					    uint32_t user_ptr,
 					    size_t max)
+{
+	return wasmjit_emscripten_strnlen(wasmjit_emscripten_get_mem_inst(funcinst),
+					  user_ptr, max) >= 0;
+}
+
+/*
+  Checks a path argument, looking up the memory instance once.
+  Returns its length.
+*/
+static long wasmjit_emscripten_get_path(struct FuncInst *funcinst,
+					uint32_t user_ptr,
+					const char **path)
 {
 	struct MemInst *meminst = wasmjit_emscripten_get_mem_inst(funcinst);
-	size_t len = 0;
+	long ret;
 
-	while (user_ptr + len < meminst->size && len < max) {
-		if (!*(meminst->data + user_ptr + len))
-			return 1;
-		len += 1;
-	}
+	ret = wasmjit_emscripten_strnlen(meminst, user_ptr, PATH_MAX);
+	if (ret < 0)
+		return ret;
 
-	return 0;
+	*path = meminst->data + user_ptr;
+	return ret;
 }
 
 /* shortcut functions */
@@ -390,6 +453,408 @@ static struct EmscriptenContext *_wasmjit_emscripten_get_context(struct FuncInst
 	return wasmjit_emscripten_get_context(funcinst->module_inst);
 }
 
+#ifndef __KERNEL__
+
+/*
+  A guest thread, see _pthread_create below. Host functions that call
+  back into the guest must use the calling thread's own instance,
+  whose globals hold that thread's stack pointer.
+*/
+struct EmscriptenThread {
+	struct EmscriptenThread *next;
+	struct EmscriptenThreads *threads;
+	uint32_t id;
+	/* env with a table of its own, and the guest instance using it */
+	struct ModuleInst *env;
+	struct ModuleInst *inst;
+	struct FuncInst *errno_location_inst;
+	struct FuncInst *malloc_inst;
+	struct FuncInst *free_inst;
+	struct FuncInst *establish_inst;
+	struct FuncInst *start_routine_inst;
+	uint32_t arg;
+	uint32_t stack;
+	uint32_t result;
+	int trap;
+	int started, detached, joining, exiting;
+	/* futex word, joiners sleep on it in wasmjit_atomic_wait() */
+	uint32_t exited;
+	pthread_t host;
+	void *host_stack;
+	/* NULL unless the thread is running, under the lock */
+	struct WasmJITThreadContext *tctx;
+};
+
+struct EmscriptenThreads {
+	pthread_mutex_t lock;
+	/* signalled when running drops to zero */
+	pthread_cond_t idle;
+	struct EmscriptenThread *list;
+	uint32_t next_id;
+	size_t running;
+	int stopping;
+	struct ModuleInst *(*instantiate)(void *arg, struct ModuleInst *env);
+	void *arg;
+};
+
+/* NULL on the main thread */
+static __thread struct EmscriptenThread *current_thread;
+
+#define CURRENT_INST(ctx, name)					\
+	(current_thread ? current_thread->name : (ctx)->name)
+
+#else
+
+#define CURRENT_INST(ctx, name) ((ctx)->name)
+
+#endif
+
+/*
+  Preopened directories.
+
+  Once a directory has been preopened, guest paths stop naming host
+  paths. They are made absolute against the guest working directory,
+  normalized lexically, matched against the preopened guest prefixes
+  and then opened relative to the matching preopen's fd. ".." stops at
+  the guest root, so nothing outside a preopen can be named. Symlinks
+  are resolved by the host with RESOLVE_BENEATH where openat2() exists,
+  elsewhere every component is opened with O_NOFOLLOW and symlinks are
+  refused. Pathname AF_UNIX addresses cannot be opened relative to a
+  directory, so they are refused too.
+
+  Resolutions are cached per instance, keyed by the string the guest
+  passed, so reopening the same paths skips the normalization, the
+  prefix search and the read-only check's lookup.
+*/
+
+static long fs_normalize_path(const char *cwd,
+			      const char *path, size_t len,
+			      char *out)
+{
+	size_t n, i, clen;
+
+	/* the root is "/" in cwd but is built up from "" here */
+	n = 0;
+	if (path[0] != '/') {
+		n = strlen(cwd);
+		if (n == 1)
+			n = 0;
+		memcpy(out, cwd, n);
+	}
+
+	for (i = 0; i < len; i += clen) {
+		const char *comp = path + i;
+
+		if (comp[0] == '/') {
+			clen = 1;
+			continue;
+		}
+
+		for (clen = 0; i + clen < len && comp[clen] != '/'; ++clen)
+			;
+
+		if (clen == 1 && comp[0] == '.')
+			continue;
+
+		if (clen == 2 && comp[0] == '.' && comp[1] == '.') {
+			while (n && out[--n] != '/')
+				;
+			continue;
+		}
+
+		if (n + 1 + clen >= WASMJIT_EMSCRIPTEN_PATH_MAX)
+			return -EM_ENAMETOOLONG;
+
+		out[n++] = '/';
+		memcpy(out + n, comp, clen);
+		n += clen;
+	}
+
+	if (!n)
+		out[n++] = '/';
+	out[n] = '\0';
+
+	return n;
+}
+
+/* returns the index of the longest preopen containing abs_path */
+static long fs_find_preopen(struct EmscriptenFS *fs,
+			    const char *abs_path,
+			    const char **rel_path)
+{
+	size_t i, best_len = 0;
+	long best = -EM_ENOENT;
+
+	for (i = 0; i < fs->n_preopens; ++i) {
+		struct EmscriptenPreopen *preopen = &fs->preopens[i];
+		size_t len = preopen->guest_path_len;
+
+		if (len == 1)
+			len = 0;
+
+		if (memcmp(abs_path, preopen->guest_path, len) ||
+		    (abs_path[len] != '/' && abs_path[len] != '\0'))
+			continue;
+
+		if (best < 0 || len > best_len) {
+			best = i;
+			best_len = len;
+		}
+	}
+
+	if (best >= 0) {
+		abs_path += best_len;
+		while (*abs_path == '/')
+			abs_path++;
+		*rel_path = *abs_path ? abs_path : ".";
+	}
+
+	return best;
+}
+
+static void fs_invalidate_cache(struct EmscriptenFS *fs)
+{
+	if (!++fs->generation) {
+		memset(fs->cache, 0, sizeof(fs->cache));
+		fs->generation = 1;
+	}
+}
+
+static uint32_t fs_hash(const char *s, size_t len)
+{
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		h ^= (unsigned char) s[i];
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+/*
+  Resolves the guest path at user_ptr to a host directory fd and a
+  path relative to it, suitable for the *at() syscalls. The returned
+  path is only valid until the next resolution.
+*/
+static long wasmjit_emscripten_resolve_path(struct FuncInst *funcinst,
+					    uint32_t user_ptr,
+					    int *dirfd,
+					    const char **path,
+					    int *readonly)
+{
+	struct EmscriptenFS *fs = &_wasmjit_emscripten_get_context(funcinst)->fs;
+	struct EmscriptenPathCacheEntry *entry;
+	const char *guest_path, *rel_path;
+	long len, preopen;
+
+	len = wasmjit_emscripten_get_path(funcinst, user_ptr, &guest_path);
+	if (len < 0)
+		return len;
+
+	if (!fs->n_preopens) {
+		*dirfd = AT_FDCWD;
+		*path = guest_path;
+		*readonly = 0;
+		return 0;
+	}
+
+	if (!len)
+		return -EM_ENOENT;
+
+	entry = NULL;
+	if (len < WASMJIT_EMSCRIPTEN_PATH_CACHE_KEY_MAX)
+		entry = &fs->cache[fs_hash(guest_path, len) %
+				   WASMJIT_EMSCRIPTEN_PATH_CACHE_SIZE];
+
+	if (entry && entry->generation == fs->generation &&
+	    !memcmp(entry->guest_path, guest_path, len + 1)) {
+		preopen = entry->preopen;
+		rel_path = entry->host_path;
+	} else {
+		size_t rel_len;
+		long ret;
+
+		ret = fs_normalize_path(fs->cwd, guest_path, len, fs->scratch);
+		if (ret < 0)
+			return ret;
+
+		preopen = fs_find_preopen(fs, fs->scratch, &rel_path);
+		if (preopen < 0)
+			return preopen;
+
+		rel_len = strlen(rel_path);
+		if (entry && rel_len < WASMJIT_EMSCRIPTEN_PATH_CACHE_KEY_MAX) {
+			entry->generation = fs->generation;
+			entry->preopen = preopen;
+			memcpy(entry->guest_path, guest_path, len + 1);
+			memcpy(entry->host_path, rel_path, rel_len + 1);
+			rel_path = entry->host_path;
+		}
+	}
+
+	*dirfd = fs->preopens[preopen].dirfd;
+	*path = rel_path;
+	*readonly = fs->preopens[preopen].readonly;
+
+	return 0;
+}
+
+#ifdef O_PATH
+#define FS_DIR_FLAGS (O_PATH | O_DIRECTORY | O_CLOEXEC)
+#else
+#define FS_DIR_FLAGS (O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+#endif
+
+long wasmjit_emscripten_openat_beneath(int dirfd, const char *path,
+				       int flags, mode_t mode)
+{
+	char name[256];
+	const char *slash;
+	size_t len;
+	long fd, ret;
+
+#ifdef HAVE_OPENAT2
+	{
+		struct open_how how;
+
+		memset(&how, 0, sizeof(how));
+		how.flags = flags;
+		if ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE)
+			how.mode = mode;
+		how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+		ret = syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+		if (ret >= 0)
+			return ret;
+		if (errno != ENOSYS)
+			return -errno;
+	}
+#endif
+
+	fd = dirfd;
+	while ((slash = strchr(path, '/'))) {
+		len = slash - path;
+		if (len >= sizeof(name)) {
+			ret = -ENAMETOOLONG;
+			goto out;
+		}
+		memcpy(name, path, len);
+		name[len] = '\0';
+
+		ret = sys_openat(fd, name, FS_DIR_FLAGS | O_NOFOLLOW, 0);
+		if (fd != dirfd)
+			sys_close(fd);
+		if (ret < 0)
+			return ret;
+		fd = ret;
+
+		path = slash + 1;
+	}
+
+	ret = sys_openat(fd, path, flags | O_NOFOLLOW, mode);
+
+ out:
+	if (fd != dirfd)
+		sys_close(fd);
+
+	return ret;
+}
+
+long wasmjit_emscripten_open_parent_beneath(int dirfd, const char *path,
+					    char *parent, const char **name)
+{
+	const char *slash;
+	size_t len;
+
+	slash = strrchr(path, '/');
+	if (!slash) {
+		*name = path;
+		return sys_openat(dirfd, ".", FS_DIR_FLAGS, 0);
+	}
+
+	*name = slash + 1;
+	len = slash - path;
+	memmove(parent, path, len);
+	parent[len] = '\0';
+
+	return wasmjit_emscripten_openat_beneath(dirfd, parent,
+						 FS_DIR_FLAGS, 0);
+}
+
+static long wasmjit_emscripten_fs_chdir(struct EmscriptenFS *fs,
+					const char *path, size_t len)
+{
+	const char *rel_path;
+	long ret, preopen;
+
+	if (!len)
+		return -EM_ENOENT;
+
+	ret = fs_normalize_path(fs->cwd, path, len, fs->scratch);
+	if (ret < 0)
+		return ret;
+	len = ret;
+
+	preopen = fs_find_preopen(fs, fs->scratch, &rel_path);
+	if (preopen < 0)
+		return preopen;
+
+	ret = wasmjit_emscripten_openat_beneath(fs->preopens[preopen].dirfd,
+						rel_path,
+						O_RDONLY | O_DIRECTORY | O_CLOEXEC,
+						0);
+	if (ret < 0)
+		return check_ret(ret);
+	sys_close(ret);
+
+	memcpy(fs->cwd, fs->scratch, len + 1);
+	fs_invalidate_cache(fs);
+
+	return 0;
+}
+
+int wasmjit_emscripten_preopen(struct EmscriptenContext *ctx,
+			       const char *guest_path,
+			       const char *host_path,
+			       int readonly)
+{
+	struct EmscriptenFS *fs = &ctx->fs;
+	struct EmscriptenPreopen *preopen;
+	long ret;
+
+	if (fs->n_preopens == WASMJIT_EMSCRIPTEN_MAX_PREOPENS)
+		return -1;
+
+	preopen = &fs->preopens[fs->n_preopens];
+
+	ret = fs_normalize_path("/", guest_path, strlen(guest_path),
+				fs->scratch);
+	if (ret < 0 || (size_t) ret >= sizeof(preopen->guest_path))
+		return -1;
+
+	memcpy(preopen->guest_path, fs->scratch, ret + 1);
+	preopen->guest_path_len = ret;
+
+	ret = sys_openat(AT_FDCWD, host_path,
+			 O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+	if (ret < 0)
+		return -1;
+
+	preopen->dirfd = ret;
+	preopen->readonly = readonly;
+
+	if (!fs->n_preopens)
+		strcpy(fs->cwd, "/");
+	fs->n_preopens++;
+
+	/* a new prefix can shadow resolutions already cached */
+	fs_invalidate_cache(fs);
+
+	return 0;
+}
+
 void wasmjit_emscripten_abortStackOverflow(uint32_t allocSize, struct FuncInst *funcinst)
 {
 	(void)funcinst;
@@ -441,9 +906,11 @@ void wasmjit_emscripten____setErrNo(uint32_t value, struct FuncInst *funcinst)
 	union ValueUnion out;
 	struct EmscriptenContext *ctx =
 		_wasmjit_emscripten_get_context(funcinst);
+	struct FuncInst *errno_location_inst =
+		CURRENT_INST(ctx, errno_location_inst);
 
-	if (ctx->errno_location_inst &&
-	    !wasmjit_invoke_function(ctx->errno_location_inst, NULL, &out)) {
+	if (errno_location_inst &&
+	    !wasmjit_invoke_function(errno_location_inst, NULL, &out)) {
 		value = uint32_t_swap_bytes(value);
 		if (!_wasmjit_emscripten_copy_to_user(funcinst, out.i32, &value, sizeof(value)))
 			return;
@@ -539,71 +1006,11 @@ uint32_t wasmjit_emscripten____syscall140(uint32_t which, uint32_t varargs, stru
 	}
 }
 
-struct em_iovec {
-	uint32_t iov_base;
-	uint32_t iov_len;
-};
-
-static long copy_iov(struct FuncInst *funcinst,
-		     uint32_t iov_user,
-		     uint32_t iov_len, struct iovec **out)
-{
-	struct iovec *liov = NULL;
-	char *base;
-	long ret;
-	uint32_t i;
-
-	base = wasmjit_emscripten_get_base_address(funcinst);
-
-	/* TODO: do UIO_FASTIOV stack optimization */
-	liov = wasmjit_alloc_vector(iov_len,
-				    sizeof(struct iovec), NULL);
-	if (!liov) {
-		ret = -ENOMEM;
-		goto error;
-	}
-
-	for (i = 0; i < iov_len; ++i) {
-		struct em_iovec iov;
-
-		if (_wasmjit_emscripten_copy_from_user(funcinst,
-						       &iov,
-						       iov_user +
-						       sizeof(struct em_iovec) * i,
-						       sizeof(struct em_iovec))) {
-			ret = -EFAULT;
-			goto error;
-		}
-
-		iov.iov_base = uint32_t_swap_bytes(iov.iov_base);
-		iov.iov_len = uint32_t_swap_bytes(iov.iov_len);
-
-		if (!_wasmjit_emscripten_check_range(funcinst,
-						     iov.iov_base,
-						     iov.iov_len)) {
-			ret = -EFAULT;
-			goto error;
-		}
-
-		liov[i].iov_base = base + iov.iov_base;
-		liov[i].iov_len = iov.iov_len;
-	}
-
-	*out = liov;
-	ret = 0;
-
-	if (0) {
-	error:
-		free(liov);
-	}
-
-	return ret;
-}
-
 /* writev */
 uint32_t wasmjit_emscripten____syscall146(uint32_t which, uint32_t varargs, struct FuncInst *funcinst)
 {
 	long rret;
+	struct iovec fast_iov[WASMJIT_UIO_FASTIOV];
 	struct iovec *liov;
 
 	LOAD_ARGS(funcinst, varargs, 3,
@@ -613,13 +1020,14 @@ uint32_t wasmjit_emscripten____syscall146(uint32_t which, uint32_t varargs, stru
 
 	(void)which;
 
-	rret = copy_iov(funcinst, args.iov, args.iovcnt, &liov);
+	rret = wasmjit_copy_iov(wasmjit_emscripten_get_mem_inst(funcinst),
+				args.iov, args.iovcnt, fast_iov, &liov);
 	if (rret)
 		goto error;
 
 	rret = sys_writev(args.fd, liov, args.iovcnt);
 
-	free(liov);
+	wasmjit_free_iov(liov, fast_iov);
 
  error:
 	return check_ret(rret);
@@ -645,76 +1053,311 @@ uint32_t wasmjit_emscripten____syscall4(uint32_t which, uint32_t varargs, struct
 	return check_ret(sys_write(args.fd, base + args.buf, args.count));
 }
 
-/* ioctl */
-uint32_t wasmjit_emscripten____syscall54(uint32_t which, uint32_t varargs, struct FuncInst *funcinst)
+#if defined(__linux__) || defined(__KERNEL__)
+
+/*
+  The kernel-to-kernel copies below never touch guest memory except
+  for the optional 64-bit offsets, which are copied in and back out.
+*/
+static long read_user_loff(struct FuncInst *funcinst, uint32_t user_off,
+			   loff_t *off, loff_t **offp)
 {
-	(void)funcinst;
-	/* TODO: need to define non-no filesystem case */
-	(void)which;
-	(void)varargs;
+	uint64_t val;
+
+	*offp = NULL;
+	if (!user_off)
+		return 0;
+
+	if (_wasmjit_emscripten_copy_from_user(funcinst, &val, user_off,
+					       sizeof(val)))
+		return -EM_EFAULT;
+
+	*off = uint64_t_swap_bytes(val);
+	*offp = off;
 	return 0;
 }
 
-/* close */
-uint32_t wasmjit_emscripten____syscall6(uint32_t which, uint32_t varargs, struct FuncInst *funcinst)
+static long write_user_loff(struct FuncInst *funcinst, uint32_t user_off,
+			    const loff_t *offp)
 {
-	/* TODO: need to define non-no filesystem case */
-	LOAD_ARGS(funcinst, varargs, 1,
-		  int32_t, fd);
+	uint64_t val;
 
-	(void)which;
-	return check_ret(sys_close(args.fd));
-}
+	if (!offp)
+		return 0;
 
-void wasmjit_emscripten____unlock(uint32_t x, struct FuncInst *funcinst)
-{
-	(void)funcinst;
-	(void)x;
-}
+	val = uint64_t_swap_bytes(*offp);
+	if (_wasmjit_emscripten_copy_to_user(funcinst, user_off, &val,
+					     sizeof(val)))
+		return -EM_EFAULT;
 
-uint32_t wasmjit_emscripten__emscripten_memcpy_big(uint32_t dest, uint32_t src, uint32_t num, struct FuncInst *funcinst)
-{
-	char *base = wasmjit_emscripten_get_base_address(funcinst);
-	if (!_wasmjit_emscripten_check_range(funcinst, dest, num) ||
-	    !_wasmjit_emscripten_check_range(funcinst, src, num)) {
-		wasmjit_trap(WASMJIT_TRAP_MEMORY_OVERFLOW);
-	}
-	memcpy(dest + base, src + base, num);
-	return dest;
+	return 0;
 }
 
-__attribute__((noreturn))
-void wasmjit_emscripten_abort(uint32_t what, struct FuncInst *funcinst)
+#endif
+
+/* sendfile, off_t is 32-bits */
+uint32_t wasmjit_emscripten____syscall187(uint32_t which, uint32_t varargs,
+					  struct FuncInst *funcinst)
 {
-	struct MemInst *meminst = wasmjit_emscripten_get_mem_inst(funcinst);
-	char *abort_string;
-	if (!_wasmjit_emscripten_check_string(funcinst, what, 256)) {
-		abort_string = "Invalid abort string";
-	} else {
-		abort_string = meminst->data + what;
+	LOAD_ARGS(funcinst, varargs, 4,
+		  int32_t, out_fd,
+		  int32_t, in_fd,
+		  uint32_t, offset,
+		  uint32_t, count);
+
+	(void)which;
+
+#if defined(__linux__) || defined(__KERNEL__)
+	{
+		loff_t off, *offp = NULL;
+		size_t count = args.count;
+		int32_t emoff;
+		long ret;
+
+		if (args.offset) {
+			if (_wasmjit_emscripten_copy_from_user(funcinst, &emoff,
+							       args.offset,
+							       sizeof(emoff)))
+				return -EM_EFAULT;
+			off = int32_t_swap_bytes(emoff);
+			if (off < 0)
+				return -EM_EINVAL;
+
+			/* as Linux does for 32-bit offsets: short transfer
+			   up to the limit, fail only if nothing fits, so the
+			   updated offset always fits back into 32 bits */
+			if (count > (uint64_t) INT32_MAX - off) {
+				if (off == INT32_MAX)
+					return -EM_EOVERFLOW;
+				count = INT32_MAX - off;
+			}
+			offp = &off;
+		}
+
+		ret = sys_sendfile64(args.out_fd, args.in_fd, offp, count);
+
+		if (offp) {
+			emoff = int32_t_swap_bytes(off);
+			if (_wasmjit_emscripten_copy_to_user(funcinst, args.offset,
+							     &emoff,
+							     sizeof(emoff)))
+				return -EM_EFAULT;
+		}
+
+		return check_ret(ret);
 	}
-	wasmjit_emscripten_internal_abort(abort_string);
+#else
+	(void)args;
+	return -EM_ENOSYS;
+#endif
 }
 
-static uint32_t getMemory(struct EmscriptenContext *ctx,
-			  uint32_t amount)
+/* sendfile64 */
+uint32_t wasmjit_emscripten____syscall239(uint32_t which, uint32_t varargs,
+					  struct FuncInst *funcinst)
 {
-	union ValueUnion input, output;
-	input.i32 = amount;
-	if (wasmjit_invoke_function(ctx->malloc_inst, &input, &output))
-		wasmjit_emscripten_internal_abort("Failed to invoke allocator");
-	return output.i32;
-}
+	LOAD_ARGS(funcinst, varargs, 4,
+		  int32_t, out_fd,
+		  int32_t, in_fd,
+		  uint32_t, offset,
+		  uint32_t, count);
 
-static void freeMemory(struct EmscriptenContext *ctx,
-		       uint32_t ptr)
+	(void)which;
+
+#if defined(__linux__) || defined(__KERNEL__)
+	{
+		loff_t off, *offp;
+		long ret;
+
+		ret = read_user_loff(funcinst, args.offset, &off, &offp);
+		if (ret)
+			return ret;
+
+		ret = sys_sendfile64(args.out_fd, args.in_fd, offp, args.count);
+
+		if (write_user_loff(funcinst, args.offset, offp))
+			return -EM_EFAULT;
+
+		return check_ret(ret);
+	}
+#else
+	(void)args;
+	return -EM_ENOSYS;
+#endif
+}
+
+#define EM_SPLICE_F_MOVE 1
+#define EM_SPLICE_F_NONBLOCK 2
+#define EM_SPLICE_F_MORE 4
+#define EM_SPLICE_F_GIFT 8
+
+/* splice */
+uint32_t wasmjit_emscripten____syscall313(uint32_t which, uint32_t varargs,
+					  struct FuncInst *funcinst)
 {
-	union ValueUnion input;
-	input.i32 = ptr;
-	if (!ctx->free_inst)
-		wasmjit_emscripten_internal_abort("Failed to invoke deallocator");
-	if (wasmjit_invoke_function(ctx->free_inst, &input, NULL))
+	LOAD_ARGS(funcinst, varargs, 6,
+		  int32_t, fd_in,
+		  uint32_t, off_in,
+		  int32_t, fd_out,
+		  uint32_t, off_out,
+		  uint32_t, len,
+		  uint32_t, flags);
+
+	(void)which;
+
+#if defined(__linux__) || defined(__KERNEL__)
+	{
+		loff_t in, out, *inp, *outp;
+		long ret;
+
+		/* the flag values are the same on Linux */
+		if (args.flags & ~(EM_SPLICE_F_MOVE | EM_SPLICE_F_NONBLOCK |
+				   EM_SPLICE_F_MORE | EM_SPLICE_F_GIFT))
+			return -EM_EINVAL;
+
+		ret = read_user_loff(funcinst, args.off_in, &in, &inp);
+		if (ret)
+			return ret;
+
+		ret = read_user_loff(funcinst, args.off_out, &out, &outp);
+		if (ret)
+			return ret;
+
+		ret = sys_splice(args.fd_in, inp, args.fd_out, outp,
+				 args.len, args.flags);
+
+		if (write_user_loff(funcinst, args.off_in, inp) ||
+		    write_user_loff(funcinst, args.off_out, outp))
+			return -EM_EFAULT;
+
+		return check_ret(ret);
+	}
+#else
+	(void)args;
+	return -EM_ENOSYS;
+#endif
+}
+
+/* copy_file_range */
+uint32_t wasmjit_emscripten____syscall377(uint32_t which, uint32_t varargs,
+					  struct FuncInst *funcinst)
+{
+	LOAD_ARGS(funcinst, varargs, 6,
+		  int32_t, fd_in,
+		  uint32_t, off_in,
+		  int32_t, fd_out,
+		  uint32_t, off_out,
+		  uint32_t, len,
+		  uint32_t, flags);
+
+	(void)which;
+
+#if defined(__linux__) || defined(__KERNEL__)
+	{
+		loff_t in, out, *inp, *outp;
+		long ret;
+
+		ret = read_user_loff(funcinst, args.off_in, &in, &inp);
+		if (ret)
+			return ret;
+
+		ret = read_user_loff(funcinst, args.off_out, &out, &outp);
+		if (ret)
+			return ret;
+
+		ret = sys_copy_file_range(args.fd_in, inp, args.fd_out, outp,
+					  args.len, args.flags);
+
+		if (write_user_loff(funcinst, args.off_in, inp) ||
+		    write_user_loff(funcinst, args.off_out, outp))
+			return -EM_EFAULT;
+
+		return check_ret(ret);
+	}
+#else
+	(void)args;
+	return -EM_ENOSYS;
+#endif
+}
+
+/* ioctl */
+uint32_t wasmjit_emscripten____syscall54(uint32_t which, uint32_t varargs, struct FuncInst *funcinst)
+{
+	(void)funcinst;
+	/* TODO: need to define non-no filesystem case */
+	(void)which;
+	(void)varargs;
+	return 0;
+}
+
+/* close */
+uint32_t wasmjit_emscripten____syscall6(uint32_t which, uint32_t varargs, struct FuncInst *funcinst)
+{
+	/* TODO: need to define non-no filesystem case */
+	LOAD_ARGS(funcinst, varargs, 1,
+		  int32_t, fd);
+
+	(void)which;
+	return check_ret(sys_close(args.fd));
+}
+
+void wasmjit_emscripten____unlock(uint32_t x, struct FuncInst *funcinst)
+{
+	(void)funcinst;
+	(void)x;
+}
+
+uint32_t wasmjit_emscripten__emscripten_memcpy_big(uint32_t dest, uint32_t src, uint32_t num, struct FuncInst *funcinst)
+{
+	char *base = wasmjit_emscripten_get_base_address(funcinst);
+	if (!_wasmjit_emscripten_check_range(funcinst, dest, num) ||
+	    !_wasmjit_emscripten_check_range(funcinst, src, num)) {
+		wasmjit_trap(WASMJIT_TRAP_MEMORY_OVERFLOW);
+	}
+	memcpy(dest + base, src + base, num);
+	return dest;
+}
+
+__attribute__((noreturn))
+void wasmjit_emscripten_abort(uint32_t what, struct FuncInst *funcinst)
+{
+	struct MemInst *meminst = wasmjit_emscripten_get_mem_inst(funcinst);
+	char *abort_string;
+	if (!_wasmjit_emscripten_check_string(funcinst, what, 256)) {
+		abort_string = "Invalid abort string";
+	} else {
+		abort_string = meminst->data + what;
+	}
+	wasmjit_emscripten_internal_abort(abort_string);
+}
+
+/*
+  These are only used by host functions, i.e. while guest code is on
+  the stack and a trap can already unwind to its entry. So instead of
+  wasmjit_invoke_function() and its generic invoker, call the compiled
+  code directly through its C signature, which wasmjit_emscripten_init()
+  typechecked.
+*/
+static uint32_t getMemory(struct EmscriptenContext *ctx,
+			  uint32_t amount)
+{
+	uint32_t (*malloc_fn)(uint32_t) =
+		CURRENT_INST(ctx, malloc_inst)->compiled_code;
+
+	return malloc_fn(amount);
+}
+
+static void freeMemory(struct EmscriptenContext *ctx,
+		       uint32_t ptr)
+{
+	struct FuncInst *free_inst = CURRENT_INST(ctx, free_inst);
+	void (*free_fn)(uint32_t);
+
+	if (!free_inst)
 		wasmjit_emscripten_internal_abort("Failed to invoke deallocator");
+
+	free_fn = free_inst->compiled_code;
+	free_fn(ptr);
 }
 
 void wasmjit_emscripten____buildEnvironment(uint32_t environ_arg,
@@ -739,8 +1382,7 @@ void wasmjit_emscripten____buildEnvironment(uint32_t environ_arg,
 
 		envPtr = uint32_t_swap_bytes(envPtr);
 
-		freeMemory(ctx, envPtr);
-
+		/* read the pool pointer before envPtr is freed */
 		if (_wasmjit_emscripten_copy_from_user(funcinst,
 						       &poolPtr,
 						       envPtr,
@@ -749,6 +1391,7 @@ void wasmjit_emscripten____buildEnvironment(uint32_t environ_arg,
 
 		poolPtr = uint32_t_swap_bytes(poolPtr);
 
+		freeMemory(ctx, envPtr);
 		freeMemory(ctx, poolPtr);
 	}
 
@@ -806,19 +1449,37 @@ void wasmjit_emscripten____buildEnvironment(uint32_t environ_arg,
 uint32_t wasmjit_emscripten____syscall10(uint32_t which, uint32_t varargs,
 					 struct FuncInst *funcinst)
 {
-	char *base;
+	struct EmscriptenFS *fs = &_wasmjit_emscripten_get_context(funcinst)->fs;
+	const char *pathname;
+	int dirfd, readonly;
+	long ret;
 
 	LOAD_ARGS(funcinst, varargs, 1,
 		  uint32_t, pathname);
 
 	(void)which;
 
-	base = wasmjit_emscripten_get_base_address(funcinst);
+	ret = wasmjit_emscripten_resolve_path(funcinst, args.pathname,
+					      &dirfd, &pathname, &readonly);
+	if (ret)
+		return ret;
 
-	if (!_wasmjit_emscripten_check_string(funcinst, args.pathname, PATH_MAX))
-		return -EM_EFAULT;
+	if (readonly)
+		return -EM_EROFS;
+
+	if (!fs->n_preopens)
+		return check_ret(sys_unlinkat(dirfd, pathname, 0));
+
+	ret = wasmjit_emscripten_open_parent_beneath(dirfd, pathname,
+						     fs->parent, &pathname);
+	if (ret < 0)
+		return check_ret(ret);
+	dirfd = ret;
 
-	return check_ret(sys_unlink(base + args.pathname));
+	ret = sys_unlinkat(dirfd, pathname, 0);
+	sys_close(dirfd);
+
+	return check_ret(ret);
 }
 
 #ifndef __INT_WIDTH__
@@ -993,6 +1654,23 @@ static int convert_proto_to_local(int domain, int32_t proto)
 #define SAME_SOCKADDR
 #endif
 
+/* see "Preopened directories" */
+static int fs_allows_sockaddr(struct FuncInst *funcinst,
+			      const char *addr, uint32_t len)
+{
+	uint16_t family;
+
+	if (!_wasmjit_emscripten_get_context(funcinst)->fs.n_preopens ||
+	    len <= FAS)
+		return 1;
+
+	memcpy(&family, addr, FAS);
+	family = uint16_t_swap_bytes(family);
+
+	/* abstract addresses start with a NUL and are not files */
+	return family != EM_AF_UNIX || addr[FAS] == '\0';
+}
+
 #ifndef SAME_SOCKADDR
 
 static long read_sockaddr(struct sockaddr_storage *ss, size_t *size,
@@ -2257,6 +2935,10 @@ uint32_t wasmjit_emscripten____syscall102(uint32_t which, uint32_t varargs,
 
 		base = wasmjit_emscripten_get_base_address(funcinst);
 
+		if (!fs_allows_sockaddr(funcinst, base + args.addrp,
+					args.addrlen))
+			return -EM_EACCES;
+
 		if (icall == 2) {
 			ret = finish_bindlike(sys_bind,
 					      args.fd,
@@ -2355,6 +3037,11 @@ uint32_t wasmjit_emscripten____syscall102(uint32_t which, uint32_t varargs,
 
 		base = wasmjit_emscripten_get_base_address(funcinst);
 
+		if (args.addrp &&
+		    !fs_allows_sockaddr(funcinst, base + args.addrp,
+					args.addrlen))
+			return -EM_EACCES;
+
 		/* if there are flags we don't understand, then return invalid flag */
 		if (has_bad_sendto_flag(args.flags))
 			return -EM_EINVAL;
@@ -2489,6 +3176,7 @@ uint32_t wasmjit_emscripten____syscall102(uint32_t which, uint32_t varargs,
 		{
 			char *base;
 			user_msghdr_t msg;
+			struct iovec fast_iov[WASMJIT_UIO_FASTIOV];
 
 			LOAD_ARGS_CUSTOM(emmsg, funcinst, args.msg, 7,
 					 uint32_t, name,
@@ -2512,6 +3200,13 @@ uint32_t wasmjit_emscripten____syscall102(uint32_t which, uint32_t varargs,
 					goto error;
 				}
 
+				if (!fs_allows_sockaddr(funcinst,
+							base + emmsg.name,
+							emmsg.namelen)) {
+					ret = -EACCES;
+					goto error;
+				}
+
 				msg.msg_name = base + emmsg.name;
 			} else {
 				msg.msg_name = NULL;
@@ -2520,7 +3215,9 @@ uint32_t wasmjit_emscripten____syscall102(uint32_t which, uint32_t varargs,
 			msg.msg_namelen = emmsg.namelen;
 
 
-			ret = copy_iov(funcinst, emmsg.iov, emmsg.iovlen, &msg.msg_iov);
+			ret = wasmjit_copy_iov(wasmjit_emscripten_get_mem_inst(funcinst),
+					       emmsg.iov, emmsg.iovlen, fast_iov,
+					       &msg.msg_iov);
 			if (ret) {
 				goto error;
 			}
@@ -2548,7 +3245,7 @@ uint32_t wasmjit_emscripten____syscall102(uint32_t which, uint32_t varargs,
 
 		error:
 			free(msg.msg_control);
-			free(msg.msg_iov);
+			wasmjit_free_iov(msg.msg_iov, fast_iov);
 		}
 
 		break;
@@ -2556,6 +3253,7 @@ uint32_t wasmjit_emscripten____syscall102(uint32_t which, uint32_t varargs,
 	case 17: { // recvmsg
 		char *base;
 		user_msghdr_t msg;
+		struct iovec fast_iov[WASMJIT_UIO_FASTIOV];
 		struct em_msghdr emmsg;
 
 		LOAD_ARGS(funcinst, ivargs, 3,
@@ -2600,7 +3298,9 @@ uint32_t wasmjit_emscripten____syscall102(uint32_t which, uint32_t varargs,
 
 		msg.msg_namelen = emmsg.msg_namelen;
 
-		ret = copy_iov(funcinst, emmsg.msg_iov, emmsg.msg_iovlen, &msg.msg_iov);
+		ret = wasmjit_copy_iov(wasmjit_emscripten_get_mem_inst(funcinst),
+				       emmsg.msg_iov, emmsg.msg_iovlen, fast_iov,
+				       &msg.msg_iov);
 		if (ret)
 			goto error2;
 
@@ -2670,13 +3370,13 @@ uint32_t wasmjit_emscripten____syscall102(uint32_t which, uint32_t varargs,
 		if (0) {
 		error_abort:
 			free(msg.msg_control);
-			free(msg.msg_iov);
+			wasmjit_free_iov(msg.msg_iov, fast_iov);
 			wasmjit_emscripten_internal_abort("Unknown cmsg type!");
 		}
 
 		error2:
 		free(msg.msg_control);
-		free(msg.msg_iov);
+		wasmjit_free_iov(msg.msg_iov, fast_iov);
 		break;
 	}
 	default: {
@@ -2691,69 +3391,2133 @@ uint32_t wasmjit_emscripten____syscall102(uint32_t which, uint32_t varargs,
 	return check_ret(ret);
 }
 
-/* fcntl64 */
-uint32_t wasmjit_emscripten____syscall221(uint32_t which, uint32_t varargs,
-					  struct FuncInst *funcinst)
+#define EM_F_DUPFD 0
+#define EM_F_GETFD 1
+#define EM_F_SETFD 2
+#define EM_F_GETFL 3
+#define EM_F_SETFL 4
+#define EM_F_GETLK 12
+#define EM_F_SETLK 13
+#define EM_F_SETLKW 14
+#define EM_F_DUPFD_CLOEXEC 1030
+
+#define EM_FD_CLOEXEC 1
+
+#define EM_F_RDLCK 0
+#define EM_F_WRLCK 1
+#define EM_F_UNLCK 2
+
+#define EM_SEEK_SET 0
+#define EM_SEEK_CUR 1
+#define EM_SEEK_END 2
+
+/* musl's off_t is 64-bit, so l_start is aligned to offset 8 */
+struct em_flock {
+	int16_t l_type;
+	int16_t l_whence;
+	uint32_t pad;
+	int64_t l_start;
+	int64_t l_len;
+	int32_t l_pid;
+	uint32_t pad2;
+};
+
+#define EM_O_ACCMODE 03
+#define EM_O_RDONLY 00
+#define EM_O_WRONLY 01
+#define EM_O_RDWR 02
+#define EM_O_CREAT 0100
+#define EM_O_EXCL 0200
+#define EM_O_NOCTTY 0400
+#define EM_O_TRUNC 01000
+#define EM_O_APPEND 02000
+#define EM_O_NONBLOCK 04000
+#define EM_O_ASYNC 020000
+#define EM_O_DIRECT 040000
+#define EM_O_NOATIME 01000000
+#define EM_O_DSYNC 010000
+#define EM_O_DIRECTORY 0200000
+#define EM_O_NOFOLLOW 0400000
+#define EM_O_CLOEXEC 02000000
+#define EM_O_SYNC 04010000
+
+#if defined(__linux__) || defined(__KERNEL__)
+
+static int convert_status_flags_to_local(int32_t flags)
 {
-	LOAD_ARGS(funcinst, varargs, 2,
-		  int32_t, fd,
-		  int32_t, cmd);
+	return flags;
+}
 
-	(void) which;
+static int32_t convert_status_flags_from_local(long flags)
+{
+	return flags;
+}
 
-	/* TODO: implement */
-	(void) args;
+#else
+
+static int convert_status_flags_to_local(int32_t flags)
+{
+	int oflags = 0;
+
+	/* F_SETFL ignores the access mode and creation flags */
+	if (flags & EM_O_APPEND)
+		oflags |= O_APPEND;
+	if (flags & EM_O_NONBLOCK)
+		oflags |= O_NONBLOCK;
+#ifdef O_ASYNC
+	if (flags & EM_O_ASYNC)
+		oflags |= O_ASYNC;
+#endif
+#ifdef O_DIRECT
+	if (flags & EM_O_DIRECT)
+		oflags |= O_DIRECT;
+#endif
+#ifdef O_NOATIME
+	if (flags & EM_O_NOATIME)
+		oflags |= O_NOATIME;
+#endif
 
-	return -EM_EINVAL;
+	return oflags;
 }
 
-/* chdir */
-uint32_t wasmjit_emscripten____syscall12(uint32_t which, uint32_t varargs,
-					 struct FuncInst *funcinst)
+static int32_t convert_status_flags_from_local(long flags)
 {
-	char *base;
+	int32_t emflags;
 
-	LOAD_ARGS(funcinst, varargs, 1,
-		  uint32_t, pathname);
+	switch (flags & O_ACCMODE) {
+	case O_WRONLY:
+		emflags = 1;
+		break;
+	case O_RDWR:
+		emflags = 2;
+		break;
+	default:
+		emflags = 0;
+		break;
+	}
 
-	(void) which;
+	if (flags & O_APPEND)
+		emflags |= EM_O_APPEND;
+	if (flags & O_NONBLOCK)
+		emflags |= EM_O_NONBLOCK;
+#ifdef O_ASYNC
+	if (flags & O_ASYNC)
+		emflags |= EM_O_ASYNC;
+#endif
+#ifdef O_DIRECT
+	if (flags & O_DIRECT)
+		emflags |= EM_O_DIRECT;
+#endif
+#ifdef O_NOATIME
+	if (flags & O_NOATIME)
+		emflags |= EM_O_NOATIME;
+#endif
 
-	base = wasmjit_emscripten_get_base_address(funcinst);
+	return emflags;
+}
 
-	if (!_wasmjit_emscripten_check_string(funcinst, args.pathname, PATH_MAX))
-		return -EM_EFAULT;
+#endif
 
-	return check_ret(sys_chdir(base + args.pathname));
+/* Emscripten uses the x86 open flags, which not every Linux port shares */
+#if (defined(__KERNEL__) || defined(__linux__)) && defined(__x86_64__)
+
+static int convert_open_flags_to_local(int32_t flags)
+{
+	return flags;
 }
 
-/* uname */
-uint32_t wasmjit_emscripten____syscall122(uint32_t which, uint32_t varargs,
-					  struct FuncInst *funcinst)
+#else
+
+static int convert_open_flags_to_local(int32_t flags)
 {
-	char *base;
+	int oflags;
 
-	LOAD_ARGS(funcinst, varargs, 1,
-		  uint32_t, buf);
+	switch (flags & EM_O_ACCMODE) {
+	case EM_O_WRONLY:
+		oflags = O_WRONLY;
+		break;
+	case EM_O_RDWR:
+		oflags = O_RDWR;
+		break;
+	default:
+		oflags = O_RDONLY;
+		break;
+	}
+
+	if (flags & EM_O_CREAT)
+		oflags |= O_CREAT;
+	if (flags & EM_O_EXCL)
+		oflags |= O_EXCL;
+	if (flags & EM_O_NOCTTY)
+		oflags |= O_NOCTTY;
+	if (flags & EM_O_TRUNC)
+		oflags |= O_TRUNC;
+	if (flags & EM_O_DIRECTORY)
+		oflags |= O_DIRECTORY;
+	if (flags & EM_O_NOFOLLOW)
+		oflags |= O_NOFOLLOW;
+	if (flags & EM_O_CLOEXEC)
+		oflags |= O_CLOEXEC;
+	if ((flags & EM_O_SYNC) == EM_O_SYNC)
+		oflags |= O_SYNC;
+#ifdef O_DSYNC
+	else if (flags & EM_O_DSYNC)
+		oflags |= O_DSYNC;
+#endif
+
+	return oflags | convert_status_flags_to_local(flags);
+}
+
+#endif
+
+/* open */
+uint32_t wasmjit_emscripten____syscall5(uint32_t which, uint32_t varargs,
+					struct FuncInst *funcinst)
+{
+	struct EmscriptenFS *fs = &_wasmjit_emscripten_get_context(funcinst)->fs;
+	const char *pathname;
+	int dirfd, readonly;
+	long ret;
+
+	LOAD_ARGS(funcinst, varargs, 3,
+		  uint32_t, pathname,
+		  int32_t, flags,
+		  uint32_t, mode);
 
 	(void) which;
 
-	if (!_wasmjit_emscripten_check_range(funcinst, args.buf, 390))
+	ret = wasmjit_emscripten_resolve_path(funcinst, args.pathname,
+					      &dirfd, &pathname, &readonly);
+	if (ret)
+		return ret;
+
+	if (readonly &&
+	    ((args.flags & EM_O_ACCMODE) != EM_O_RDONLY ||
+	     (args.flags & (EM_O_CREAT | EM_O_TRUNC))))
+		return -EM_EROFS;
+
+	if (fs->n_preopens)
+		return check_ret(wasmjit_emscripten_openat_beneath(dirfd, pathname,
+								   convert_open_flags_to_local(args.flags),
+								   args.mode & 07777));
+
+	return check_ret(sys_openat(dirfd, pathname,
+				    convert_open_flags_to_local(args.flags),
+				    args.mode & 07777));
+}
+
+static long read_user_flock(struct FuncInst *funcinst, struct flock *fl,
+			    uint32_t user_fl)
+{
+	struct em_flock emfl;
+
+	if (_wasmjit_emscripten_copy_from_user(funcinst, &emfl, user_fl,
+					       sizeof(emfl)))
 		return -EM_EFAULT;
 
-	base = wasmjit_emscripten_get_base_address(funcinst);
+	memset(fl, 0, sizeof(*fl));
 
-	strcpy(base + args.buf + 0, "Emscripten");
-	strcpy(base + args.buf + 65, "emscripten");
-	strcpy(base + args.buf + 130, "1.0");
-	strcpy(base + args.buf + 195, "#1");
-	strcpy(base + args.buf + 260, "x86-JS");
+	switch ((int16_t) uint16_t_swap_bytes(emfl.l_type)) {
+	case EM_F_RDLCK:
+		fl->l_type = F_RDLCK;
+		break;
+	case EM_F_WRLCK:
+		fl->l_type = F_WRLCK;
+		break;
+	case EM_F_UNLCK:
+		fl->l_type = F_UNLCK;
+		break;
+	default:
+		return -EM_EINVAL;
+	}
+
+	switch ((int16_t) uint16_t_swap_bytes(emfl.l_whence)) {
+	case EM_SEEK_SET:
+		fl->l_whence = SEEK_SET;
+		break;
+	case EM_SEEK_CUR:
+		fl->l_whence = SEEK_CUR;
+		break;
+	case EM_SEEK_END:
+		fl->l_whence = SEEK_END;
+		break;
+	default:
+		return -EM_EINVAL;
+	}
+
+	fl->l_start = (int64_t) uint64_t_swap_bytes(emfl.l_start);
+	fl->l_len = (int64_t) uint64_t_swap_bytes(emfl.l_len);
 
 	return 0;
 }
 
-void wasmjit_emscripten_cleanup(struct ModuleInst *moduleinst) {
-	(void)moduleinst;
-	/* TODO: implement */
+static long write_user_flock(struct FuncInst *funcinst, uint32_t user_fl,
+			     const struct flock *fl)
+{
+	struct em_flock emfl;
+	int16_t type, whence;
+
+	switch (fl->l_type) {
+	case F_RDLCK:
+		type = EM_F_RDLCK;
+		break;
+	case F_WRLCK:
+		type = EM_F_WRLCK;
+		break;
+	default:
+		type = EM_F_UNLCK;
+		break;
+	}
+
+	switch (fl->l_whence) {
+	case SEEK_CUR:
+		whence = EM_SEEK_CUR;
+		break;
+	case SEEK_END:
+		whence = EM_SEEK_END;
+		break;
+	default:
+		whence = EM_SEEK_SET;
+		break;
+	}
+
+	memset(&emfl, 0, sizeof(emfl));
+	emfl.l_type = uint16_t_swap_bytes(type);
+	emfl.l_whence = uint16_t_swap_bytes(whence);
+	emfl.l_start = uint64_t_swap_bytes(fl->l_start);
+	emfl.l_len = uint64_t_swap_bytes(fl->l_len);
+	emfl.l_pid = int32_t_swap_bytes(fl->l_pid);
+
+	if (_wasmjit_emscripten_copy_to_user(funcinst, user_fl, &emfl,
+					     sizeof(emfl)))
+		return -EM_EFAULT;
+
+	return 0;
+}
+
+/* fcntl64 */
+uint32_t wasmjit_emscripten____syscall221(uint32_t which, uint32_t varargs,
+					  struct FuncInst *funcinst)
+{
+	long ret;
+
+	LOAD_ARGS(funcinst, varargs, 3,
+		  int32_t, fd,
+		  int32_t, cmd,
+		  int32_t, arg);
+
+	(void) which;
+
+	switch (args.cmd) {
+	case EM_F_DUPFD:
+	case EM_F_DUPFD_CLOEXEC:
+		if (args.arg < 0)
+			return -EM_EINVAL;
+		return check_ret(sys_fcntl(args.fd,
+					   args.cmd == EM_F_DUPFD
+					   ? F_DUPFD : F_DUPFD_CLOEXEC,
+					   args.arg));
+	case EM_F_GETFD:
+		ret = sys_fcntl(args.fd, F_GETFD, 0);
+		if (ret < 0)
+			return check_ret(ret);
+		return ret & FD_CLOEXEC ? EM_FD_CLOEXEC : 0;
+	case EM_F_SETFD:
+		return check_ret(sys_fcntl(args.fd, F_SETFD,
+					   args.arg & EM_FD_CLOEXEC
+					   ? FD_CLOEXEC : 0));
+	case EM_F_GETFL:
+		ret = sys_fcntl(args.fd, F_GETFL, 0);
+		if (ret < 0)
+			return check_ret(ret);
+		return convert_status_flags_from_local(ret);
+	case EM_F_SETFL:
+		return check_ret(sys_fcntl(args.fd, F_SETFL,
+					   convert_status_flags_to_local(args.arg)));
+	case EM_F_GETLK:
+	case EM_F_SETLK:
+	case EM_F_SETLKW: {
+		struct flock fl;
+
+		ret = read_user_flock(funcinst, &fl, args.arg);
+		if (ret)
+			return ret;
+
+		ret = sys_fcntl(args.fd,
+				args.cmd == EM_F_GETLK
+				? F_GETLK
+				: args.cmd == EM_F_SETLK
+				? F_SETLK
+				: F_SETLKW,
+				(unsigned long) &fl);
+		if (ret < 0 || args.cmd != EM_F_GETLK)
+			return check_ret(ret);
+
+		return write_user_flock(funcinst, args.arg, &fl);
+	}
+	default:
+		return -EM_EINVAL;
+	}
+}
+
+/*
+  Emscripten's fd_set is 1024 bits in 32-bit little-endian words,
+  which is the byte layout of the host's fd_set on little-endian
+  Linux, so it can be copied as is.
+*/
+#define EM_FD_SETSIZE 1024
+
+#ifdef SAME_SOCKADDR
+#define SAME_FD_SET
+COMPILE_TIME_ASSERT(sizeof(fd_set) >= EM_FD_SETSIZE / 8);
+#endif
+
+static long read_fd_set(struct FuncInst *funcinst, fd_set *set,
+			uint32_t user_set, int32_t nfds)
+{
+	/* only whole words up to nfds are guaranteed to be there */
+	size_t size = ((nfds + 31) / 32) * 4;
+	char buf[EM_FD_SETSIZE / 8];
+
+	if (_wasmjit_emscripten_copy_from_user(funcinst, buf, user_set, size))
+		return -EM_EFAULT;
+
+#ifdef SAME_FD_SET
+	memset(set, 0, sizeof(*set));
+	memcpy(set, buf, size);
+#else
+	{
+		int32_t fd;
+
+		FD_ZERO(set);
+		for (fd = 0; fd < nfds; ++fd) {
+			if (buf[fd / 8] & (1 << (fd % 8)))
+				FD_SET(fd, set);
+		}
+	}
+#endif
+
+	return 0;
+}
+
+static long write_fd_set(struct FuncInst *funcinst, uint32_t user_set,
+			 fd_set *set, int32_t nfds)
+{
+	size_t size = ((nfds + 31) / 32) * 4;
+	char buf[EM_FD_SETSIZE / 8];
+
+#ifdef SAME_FD_SET
+	memcpy(buf, set, size);
+#else
+	{
+		int32_t fd;
+
+		memset(buf, 0, size);
+		for (fd = 0; fd < nfds; ++fd) {
+			if (FD_ISSET(fd, set))
+				buf[fd / 8] |= 1 << (fd % 8);
+		}
+	}
+#endif
+
+	if (_wasmjit_emscripten_copy_to_user(funcinst, user_set, buf, size))
+		return -EM_EFAULT;
+
+	return 0;
+}
+
+/* _newselect */
+uint32_t wasmjit_emscripten____syscall142(uint32_t which, uint32_t varargs,
+					  struct FuncInst *funcinst)
+{
+	fd_set sets[3];
+	fd_set *setps[3];
+	uint32_t user_sets[3];
+	struct timeval tv, *tvp = NULL;
+	long ret;
+	int i;
+
+	LOAD_ARGS(funcinst, varargs, 5,
+		  int32_t, nfds,
+		  uint32_t, readfds,
+		  uint32_t, writefds,
+		  uint32_t, exceptfds,
+		  uint32_t, timeout);
+
+	(void) which;
+
+	if (args.nfds < 0 || args.nfds > EM_FD_SETSIZE)
+		return -EM_EINVAL;
+
+	user_sets[0] = args.readfds;
+	user_sets[1] = args.writefds;
+	user_sets[2] = args.exceptfds;
+
+	for (i = 0; i < 3; ++i) {
+		setps[i] = NULL;
+		if (!user_sets[i])
+			continue;
+		ret = read_fd_set(funcinst, &sets[i], user_sets[i], args.nfds);
+		if (ret)
+			return ret;
+		setps[i] = &sets[i];
+	}
+
+	if (args.timeout) {
+		LOAD_ARGS_CUSTOM(emtv, funcinst, args.timeout, 2,
+				 int32_t, sec,
+				 int32_t, usec);
+
+		tv.tv_sec = emtv.sec;
+		tv.tv_usec = emtv.usec;
+		tvp = &tv;
+	}
+
+	ret = sys_select(args.nfds, setps[0], setps[1], setps[2], tvp);
+	if (ret < 0)
+		return check_ret(ret);
+
+	for (i = 0; i < 3; ++i) {
+		if (setps[i] &&
+		    write_fd_set(funcinst, user_sets[i], setps[i], args.nfds))
+			return -EM_EFAULT;
+	}
+
+	/* Linux reports the time left, guests may rely on that */
+	if (tvp) {
+		int32_t emtv[2];
+
+		emtv[0] = int32_t_swap_bytes(tv.tv_sec);
+		emtv[1] = int32_t_swap_bytes(tv.tv_usec);
+		if (_wasmjit_emscripten_copy_to_user(funcinst, args.timeout,
+						     emtv, sizeof(emtv)))
+			return -EM_EFAULT;
+	}
+
+	return check_ret(ret);
+}
+
+struct em_pollfd {
+	int32_t fd;
+	int16_t events;
+	int16_t revents;
+};
+
+#define EM_POLLIN 0x1
+#define EM_POLLPRI 0x2
+#define EM_POLLOUT 0x4
+#define EM_POLLERR 0x8
+#define EM_POLLHUP 0x10
+#define EM_POLLNVAL 0x20
+
+#if defined(SAME_SOCKADDR) && defined(__linux__)
+/* struct pollfd and the event bits match, poll the guest's array */
+#define SAME_POLLFD
+#endif
+
+#ifdef SAME_POLLFD
+
+static long finish_poll(char *base, uint32_t fds, uint32_t nfds,
+			int32_t timeout)
+{
+	return sys_poll((struct pollfd *)(base + fds), nfds, timeout);
+}
+
+#else
+
+static int convert_poll_events_to_local(int16_t events)
+{
+	int levents = 0;
+
+	if (events & EM_POLLIN)
+		levents |= POLLIN;
+	if (events & EM_POLLPRI)
+		levents |= POLLPRI;
+	if (events & EM_POLLOUT)
+		levents |= POLLOUT;
+
+	return levents;
+}
+
+static int16_t convert_poll_events_from_local(int levents)
+{
+	int16_t events = 0;
+
+	if (levents & POLLIN)
+		events |= EM_POLLIN;
+	if (levents & POLLPRI)
+		events |= EM_POLLPRI;
+	if (levents & POLLOUT)
+		events |= EM_POLLOUT;
+	if (levents & POLLERR)
+		events |= EM_POLLERR;
+	if (levents & POLLHUP)
+		events |= EM_POLLHUP;
+	if (levents & POLLNVAL)
+		events |= EM_POLLNVAL;
+
+	return events;
+}
+
+static long finish_poll(char *base, uint32_t fds, uint32_t nfds,
+			int32_t timeout)
+{
+	struct em_pollfd *emfds = (struct em_pollfd *)(base + fds);
+	struct pollfd *lfds;
+	uint32_t i;
+	long ret;
+
+	lfds = wasmjit_alloc_vector(nfds, sizeof(struct pollfd), NULL);
+	if (nfds && !lfds)
+		return -ENOMEM;
+
+	for (i = 0; i < nfds; ++i) {
+		struct em_pollfd emfd;
+
+		memcpy(&emfd, &emfds[i], sizeof(emfd));
+		lfds[i].fd = int32_t_swap_bytes(emfd.fd);
+		lfds[i].events =
+			convert_poll_events_to_local(uint16_t_swap_bytes(emfd.events));
+		lfds[i].revents = 0;
+	}
+
+	ret = sys_poll(lfds, nfds, timeout);
+
+	if (ret >= 0) {
+		for (i = 0; i < nfds; ++i) {
+			int16_t revents =
+				convert_poll_events_from_local(lfds[i].revents);
+
+			revents = uint16_t_swap_bytes(revents);
+			memcpy(&emfds[i].revents, &revents, sizeof(revents));
+		}
+	}
+
+	free(lfds);
+
+	return ret;
+}
+
+#endif
+
+/* poll */
+uint32_t wasmjit_emscripten____syscall168(uint32_t which, uint32_t varargs,
+					  struct FuncInst *funcinst)
+{
+	size_t size;
+
+	LOAD_ARGS(funcinst, varargs, 3,
+		  uint32_t, fds,
+		  uint32_t, nfds,
+		  int32_t, timeout);
+
+	(void) which;
+
+	if (__builtin_mul_overflow(args.nfds, sizeof(struct em_pollfd), &size) ||
+	    !_wasmjit_emscripten_check_range(funcinst, args.fds, size))
+		return -EM_EFAULT;
+
+	return check_ret(finish_poll(wasmjit_emscripten_get_base_address(funcinst),
+				     args.fds, args.nfds, args.timeout));
+}
+
+/*
+  Emscripten's struct epoll_event is not packed, so its 64-bit data
+  member sits at offset 8 rather than 4 as it does on x86_64.
+*/
+struct em_epoll_event {
+	uint32_t events;
+	uint32_t pad;
+	uint64_t data;
+};
+
+#define EM_EPOLL_CLOEXEC 02000000
+
+/* epoll_create */
+uint32_t wasmjit_emscripten____syscall254(uint32_t which, uint32_t varargs,
+					  struct FuncInst *funcinst)
+{
+	LOAD_ARGS(funcinst, varargs, 1,
+		  int32_t, size);
+
+	(void) which;
+
+	if (args.size <= 0)
+		return -EM_EINVAL;
+
+#if defined(__linux__) || defined(__KERNEL__)
+	return check_ret(sys_epoll_create1(0));
+#else
+	return -EM_ENOSYS;
+#endif
+}
+
+/* epoll_create1 */
+uint32_t wasmjit_emscripten____syscall329(uint32_t which, uint32_t varargs,
+					  struct FuncInst *funcinst)
+{
+	LOAD_ARGS(funcinst, varargs, 1,
+		  int32_t, flags);
+
+	(void) which;
+
+	if (args.flags & ~EM_EPOLL_CLOEXEC)
+		return -EM_EINVAL;
+
+#if defined(__linux__) || defined(__KERNEL__)
+	return check_ret(sys_epoll_create1(args.flags & EM_EPOLL_CLOEXEC
+					   ? EPOLL_CLOEXEC : 0));
+#else
+	return -EM_ENOSYS;
+#endif
+}
+
+/* epoll_ctl */
+uint32_t wasmjit_emscripten____syscall255(uint32_t which, uint32_t varargs,
+					  struct FuncInst *funcinst)
+{
+	LOAD_ARGS(funcinst, varargs, 4,
+		  int32_t, epfd,
+		  int32_t, op,
+		  int32_t, fd,
+		  uint32_t, event);
+
+	(void) which;
+
+#if defined(__linux__) || defined(__KERNEL__)
+	{
+		struct epoll_event ev, *evp = NULL;
+
+		/* EPOLL_CTL_DEL takes no event */
+		if (args.event) {
+			struct em_epoll_event emev;
+
+			if (_wasmjit_emscripten_copy_from_user(funcinst, &emev,
+							       args.event,
+							       sizeof(emev)))
+				return -EM_EFAULT;
+
+			/* the event bits match on Linux */
+			ev.events = uint32_t_swap_bytes(emev.events);
+			ev.data.u64 = emev.data;
+			evp = &ev;
+		}
+
+		return check_ret(sys_epoll_ctl(args.epfd, args.op, args.fd,
+					       evp));
+	}
+#else
+	(void) args;
+	return -EM_ENOSYS;
+#endif
+}
+
+/* epoll_wait */
+uint32_t wasmjit_emscripten____syscall256(uint32_t which, uint32_t varargs,
+					  struct FuncInst *funcinst)
+{
+	LOAD_ARGS(funcinst, varargs, 4,
+		  int32_t, epfd,
+		  uint32_t, events,
+		  int32_t, maxevents,
+		  int32_t, timeout);
+
+	(void) which;
+
+#if defined(__linux__) || defined(__KERNEL__)
+	{
+		struct epoll_event *evs;
+		struct em_epoll_event *emevs;
+		long ret, i;
+
+		if (args.maxevents <= 0)
+			return -EM_EINVAL;
+
+		if (!_wasmjit_emscripten_check_range(funcinst, args.events,
+						     (size_t) args.maxevents *
+						     sizeof(struct em_epoll_event)))
+			return -EM_EFAULT;
+
+		evs = wasmjit_alloc_vector(args.maxevents,
+					   sizeof(struct epoll_event), NULL);
+		if (!evs)
+			return -EM_ENOMEM;
+
+		ret = sys_epoll_wait(args.epfd, evs, args.maxevents,
+				     args.timeout);
+
+		emevs = (struct em_epoll_event *)
+			(wasmjit_emscripten_get_base_address(funcinst) +
+			 args.events);
+		for (i = 0; i < ret; ++i) {
+			struct em_epoll_event emev;
+
+			emev.events = uint32_t_swap_bytes(evs[i].events);
+			emev.pad = 0;
+			emev.data = evs[i].data.u64;
+			memcpy(&emevs[i], &emev, sizeof(emev));
+		}
+
+		free(evs);
+
+		return check_ret(ret);
+	}
+#else
+	(void) args;
+	return -EM_ENOSYS;
+#endif
+}
+
+/* chdir */
+uint32_t wasmjit_emscripten____syscall12(uint32_t which, uint32_t varargs,
+					 struct FuncInst *funcinst)
+{
+	struct EmscriptenFS *fs = &_wasmjit_emscripten_get_context(funcinst)->fs;
+	const char *pathname;
+	long ret;
+
+	LOAD_ARGS(funcinst, varargs, 1,
+		  uint32_t, pathname);
+
+	(void) which;
+
+	ret = wasmjit_emscripten_get_path(funcinst, args.pathname, &pathname);
+	if (ret < 0)
+		return ret;
+
+	if (fs->n_preopens)
+		return wasmjit_emscripten_fs_chdir(fs, pathname, ret);
+
+	return check_ret(sys_chdir(pathname));
+}
+
+/* uname */
+uint32_t wasmjit_emscripten____syscall122(uint32_t which, uint32_t varargs,
+					  struct FuncInst *funcinst)
+{
+	char *base;
+
+	LOAD_ARGS(funcinst, varargs, 1,
+		  uint32_t, buf);
+
+	(void) which;
+
+	if (!_wasmjit_emscripten_check_range(funcinst, args.buf, 390))
+		return -EM_EFAULT;
+
+	base = wasmjit_emscripten_get_base_address(funcinst);
+
+	strcpy(base + args.buf + 0, "Emscripten");
+	strcpy(base + args.buf + 65, "emscripten");
+	strcpy(base + args.buf + 130, "1.0");
+	strcpy(base + args.buf + 195, "#1");
+	strcpy(base + args.buf + 260, "x86-JS");
+
+	return 0;
+}
+
+/*
+  Batched syscalls, see emscripten_ring.h for the guest ABI. A guest
+  issuing many small reads, writes and accepts enters the host once
+  per batch instead of once per syscall, and with io_uring the host
+  enters the kernel once per batch too.
+*/
+
+/* accept hands the guest's sockaddr straight to the kernel */
+#if defined(HAVE_IO_URING) && !defined(SAME_SOCKADDR)
+#undef HAVE_IO_URING
+#endif
+
+static void ring_load_sqe(char *base, uint32_t sqes, uint32_t idx,
+			  struct em_ring_sqe *sqe)
+{
+	memcpy(sqe, base + sqes + idx * sizeof(*sqe), sizeof(*sqe));
+	sqe->fd = int32_t_swap_bytes(sqe->fd);
+	sqe->addr = uint32_t_swap_bytes(sqe->addr);
+	sqe->len = uint32_t_swap_bytes(sqe->len);
+	sqe->off = uint64_t_swap_bytes(sqe->off);
+}
+
+static void ring_store_cqe(char *base, uint32_t cqes, uint32_t idx,
+			   uint64_t user_data, int32_t res)
+{
+	struct em_ring_cqe cqe;
+
+	cqe.user_data = user_data;
+	cqe.res = int32_t_swap_bytes(res);
+	cqe.flags = 0;
+
+	memcpy(base + cqes + idx * sizeof(cqe), &cqe, sizeof(cqe));
+}
+
+static int32_t ring_execute(struct FuncInst *funcinst,
+			    const struct em_ring_sqe *sqe)
+{
+	char *base = wasmjit_emscripten_get_base_address(funcinst);
+	long ret;
+
+	if (sqe->flags & ~EM_RING_SQE_LINK)
+		return -EM_EINVAL;
+
+	switch (sqe->opcode) {
+	case EM_RING_OP_NOP:
+		return 0;
+	case EM_RING_OP_READ:
+	case EM_RING_OP_WRITE:
+		if (!_wasmjit_emscripten_check_range(funcinst, sqe->addr,
+						     sqe->len))
+			return -EM_EFAULT;
+
+		if (sqe->off == EM_RING_NO_OFFSET) {
+			ret = sqe->opcode == EM_RING_OP_READ
+				? sys_read(sqe->fd, base + sqe->addr, sqe->len)
+				: sys_write(sqe->fd, base + sqe->addr, sqe->len);
+		} else {
+#if defined(__linux__) || defined(__KERNEL__)
+			if (sqe->off > INT64_MAX)
+				return -EM_EINVAL;
+			ret = sqe->opcode == EM_RING_OP_READ
+				? sys_pread64(sqe->fd, base + sqe->addr,
+					      sqe->len, sqe->off)
+				: sys_pwrite64(sqe->fd, base + sqe->addr,
+					       sqe->len, sqe->off);
+#else
+			return -EM_ENOSYS;
+#endif
+		}
+		return check_ret(ret);
+	case EM_RING_OP_READV:
+	case EM_RING_OP_WRITEV: {
+		struct iovec fast_iov[WASMJIT_UIO_FASTIOV];
+		struct iovec *liov;
+
+		if (sqe->off != EM_RING_NO_OFFSET)
+			return -EM_EINVAL;
+
+		ret = wasmjit_copy_iov(wasmjit_emscripten_get_mem_inst(funcinst),
+				       sqe->addr, sqe->len, fast_iov, &liov);
+		if (ret)
+			return check_ret(ret);
+
+		ret = sqe->opcode == EM_RING_OP_READV
+			? sys_readv(sqe->fd, liov, sqe->len)
+			: sys_writev(sqe->fd, liov, sqe->len);
+
+		wasmjit_free_iov(liov, fast_iov);
+
+		return check_ret(ret);
+	}
+	case EM_RING_OP_ACCEPT: {
+		uint32_t addrlen;
+
+		if (!sqe->addr)
+			return check_ret(sys_accept(sqe->fd, NULL, NULL));
+
+		if (sqe->off > UINT32_MAX ||
+		    _wasmjit_emscripten_copy_from_user(funcinst, &addrlen,
+						       sqe->off,
+						       sizeof(addrlen)))
+			return -EM_EFAULT;
+
+		addrlen = uint32_t_swap_bytes(addrlen);
+
+		if (!_wasmjit_emscripten_check_range(funcinst, sqe->addr,
+						     addrlen))
+			return -EM_EFAULT;
+
+		return check_ret(finish_acceptlike(sys_accept, sqe->fd,
+						   base + sqe->addr, addrlen,
+						   base + sqe->off));
+	}
+	case EM_RING_OP_CLOSE:
+		return check_ret(sys_close(sqe->fd));
+	default:
+		return -EM_EINVAL;
+	}
+}
+
+/* the fallback, entries run in order on the calling thread */
+static void ring_run_sync(struct FuncInst *funcinst,
+			  uint32_t entries, uint32_t sq_head, uint32_t sqes,
+			  uint32_t cq_tail, uint32_t cqes, uint32_t n)
+{
+	char *base = wasmjit_emscripten_get_base_address(funcinst);
+	uint32_t i, mask = entries - 1;
+	int cancel = 0;
+
+	for (i = 0; i < n; ++i) {
+		struct em_ring_sqe sqe;
+		int32_t res;
+
+		ring_load_sqe(base, sqes, (sq_head + i) & mask, &sqe);
+
+		res = cancel ? -EM_ECANCELED : ring_execute(funcinst, &sqe);
+		cancel = (sqe.flags & EM_RING_SQE_LINK) && res < 0;
+
+		ring_store_cqe(base, cqes, (cq_tail + i) & mask,
+			       sqe.user_data, res);
+	}
+}
+
+#ifdef HAVE_IO_URING
+
+struct EmscriptenHostRing {
+	/* -1 once io_uring turned out to be unusable */
+	int fd;
+	uint32_t entries;
+	void *ring;
+	size_t ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	uint32_t *sq_tail, *sq_mask, *sq_array;
+	uint32_t *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* indexed by position in the batch, the io_uring user_data */
+	struct EmscriptenHostRingOp {
+		uint64_t user_data;
+		struct iovec *liov;
+		struct iovec fast_iov[WASMJIT_UIO_FASTIOV];
+	} *ops;
+};
+
+static void host_ring_teardown(struct EmscriptenHostRing *hr)
+{
+	if (hr->sqes)
+		munmap(hr->sqes, hr->sqes_size);
+	if (hr->ring)
+		munmap(hr->ring, hr->ring_size);
+	if (hr->fd >= 0)
+		close(hr->fd);
+	free(hr->ops);
+	hr->fd = -1;
+	hr->ring = NULL;
+	hr->sqes = NULL;
+	hr->ops = NULL;
+}
+
+static int host_ring_supports_ops(int fd)
+{
+	static const uint8_t needed[] = {
+		IORING_OP_NOP,
+		IORING_OP_READ,
+		IORING_OP_WRITE,
+		IORING_OP_READV,
+		IORING_OP_WRITEV,
+		IORING_OP_ACCEPT,
+		IORING_OP_CLOSE,
+	};
+	struct io_uring_probe *probe;
+	size_t i;
+	int ret = 0;
+
+	probe = calloc(1, sizeof(*probe) +
+		       256 * sizeof(struct io_uring_probe_op));
+	if (!probe)
+		return 0;
+
+	if (syscall(SYS_io_uring_register, fd, IORING_REGISTER_PROBE,
+		    probe, 256) < 0)
+		goto out;
+
+	for (i = 0; i < sizeof(needed) / sizeof(needed[0]); ++i) {
+		if (needed[i] > probe->last_op ||
+		    !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED))
+			goto out;
+	}
+
+	ret = 1;
+
+ out:
+	free(probe);
+	return ret;
+}
+
+/* one io_uring the size of the guest's ring, so a batch always fits */
+static int host_ring_setup(struct EmscriptenHostRing *hr, uint32_t entries)
+{
+	struct io_uring_params p;
+	size_t cq_size;
+	char *ring;
+
+	memset(&p, 0, sizeof(p));
+	hr->fd = syscall(SYS_io_uring_setup, entries, &p);
+	if (hr->fd < 0)
+		return -1;
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_RW_CUR_POS) ||
+	    p.sq_entries < entries ||
+	    !host_ring_supports_ops(hr->fd))
+		goto error;
+
+	hr->ring_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_size > hr->ring_size)
+		hr->ring_size = cq_size;
+
+	ring = mmap(NULL, hr->ring_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, hr->fd, IORING_OFF_SQ_RING);
+	if (ring == MAP_FAILED)
+		goto error;
+	hr->ring = ring;
+
+	hr->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	hr->sqes = mmap(NULL, hr->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, hr->fd, IORING_OFF_SQES);
+	if (hr->sqes == MAP_FAILED) {
+		hr->sqes = NULL;
+		goto error;
+	}
+
+	hr->ops = wasmjit_alloc_vector(entries, sizeof(hr->ops[0]), NULL);
+	if (!hr->ops)
+		goto error;
+
+	hr->sq_tail = (uint32_t *) (ring + p.sq_off.tail);
+	hr->sq_mask = (uint32_t *) (ring + p.sq_off.ring_mask);
+	hr->sq_array = (uint32_t *) (ring + p.sq_off.array);
+	hr->cq_head = (uint32_t *) (ring + p.cq_off.head);
+	hr->cq_tail = (uint32_t *) (ring + p.cq_off.tail);
+	hr->cq_mask = (uint32_t *) (ring + p.cq_off.ring_mask);
+	hr->cqes = (struct io_uring_cqe *) (ring + p.cq_off.cqes);
+	hr->entries = entries;
+
+	return 0;
+
+ error:
+	host_ring_teardown(hr);
+	return -1;
+}
+
+/* NULL when the batch has to run synchronously */
+static struct EmscriptenHostRing *host_ring_get(struct EmscriptenContext *ctx,
+						uint32_t entries)
+{
+	struct EmscriptenHostRing *hr = ctx->host_ring;
+
+	if (!hr) {
+		hr = calloc(1, sizeof(*hr));
+		if (!hr)
+			return NULL;
+		ctx->host_ring = hr;
+		hr->fd = -1;
+	} else if (hr->entries == entries) {
+		return hr;
+	} else if (hr->fd < 0) {
+		return NULL;
+	}
+
+	/* first use, or the guest switched to a ring of another size */
+	host_ring_teardown(hr);
+	if (host_ring_setup(hr, entries))
+		return NULL;
+
+	return hr;
+}
+
+static void host_ring_free(struct EmscriptenHostRing *hr)
+{
+	if (!hr)
+		return;
+	host_ring_teardown(hr);
+	free(hr);
+}
+
+/* the io_uring counterpart of ring_execute(), the checks are the same */
+static int32_t ring_prepare(struct FuncInst *funcinst,
+			    const struct em_ring_sqe *sqe,
+			    struct EmscriptenHostRingOp *op,
+			    struct io_uring_sqe *hsqe)
+{
+	char *base = wasmjit_emscripten_get_base_address(funcinst);
+	long ret;
+
+	if (sqe->flags & ~EM_RING_SQE_LINK)
+		return -EM_EINVAL;
+
+	memset(hsqe, 0, sizeof(*hsqe));
+	hsqe->fd = sqe->fd;
+
+	switch (sqe->opcode) {
+	case EM_RING_OP_NOP:
+		hsqe->opcode = IORING_OP_NOP;
+		break;
+	case EM_RING_OP_READ:
+	case EM_RING_OP_WRITE:
+		if (!_wasmjit_emscripten_check_range(funcinst, sqe->addr,
+						     sqe->len))
+			return -EM_EFAULT;
+		if (sqe->off != EM_RING_NO_OFFSET && sqe->off > INT64_MAX)
+			return -EM_EINVAL;
+
+		hsqe->opcode = sqe->opcode == EM_RING_OP_READ
+			? IORING_OP_READ
+			: IORING_OP_WRITE;
+		hsqe->addr = (uintptr_t) (base + sqe->addr);
+		hsqe->len = sqe->len;
+		/* -1 is the current position, like EM_RING_NO_OFFSET */
+		hsqe->off = sqe->off;
+		break;
+	case EM_RING_OP_READV:
+	case EM_RING_OP_WRITEV:
+		if (sqe->off != EM_RING_NO_OFFSET)
+			return -EM_EINVAL;
+
+		ret = wasmjit_copy_iov(wasmjit_emscripten_get_mem_inst(funcinst),
+				       sqe->addr, sqe->len, op->fast_iov,
+				       &op->liov);
+		if (ret)
+			return check_ret(ret);
+
+		hsqe->opcode = sqe->opcode == EM_RING_OP_READV
+			? IORING_OP_READV
+			: IORING_OP_WRITEV;
+		hsqe->addr = (uintptr_t) op->liov;
+		hsqe->len = sqe->len;
+		hsqe->off = -1;
+		break;
+	case EM_RING_OP_ACCEPT:
+		hsqe->opcode = IORING_OP_ACCEPT;
+		if (sqe->addr) {
+			uint32_t addrlen;
+
+			if (sqe->off > UINT32_MAX ||
+			    _wasmjit_emscripten_copy_from_user(funcinst,
+							       &addrlen,
+							       sqe->off,
+							       sizeof(addrlen)))
+				return -EM_EFAULT;
+
+			addrlen = uint32_t_swap_bytes(addrlen);
+
+			if (!_wasmjit_emscripten_check_range(funcinst,
+							     sqe->addr,
+							     addrlen))
+				return -EM_EFAULT;
+
+			hsqe->addr = (uintptr_t) (base + sqe->addr);
+			hsqe->addr2 = (uintptr_t) (base + sqe->off);
+		}
+		break;
+	case EM_RING_OP_CLOSE:
+		hsqe->opcode = IORING_OP_CLOSE;
+		break;
+	default:
+		return -EM_EINVAL;
+	}
+
+	if (sqe->flags & EM_RING_SQE_LINK)
+		hsqe->flags |= IOSQE_IO_LINK;
+
+	return 0;
+}
+
+/*
+  Entries that fail their checks complete right away, the rest are
+  submitted together and reaped by the same io_uring_enter().
+  Nothing is left in flight on return, so the guest may reuse its
+  buffers as soon as it sees the completions.
+*/
+static void ring_run_io_uring(struct FuncInst *funcinst,
+			      struct EmscriptenHostRing *hr,
+			      uint32_t entries, uint32_t sq_head,
+			      uint32_t sqes, uint32_t cq_tail, uint32_t cqes,
+			      uint32_t n)
+{
+	char *base = wasmjit_emscripten_get_base_address(funcinst);
+	struct io_uring_sqe *link = NULL;
+	uint32_t i, mask = entries - 1, posted = 0, queued = 0;
+	uint32_t tail, head, to_submit;
+	int cancel = 0;
+
+	tail = *hr->sq_tail;
+
+	for (i = 0; i < n; ++i) {
+		struct EmscriptenHostRingOp *op = &hr->ops[i];
+		uint32_t slot = (tail + queued) & *hr->sq_mask;
+		struct io_uring_sqe *hsqe = &hr->sqes[slot];
+		struct em_ring_sqe sqe;
+		int32_t res;
+
+		ring_load_sqe(base, sqes, (sq_head + i) & mask, &sqe);
+
+		op->user_data = sqe.user_data;
+		op->liov = op->fast_iov;
+
+		res = cancel
+			? -EM_ECANCELED
+			: ring_prepare(funcinst, &sqe, op, hsqe);
+		if (res) {
+			/* the host chain stops short of this entry */
+			if (link)
+				link->flags &= ~IOSQE_IO_LINK;
+			link = NULL;
+			cancel = sqe.flags & EM_RING_SQE_LINK;
+			ring_store_cqe(base, cqes, (cq_tail + posted++) & mask,
+				       sqe.user_data, res);
+			continue;
+		}
+
+		cancel = 0;
+		link = (hsqe->flags & IOSQE_IO_LINK) ? hsqe : NULL;
+		hsqe->user_data = i;
+		hr->sq_array[slot] = slot;
+		queued++;
+	}
+
+	/* chains end with the batch */
+	if (link)
+		link->flags &= ~IOSQE_IO_LINK;
+
+	__atomic_store_n(hr->sq_tail, tail + queued, __ATOMIC_RELEASE);
+
+	to_submit = queued;
+	head = *hr->cq_head;
+	while (queued) {
+		uint32_t cq_end;
+		long ret;
+
+		ret = syscall(SYS_io_uring_enter, hr->fd, to_submit, queued,
+			      IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0) {
+			/* NB: the entries can't be taken back */
+			if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+				wasmjit_emscripten_internal_abort("io_uring_enter() failed");
+			ret = 0;
+		}
+		to_submit -= ret;
+
+		cq_end = __atomic_load_n(hr->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != cq_end; ++head) {
+			struct io_uring_cqe *hcqe = &hr->cqes[head & *hr->cq_mask];
+			struct EmscriptenHostRingOp *op = &hr->ops[hcqe->user_data];
+
+			wasmjit_free_iov(op->liov, op->fast_iov);
+			ring_store_cqe(base, cqes, (cq_tail + posted++) & mask,
+				       op->user_data, check_ret(hcqe->res));
+			queued--;
+		}
+		__atomic_store_n(hr->cq_head, head, __ATOMIC_RELEASE);
+	}
+}
+
+#endif
+
+uint32_t wasmjit_emscripten__wasmjit_ring_enter(uint32_t ring,
+						uint32_t to_submit,
+						struct FuncInst *funcinst)
+{
+	char *base;
+	uint32_t n, pending, used, sq_head, cq_tail;
+#ifdef HAVE_IO_URING
+	struct EmscriptenHostRing *hr;
+#endif
+
+	LOAD_ARGS_CUSTOM(hdr, funcinst, ring, 7,
+			 uint32_t, entries,
+			 uint32_t, sq_head,
+			 uint32_t, sq_tail,
+			 uint32_t, cq_head,
+			 uint32_t, cq_tail,
+			 uint32_t, sqes,
+			 uint32_t, cqes);
+
+	if (!hdr.entries || hdr.entries > EM_RING_MAX_ENTRIES ||
+	    (hdr.entries & (hdr.entries - 1)))
+		return -EM_EINVAL;
+
+	if (!_wasmjit_emscripten_check_range(funcinst, hdr.sqes,
+					     hdr.entries *
+					     sizeof(struct em_ring_sqe)) ||
+	    !_wasmjit_emscripten_check_range(funcinst, hdr.cqes,
+					     hdr.entries *
+					     sizeof(struct em_ring_cqe)))
+		return -EM_EFAULT;
+
+	pending = hdr.sq_tail - hdr.sq_head;
+	used = hdr.cq_tail - hdr.cq_head;
+	if (pending > hdr.entries || used > hdr.entries)
+		return -EM_EINVAL;
+
+	n = pending;
+	if (n > to_submit)
+		n = to_submit;
+	if (n > hdr.entries - used)
+		n = hdr.entries - used;
+
+	if (n) {
+#ifdef HAVE_IO_URING
+		hr = host_ring_get(_wasmjit_emscripten_get_context(funcinst),
+				   hdr.entries);
+		if (hr)
+			ring_run_io_uring(funcinst, hr, hdr.entries,
+					  hdr.sq_head, hdr.sqes,
+					  hdr.cq_tail, hdr.cqes, n);
+		else
+#endif
+			ring_run_sync(funcinst, hdr.entries,
+				      hdr.sq_head, hdr.sqes,
+				      hdr.cq_tail, hdr.cqes, n);
+	}
+
+	/* publish both indices only after the entries are written */
+	base = wasmjit_emscripten_get_base_address(funcinst);
+	sq_head = uint32_t_swap_bytes(hdr.sq_head + n);
+	cq_tail = uint32_t_swap_bytes(hdr.cq_tail + n);
+	memcpy(base + ring + offsetof(struct em_ring, sq_head), &sq_head,
+	       sizeof(sq_head));
+	memcpy(base + ring + offsetof(struct em_ring, cq_tail), &cq_tail,
+	       sizeof(cq_tail));
+
+	return n;
+}
+
+#ifndef __KERNEL__
+
+/*
+  Guest pthreads.
+
+  Each thread runs its own instance of the guest module on a host
+  thread. The instances share env.memory, and so the heap and every
+  atomic, but have their own globals, i.e. stack pointer, and their
+  own copy of the table, which the element segments fill again. Data
+  segments and the start function only ran for the first instance.
+
+  pthread_t is an id handed out by the host, the main thread is 1.
+  The attributes are ignored: each thread gets EM_THREAD_STACK_SIZE
+  of guest stack from the guest's malloc() and a host stack of
+  EM_THREAD_HOST_STACK_SIZE. _emscripten_futex_wait and
+  _emscripten_futex_wake are memory.atomic.wait32 and
+  memory.atomic.notify for code that doesn't use the instructions.
+
+  A thread that traps passes the trap to its joiner. Stopping the
+  threads interrupts them all and waits for them, including those
+  blocked in a host syscall.
+*/
+
+enum {
+	EM_THREAD_STACK_SIZE = 2 * 1024 * 1024,
+	EM_THREAD_HOST_STACK_SIZE = 8 * 1024 * 1024,
+};
+
+int wasmjit_emscripten_init_threads(struct EmscriptenContext *ctx,
+				    struct ModuleInst *(*instantiate)(void *arg,
+								      struct ModuleInst *env),
+				    void *arg)
+{
+	struct EmscriptenThreads *threads;
+
+	if (ctx->threads)
+		return 0;
+
+	threads = calloc(1, sizeof(*threads));
+	if (!threads)
+		return -1;
+
+	if (pthread_mutex_init(&threads->lock, NULL)) {
+		free(threads);
+		return -1;
+	}
+
+	if (pthread_cond_init(&threads->idle, NULL)) {
+		pthread_mutex_destroy(&threads->lock);
+		free(threads);
+		return -1;
+	}
+
+	threads->next_id = 2;
+	threads->instantiate = instantiate;
+	threads->arg = arg;
+	ctx->threads = threads;
+
+	return 0;
+}
+
+/* env as the thread's instance imports it, with a table of its own */
+static struct ModuleInst *thread_env(const struct ModuleInst *env)
+{
+	struct ModuleInst *tenv;
+	size_t i;
+
+	tenv = calloc(1, sizeof(*tenv));
+	if (!tenv)
+		return NULL;
+
+	for (i = 0; i < env->exports.n_elts; ++i) {
+		const struct Export *export = &env->exports.elts[i];
+		struct Export *copy;
+		struct TableInst *table;
+
+		if (!VECTOR_GROW(&tenv->exports, 1))
+			goto error;
+		copy = &tenv->exports.elts[tenv->exports.n_elts - 1];
+		*copy = *export;
+		copy->name = strdup(export->name);
+		if (!copy->name)
+			goto error;
+
+		if (export->type != IMPORT_DESC_TYPE_TABLE)
+			continue;
+
+		table = calloc(1, sizeof(*table));
+		if (!table)
+			goto error;
+		if (!VECTOR_GROW(&tenv->tables, 1)) {
+			free(table);
+			goto error;
+		}
+		tenv->tables.elts[tenv->tables.n_elts - 1] = table;
+
+		table->elemtype = export->value.table->elemtype;
+		table->length = export->value.table->length;
+		table->max = export->value.table->max;
+		table->data = calloc(table->length, sizeof(table->data[0]));
+		if (!table->data && table->length)
+			goto error;
+		copy->value.table = table;
+	}
+
+	return tenv;
+
+ error:
+	wasmjit_free_module_inst(tenv);
+	return NULL;
+}
+
+/* all inputs are i32, output is VALTYPE_I32 or VALTYPE_NULL */
+static struct FuncInst *thread_export(struct ModuleInst *inst,
+				      const char *name,
+				      size_t n_inputs,
+				      wasmjit_valtype_t output)
+{
+	wasmjit_valtype_t inputs[2] = { VALTYPE_I32, VALTYPE_I32 };
+	struct FuncInst *funcinst;
+	struct FuncType type;
+
+	assert(n_inputs <= ARRAY_LEN(inputs));
+
+	funcinst = wasmjit_get_export(inst, name, IMPORT_DESC_TYPE_FUNC).func;
+	if (!funcinst)
+		return NULL;
+
+	_wasmjit_create_func_type(&type, n_inputs, inputs,
+				  output == VALTYPE_NULL ? 0 : 1, &output);
+	if (!wasmjit_typecheck_func(&type, funcinst))
+		return NULL;
+
+	return funcinst;
+}
+
+/* the guest stack belongs to the guest heap, free it separately */
+static void free_thread(struct EmscriptenThread *thread)
+{
+	if (thread->started)
+		pthread_join(thread->host, NULL);
+	if (thread->host_stack)
+		munmap(thread->host_stack, EM_THREAD_HOST_STACK_SIZE);
+	if (thread->inst)
+		wasmjit_free_module_inst(thread->inst);
+	if (thread->env)
+		wasmjit_free_module_inst(thread->env);
+	free(thread);
+}
+
+static void *thread_main(void *arg)
+{
+	struct EmscriptenThread *thread = arg;
+	struct EmscriptenThreads *threads = thread->threads;
+	union ValueUnion args[2], out;
+	int ret;
+
+	current_thread = thread;
+	/* above the guard page */
+	wasmjit_set_stack_top((char *) thread->host_stack +
+			      sysconf(_SC_PAGESIZE));
+
+	pthread_mutex_lock(&threads->lock);
+	thread->tctx = wasmjit_get_thread_context();
+	if (threads->stopping)
+		wasmjit_interrupt(thread->tctx);
+	pthread_mutex_unlock(&threads->lock);
+
+	args[0].i32 = thread->stack;
+	args[1].i32 = thread->stack + EM_THREAD_STACK_SIZE;
+	ret = wasmjit_invoke_function(thread->establish_inst, args, &out);
+	if (!ret) {
+		args[0].i32 = thread->arg;
+		ret = wasmjit_invoke_function(thread->start_routine_inst,
+					      args, &out);
+	}
+
+	pthread_mutex_lock(&threads->lock);
+	/* pthread_exit() left through a trap with the result set */
+	if (!thread->exiting) {
+		thread->trap = ret;
+		if (!ret)
+			thread->result = out.i32;
+	}
+	thread->tctx = NULL;
+	__atomic_store_n(&thread->exited, 1, __ATOMIC_SEQ_CST);
+	if (!--threads->running)
+		pthread_cond_broadcast(&threads->idle);
+	pthread_mutex_unlock(&threads->lock);
+
+	/* NB: thread is only freed after this host thread is joined */
+	wasmjit_atomic_notify(&thread->exited, UINT32_MAX);
+
+	return NULL;
+}
+
+static void unlink_thread(struct EmscriptenThreads *threads,
+			  struct EmscriptenThread *thread)
+{
+	struct EmscriptenThread **threadp;
+
+	for (threadp = &threads->list; *threadp != thread;
+	     threadp = &(*threadp)->next)
+		;
+	*threadp = thread->next;
+}
+
+/* frees the detached threads that have exited */
+static void reap_threads(struct EmscriptenContext *ctx)
+{
+	struct EmscriptenThreads *threads = ctx->threads;
+	struct EmscriptenThread *thread, *next, *reaped = NULL;
+
+	pthread_mutex_lock(&threads->lock);
+	for (thread = threads->list; thread; thread = next) {
+		next = thread->next;
+		if (thread->detached && thread->exited) {
+			unlink_thread(threads, thread);
+			thread->next = reaped;
+			reaped = thread;
+		}
+	}
+	pthread_mutex_unlock(&threads->lock);
+
+	while ((thread = reaped)) {
+		reaped = thread->next;
+		freeMemory(ctx, thread->stack);
+		free_thread(thread);
+	}
+}
+
+/*
+  Interrupts every thread and waits for all of them to finish, then
+  frees them. Their guest stacks go with the memory, the guest isn't
+  called again.
+*/
+static void stop_threads(struct EmscriptenContext *ctx)
+{
+	struct EmscriptenThreads *threads = ctx->threads;
+	struct EmscriptenThread *thread;
+
+	if (!threads)
+		return;
+
+	pthread_mutex_lock(&threads->lock);
+	threads->stopping = 1;
+	for (thread = threads->list; thread; thread = thread->next) {
+		if (thread->tctx)
+			wasmjit_interrupt(thread->tctx);
+	}
+	while (threads->running)
+		pthread_cond_wait(&threads->idle, &threads->lock);
+	pthread_mutex_unlock(&threads->lock);
+
+	while ((thread = threads->list)) {
+		threads->list = thread->next;
+		free_thread(thread);
+	}
+
+	pthread_cond_destroy(&threads->idle);
+	pthread_mutex_destroy(&threads->lock);
+	free(threads);
+	ctx->threads = NULL;
+}
+
+uint32_t wasmjit_emscripten__pthread_create(uint32_t thread_ptr,
+					    uint32_t attr,
+					    uint32_t start_routine,
+					    uint32_t arg,
+					    struct FuncInst *funcinst)
+{
+	struct EmscriptenContext *ctx =
+		_wasmjit_emscripten_get_context(funcinst);
+	struct EmscriptenThreads *threads = ctx->threads;
+	struct EmscriptenThread *thread = NULL;
+	struct TableInst *table;
+	struct FuncInst *start_routine_inst;
+	struct FuncType start_type;
+	wasmjit_valtype_t start_valtype = VALTYPE_I32;
+	pthread_attr_t host_attr;
+	long page = sysconf(_SC_PAGESIZE);
+	uint32_t id, ret;
+
+	(void)attr;
+
+	if (!threads)
+		return EM_EAGAIN;
+
+	if (!_wasmjit_emscripten_check_range(funcinst, thread_ptr, 4))
+		return EM_EINVAL;
+
+	reap_threads(ctx);
+
+	thread = calloc(1, sizeof(*thread));
+	if (!thread)
+		return EM_EAGAIN;
+	thread->threads = threads;
+	thread->arg = arg;
+
+	ret = EM_EAGAIN;
+
+	thread->env = thread_env(funcinst->module_inst);
+	if (!thread->env)
+		goto error;
+
+	thread->inst = threads->instantiate(threads->arg, thread->env);
+	if (!thread->inst)
+		goto error;
+
+	ret = EM_EINVAL;
+
+	thread->establish_inst = thread_export(thread->inst,
+					       "establishStackSpace",
+					       2, VALTYPE_NULL);
+	thread->malloc_inst = thread_export(thread->inst, "_malloc",
+					    1, VALTYPE_I32);
+	thread->free_inst = thread_export(thread->inst, "_free",
+					  1, VALTYPE_NULL);
+	thread->errno_location_inst = thread_export(thread->inst,
+						    "___errno_location",
+						    0, VALTYPE_I32);
+	if (!thread->establish_inst || !thread->malloc_inst ||
+	    !thread->free_inst)
+		goto error;
+
+	/* start_routine is an index into the guest's table */
+	_wasmjit_create_func_type(&start_type, 1, &start_valtype,
+				  1, &start_valtype);
+	if (!thread->inst->tables.n_elts)
+		goto error;
+	table = thread->inst->tables.elts[0];
+	if (start_routine >= table->length)
+		goto error;
+	start_routine_inst = table->data[start_routine];
+	if (!start_routine_inst ||
+	    !wasmjit_typecheck_func(&start_type, start_routine_inst))
+		goto error;
+	thread->start_routine_inst = start_routine_inst;
+
+	ret = EM_EAGAIN;
+
+	thread->stack = getMemory(ctx, EM_THREAD_STACK_SIZE);
+	if (!thread->stack)
+		goto error;
+
+	thread->host_stack = mmap(NULL, EM_THREAD_HOST_STACK_SIZE,
+				  PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK,
+				  -1, 0);
+	if (thread->host_stack == MAP_FAILED) {
+		thread->host_stack = NULL;
+		goto error;
+	}
+	if (mprotect(thread->host_stack, page, PROT_NONE))
+		goto error;
+
+	if (pthread_attr_init(&host_attr))
+		goto error;
+	if (pthread_attr_setstack(&host_attr,
+				  (char *) thread->host_stack + page,
+				  EM_THREAD_HOST_STACK_SIZE - page)) {
+		pthread_attr_destroy(&host_attr);
+		goto error;
+	}
+
+	pthread_mutex_lock(&threads->lock);
+	if (!threads->stopping) {
+		id = threads->next_id++;
+		thread->id = id;
+		id = uint32_t_swap_bytes(id);
+		memcpy(wasmjit_emscripten_get_base_address(funcinst) + thread_ptr,
+		       &id, sizeof(id));
+
+		thread->started = !pthread_create(&thread->host, &host_attr,
+						  thread_main, thread);
+		if (thread->started) {
+			thread->next = threads->list;
+			threads->list = thread;
+			threads->running += 1;
+		}
+	}
+	pthread_mutex_unlock(&threads->lock);
+
+	pthread_attr_destroy(&host_attr);
+
+	if (!thread->started)
+		goto error;
+
+	return 0;
+
+ error:
+	if (thread->stack)
+		freeMemory(ctx, thread->stack);
+	free_thread(thread);
+	return ret;
+}
+
+uint32_t wasmjit_emscripten__pthread_self(struct FuncInst *funcinst)
+{
+	(void)funcinst;
+	return current_thread ? current_thread->id : 1;
+}
+
+uint32_t wasmjit_emscripten__pthread_join(uint32_t id,
+					  uint32_t retval_ptr,
+					  struct FuncInst *funcinst)
+{
+	struct EmscriptenContext *ctx =
+		_wasmjit_emscripten_get_context(funcinst);
+	struct EmscriptenThreads *threads = ctx->threads;
+	struct EmscriptenThread *thread;
+	uint32_t result;
+	int trap;
+
+	if (!threads)
+		return EM_ESRCH;
+
+	if (id == wasmjit_emscripten__pthread_self(funcinst))
+		return EM_EDEADLK;
+
+	/* checked first so a fault can't lose the thread */
+	if (retval_ptr &&
+	    !_wasmjit_emscripten_check_range(funcinst, retval_ptr, 4))
+		return EM_EINVAL;
+
+	pthread_mutex_lock(&threads->lock);
+	for (thread = threads->list; thread; thread = thread->next) {
+		if (thread->id == id)
+			break;
+	}
+	if (!thread) {
+		pthread_mutex_unlock(&threads->lock);
+		return EM_ESRCH;
+	}
+	if (thread->detached || thread->joining) {
+		pthread_mutex_unlock(&threads->lock);
+		return EM_EINVAL;
+	}
+	thread->joining = 1;
+	pthread_mutex_unlock(&threads->lock);
+
+	/* an interrupted joiner traps here and the thread is freed
+	   when the threads are stopped */
+	while (!__atomic_load_n(&thread->exited, __ATOMIC_SEQ_CST))
+		wasmjit_atomic_wait(&thread->exited, 0, -1, 0);
+
+	pthread_mutex_lock(&threads->lock);
+	unlink_thread(threads, thread);
+	pthread_mutex_unlock(&threads->lock);
+
+	trap = thread->trap;
+	result = thread->result;
+	freeMemory(ctx, thread->stack);
+	free_thread(thread);
+
+	if (trap)
+		wasmjit_trap(trap);
+
+	if (retval_ptr) {
+		result = uint32_t_swap_bytes(result);
+		memcpy(wasmjit_emscripten_get_base_address(funcinst) + retval_ptr,
+		       &result, sizeof(result));
+	}
+
+	return 0;
+}
+
+uint32_t wasmjit_emscripten__pthread_detach(uint32_t id,
+					    struct FuncInst *funcinst)
+{
+	struct EmscriptenContext *ctx =
+		_wasmjit_emscripten_get_context(funcinst);
+	struct EmscriptenThreads *threads = ctx->threads;
+	struct EmscriptenThread *thread;
+	uint32_t ret = 0;
+
+	if (!threads)
+		return EM_ESRCH;
+
+	pthread_mutex_lock(&threads->lock);
+	for (thread = threads->list; thread; thread = thread->next) {
+		if (thread->id == id)
+			break;
+	}
+	if (!thread)
+		ret = EM_ESRCH;
+	else if (thread->detached || thread->joining)
+		ret = EM_EINVAL;
+	else
+		thread->detached = 1;
+	pthread_mutex_unlock(&threads->lock);
+
+	if (!ret)
+		reap_threads(ctx);
+
+	return ret;
+}
+
+void wasmjit_emscripten__pthread_exit(uint32_t retval,
+				      struct FuncInst *funcinst)
+{
+	(void)funcinst;
+
+	if (!current_thread)
+		wasmjit_emscripten_internal_abort("pthread_exit() on the main thread");
+
+	current_thread->result = retval;
+	current_thread->exiting = 1;
+	/* unwinds to thread_main() */
+	wasmjit_trap(WASMJIT_TRAP_ABORT);
+}
+
+uint32_t wasmjit_emscripten__emscripten_futex_wait(uint32_t addr,
+						   uint32_t val,
+						   double timeout_ms,
+						   struct FuncInst *funcinst)
+{
+	struct MemInst *meminst = wasmjit_emscripten_get_mem_inst(funcinst);
+	int64_t timeout;
+
+	if (!meminst->shared || (addr & 3) ||
+	    !wasmjit_emscripten_check_range(meminst, addr, 4))
+		return -EM_EINVAL;
+
+	/* Infinity, NaN and anything past INT64_MAX ns wait forever */
+	if (!(timeout_ms < (double) INT64_MAX / 1000000))
+		timeout = -1;
+	else if (timeout_ms > 0)
+		timeout = timeout_ms * 1000000;
+	else
+		timeout = 0;
+
+	switch (wasmjit_atomic_wait(meminst->data + addr,
+				    uint32_t_swap_bytes(val), timeout, 0)) {
+	case 0:
+		return 0;
+	case 1:
+		return -EM_EAGAIN;
+	default:
+		return -EM_ETIMEDOUT;
+	}
+}
+
+uint32_t wasmjit_emscripten__emscripten_futex_wake(uint32_t addr,
+						   uint32_t count,
+						   struct FuncInst *funcinst)
+{
+	struct MemInst *meminst = wasmjit_emscripten_get_mem_inst(funcinst);
+
+	if ((addr & 3) || (int32_t) count < 0 ||
+	    !wasmjit_emscripten_check_range(meminst, addr, 4))
+		return -EM_EINVAL;
+
+	/* nobody can wait on unshared memory */
+	if (!meminst->shared)
+		return 0;
+
+	return wasmjit_atomic_notify(meminst->data + addr, count);
+}
+
+uint32_t wasmjit_emscripten__emscripten_num_logical_cores(struct FuncInst *funcinst)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	(void)funcinst;
+	return n > 0 ? n : 1;
+}
+
+uint32_t wasmjit_emscripten__emscripten_has_threading_support(struct FuncInst *funcinst)
+{
+	return _wasmjit_emscripten_get_context(funcinst)->threads != NULL;
+}
+
+#endif
+
+/*
+  Syscall statistics.
+
+  With stats requested the runtime module exports a counted wrapper
+  for each ___syscall import instead of the syscall itself, so runs
+  without them pay nothing. The wrappers are generated from
+  emscripten_runtime_def.h and time the call with the monotonic clock.
+*/
+
+static uint64_t stats_now_ns(void)
+{
+#ifdef __KERNEL__
+	return ktime_get_ns();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* syscalls whose non-negative result is the number of bytes moved */
+static int syscall_moves_bytes(uint32_t n)
+{
+	switch (n) {
+	case 3: /* read */
+	case 4: /* write */
+	case 146: /* writev */
+	case 187: /* sendfile */
+	case 239: /* sendfile64 */
+	case 313: /* splice */
+	case 377: /* copy_file_range */
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static uint32_t count_syscall(uint32_t n,
+			      uint32_t (*syscall)(uint32_t, uint32_t,
+						  struct FuncInst *),
+			      uint32_t which, uint32_t varargs,
+			      struct FuncInst *funcinst)
+{
+	struct EmscriptenContext *ctx =
+		_wasmjit_emscripten_get_context(funcinst);
+	struct EmscriptenSyscallStats *stats;
+	uint64_t start, elapsed;
+	int32_t ret;
+	unsigned bucket;
+
+	start = stats_now_ns();
+	ret = syscall(which, varargs, funcinst);
+	elapsed = stats_now_ns() - start;
+
+	if (!ctx->syscall_stats)
+		return ret;
+
+	stats = &ctx->syscall_stats[n];
+	stats->calls += 1;
+	stats->total_ns += elapsed;
+	if (ret < 0)
+		stats->errors += 1;
+	else if (syscall_moves_bytes(n))
+		stats->bytes += ret;
+
+	bucket = elapsed ? 63 - __builtin_clzll(elapsed) : 0;
+	if (bucket >= WASMJIT_EMSCRIPTEN_LATENCY_BUCKETS)
+		bucket = WASMJIT_EMSCRIPTEN_LATENCY_BUCKETS - 1;
+	stats->latency[bucket] += 1;
+
+	return ret;
+}
+
+#define START_MODULE()
+#define END_MODULE()
+#define START_FUNCTION_DEFS()
+#define END_FUNCTION_DEFS()
+#define START_TABLE_DEFS()
+#define END_TABLE_DEFS()
+#define START_MEMORY_DEFS()
+#define END_MEMORY_DEFS()
+#define START_GLOBAL_DEFS()
+#define END_GLOBAL_DEFS()
+#define DEFINE_WASM_GLOBAL(...)
+#define DEFINE_WASM_TABLE(...)
+#define DEFINE_WASM_MEMORY(...)
+#define DEFINE_WASM_FUNCTION(...)
+#define DEFINE_WASM_START_FUNCTION(...)
+#define DEFINE_EXTERNAL_WASM_GLOBAL(...)
+#define DEFINE_EXTERNAL_WASM_TABLE(...)
+#define DEFINE_EMSCRIPTEN_SYSCALL(_n)					\
+	COMPILE_TIME_ASSERT(_n < WASMJIT_EMSCRIPTEN_MAX_SYSCALL);	\
+	uint32_t wasmjit_emscripten_counted____syscall ## _n(uint32_t which, \
+							     uint32_t varargs, \
+							     struct FuncInst *funcinst) \
+	{								\
+		return count_syscall(_n, &wasmjit_emscripten____syscall ## _n, \
+				     which, varargs, funcinst);		\
+	}
+
+#include <wasmjit/emscripten_runtime_def.h>
+
+#undef START_MODULE
+#undef END_MODULE
+#undef START_FUNCTION_DEFS
+#undef END_FUNCTION_DEFS
+#undef START_TABLE_DEFS
+#undef END_TABLE_DEFS
+#undef START_MEMORY_DEFS
+#undef END_MEMORY_DEFS
+#undef START_GLOBAL_DEFS
+#undef END_GLOBAL_DEFS
+#undef DEFINE_WASM_GLOBAL
+#undef DEFINE_WASM_TABLE
+#undef DEFINE_WASM_MEMORY
+#undef DEFINE_WASM_FUNCTION
+#undef DEFINE_WASM_START_FUNCTION
+#undef DEFINE_EXTERNAL_WASM_GLOBAL
+#undef DEFINE_EXTERNAL_WASM_TABLE
+
+int wasmjit_emscripten_enable_syscall_stats(struct EmscriptenContext *ctx)
+{
+	if (ctx->syscall_stats)
+		return 0;
+
+	ctx->syscall_stats = calloc(WASMJIT_EMSCRIPTEN_MAX_SYSCALL,
+				    sizeof(ctx->syscall_stats[0]));
+	if (!ctx->syscall_stats)
+		return -1;
+
+	return 0;
+}
+
+const struct EmscriptenSyscallStats *
+wasmjit_emscripten_get_syscall_stats(struct EmscriptenContext *ctx,
+				     uint32_t which)
+{
+	if (!ctx->syscall_stats || which >= WASMJIT_EMSCRIPTEN_MAX_SYSCALL)
+		return NULL;
+
+	return &ctx->syscall_stats[which];
+}
+
+void wasmjit_emscripten_free_context(void *ctx)
+{
+	struct EmscriptenContext *ectx = ctx;
+
+#ifndef __KERNEL__
+	stop_threads(ectx);
+#endif
+	if (ectx->syscall_stats)
+		free(ectx->syscall_stats);
+#ifdef HAVE_IO_URING
+	host_ring_free(ectx->host_ring);
+#endif
+	free(ectx);
+}
+
+void wasmjit_emscripten_cleanup(struct ModuleInst *moduleinst) {
+	struct EmscriptenFS *fs = &wasmjit_emscripten_get_context(moduleinst)->fs;
+	size_t i;
+
+#ifndef __KERNEL__
+	/* before the preopens close under them */
+	stop_threads(wasmjit_emscripten_get_context(moduleinst));
+#endif
+
+	for (i = 0; i < fs->n_preopens; ++i)
+		sys_close(fs->preopens[i].dirfd);
+	fs->n_preopens = 0;
 }
 
 struct EmscriptenContext *wasmjit_emscripten_get_context(struct ModuleInst *module_inst)
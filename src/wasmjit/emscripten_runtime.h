@@ -31,17 +31,86 @@
 
 enum {
 	WASMJIT_EMSCRIPTEN_TOTAL_MEMORY = 16777216,
+	WASMJIT_EMSCRIPTEN_PATH_MAX = 4096,
+	WASMJIT_EMSCRIPTEN_MAX_PREOPENS = 8,
+	WASMJIT_EMSCRIPTEN_PREOPEN_PATH_MAX = 256,
+	WASMJIT_EMSCRIPTEN_PATH_CACHE_SIZE = 64,
+	WASMJIT_EMSCRIPTEN_PATH_CACHE_KEY_MAX = 120,
+	/* above every syscall number in emscripten_runtime_def.h */
+	WASMJIT_EMSCRIPTEN_MAX_SYSCALL = 400,
+	WASMJIT_EMSCRIPTEN_LATENCY_BUCKETS = 32,
 };
 
+struct EmscriptenPreopen {
+	int dirfd;
+	int readonly;
+	size_t guest_path_len;
+	char guest_path[WASMJIT_EMSCRIPTEN_PREOPEN_PATH_MAX];
+};
+
+/*
+  Maps a guest path string, as passed to a syscall, to the preopen
+  it resolves under and the host path relative to that preopen.
+  Entries are only valid while generation matches the one in
+  EmscriptenFS, which changes whenever the guest working directory
+  does.
+ */
+struct EmscriptenPathCacheEntry {
+	uint32_t generation;
+	uint32_t preopen;
+	char guest_path[WASMJIT_EMSCRIPTEN_PATH_CACHE_KEY_MAX];
+	char host_path[WASMJIT_EMSCRIPTEN_PATH_CACHE_KEY_MAX];
+};
+
+/*
+  With no preopens guest paths are host paths. Otherwise the guest
+  sees a virtual namespace made only of the preopened directories and
+  every path is resolved, lexically, to one of their fds.
+ */
+struct EmscriptenFS {
+	size_t n_preopens;
+	struct EmscriptenPreopen preopens[WASMJIT_EMSCRIPTEN_MAX_PREOPENS];
+	uint32_t generation;
+	char cwd[WASMJIT_EMSCRIPTEN_PATH_MAX];
+	char scratch[WASMJIT_EMSCRIPTEN_PATH_MAX];
+	char parent[WASMJIT_EMSCRIPTEN_PATH_MAX];
+	struct EmscriptenPathCacheEntry cache[WASMJIT_EMSCRIPTEN_PATH_CACHE_SIZE];
+};
+
+/*
+  Counters for one syscall number. bytes only counts the results of
+  syscalls that return a byte count. Latency bucket i counts calls
+  that took less than 2^(i + 1) nanoseconds but not less than 2^i,
+  the last bucket also takes everything slower.
+ */
+struct EmscriptenSyscallStats {
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t bytes;
+	uint64_t total_ns;
+	uint64_t latency[WASMJIT_EMSCRIPTEN_LATENCY_BUCKETS];
+};
+
+struct EmscriptenHostRing;
+struct EmscriptenThreads;
+
 struct EmscriptenContext {
 	struct FuncInst *errno_location_inst;
 	char **environ;
 	int buildEnvironmentCalled;
 	struct FuncInst *malloc_inst;
 	struct FuncInst *free_inst;
+	struct EmscriptenFS fs;
+	/* indexed by syscall number, NULL unless stats are enabled */
+	struct EmscriptenSyscallStats *syscall_stats;
+	/* io_uring behind _wasmjit_ring_enter(), set up on first use */
+	struct EmscriptenHostRing *host_ring;
+	/* guest pthreads, NULL unless wasmjit_emscripten_init_threads() */
+	struct EmscriptenThreads *threads;
 };
 
 #define CTYPE_VALTYPE_I32 uint32_t
+#define CTYPE_VALTYPE_F64 double
 #define CTYPE_VALTYPE_NULL void
 #define CTYPE(val) CTYPE_ ## val
 
@@ -51,6 +120,7 @@ struct EmscriptenContext {
 #define COMMA_1 ,
 #define COMMA_2 ,
 #define COMMA_3 ,
+#define COMMA_4 ,
 #define COMMA_IF_NOT_EMPTY(_n) CAT(COMMA_, _n)
 
 #define DEFINE_WASM_FUNCTION(_name, _fptr, _output, _n, ...)		\
@@ -74,6 +144,9 @@ struct EmscriptenContext {
 #define DEFINE_WASM_MEMORY(...)
 #define DEFINE_EXTERNAL_WASM_GLOBAL(...)
 #define DEFINE_EXTERNAL_WASM_TABLE(...)
+#define DEFINE_EMSCRIPTEN_SYSCALL(_n)					\
+	DEFINE_EMSCRIPTEN_FUNCTION(___syscall ## _n, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32) \
+	uint32_t wasmjit_emscripten_counted____syscall ## _n(uint32_t, uint32_t, struct FuncInst *);
 
 #include <wasmjit/emscripten_runtime_def.h>
 
@@ -81,6 +154,7 @@ struct EmscriptenContext {
 #undef COMMA_1
 #undef COMMA_2
 #undef COMMA_3
+#undef COMMA_4
 #undef COMMA_IF_NOT_EMPTY
 #undef START_MODULE
 #undef END_MODULE
@@ -103,10 +177,12 @@ struct EmscriptenContext {
 #undef __PARAM
 #undef CTYPE
 #undef CTYPE_VALTYPE_I32
+#undef CTYPE_VALTYPE_F64
 #undef CTYPE_VALTYPE_NULL
 
 struct EmscriptenContext *wasmjit_emscripten_get_context(struct ModuleInst *);
 void wasmjit_emscripten_cleanup(struct ModuleInst *);
+void wasmjit_emscripten_free_context(void *ctx);
 
 void wasmjit_emscripten_internal_abort(const char *msg) __attribute__((noreturn));
 struct MemInst *wasmjit_emscripten_get_mem_inst(struct FuncInst *funcinst);
@@ -118,6 +194,46 @@ int wasmjit_emscripten_init(struct EmscriptenContext *ctx,
 			    struct FuncInst *free_inst,
 			    char *envp[]);
 
+#ifndef __KERNEL__
+/*
+  Lets the guest start threads with _pthread_create, only for a
+  shared env.memory. instantiate returns a new instance of the guest
+  module that imports env from the given module instead, which has
+  its own table; it is called from whichever thread creates one.
+ */
+int wasmjit_emscripten_init_threads(struct EmscriptenContext *ctx,
+				    struct ModuleInst *(*instantiate)(void *arg,
+								      struct ModuleInst *env),
+				    void *arg);
+#endif
+
+int wasmjit_emscripten_preopen(struct EmscriptenContext *ctx,
+			       const char *guest_path,
+			       const char *host_path,
+			       int readonly);
+
+/*
+  openat() for a relative path without "." or ".." components that
+  cannot leave dirfd through a symlink. The second variant opens the
+  directory containing path, for syscalls that act on the last
+  component itself: parent must have room for path, it may be path.
+  Both return a host fd or a negative host errno.
+*/
+long wasmjit_emscripten_openat_beneath(int dirfd, const char *path,
+				       int flags, mode_t mode);
+long wasmjit_emscripten_open_parent_beneath(int dirfd, const char *path,
+					    char *parent, const char **name);
+
+/*
+  Syscall statistics are only gathered when the runtime module routes
+  its ___syscall imports through the wasmjit_emscripten_counted_*
+  wrappers, the context also has to have them enabled.
+ */
+int wasmjit_emscripten_enable_syscall_stats(struct EmscriptenContext *ctx);
+const struct EmscriptenSyscallStats *
+wasmjit_emscripten_get_syscall_stats(struct EmscriptenContext *ctx,
+				     uint32_t which);
+
 #define WASMJIT_TRAP_OFFSET 0x100
 #define WASMJIT_IS_TRAP_ERROR(ret) ((ret) >= WASMJIT_TRAP_OFFSET)
 #define WASMJIT_DECODE_TRAP_ERROR(ret) ((ret) - WASMJIT_TRAP_OFFSET)
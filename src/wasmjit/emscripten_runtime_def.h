@@ -58,6 +58,8 @@ DEFINE_EXTERNAL_WASM_TABLE(table)
 END_TABLE_DEFS()
 
 START_MEMORY_DEFS()
+/* shared when the guest imports a shared memory, see
+   WASMJIT_HIGH_INSTANTIATE_EMSCRIPTEN_RUNTIME_FLAGS_SHARED_MEMORY */
 DEFINE_WASM_MEMORY(memory, 256, 256)
 END_MEMORY_DEFS()
 
@@ -74,6 +76,12 @@ END_GLOBAL_DEFS()
 #define DEFINE_EMSCRIPTEN_FUNCTION(_name, _output, _n, ...)		\
 	DEFINE_WASM_FUNCTION(_name, &(wasmjit_emscripten_ ## _name), _output, _n, ##__VA_ARGS__)
 
+/* includers can override this, e.g. to route syscalls elsewhere */
+#ifndef DEFINE_EMSCRIPTEN_SYSCALL
+#define DEFINE_EMSCRIPTEN_SYSCALL(_n)					\
+	DEFINE_EMSCRIPTEN_FUNCTION(___syscall ## _n, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
+#endif
+
 START_FUNCTION_DEFS()
 DEFINE_EMSCRIPTEN_FUNCTION(enlargeMemory, VALTYPE_I32, 0)
 DEFINE_EMSCRIPTEN_FUNCTION(getTotalMemory, VALTYPE_I32, 0)
@@ -83,22 +91,45 @@ DEFINE_EMSCRIPTEN_FUNCTION(nullFunc_ii, VALTYPE_NULL, 1, VALTYPE_I32)
 DEFINE_EMSCRIPTEN_FUNCTION(nullFunc_iiii, VALTYPE_NULL, 1, VALTYPE_I32)
 DEFINE_EMSCRIPTEN_FUNCTION(___lock, VALTYPE_NULL, 1, VALTYPE_I32)
 DEFINE_EMSCRIPTEN_FUNCTION(___setErrNo, VALTYPE_NULL, 1, VALTYPE_I32)
-DEFINE_EMSCRIPTEN_FUNCTION(___syscall3, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
-DEFINE_EMSCRIPTEN_FUNCTION(___syscall42, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
-DEFINE_EMSCRIPTEN_FUNCTION(___syscall140, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
-DEFINE_EMSCRIPTEN_FUNCTION(___syscall146, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
-DEFINE_EMSCRIPTEN_FUNCTION(___syscall4, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
-DEFINE_EMSCRIPTEN_FUNCTION(___syscall54, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
-DEFINE_EMSCRIPTEN_FUNCTION(___syscall6, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
+DEFINE_EMSCRIPTEN_SYSCALL(3)
+DEFINE_EMSCRIPTEN_SYSCALL(42)
+DEFINE_EMSCRIPTEN_SYSCALL(140)
+DEFINE_EMSCRIPTEN_SYSCALL(146)
+DEFINE_EMSCRIPTEN_SYSCALL(4)
+DEFINE_EMSCRIPTEN_SYSCALL(54)
+DEFINE_EMSCRIPTEN_SYSCALL(5)
+DEFINE_EMSCRIPTEN_SYSCALL(6)
 DEFINE_EMSCRIPTEN_FUNCTION(___unlock, VALTYPE_NULL, 1, VALTYPE_I32)
 DEFINE_EMSCRIPTEN_FUNCTION(_emscripten_memcpy_big, VALTYPE_I32, 3, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32)
+DEFINE_EMSCRIPTEN_FUNCTION(_wasmjit_ring_enter, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
 DEFINE_EMSCRIPTEN_FUNCTION(abort, VALTYPE_NULL, 1, VALTYPE_I32)
 DEFINE_EMSCRIPTEN_FUNCTION(___buildEnvironment, VALTYPE_NULL, 1, VALTYPE_I32)
-DEFINE_EMSCRIPTEN_FUNCTION(___syscall10, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
-DEFINE_EMSCRIPTEN_FUNCTION(___syscall102, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
-DEFINE_EMSCRIPTEN_FUNCTION(___syscall221, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
-DEFINE_EMSCRIPTEN_FUNCTION(___syscall12, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
-DEFINE_EMSCRIPTEN_FUNCTION(___syscall122, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
+DEFINE_EMSCRIPTEN_SYSCALL(10)
+DEFINE_EMSCRIPTEN_SYSCALL(102)
+DEFINE_EMSCRIPTEN_SYSCALL(221)
+DEFINE_EMSCRIPTEN_SYSCALL(12)
+DEFINE_EMSCRIPTEN_SYSCALL(122)
+DEFINE_EMSCRIPTEN_SYSCALL(142)
+DEFINE_EMSCRIPTEN_SYSCALL(168)
+DEFINE_EMSCRIPTEN_SYSCALL(254)
+DEFINE_EMSCRIPTEN_SYSCALL(255)
+DEFINE_EMSCRIPTEN_SYSCALL(256)
+DEFINE_EMSCRIPTEN_SYSCALL(329)
+DEFINE_EMSCRIPTEN_SYSCALL(187)
+DEFINE_EMSCRIPTEN_SYSCALL(239)
+DEFINE_EMSCRIPTEN_SYSCALL(313)
+DEFINE_EMSCRIPTEN_SYSCALL(377)
+#ifndef __KERNEL__
+DEFINE_EMSCRIPTEN_FUNCTION(_pthread_create, VALTYPE_I32, 4, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32)
+DEFINE_EMSCRIPTEN_FUNCTION(_pthread_join, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
+DEFINE_EMSCRIPTEN_FUNCTION(_pthread_detach, VALTYPE_I32, 1, VALTYPE_I32)
+DEFINE_EMSCRIPTEN_FUNCTION(_pthread_exit, VALTYPE_NULL, 1, VALTYPE_I32)
+DEFINE_EMSCRIPTEN_FUNCTION(_pthread_self, VALTYPE_I32, 0)
+DEFINE_EMSCRIPTEN_FUNCTION(_emscripten_futex_wait, VALTYPE_I32, 3, VALTYPE_I32, VALTYPE_I32, VALTYPE_F64)
+DEFINE_EMSCRIPTEN_FUNCTION(_emscripten_futex_wake, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
+DEFINE_EMSCRIPTEN_FUNCTION(_emscripten_num_logical_cores, VALTYPE_I32, 0)
+DEFINE_EMSCRIPTEN_FUNCTION(_emscripten_has_threading_support, VALTYPE_I32, 0)
+#endif
 END_FUNCTION_DEFS()
 
 DEFINE_WASM_START_FUNCTION(wasmjit_emscripten_start_func)
@@ -106,6 +137,7 @@ DEFINE_WASM_START_FUNCTION(wasmjit_emscripten_start_func)
 END_MODULE()
 
 #undef DEFINE_EMSCRIPTEN_FUNCTION
+#undef DEFINE_EMSCRIPTEN_SYSCALL
 
 #undef CURRENT_MODULE
 
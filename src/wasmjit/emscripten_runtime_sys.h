@@ -32,9 +32,19 @@
 #include <linux/kallsyms.h>
 #include <linux/limits.h>
 #include <linux/socket.h>
+#include <linux/poll.h>
+#include <linux/time.h>
+#include <linux/eventpoll.h>
+#include <linux/fcntl.h>
+#include <linux/stat.h>
+#include <linux/random.h>
+#include <linux/timekeeping.h>
+#include <linux/dirent.h>
+#include <linux/fs.h>
 
 typedef int socklen_t;
 typedef struct user_msghdr user_msghdr_t;
+typedef struct linux_dirent64 sys_dirent64_t;
 
 #define SYS_CMSG_NXTHDR(msg, cmsg) __CMSG_NXTHDR((msg)->msg_control, (msg)->msg_controllen, (cmsg))
 
@@ -48,12 +58,28 @@ typedef struct user_msghdr user_msghdr_t;
 #include <netinet/in.h>
 #include <sys/un.h>
 #include <net/if.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/random.h>
+#include <dirent.h>
+#endif
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
 #endif
 
 typedef struct msghdr user_msghdr_t;
+#ifdef __linux__
+/* what getdents64() fills in, struct dirent64 has the same layout */
+typedef struct dirent64 sys_dirent64_t;
+#endif
 
 #define SYS_CMSG_NXTHDR(msg, cmsg) CMSG_NXTHDR((msg), (cmsg))
 
@@ -78,14 +104,17 @@ typedef struct msghdr user_msghdr_t;
 #define KWSC1(name, ...) KWSCx(1, name, __VA_ARGS__)
 #define KWSC2(name, ...) KWSCx(2, name, __VA_ARGS__)
 #define KWSC3(name, ...) KWSCx(3, name, __VA_ARGS__)
+#define KWSC4(name, ...) KWSCx(4, name, __VA_ARGS__)
 #define KWSC5(name, ...) KWSCx(5, name, __VA_ARGS__)
 #define KWSC6(name, ...) KWSCx(6, name, __VA_ARGS__)
 
 #include <wasmjit/emscripten_runtime_sys_def.h>
+#include <wasmjit/emscripten_runtime_sys_opt_def.h>
 
 #undef KWSC1
 #undef KWSC2
 #undef KWSC3
+#undef KWSC4
 #undef KWSC5
 #undef KWSC6
 #undef KWSCx
@@ -39,12 +39,26 @@
 #define KWSC1(name, ...) KWSCx(1, name, __VA_ARGS__)
 #define KWSC2(name, ...) KWSCx(2, name, __VA_ARGS__)
 #define KWSC3(name, ...) KWSCx(3, name, __VA_ARGS__)
+#define KWSC4(name, ...) KWSCx(4, name, __VA_ARGS__)
 #define KWSC5(name, ...) KWSCx(5, name, __VA_ARGS__)
 #define KWSC6(name, ...) KWSCx(6, name, __VA_ARGS__)
 
 #define KWSCx(x, name, ...) long (*sys_ ## name)(__KMAP(x, __KT, __VA_ARGS__));
 
 #include <wasmjit/emscripten_runtime_sys_def.h>
+#include <wasmjit/emscripten_runtime_sys_opt_def.h>
+
+#undef KWSCx
+
+/* stand-ins for optional syscalls the running kernel doesn't have */
+
+#define KWSCx(x, name, ...)						\
+	static long sys_ ## name ## _enosys(__KMAP(x, __KDECL, __VA_ARGS__)) \
+	{								\
+		return -ENOSYS;						\
+	}
+
+#include <wasmjit/emscripten_runtime_sys_opt_def.h>
 
 #undef KWSCx
 
@@ -54,6 +68,7 @@
 
 static struct {
 #include <wasmjit/emscripten_runtime_sys_def.h>
+#include <wasmjit/emscripten_runtime_sys_opt_def.h>
 } sctable_regs;
 
 #undef KWSCx
@@ -66,6 +81,7 @@ static struct {
 	}
 
 #include <wasmjit/emscripten_runtime_sys_def.h>
+#include <wasmjit/emscripten_runtime_sys_opt_def.h>
 
 #undef KWSCx
 
@@ -88,31 +104,42 @@ struct MemInst *wasmjit_emscripten_get_mem_inst(struct FuncInst *funcinst)
 int wasmjit_emscripten_linux_kernel_init(void) {
 #ifdef SCPREFIX
 
-#define KWSCx(x, n, ...)						\
+#define KWSC_LOOKUP(n, missing)						\
 	do {								\
 		sys_ ## n = (void *)kallsyms_lookup_name("sys_" #n);	\
 		if (!sys_ ## n) {					\
 			sctable_regs. n = (void *)kallsyms_lookup_name(SCPREFIX #n); \
-			if (!sctable_regs. n)				\
-				return 0;				\
-			sys_ ## n = &sys_ ## n ## _regs;		\
+			if (sctable_regs. n)				\
+				sys_ ## n = &sys_ ## n ## _regs;	\
+			else						\
+				missing;				\
 		}							\
 	}								\
 	while (0);
 
 #else
 
-#define KWSCx(x, n, ...)					\
+#define KWSC_LOOKUP(n, missing)					\
 	do {							\
-		sctable. n = (void *)kallsyms_lookup_name("sys_" #n);	\
-		if (!sctable. n)				\
-			return 0;				\
+		sys_ ## n = (void *)kallsyms_lookup_name("sys_" #n);	\
+		if (!sys_ ## n)					\
+			missing;				\
 	}							\
 	while (0);
 
 #endif
 
+#define KWSCx(x, n, ...) KWSC_LOOKUP(n, return 0)
+
 #include <wasmjit/emscripten_runtime_sys_def.h>
 
+#undef KWSCx
+#define KWSCx(x, n, ...) KWSC_LOOKUP(n, sys_ ## n = &sys_ ## n ## _enosys)
+
+#include <wasmjit/emscripten_runtime_sys_opt_def.h>
+
+#undef KWSCx
+#undef KWSC_LOOKUP
+
 	return 1;
 }
@@ -0,0 +1,57 @@
+/*
+  Copyright (c) 2018 Rian Hunter
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+/*
+  Newer syscalls, a kernel may lack any of these. The kernel module
+  still loads and their sys_ wrappers fail with -ENOSYS instead.
+*/
+
+KWSC3(readv, unsigned long, const struct iovec *, unsigned long)
+KWSC3(poll, struct pollfd *, unsigned int, int)
+KWSC5(select, int, fd_set *, fd_set *, fd_set *, struct timeval *)
+KWSC3(fcntl, unsigned int, unsigned int, unsigned long)
+KWSC4(openat, int, const char *, int, mode_t)
+KWSC3(unlinkat, int, const char *, int)
+KWSC3(mkdirat, int, const char *, mode_t)
+KWSC4(renameat, int, const char *, int, const char *)
+KWSC1(fsync, unsigned int)
+KWSC2(clock_gettime, clockid_t, struct timespec *)
+KWSC2(clock_getres, clockid_t, struct timespec *)
+#ifdef __KERNEL__
+KWSC2(newfstat, unsigned int, struct stat *)
+KWSC4(newfstatat, int, const char *, struct stat *, int)
+#else
+KWSC2(fstat, int, struct stat *)
+KWSC4(fstatat, int, const char *, struct stat *, int)
+#endif
+#if defined(__KERNEL__) || defined(__linux__)
+KWSC1(epoll_create1, int)
+KWSC4(epoll_ctl, int, int, int, struct epoll_event *)
+KWSC4(epoll_wait, int, struct epoll_event *, int, int)
+KWSC4(sendfile64, int, int, loff_t *, size_t)
+KWSC6(splice, int, loff_t *, int, loff_t *, size_t, unsigned int)
+KWSC6(copy_file_range, int, loff_t *, int, loff_t *, size_t, unsigned int)
+KWSC4(pread64, unsigned int, char *, size_t, loff_t)
+KWSC4(pwrite64, unsigned int, const char *, size_t, loff_t)
+KWSC3(getrandom, char *, size_t, unsigned int)
+KWSC3(getdents64, unsigned int, sys_dirent64_t *, unsigned int)
+#endif
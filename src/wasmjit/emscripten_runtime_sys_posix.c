@@ -22,6 +22,11 @@
   SOFTWARE.
  */
 
+/* For splice and copy_file_range */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <wasmjit/emscripten_runtime_sys.h>
 
 #include <wasmjit/ast.h>
@@ -50,10 +55,12 @@
 #define KWSC1(name, ...) KWSCx(1, name, __VA_ARGS__)
 #define KWSC2(name, ...) KWSCx(2, name, __VA_ARGS__)
 #define KWSC3(name, ...) KWSCx(3, name, __VA_ARGS__)
+#define KWSC4(name, ...) KWSCx(4, name, __VA_ARGS__)
 #define KWSC5(name, ...) KWSCx(5, name, __VA_ARGS__)
 #define KWSC6(name, ...) KWSCx(6, name, __VA_ARGS__)
 
 #include <wasmjit/emscripten_runtime_sys_def.h>
+#include <wasmjit/emscripten_runtime_sys_opt_def.h>
 
 struct MemInst *wasmjit_emscripten_get_mem_inst(struct FuncInst *funcinst) {
 	return funcinst->module_inst->mems.elts[0];
@@ -28,8 +28,11 @@
 #include <wasmjit/instantiate.h>
 #include <wasmjit/dynamic_emscripten_runtime.h>
 #include <wasmjit/emscripten_runtime.h>
+#include <wasmjit/dynamic_wasi_runtime.h>
+#include <wasmjit/wasi_runtime.h>
 #include <wasmjit/sys.h>
 #include <wasmjit/util.h>
+#include <wasmjit/validate.h>
 
 #ifdef WASMJIT_CAN_USE_DEVICE
 #include <wasmjit/kwasmjit.h>
@@ -41,6 +44,11 @@
 #include <unistd.h>
 #endif
 
+#ifndef __KERNEL__
+#include <errno.h>
+#include <unistd.h>
+#endif
+
 static int add_named_module(struct WasmJITHigh *self,
 			    const char *module_name,
 			    struct ModuleInst *module)
@@ -101,17 +109,27 @@ int wasmjit_high_init(struct WasmJITHigh *self)
 	self->modules = NULL;
 	self->emscripten_asm_module = NULL;
 	self->emscripten_env_module = NULL;
+	self->wasi_module = NULL;
+	self->thread_module = NULL;
+	self->thread_module_inst = NULL;
+	self->thread_module_flags = 0;
 	memset(self->error_buffer, 0, sizeof(self->error_buffer));
 	return 0;
 }
 
-static int wasmjit_high_instantiate_buf(struct WasmJITHigh *self,
-					const char *buf, size_t size,
-					const char *module_name, uint32_t flags)
+static unsigned instantiate_flags(uint32_t flags)
+{
+	return (flags & WASMJIT_HIGH_INSTANTIATE_FLAGS_LIBC_BUILTINS) ?
+		WASMJIT_INSTANTIATE_FLAGS_LIBC_BUILTINS : 0;
+}
+
+static int wasmjit_high_instantiate_parsed(struct WasmJITHigh *self,
+					   const struct Module *module,
+					   const struct CompiledCode *compiled,
+					   const char *module_name,
+					   uint32_t flags)
 {
 	int ret;
-	struct ParseState pstate;
-	struct Module module;
 	struct ModuleInst *module_inst = NULL;
 
 #ifdef WASMJIT_CAN_USE_DEVICE
@@ -119,22 +137,16 @@ static int wasmjit_high_instantiate_buf(struct WasmJITHigh *self,
 	assert(self->fd < 0);
 #endif
 
-	(void)flags;
-
-	wasmjit_init_module(&module);
-
-	if (!init_pstate(&pstate, buf, size)) {
-		goto error;
-	}
-
-	if (!read_module(&pstate, &module, NULL, 0)) {
+	/* function bodies are validated as they are compiled */
+	if (!wasmjit_validate_module(module, self->error_buffer,
+				     sizeof(self->error_buffer)))
 		goto error;
-	}
 
-	/* TODO: validate module */
-
-	module_inst = wasmjit_instantiate(&module, self->n_modules, self->modules,
-					  self->error_buffer, sizeof(self->error_buffer));
+	module_inst = wasmjit_instantiate_compiled(module, compiled,
+						   instantiate_flags(flags),
+						   self->n_modules, self->modules,
+						   self->error_buffer,
+						   sizeof(self->error_buffer));
 	if (!module_inst) {
 		goto error;
 	}
@@ -151,8 +163,6 @@ static int wasmjit_high_instantiate_buf(struct WasmJITHigh *self,
 		ret = 0;
 	}
 
-	wasmjit_free_module(&module);
-
 	if (module_inst) {
 		wasmjit_free_module_inst(module_inst);
 	}
@@ -160,6 +170,104 @@ static int wasmjit_high_instantiate_buf(struct WasmJITHigh *self,
 	return ret;
 }
 
+static int wasmjit_high_instantiate_buf(struct WasmJITHigh *self,
+					const char *buf, size_t size,
+					const char *module_name, uint32_t flags)
+{
+	int ret;
+	struct ParseState pstate;
+	struct Module module;
+
+	wasmjit_init_module(&module);
+
+	if (!init_pstate(&pstate, buf, size)) {
+		goto error;
+	}
+
+	if (!read_module(&pstate, &module,
+			 WASMJIT_PARSE_FLAGS_RAW_CODE |
+			 WASMJIT_PARSE_FLAGS_BORROW_INPUT,
+			 NULL, 0)) {
+		goto error;
+	}
+
+	ret = wasmjit_high_instantiate_parsed(self, &module, NULL,
+					      module_name, flags);
+
+	if (0) {
+ error:
+		ret = -1;
+	}
+
+	wasmjit_free_module(&module);
+
+	return ret;
+}
+
+int wasmjit_high_instantiate_module(struct WasmJITHigh *self,
+				    const char *filename,
+				    const struct Module *module,
+				    const char *module_name,
+				    uint32_t flags)
+{
+#ifdef WASMJIT_CAN_USE_DEVICE
+	if (self->fd >= 0)
+		return wasmjit_high_instantiate(self, filename, module_name, flags);
+#else
+	(void)filename;
+#endif
+
+	self->error_buffer[0] = '\0';
+
+	if (wasmjit_high_instantiate_parsed(self, module, NULL,
+					    module_name, flags))
+		return -1;
+
+	self->thread_module = module;
+	self->thread_module_inst = self->modules[self->n_modules - 1].module;
+	self->thread_module_flags = flags;
+
+	return 0;
+}
+
+#ifndef __KERNEL__
+/*
+  The instance for a new guest thread, see
+  wasmjit_emscripten_init_threads(). Its imports are those of the
+  first instance except for env.
+*/
+static struct ModuleInst *instantiate_thread(void *arg,
+					     struct ModuleInst *env)
+{
+	struct WasmJITHigh *self = arg;
+	struct NamedModule *imports;
+	struct ModuleInst *module_inst;
+	char why[256];
+	size_t i;
+
+	imports = wasmjit_alloc_vector(self->n_modules, sizeof(imports[0]),
+				       NULL);
+	if (!imports)
+		return NULL;
+
+	for (i = 0; i < self->n_modules; ++i) {
+		imports[i] = self->modules[i];
+		if (!strcmp(self->modules[i].name, "env"))
+			imports[i].module = env;
+	}
+
+	module_inst = wasmjit_instantiate_compiled(self->thread_module, NULL,
+						   instantiate_flags(self->thread_module_flags) |
+						   WASMJIT_INSTANTIATE_FLAGS_THREAD,
+						   self->n_modules, imports,
+						   why, sizeof(why));
+
+	free(imports);
+
+	return module_inst;
+}
+#endif
+
 int wasmjit_high_instantiate(struct WasmJITHigh *self, const char *filename, const char *module_name, uint32_t flags)
 {
 	int ret;
@@ -180,8 +288,8 @@ int wasmjit_high_instantiate(struct WasmJITHigh *self, const char *filename, con
 
 	self->error_buffer[0] = '\0';
 
-	/* TODO: do incremental reading */
-
+	/* files are mapped, pipes and sockets go through
+	   wasmjit_high_instantiate_fd() */
 	buf = wasmjit_load_file(filename, &size);
 	if (!buf)
 		goto error;
@@ -199,6 +307,173 @@ int wasmjit_high_instantiate(struct WasmJITHigh *self, const char *filename, con
 	return ret;
 }
 
+struct WasmJITHighStream {
+	struct WasmJITHigh *self;
+	char *module_name;
+	uint32_t flags;
+	struct Module module;
+	struct ModuleStream parser;
+	struct ModuleTypes module_types;
+	struct CompiledCode *compiled;
+};
+
+static int stream_compile_code(void *ctx, uint32_t codeidx,
+			       char *why, size_t why_size)
+{
+	struct WasmJITHighStream *stream = ctx;
+	const struct Module *module = &stream->module;
+	char reason[128];
+
+	if (!stream->compiled) {
+		/* every section a body refers to precedes the code section */
+		if (!wasmjit_module_types(module, &stream->module_types)) {
+			if (why)
+				snprintf(why, why_size,
+					 "Bad function declarations");
+			return 0;
+		}
+
+		stream->compiled = calloc(module->code_section.n_codes,
+					  sizeof(stream->compiled[0]));
+		if (!stream->compiled)
+			return 0;
+	}
+
+	reason[0] = '\0';
+	if (!wasmjit_compile_module_function(module, &stream->module_types,
+					     codeidx,
+					     instantiate_flags(stream->flags),
+					     &stream->compiled[codeidx],
+					     reason, sizeof(reason))) {
+		if (why)
+			snprintf(why, why_size, "function body %" PRIu32 ": %s",
+				 codeidx, reason[0] ? reason : "failed to compile");
+		return 0;
+	}
+
+	return 1;
+}
+
+struct WasmJITHighStream *wasmjit_high_stream_begin(struct WasmJITHigh *self,
+						    const char *module_name,
+						    uint32_t flags)
+{
+	struct WasmJITHighStream *stream;
+
+	self->error_buffer[0] = '\0';
+
+#ifdef WASMJIT_CAN_USE_DEVICE
+	if (self->fd >= 0) {
+		snprintf(self->error_buffer, sizeof(self->error_buffer),
+			 "Streaming is not supported by the kernel backend");
+		return NULL;
+	}
+#endif
+
+	stream = calloc(1, sizeof(*stream));
+	if (!stream)
+		return NULL;
+
+	stream->module_name = strdup(module_name);
+	if (!stream->module_name) {
+		free(stream);
+		return NULL;
+	}
+
+	stream->self = self;
+	stream->flags = flags;
+	wasmjit_init_module(&stream->module);
+	init_module_stream(&stream->parser, &stream->module,
+			   WASMJIT_PARSE_FLAGS_RAW_CODE,
+			   stream_compile_code, stream);
+
+	return stream;
+}
+
+int wasmjit_high_stream_feed(struct WasmJITHighStream *stream,
+			     const void *buf, size_t size)
+{
+	struct WasmJITHigh *self = stream->self;
+
+	if (!feed_module_stream(&stream->parser, buf, size,
+				self->error_buffer,
+				sizeof(self->error_buffer)))
+		return -1;
+
+	return 0;
+}
+
+void wasmjit_high_stream_abort(struct WasmJITHighStream *stream)
+{
+	if (stream->compiled)
+		wasmjit_free_compiled_code(stream->compiled,
+					   stream->module.code_section.n_codes);
+	wasmjit_free_module_types(&stream->module_types);
+	free_module_stream(&stream->parser);
+	wasmjit_free_module(&stream->module);
+	free(stream->module_name);
+	free(stream);
+}
+
+int wasmjit_high_stream_finish(struct WasmJITHighStream *stream)
+{
+	struct WasmJITHigh *self = stream->self;
+	int ret;
+
+	if (!finish_module_stream(&stream->parser, self->error_buffer,
+				  sizeof(self->error_buffer))) {
+		ret = -1;
+	} else {
+		ret = wasmjit_high_instantiate_parsed(self, &stream->module,
+						      stream->compiled,
+						      stream->module_name,
+						      stream->flags);
+	}
+
+	wasmjit_high_stream_abort(stream);
+
+	return ret;
+}
+
+#ifndef __KERNEL__
+int wasmjit_high_instantiate_fd(struct WasmJITHigh *self,
+				int fd,
+				const char *module_name,
+				uint32_t flags)
+{
+	struct WasmJITHighStream *stream;
+	char buf[64 * 1024];
+
+	stream = wasmjit_high_stream_begin(self, module_name, flags);
+	if (!stream)
+		return -1;
+
+	while (1) {
+		ssize_t amt = read(fd, buf, sizeof(buf));
+
+		if (amt < 0) {
+			if (errno == EINTR)
+				continue;
+			snprintf(self->error_buffer, sizeof(self->error_buffer),
+				 "Error reading module: %s", strerror(errno));
+			goto error;
+		}
+
+		if (!amt)
+			break;
+
+		if (wasmjit_high_stream_feed(stream, buf, amt))
+			goto error;
+	}
+
+	return wasmjit_high_stream_finish(stream);
+
+ error:
+	wasmjit_high_stream_abort(stream);
+	return -1;
+}
+#endif
+
 int wasmjit_high_instantiate_emscripten_runtime(struct WasmJITHigh *self,
 						uint32_t static_bump,
 						size_t tablemin,
@@ -234,6 +509,8 @@ int wasmjit_high_instantiate_emscripten_runtime(struct WasmJITHigh *self,
 							 has_table,
 							 tablemin,
 							 tablemax,
+							 !!(flags & WASMJIT_HIGH_INSTANTIATE_EMSCRIPTEN_RUNTIME_FLAGS_SYSCALL_STATS),
+							 !!(flags & WASMJIT_HIGH_INSTANTIATE_EMSCRIPTEN_RUNTIME_FLAGS_SHARED_MEMORY),
 							 &n_modules);
 	if (!modules) {
 		goto error;
@@ -275,6 +552,179 @@ int wasmjit_high_instantiate_emscripten_runtime(struct WasmJITHigh *self,
 	return ret;
 }
 
+int wasmjit_high_instantiate_wasi_runtime(struct WasmJITHigh *self,
+					  int argc, char **argv, char **envp,
+					  uint32_t flags)
+{
+	int ret;
+	size_t n_modules, i;
+	struct NamedModule *modules = NULL;
+
+	(void)flags;
+
+	self->error_buffer[0] = '\0';
+
+#ifdef WASMJIT_CAN_USE_DEVICE
+	if (self->fd >= 0) {
+		snprintf(self->error_buffer, sizeof(self->error_buffer),
+			 "WASI is not supported by the kernel backend");
+		return -1;
+	}
+#endif
+
+	modules = wasmjit_instantiate_wasi_runtime(&n_modules);
+	if (!modules)
+		goto error;
+
+	for (i = 0; i < n_modules; ++i) {
+		if (!add_named_module(self, modules[i].name, modules[i].module))
+			goto error;
+
+		if (!strcmp(modules[i].name, "wasi_snapshot_preview1")) {
+			self->wasi_module = modules[i].module;
+			if (wasmjit_wasi_init(wasmjit_wasi_get_context(self->wasi_module),
+					      argc, argv, envp))
+				goto error;
+		}
+
+		modules[i].module = NULL;
+	}
+
+	ret = 0;
+
+	if (0) {
+	error:
+		ret = -1;
+	}
+
+	if (modules) {
+		for (i = 0; i < n_modules; ++i) {
+			free(modules[i].name);
+			if (modules[i].module)
+				wasmjit_free_module_inst(modules[i].module);
+		}
+		free(modules);
+	}
+
+	return ret;
+}
+
+int wasmjit_high_wasi_preopen(struct WasmJITHigh *self,
+			      const char *guest_path,
+			      const char *host_path)
+{
+	self->error_buffer[0] = '\0';
+
+	if (!self->wasi_module)
+		return -1;
+
+	if (wasmjit_wasi_preopen(wasmjit_wasi_get_context(self->wasi_module),
+				 guest_path, host_path)) {
+		snprintf(self->error_buffer, sizeof(self->error_buffer),
+			 "couldn't preopen %s at %s", host_path, guest_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+int wasmjit_high_wasi_start(struct WasmJITHigh *self,
+			    const char *module_name)
+{
+	size_t i;
+	struct ModuleInst *module_inst;
+	struct FuncInst *start_inst;
+	struct MemInst *meminst;
+
+	self->error_buffer[0] = '\0';
+
+	if (!self->wasi_module)
+		return -1;
+
+	module_inst = NULL;
+	for (i = 0; i < self->n_modules; ++i) {
+		if (!strcmp(self->modules[i].name, module_name)) {
+			module_inst = self->modules[i].module;
+		}
+	}
+
+	if (!module_inst)
+		return -1;
+
+	start_inst = wasmjit_get_export(module_inst, "_start",
+					IMPORT_DESC_TYPE_FUNC).func;
+	if (!start_inst)
+		return -1;
+
+	meminst = wasmjit_get_export(module_inst, "memory",
+				     IMPORT_DESC_TYPE_MEM).mem;
+	if (!meminst)
+		return -1;
+
+	return wasmjit_wasi_start(wasmjit_wasi_get_context(self->wasi_module),
+				  meminst, start_inst);
+}
+
+int wasmjit_high_emscripten_preopen(struct WasmJITHigh *self,
+				    const char *guest_path,
+				    const char *host_path,
+				    int readonly)
+{
+	self->error_buffer[0] = '\0';
+
+#ifdef WASMJIT_CAN_USE_DEVICE
+	if (self->fd >= 0) {
+		snprintf(self->error_buffer, sizeof(self->error_buffer),
+			 "Preopens are not supported by the kernel backend");
+		return -1;
+	}
+#endif
+
+	if (!self->emscripten_env_module)
+		return -1;
+
+	if (wasmjit_emscripten_preopen(wasmjit_emscripten_get_context(self->emscripten_env_module),
+				       guest_path, host_path, readonly)) {
+		snprintf(self->error_buffer, sizeof(self->error_buffer),
+			 "couldn't preopen %s at %s", host_path, guest_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+int wasmjit_high_emscripten_syscall_stats(struct WasmJITHigh *self,
+					  uint32_t which,
+					  struct EmscriptenSyscallStats *stats)
+{
+	const struct EmscriptenSyscallStats *counters;
+
+	self->error_buffer[0] = '\0';
+
+#ifdef WASMJIT_CAN_USE_DEVICE
+	if (self->fd >= 0) {
+		snprintf(self->error_buffer, sizeof(self->error_buffer),
+			 "Syscall stats are not supported by the kernel backend");
+		return -1;
+	}
+#endif
+
+	if (!self->emscripten_env_module)
+		return -1;
+
+	counters = wasmjit_emscripten_get_syscall_stats(wasmjit_emscripten_get_context(self->emscripten_env_module),
+							which);
+	if (!counters) {
+		snprintf(self->error_buffer, sizeof(self->error_buffer),
+			 "No syscall stats for %" PRIu32, which);
+		return -1;
+	}
+
+	*stats = *counters;
+
+	return 0;
+}
+
 int wasmjit_high_emscripten_invoke_main(struct WasmJITHigh *self,
 					const char *module_name,
 					int argc, char **argv, char **envp,
@@ -371,6 +821,15 @@ int wasmjit_high_emscripten_invoke_main(struct WasmJITHigh *self,
 						    envp))
 				return -1;
 
+#ifndef __KERNEL__
+			if (meminst->shared &&
+			    module_inst == self->thread_module_inst &&
+			    wasmjit_emscripten_init_threads(wasmjit_emscripten_get_context(env_module_inst),
+							    instantiate_thread,
+							    self))
+				return -1;
+#endif
+
 			self->emscripten_asm_module = module_inst;
 		}
 
@@ -411,6 +870,9 @@ void wasmjit_high_close(struct WasmJITHigh *self)
 	if (self->emscripten_env_module)
 		wasmjit_emscripten_cleanup(self->emscripten_env_module);
 
+	if (self->wasi_module)
+		wasmjit_wasi_cleanup(self->wasi_module);
+
 	self->error_buffer[0] = '\0';
 
 	for (i = 0; i < self->n_modules; ++i) {
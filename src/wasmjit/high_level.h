@@ -25,6 +25,8 @@
 #ifndef __WASMJIT__HIGH_LEVEL_H
 #define __WASMJIT__HIGH_LEVEL_H
 
+#include <wasmjit/ast.h>
+
 #include <wasmjit/sys.h>
 
 /* this interface mimics the kernel interface and thus lacks power
@@ -43,24 +45,108 @@ struct WasmJITHigh {
 	char error_buffer[256];
 	struct ModuleInst *emscripten_asm_module;
 	struct ModuleInst *emscripten_env_module;
+	struct ModuleInst *wasi_module;
+	/* the last module given to wasmjit_high_instantiate_module(),
+	   instantiated again for each guest thread */
+	const struct Module *thread_module;
+	struct ModuleInst *thread_module_inst;
+	uint32_t thread_module_flags;
 };
 
+/*
+  compile exported memcpy, memmove and memset as bulk memory operations
+  instead of their bodies, only for modules known to export libc ones
+*/
+#define WASMJIT_HIGH_INSTANTIATE_FLAGS_LIBC_BUILTINS 1
+
 #define WASMJIT_HIGH_INSTANTIATE_EMSCRIPTEN_RUNTIME_FLAGS_NO_TABLE 1
+/* count calls, errors, bytes and latencies of each ___syscall import */
+#define WASMJIT_HIGH_INSTANTIATE_EMSCRIPTEN_RUNTIME_FLAGS_SYSCALL_STATS 2
+/* env.memory is shared, for guests built with pthreads */
+#define WASMJIT_HIGH_INSTANTIATE_EMSCRIPTEN_RUNTIME_FLAGS_SHARED_MEMORY 4
+
+struct EmscriptenSyscallStats;
 
 int wasmjit_high_init(struct WasmJITHigh *self);
 int wasmjit_high_instantiate(struct WasmJITHigh *self,
 			     const char *filename,
 			     const char *module_name,
 			     uint32_t flags);
+/* like wasmjit_high_instantiate() but reuses module, the already parsed
+   contents of filename, unless the kernel backend needs the file. A
+   guest that imports a shared env.memory can start threads, which
+   instantiate module again: it must outlive wasmjit_high_close(). */
+int wasmjit_high_instantiate_module(struct WasmJITHigh *self,
+				    const char *filename,
+				    const struct Module *module,
+				    const char *module_name,
+				    uint32_t flags);
+
+/*
+  Instantiates a module while it is still arriving: feed it the bytes
+  in order, in chunks of any size. Each function body is compiled as
+  soon as it is complete, overlapping compilation with I/O.
+  wasmjit_high_stream_finish() instantiates the module and frees the
+  stream, wasmjit_high_stream_abort() only frees it.
+ */
+struct WasmJITHighStream;
+
+struct WasmJITHighStream *wasmjit_high_stream_begin(struct WasmJITHigh *self,
+						    const char *module_name,
+						    uint32_t flags);
+int wasmjit_high_stream_feed(struct WasmJITHighStream *stream,
+			     const void *buf, size_t size);
+int wasmjit_high_stream_finish(struct WasmJITHighStream *stream);
+void wasmjit_high_stream_abort(struct WasmJITHighStream *stream);
+
+#ifndef __KERNEL__
+/* streams the module from fd, e.g. a pipe or socket, until EOF */
+int wasmjit_high_instantiate_fd(struct WasmJITHigh *self,
+				int fd,
+				const char *module_name,
+				uint32_t flags);
+#endif
+
 int wasmjit_high_instantiate_emscripten_runtime(struct WasmJITHigh *self,
 						uint32_t static_bump,
 						size_t tablemin,
 						size_t tablemax,
 						uint32_t flags);
+/*
+  Gives the guest access to the host directory host_path as
+  guest_path. Once anything is preopened the guest can only reach
+  files below its preopens. Call after instantiating the runtime.
+ */
+int wasmjit_high_emscripten_preopen(struct WasmJITHigh *self,
+				    const char *guest_path,
+				    const char *host_path,
+				    int readonly);
 int wasmjit_high_emscripten_invoke_main(struct WasmJITHigh *self,
 					const char *module_name,
 					int argc, char **argv, char **envp,
 					uint32_t flags);
+/*
+  Copies out the counters of syscall number which, the runtime must
+  have been instantiated with
+  WASMJIT_HIGH_INSTANTIATE_EMSCRIPTEN_RUNTIME_FLAGS_SYSCALL_STATS.
+ */
+int wasmjit_high_emscripten_syscall_stats(struct WasmJITHigh *self,
+					  uint32_t which,
+					  struct EmscriptenSyscallStats *stats);
+
+/*
+  Provides the wasi_snapshot_preview1 imports. Modules that use them
+  are run with wasmjit_high_wasi_start(), which returns the exit code
+  or an encoded trap like wasmjit_high_emscripten_invoke_main().
+ */
+int wasmjit_high_instantiate_wasi_runtime(struct WasmJITHigh *self,
+					  int argc, char **argv, char **envp,
+					  uint32_t flags);
+int wasmjit_high_wasi_preopen(struct WasmJITHigh *self,
+			      const char *guest_path,
+			      const char *host_path);
+int wasmjit_high_wasi_start(struct WasmJITHigh *self,
+			    const char *module_name);
 void wasmjit_high_close(struct WasmJITHigh *self);
 int wasmjit_high_error_message(struct WasmJITHigh *self, char *buf, size_t buf_size);
 
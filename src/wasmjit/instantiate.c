@@ -136,6 +136,11 @@ static int fill_module_types(struct ModuleInst *module_inst,
 		goto error;
 
 
+	module_types->n_functypes = module_inst->funcs.n_elts;
+	module_types->n_tabletypes = module_inst->tables.n_elts;
+	module_types->n_memorytypes = module_inst->mems.n_elts;
+	module_types->n_globaltypes = module_inst->globals.n_elts;
+
 	for (i = 0; i < module_inst->funcs.n_elts; ++i) {
 		module_types->functypes[i] = module_inst->funcs.elts[i]->type;
 	}
@@ -169,10 +174,338 @@ static int fill_module_types(struct ModuleInst *module_inst,
 	return 0;
 }
 
+/*
+  memcpy, memmove and memset are exported by Emscripten (with a
+  leading underscore) and wasi-libc, and their guest versions are
+  byte and word loops. With WASMJIT_INSTANTIATE_FLAGS_LIBC_BUILTINS,
+  exports with one of those names and the libc signature are compiled
+  from the matching bulk memory instruction instead, which becomes a
+  range check and a rep movsb or rep stosb. Only the name says what
+  the body does, so this is up to the embedder. The original body
+  must still be valid.
+ */
+static const unsigned char libc_copy_body[] = {
+	OPCODE_GET_LOCAL, 0, OPCODE_GET_LOCAL, 1, OPCODE_GET_LOCAL, 2,
+	OPCODE_MISC_PREFIX, OPCODE_MISC_MEMORY_COPY, 0, 0,
+	OPCODE_GET_LOCAL, 0, BLOCK_TERMINAL,
+};
+
+static const unsigned char libc_fill_body[] = {
+	OPCODE_GET_LOCAL, 0, OPCODE_GET_LOCAL, 1, OPCODE_GET_LOCAL, 2,
+	OPCODE_MISC_PREFIX, OPCODE_MISC_MEMORY_FILL, 0,
+	OPCODE_GET_LOCAL, 0, BLOCK_TERMINAL,
+};
+
+#define LIBC_BUILTIN_CODE(body)						\
+	{ sizeof(body), 0, NULL, 0, NULL, (const char *) (body),	\
+	  sizeof(body), { 0, NULL, NULL } }
+
+static const struct {
+	const char *name;
+	struct CodeSectionCode code;
+} libc_builtins[] = {
+	{ "memcpy", LIBC_BUILTIN_CODE(libc_copy_body) },
+	{ "memmove", LIBC_BUILTIN_CODE(libc_copy_body) },
+	{ "memset", LIBC_BUILTIN_CODE(libc_fill_body) },
+};
+
+const struct CodeSectionCode *
+wasmjit_module_code(const struct Module *module,
+		    const struct ModuleTypes *module_types,
+		    uint32_t codeidx, unsigned flags,
+		    char *why, size_t why_size)
+{
+	const struct CodeSectionCode *code =
+		&module->code_section.codes[codeidx];
+	const struct FuncType *type;
+	uint32_t funcidx, i;
+	size_t j;
+
+	funcidx = module_types->n_functypes -
+		module->function_section.n_typeidxs + codeidx;
+	type = &module_types->functypes[funcidx];
+
+	if (!(flags & WASMJIT_INSTANTIATE_FLAGS_LIBC_BUILTINS) ||
+	    !module_types->n_memorytypes ||
+	    type->n_inputs != 3 ||
+	    type->input_types[0] != VALTYPE_I32 ||
+	    type->input_types[1] != VALTYPE_I32 ||
+	    type->input_types[2] != VALTYPE_I32 ||
+	    type->output_type != VALTYPE_I32)
+		return code;
+
+	for (i = 0; i < module->export_section.n_exports; ++i) {
+		const struct ExportSectionExport *export =
+			&module->export_section.exports[i];
+		const char *name = export->name;
+
+		if (export->idx_type != IMPORT_DESC_TYPE_FUNC ||
+		    export->idx != funcidx)
+			continue;
+
+		if (name[0] == '_')
+			name += 1;
+
+		for (j = 0; j < ARRAY_LEN(libc_builtins); ++j) {
+			if (strcmp(name, libc_builtins[j].name))
+				continue;
+			if (!wasmjit_validate_function(module->type_section.types,
+						       module->type_section.n_types,
+						       module_types, type, code,
+						       why, why_size))
+				return NULL;
+			return &libc_builtins[j].code;
+		}
+	}
+
+	return code;
+}
+
+/* below this much code, starting threads costs more than it saves */
+#define PARALLEL_COMPILE_MIN_BYTES (64 * 1024)
+
+struct ParallelCompile {
+	const struct Module *module;
+	struct ModuleInst *module_inst;
+	const struct ModuleTypes *module_types;
+	struct CompiledCode *compiled;
+	unsigned flags;
+	char *why;
+	size_t why_size;
+	int reported;
+};
+
+static int compile_function_worker(void *ctx, unsigned worker, size_t i)
+{
+	struct ParallelCompile *job = ctx;
+	struct ModuleInst *module_inst = job->module_inst;
+	struct CompiledCode *compiled = &job->compiled[i];
+	struct FuncInst *funcinst;
+	const struct CodeSectionCode *code;
+	char why[128];
+
+	(void)worker;
+
+	funcinst = module_inst->funcs.elts[i + module_inst->n_imported_funcs];
+
+	why[0] = '\0';
+	code = wasmjit_module_code(job->module, job->module_types, i,
+				   job->flags, why, sizeof(why));
+	if (code)
+		compiled->code =
+			wasmjit_compile_function(module_inst->types.elts,
+						 module_inst->types.n_elts,
+						 job->module_types,
+						 &funcinst->type, code,
+						 &compiled->memrefs,
+						 &compiled->code_size,
+						 &compiled->stack_usage,
+						 why, sizeof(why));
+	if (!compiled->code) {
+		/* several workers can fail at once, report the first */
+		if (job->why &&
+		    !__atomic_exchange_n(&job->reported, 1, __ATOMIC_RELAXED))
+			snprintf(job->why, job->why_size, "function %zu: %s",
+				 i + module_inst->n_imported_funcs,
+				 why[0] ? why : "failed to compile");
+		return 0;
+	}
+
+	return 1;
+}
+
+int wasmjit_module_types(const struct Module *module,
+			 struct ModuleTypes *module_types)
+{
+	uint32_t i;
+	size_t n_funcs, n_tables, n_mems, n_globals;
+
+	memset(module_types, 0, sizeof(*module_types));
+
+	n_funcs = module->function_section.n_typeidxs;
+	n_tables = module->table_section.n_tables;
+	n_mems = module->memory_section.n_memories;
+	n_globals = module->global_section.n_globals;
+	for (i = 0; i < module->import_section.n_imports; ++i) {
+		switch (module->import_section.imports[i].desc_type) {
+		case IMPORT_DESC_TYPE_FUNC:
+			n_funcs += 1;
+			break;
+		case IMPORT_DESC_TYPE_TABLE:
+			n_tables += 1;
+			break;
+		case IMPORT_DESC_TYPE_MEM:
+			n_mems += 1;
+			break;
+		case IMPORT_DESC_TYPE_GLOBAL:
+			n_globals += 1;
+			break;
+		}
+	}
+
+	module_types->functypes =
+		calloc(n_funcs, sizeof(module_types->functypes[0]));
+	if (n_funcs && !module_types->functypes)
+		goto error;
+
+	module_types->tabletypes =
+		calloc(n_tables, sizeof(module_types->tabletypes[0]));
+	if (n_tables && !module_types->tabletypes)
+		goto error;
+
+	module_types->memorytypes =
+		calloc(n_mems, sizeof(module_types->memorytypes[0]));
+	if (n_mems && !module_types->memorytypes)
+		goto error;
+
+	module_types->globaltypes =
+		calloc(n_globals, sizeof(module_types->globaltypes[0]));
+	if (n_globals && !module_types->globaltypes)
+		goto error;
+
+	/* imports come first in every index space */
+	for (i = 0; i < module->import_section.n_imports; ++i) {
+		const struct ImportSectionImport *import =
+			&module->import_section.imports[i];
+
+		switch (import->desc_type) {
+		case IMPORT_DESC_TYPE_FUNC:
+			if (import->desc.functypeidx >= module->type_section.n_types)
+				goto error;
+			module_types->functypes[module_types->n_functypes++] =
+				module->type_section.types[import->desc.functypeidx];
+			break;
+		case IMPORT_DESC_TYPE_TABLE:
+			module_types->tabletypes[module_types->n_tabletypes++] =
+				import->desc.tabletype;
+			break;
+		case IMPORT_DESC_TYPE_MEM:
+			module_types->memorytypes[module_types->n_memorytypes++] =
+				import->desc.memtype;
+			break;
+		case IMPORT_DESC_TYPE_GLOBAL:
+			module_types->globaltypes[module_types->n_globaltypes++] =
+				import->desc.globaltype;
+			break;
+		}
+	}
+
+	for (i = 0; i < module->function_section.n_typeidxs; ++i) {
+		uint32_t typeidx = module->function_section.typeidxs[i];
+		if (typeidx >= module->type_section.n_types)
+			goto error;
+		module_types->functypes[module_types->n_functypes++] =
+			module->type_section.types[typeidx];
+	}
+
+	for (i = 0; i < module->table_section.n_tables; ++i) {
+		module_types->tabletypes[module_types->n_tabletypes++] =
+			module->table_section.tables[i];
+	}
+
+	for (i = 0; i < module->memory_section.n_memories; ++i) {
+		module_types->memorytypes[module_types->n_memorytypes++] =
+			module->memory_section.memories[i].memtype;
+	}
+
+	for (i = 0; i < module->global_section.n_globals; ++i) {
+		module_types->globaltypes[module_types->n_globaltypes++] =
+			module->global_section.globals[i].type;
+	}
+
+	return 1;
+
+ error:
+	wasmjit_free_module_types(module_types);
+	return 0;
+}
+
+void wasmjit_free_module_types(struct ModuleTypes *module_types)
+{
+	if (module_types->functypes)
+		free(module_types->functypes);
+	if (module_types->tabletypes)
+		free(module_types->tabletypes);
+	if (module_types->memorytypes)
+		free(module_types->memorytypes);
+	if (module_types->globaltypes)
+		free(module_types->globaltypes);
+	memset(module_types, 0, sizeof(*module_types));
+}
+
+int wasmjit_compile_module_function(const struct Module *module,
+				    const struct ModuleTypes *module_types,
+				    uint32_t codeidx, unsigned flags,
+				    struct CompiledCode *compiled,
+				    char *why, size_t why_size)
+{
+	const struct CodeSectionCode *code;
+	size_t funcidx = module_types->n_functypes -
+		module->function_section.n_typeidxs + codeidx;
+
+	if (codeidx >= module->function_section.n_typeidxs ||
+	    codeidx >= module->code_section.n_codes) {
+		if (why)
+			snprintf(why, why_size,
+				 "function body %" PRIu32 " has no declaration",
+				 codeidx);
+		return 0;
+	}
+
+	memset(compiled, 0, sizeof(*compiled));
+	code = wasmjit_module_code(module, module_types, codeidx, flags,
+				   why, why_size);
+	if (!code)
+		return 0;
+
+	compiled->code = wasmjit_compile_function(module->type_section.types,
+						  module->type_section.n_types,
+						  module_types,
+						  &module_types->functypes[funcidx],
+						  code,
+						  &compiled->memrefs,
+						  &compiled->code_size,
+						  &compiled->stack_usage,
+						  why, why_size);
+	if (!compiled->code) {
+		if (compiled->memrefs.elts)
+			free(compiled->memrefs.elts);
+		compiled->memrefs.elts = NULL;
+		return 0;
+	}
+
+	return 1;
+}
+
+void wasmjit_free_compiled_code(struct CompiledCode *compiled,
+				size_t n_compiled)
+{
+	size_t i;
+
+	for (i = 0; i < n_compiled; ++i) {
+		if (compiled[i].code)
+			free(compiled[i].code);
+		if (compiled[i].memrefs.elts)
+			free(compiled[i].memrefs.elts);
+	}
+	free(compiled);
+}
+
 struct ModuleInst *wasmjit_instantiate(const struct Module *module,
 				       size_t n_imports,
 				       const struct NamedModule *imports,
 				       char *why, size_t why_size)
+{
+	return wasmjit_instantiate_compiled(module, NULL, 0, n_imports, imports,
+					    why, why_size);
+}
+
+struct ModuleInst *wasmjit_instantiate_compiled(const struct Module *module,
+						const struct CompiledCode *precompiled,
+						unsigned flags,
+						size_t n_imports,
+						const struct NamedModule *imports,
+						char *why, size_t why_size)
 {
 	uint32_t i;
 	struct ModuleInst *module_inst = NULL;
@@ -182,7 +515,8 @@ struct ModuleInst *wasmjit_instantiate(const struct Module *module,
 	struct MemInst *tmp_mem = NULL;
 	struct GlobalInst *tmp_global = NULL;
 	void *unmapped = NULL, *mapped = NULL;
-	struct MemoryReferences memrefs = {0, NULL};
+	struct CompiledCode *owned = NULL;
+	const struct CompiledCode *compiled = precompiled;
 	size_t code_size;
 
 	memset(&module_types, 0, sizeof(module_types));
@@ -476,6 +810,7 @@ struct ModuleInst *wasmjit_instantiate(const struct Module *module,
 
 		tmp_mem->size = size;
 		tmp_mem->max = max;
+		tmp_mem->shared = memory->memtype.limits.shared;
 
 		LVECTOR_GROW(&module_inst->mems, 1);
 		module_inst->mems.elts[module_inst->mems.n_elts - 1] = tmp_mem;
@@ -572,61 +907,76 @@ struct ModuleInst *wasmjit_instantiate(const struct Module *module,
 		}
 	}
 
-	if (!fill_module_types(module_inst, &module_types))
-		goto error;
+	/* functions compile independently, only mapping and relocating
+	   them below touches shared state */
+	if (!compiled && module->code_section.n_codes) {
+		struct ParallelCompile job;
+		size_t code_bytes = 0;
+
+		if (!fill_module_types(module_inst, &module_types))
+			goto error;
+
+		owned = calloc(module->code_section.n_codes, sizeof(owned[0]));
+		if (!owned)
+			goto error;
+		compiled = owned;
+
+		for (i = 0; i < module->code_section.n_codes; ++i) {
+			code_bytes += module->code_section.codes[i].size;
+		}
+
+		job.module = module;
+		job.module_inst = module_inst;
+		job.module_types = &module_types;
+		job.compiled = owned;
+		job.flags = flags;
+		job.why = why;
+		job.why_size = why_size;
+		job.reported = 0;
+
+		if (!wasmjit_parallel_for(wasmjit_parallel_workers(code_bytes,
+								   PARALLEL_COMPILE_MIN_BYTES),
+					  module->code_section.n_codes,
+					  compile_function_worker, &job))
+			goto error;
+	}
 
 	for (i = 0; i < module->code_section.n_codes; ++i) {
-		struct CodeSectionCode *code = &module->code_section.codes[i];
 		struct FuncInst *funcinst;
+		const struct MemoryReferences *memrefs = &compiled[i].memrefs;
 		size_t j;
 
 		funcinst = module_inst->funcs.elts[i + module_inst->n_imported_funcs];
 
-		if (memrefs.elts) {
-			free(memrefs.elts);
-			memrefs.n_elts = 0;
-			memrefs.elts = NULL;
-		}
-
-		if (unmapped)
-			free(unmapped);
+		code_size = compiled[i].code_size;
 
 		assert(mapped == NULL);
-		unmapped = wasmjit_compile_function(module_inst->types.elts,
-						    &module_types,
-						    &funcinst->type,
-						    code,
-						    &memrefs,
-						    &code_size,
-						    &funcinst->stack_usage);
-		if (!unmapped)
-			goto error;
-
 		mapped = wasmjit_map_code_segment(code_size);
 		if (!mapped)
 			goto error;
 
-		memcpy(mapped, unmapped, code_size);
+		memcpy(mapped, compiled[i].code, code_size);
+		funcinst->stack_usage = compiled[i].stack_usage;
 
 		/* resolve code references */
-		for (j = 0; j < memrefs.n_elts; ++j) {
+		for (j = 0; j < memrefs->n_elts; ++j) {
 			uint64_t val;
 
-			switch (memrefs.elts[j].type) {
+			switch (memrefs->elts[j].type) {
 			case MEMREF_TYPE:
-				val = (uintptr_t) &module_inst->types.elts[memrefs.elts[j].idx];
+				val = (uintptr_t) &module_inst->types.elts[memrefs->elts[j].idx];
 				break;
 			case MEMREF_FUNC:
-				val = (uintptr_t) module_inst->funcs.elts[memrefs.elts[j].idx];
+				val = (uintptr_t) module_inst->funcs.elts[memrefs->elts[j].idx];
 				break;
 			case MEMREF_TABLE:
-				val = (uintptr_t) module_inst->tables.elts[memrefs.elts[j].idx];
+				val = (uintptr_t) module_inst->tables.elts[memrefs->elts[j].idx];
 				break;
 			case MEMREF_MEM:
-				val = (uintptr_t) module_inst->mems.elts[memrefs.elts[j].idx];
+				val = (uintptr_t) module_inst->mems.elts[memrefs->elts[j].idx];
 				break;
 			case MEMREF_GLOBAL:
-				val = (uintptr_t) module_inst->globals.elts[memrefs.elts[j].idx];
+				val = (uintptr_t) module_inst->globals.elts[memrefs->elts[j].idx];
 				break;
 			case MEMREF_RESOLVE_INDIRECT_CALL:
 				val = (uintptr_t) &wasmjit_resolve_indirect_call;
@@ -637,13 +987,26 @@ struct ModuleInst *wasmjit_instantiate(const struct Module *module,
 			case MEMREF_STACK_TOP:
 				val = (uintptr_t) &wasmjit_stack_top;
 				break;
+			case MEMREF_ATOMIC_WAIT:
+				val = (uintptr_t) &wasmjit_atomic_wait;
+				break;
+			case MEMREF_ATOMIC_NOTIFY:
+				val = (uintptr_t) &wasmjit_atomic_notify;
+				break;
+			case MEMREF_INTERRUPT:
+#ifdef WASMJIT_INTERRUPT_FLAG_FS_RELATIVE
+				val = wasmjit_interrupt_flag_fs_offset();
+#else
+				val = (uintptr_t) &wasmjit_check_interrupt;
+#endif
+				break;
 			default:
 				assert(0);
 				val = 0;
 				break;
 			}
 
-			encode_le_uint64_t(val, &((char *) mapped)[memrefs.elts[j].code_offset]);
+			encode_le_uint64_t(val, &((char *) mapped)[memrefs->elts[j].code_offset]);
 		}
 
 
@@ -684,7 +1047,8 @@ struct ModuleInst *wasmjit_instantiate(const struct Module *module,
 		}
 	}
 
-	for (i = 0; i < module->data_section.n_datas; ++i) {
+	for (i = 0; i < module->data_section.n_datas &&
+		     !(flags & WASMJIT_INSTANTIATE_FLAGS_THREAD); ++i) {
 		struct DataSectionData *data = &module->data_section.datas[i];
 		struct MemInst *meminst =
 		    module_inst->mems.elts[data->memidx];
@@ -710,7 +1074,8 @@ struct ModuleInst *wasmjit_instantiate(const struct Module *module,
 	}
 
 	/* add start function */
-	if (module->start_section.has_start) {
+	if (module->start_section.has_start &&
+	    !(flags & WASMJIT_INSTANTIATE_FLAGS_THREAD)) {
 		wasmjit_invoke_function(module_inst->funcs.elts[module->start_section.funcidx],
 					NULL, NULL);
 	}
@@ -740,16 +1105,9 @@ struct ModuleInst *wasmjit_instantiate(const struct Module *module,
 		wasmjit_unmap_code_segment(mapped, code_size);
 	if (unmapped)
 		free(unmapped);
-	if (memrefs.elts)
-		free(memrefs.elts);
-	if (module_types.functypes)
-		free(module_types.functypes);
-	if (module_types.tabletypes)
-		free(module_types.tabletypes);
-	if (module_types.memorytypes)
-		free(module_types.memorytypes);
-	if (module_types.globaltypes)
-		free(module_types.globaltypes);
+	if (owned)
+		wasmjit_free_compiled_code(owned, module->code_section.n_codes);
+	wasmjit_free_module_types(&module_types);
 
 
 	return module_inst;
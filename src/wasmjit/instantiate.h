@@ -26,11 +26,66 @@
 #define __WASMJIT__INSTANTIATE_H__
 
 #include <wasmjit/ast.h>
+#include <wasmjit/compile.h>
 #include <wasmjit/runtime.h>
 
+/*
+  Machine code for one function body before it is mapped and its
+  memory references are resolved, lets callers compile bodies ahead of
+  instantiation (e.g. while the rest of the module is downloading).
+ */
+struct CompiledCode {
+	char *code;
+	size_t code_size;
+	size_t stack_usage;
+	struct MemoryReferences memrefs;
+};
+
+int wasmjit_module_types(const struct Module *module,
+			 struct ModuleTypes *module_types);
+void wasmjit_free_module_types(struct ModuleTypes *module_types);
+
+/* compile exported memcpy, memmove and memset as bulk memory operations */
+#define WASMJIT_INSTANTIATE_FLAGS_LIBC_BUILTINS 1
+/*
+  another instance for a new thread: its shared memory is already
+  initialized, so data segments and the start function are skipped
+*/
+#define WASMJIT_INSTANTIATE_FLAGS_THREAD 2
+
+/*
+  the body to compile for a code section entry, see libc_builtins,
+  NULL if it is substituted and the original body is invalid
+*/
+const struct CodeSectionCode *
+wasmjit_module_code(const struct Module *module,
+		    const struct ModuleTypes *module_types,
+		    uint32_t codeidx, unsigned flags,
+		    char *why, size_t why_size);
+
+int wasmjit_compile_module_function(const struct Module *module,
+				    const struct ModuleTypes *module_types,
+				    uint32_t codeidx, unsigned flags,
+				    struct CompiledCode *compiled,
+				    char *why, size_t why_size);
+void wasmjit_free_compiled_code(struct CompiledCode *compiled,
+				size_t n_compiled);
+
 struct ModuleInst *wasmjit_instantiate(const struct Module *module,
 				       size_t n_imports,
 				       const struct NamedModule *imports,
 				       char *why, size_t why_size);
 
+/*
+  compiled holds every code section body, it remains owned by the
+  caller. If it is NULL the bodies are compiled here according to
+  flags, see WASMJIT_INSTANTIATE_FLAGS_LIBC_BUILTINS.
+*/
+struct ModuleInst *wasmjit_instantiate_compiled(const struct Module *module,
+						const struct CompiledCode *compiled,
+						unsigned flags,
+						size_t n_imports,
+						const struct NamedModule *imports,
+						char *why, size_t why_size);
+
 #endif
@@ -29,13 +29,17 @@
 #error Only for kernel
 #endif
 
+#include <wasmjit/runtime.h>
+
+#include <linux/hrtimer.h>
 #include <linux/sched/task_stack.h>
 
 struct KernelThreadLocal {
-	jmp_buf *jmp_buf;
-	void *stack_top;
+	struct WasmJITThreadContext ctx;
 	struct pt_regs regs;
 	struct MemInst *mem_inst;
+	/* backs wasmjit_set_deadline(), initialized by the ioctl */
+	struct hrtimer deadline;
 };
 
 static inline char *ptrptr(void) {
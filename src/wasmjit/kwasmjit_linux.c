@@ -474,6 +474,7 @@ static long kwasmjit_unlocked_ioctl(struct file *filp,
 	preserve = wasmjit_get_ktls();
 
 	memset(&ktls, 0, sizeof(ktls));
+	hrtimer_init(&ktls.deadline, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
 	wasmjit_set_ktls(&ktls);
 
 	fpu_preserve = kvmalloc(fpu_kernel_xstate_size, GFP_KERNEL);
@@ -570,6 +571,8 @@ static long kwasmjit_unlocked_ioctl(struct file *filp,
 	if (fpu_preserve)
 		kvfree(fpu_preserve);
 
+	/* ktls is on our stack, the timer must not outlive it */
+	wasmjit_clear_deadline(&ktls.ctx);
 	wasmjit_set_ktls(preserve);
 
 	return retval;
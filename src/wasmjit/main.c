@@ -131,22 +131,26 @@ static void *get_stack_top(void)
 
 #endif
 
-static int parse_module(const char *filename, struct Module *module)
+/*
+  On success *buf holds the loaded file, which the module may borrow
+  from depending on flags, release it with wasmjit_unload_file() after
+  freeing the module.
+*/
+static int parse_module(const char *filename, struct Module *module,
+			unsigned flags, char **buf, size_t *size)
 {
-	char *buf = NULL;
 	int ret, result;
-	size_t size;
 	struct ParseState pstate;
 
-	buf = wasmjit_load_file(filename, &size);
-	if (!buf)
+	*buf = wasmjit_load_file(filename, size);
+	if (!*buf)
 		goto error;
 
-	ret = init_pstate(&pstate, buf, size);
+	ret = init_pstate(&pstate, *buf, *size);
 	if (!ret)
 		goto error;
 
-	ret = read_module(&pstate, module, NULL, 0);
+	ret = read_module(&pstate, module, flags, NULL, 0);
 	if (!ret)
 		goto error;
 
@@ -154,25 +158,32 @@ static int parse_module(const char *filename, struct Module *module)
 
 	if (0) {
 	error:
+		if (*buf) {
+			wasmjit_unload_file(*buf, *size);
+			*buf = NULL;
+		}
 		result = -1;
 	}
 
-	if (buf)
-		wasmjit_unload_file(buf, size);
 	return result;
 }
 
 static int dump_wasm_module(const char *filename)
 {
-	uint32_t i;
+	uint32_t i, n_imported_funcs = 0;
 	struct Module module;
 	int res = -1;
+	char *buf;
+	size_t size;
 
 	wasmjit_init_module(&module);
 
-	if (parse_module(filename, &module))
+	if (parse_module(filename, &module,
+			 WASMJIT_PARSE_FLAGS_COMPACT_CODE, &buf, &size))
 		goto error;
 
+	wasmjit_unload_file(buf, size);
+
 	/* the most basic validation */
 	if (module.code_section.n_codes != module.function_section.n_typeidxs) {
 		fprintf(stderr,
@@ -182,8 +193,15 @@ static int dump_wasm_module(const char *filename)
 		goto error;
 	}
 
+	for (i = 0; i < module.import_section.n_imports; ++i) {
+		if (module.import_section.imports[i].desc_type ==
+		    IMPORT_DESC_TYPE_FUNC)
+			n_imported_funcs += 1;
+	}
+
 	for (i = 0; i < module.code_section.n_codes; ++i) {
-		uint32_t j;
+		uint32_t j, name_size;
+		const char *name;
 		struct TypeSectionType *type;
 		struct CodeSectionCode *code =
 			&module.code_section.codes[i];
@@ -192,7 +210,13 @@ static int dump_wasm_module(const char *filename)
 			&module.type_section.types[module.function_section.
 						   typeidxs[i]];
 
-		printf("Code #%" PRIu32 "\n", i);
+		name = wasmjit_function_name(&module, n_imported_funcs + i,
+					     &name_size);
+		if (name)
+			printf("Code #%" PRIu32 " %.*s\n", i,
+			       (int)name_size, name);
+		else
+			printf("Code #%" PRIu32 "\n", i);
 
 		printf("Locals (%" PRIu32 "):\n", code->n_locals);
 		for (j = 0; j < code->n_locals; ++j) {
@@ -216,10 +240,7 @@ static int dump_wasm_module(const char *filename)
 		printf("]\n");
 
 		printf("Instructions:\n");
-		dump_instructions(module.code_section.codes[i].
-				  instructions,
-				  module.code_section.codes[i].
-				  n_instructions, 1);
+		dump_compact_instructions(&code->compact, 1);
 		printf("\n");
 	}
 
@@ -297,23 +318,31 @@ static int get_static_bump(const char *filename, uint32_t *static_bump)
 }
 
 static int get_emscripten_runtime_parameters(const char *filename,
+					     const struct Module *module,
 					     uint32_t *static_bump,
 					     int *has_table,
-					     size_t *tablemin, size_t *tablemax)
+					     size_t *tablemin, size_t *tablemax,
+					     int *shared_memory)
 {
 	size_t i;
 	int ret;
-	struct Module module;
 
-	wasmjit_init_module(&module);
-
-	if (parse_module(filename, &module))
-		goto error;
+	*shared_memory = 0;
+	for (i = 0; i < module->import_section.n_imports; ++i) {
+		struct ImportSectionImport *import;
+		import = &module->import_section.imports[i];
+		if (!strcmp(import->module, "env") &&
+		    !strcmp(import->name, "memory") &&
+		    import->desc_type == IMPORT_DESC_TYPE_MEM) {
+			*shared_memory = import->desc.memtype.limits.shared;
+			break;
+		}
+	}
 
 	/* find correct tablemin and tablemax */
-	for (i = 0; i < module.import_section.n_imports; ++i) {
+	for (i = 0; i < module->import_section.n_imports; ++i) {
 		struct ImportSectionImport *import;
-		import = &module.import_section.imports[i];
+		import = &module->import_section.imports[i];
 		if (strcmp(import->module, "env") ||
 		    strcmp(import->name, "table") ||
 		    import->desc_type != IMPORT_DESC_TYPE_TABLE)
@@ -324,28 +353,203 @@ static int get_emscripten_runtime_parameters(const char *filename,
 		break;
 	}
 
-	*has_table = i != module.import_section.n_imports;
+	*has_table = i != module->import_section.n_imports;
 
 	ret = get_static_bump(filename, static_bump);
 	if (ret) {
 		fprintf(stderr, "Couldn't get static bump!\n");
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/* -D and -R arguments: "host" or "guest:host" */
+struct Preopen {
+	char *arg;
+	int readonly;
+};
+
+static int preopen_dirs(struct WasmJITHigh *high,
+			const struct Preopen *preopens,
+			size_t n_preopens,
+			int wasi)
+{
+	size_t i;
+
+	for (i = 0; i < n_preopens; ++i) {
+		const char *guest_path, *host_path;
+		char *sep;
+		int ret;
+
+		if (wasi && preopens[i].readonly) {
+			/* WASI rights are not enforced */
+			fprintf(stderr,
+				"-R %s: read-only directories are not "
+				"supported for WASI modules, use -D\n",
+				preopens[i].arg);
+			return -1;
+		}
+
+		sep = strchr(preopens[i].arg, ':');
+		if (sep) {
+			*sep = '\0';
+			guest_path = preopens[i].arg;
+			host_path = sep + 1;
+		} else {
+			guest_path = host_path = preopens[i].arg;
+		}
+
+		if (!wasi)
+			ret = wasmjit_high_emscripten_preopen(high, guest_path, host_path,
+							      preopens[i].readonly);
+		else
+			ret = wasmjit_high_wasi_preopen(high, guest_path, host_path);
+		if (sep)
+			*sep = ':';
+		if (ret)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int is_wasi_module(const struct Module *module)
+{
+	size_t i;
+
+	for (i = 0; i < module->import_section.n_imports; ++i) {
+		if (!strcmp(module->import_section.imports[i].module,
+			    "wasi_snapshot_preview1"))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int run_wasi_file(const char *filename,
+			 const struct Module *module,
+			 const struct Preopen *preopens,
+			 size_t n_preopens,
+			 uint32_t module_flags,
+			 int argc, char **argv, char **envp)
+{
+	struct WasmJITHigh high;
+	int ret;
+	void *stack_top;
+	int high_init = 0;
+	const char *msg;
+
+	stack_top = get_stack_top();
+	if (!stack_top) {
+		fprintf(stderr, "warning: running without a stack limit\n");
+	}
+
+	wasmjit_set_stack_top(stack_top);
+
+	if (wasmjit_high_init(&high)) {
+		msg = "failed to initialize";
+		goto error;
+	}
+	high_init = 1;
+
+	if (wasmjit_high_instantiate_wasi_runtime(&high, argc, argv, envp, 0)) {
+		msg = "failed to instantiate wasi runtime";
+		goto error;
+	}
+
+	if (preopen_dirs(&high, preopens, n_preopens, 1)) {
+		msg = "failed to preopen directory";
+		goto error;
+	}
+
+	if (wasmjit_high_instantiate_module(&high, filename, module, "asm",
+					    module_flags)) {
+		msg = "failed to instantiate module";
+		goto error;
+	}
+
+	ret = wasmjit_high_wasi_start(&high, "asm");
+
+	if (WASMJIT_IS_TRAP_ERROR(ret)) {
+		fprintf(stderr, "TRAP: %s\n",
+			wasmjit_trap_reason_to_string(WASMJIT_DECODE_TRAP_ERROR(ret)));
+	} else if (ret < 0) {
+		msg = "failed to run _start";
 		goto error;
 	}
 
 	if (0) {
+		char error_buffer[256];
+
 	error:
-		ret = -1;
+		ret = wasmjit_high_error_message(&high,
+						 error_buffer,
+						 sizeof(error_buffer));
+		if (!ret) {
+			if (error_buffer[0])
+				fprintf(stderr, "%s: %s\n",
+					msg, error_buffer);
+			else
+				fprintf(stderr, "%s\n", msg);
+			ret = -1;
+		}
 	}
 
-	wasmjit_free_module(&module);
+	if (high_init)
+		wasmjit_high_close(&high);
 
 	return ret;
 }
 
+/* one line per syscall the guest made, on stderr */
+static void dump_syscall_stats(struct WasmJITHigh *high)
+{
+	uint32_t which;
+	unsigned i;
+
+	fprintf(stderr, "%8s %10s %8s %12s %12s  latency (ns)\n",
+		"syscall", "calls", "errors", "bytes", "total us");
+
+	for (which = 0; which < WASMJIT_EMSCRIPTEN_MAX_SYSCALL; ++which) {
+		struct EmscriptenSyscallStats stats;
+
+		if (wasmjit_high_emscripten_syscall_stats(high, which, &stats)) {
+			char error_buffer[256];
+
+			if (!wasmjit_high_error_message(high, error_buffer,
+							sizeof(error_buffer)))
+				fprintf(stderr, "no syscall stats: %s\n",
+					error_buffer);
+			return;
+		}
+
+		if (!stats.calls)
+			continue;
+
+		fprintf(stderr, "%8" PRIu32 " %10" PRIu64 " %8" PRIu64
+			" %12" PRIu64 " %12" PRIu64 " ",
+			which, stats.calls, stats.errors, stats.bytes,
+			stats.total_ns / 1000);
+		for (i = 0; i < WASMJIT_EMSCRIPTEN_LATENCY_BUCKETS; ++i) {
+			if (stats.latency[i])
+				fprintf(stderr, " <2^%u:%" PRIu64,
+					i + 1, stats.latency[i]);
+		}
+		fprintf(stderr, "\n");
+	}
+}
+
 static int run_emscripten_file(const char *filename,
+			       const struct Module *module,
 			       uint32_t static_bump,
 			       int has_table,
 			       size_t tablemin, size_t tablemax,
+			       int shared_memory,
+			       const struct Preopen *preopens,
+			       size_t n_preopens,
+			       int syscall_stats,
+			       uint32_t module_flags,
 			       int argc, char **argv, char **envp)
 {
 	struct WasmJITHigh high;
@@ -370,6 +574,10 @@ static int run_emscripten_file(const char *filename,
 
 	if (!has_table)
 		flags |= WASMJIT_HIGH_INSTANTIATE_EMSCRIPTEN_RUNTIME_FLAGS_NO_TABLE;
+	if (syscall_stats)
+		flags |= WASMJIT_HIGH_INSTANTIATE_EMSCRIPTEN_RUNTIME_FLAGS_SYSCALL_STATS;
+	if (shared_memory)
+		flags |= WASMJIT_HIGH_INSTANTIATE_EMSCRIPTEN_RUNTIME_FLAGS_SHARED_MEMORY;
 
 	if (wasmjit_high_instantiate_emscripten_runtime(&high,
 							static_bump,
@@ -378,7 +586,13 @@ static int run_emscripten_file(const char *filename,
 		goto error;
 	}
 
-	if (wasmjit_high_instantiate(&high, filename, "asm", 0)) {
+	if (preopen_dirs(&high, preopens, n_preopens, 0)) {
+		msg = "failed to preopen directory";
+		goto error;
+	}
+
+	if (wasmjit_high_instantiate_module(&high, filename, module, "asm",
+					    module_flags)) {
 		msg = "failed to instantiate module";
 		goto error;
 	}
@@ -386,6 +600,9 @@ static int run_emscripten_file(const char *filename,
 	ret = wasmjit_high_emscripten_invoke_main(&high, "asm",
 						  argc, argv, envp, 0);
 
+	if (syscall_stats)
+		dump_syscall_stats(&high);
+
 	if (WASMJIT_IS_TRAP_ERROR(ret)) {
 		fprintf(stderr, "TRAP: %s\n",
 			wasmjit_trap_reason_to_string(WASMJIT_DECODE_TRAP_ERROR(ret)));
@@ -402,8 +619,11 @@ static int run_emscripten_file(const char *filename,
 						 error_buffer,
 						 sizeof(error_buffer));
 		if (!ret) {
-			fprintf(stderr, "%s: %s\n",
-				msg, error_buffer);
+			if (error_buffer[0])
+				fprintf(stderr, "%s: %s\n",
+					msg, error_buffer);
+			else
+				fprintf(stderr, "%s\n", msg);
 			ret = -1;
 		}
 	}
@@ -420,15 +640,34 @@ int main(int argc, char *argv[])
 	int ret;
 	char *filename;
 	int dump_module, create_relocatable, create_relocatable_helper, opt;
-	int has_table;
+	int syscall_stats;
+	uint32_t module_flags;
+	int has_table, shared_memory;
 	size_t tablemin = 0, tablemax = 0;
 	uint32_t static_bump = 0;
+	struct Module module;
+	char *buf;
+	size_t size;
+	struct Preopen preopens[WASMJIT_EMSCRIPTEN_MAX_PREOPENS];
+	size_t n_preopens = 0;
 
 	dump_module =  0;
 	create_relocatable =  0;
 	create_relocatable_helper =  0;
-	while ((opt = getopt(argc, argv, "dop")) != -1) {
+	syscall_stats = 0;
+	module_flags = 0;
+	while ((opt = getopt(argc, argv, "bdopsD:R:")) != -1) {
 		switch (opt) {
+		case 'D':
+		case 'R':
+			if (n_preopens == WASMJIT_EMSCRIPTEN_MAX_PREOPENS) {
+				fprintf(stderr, "Too many preopened directories\n");
+				return -1;
+			}
+			preopens[n_preopens].arg = optarg;
+			preopens[n_preopens].readonly = opt == 'R';
+			n_preopens++;
+			break;
 		case 'o':
 			create_relocatable = 1;
 			break;
@@ -438,6 +677,12 @@ int main(int argc, char *argv[])
 		case 'd':
 			dump_module = 1;
 			break;
+		case 's':
+			syscall_stats = 1;
+			break;
+		case 'b':
+			module_flags |= WASMJIT_HIGH_INSTANTIATE_FLAGS_LIBC_BUILTINS;
+			break;
 		default:
 			return -1;
 		}
@@ -454,17 +699,18 @@ int main(int argc, char *argv[])
 		return dump_wasm_module(filename);
 
 	if (create_relocatable) {
-		struct Module module;
-
 		wasmjit_init_module(&module);
 
-		if (!parse_module(filename, &module)) {
+		if (!parse_module(filename, &module,
+				  WASMJIT_PARSE_FLAGS_COMPACT_CODE,
+				  &buf, &size)) {
 			void *a_out;
-			size_t size;
-			a_out = wasmjit_output_elf_relocatable("asm", &module, &size);
-			ret = write(1, a_out, size);
+			size_t a_out_size;
+			a_out = wasmjit_output_elf_relocatable("asm", &module, &a_out_size);
+			ret = write(1, a_out, a_out_size);
 			free(a_out);
 			ret = ret >= 0 ? 0 : -1;
+			wasmjit_unload_file(buf, size);
 		} else {
 			ret = -1;
 		}
@@ -474,9 +720,27 @@ int main(int argc, char *argv[])
 		return ret;
 	}
 
-	ret = get_emscripten_runtime_parameters(filename, &static_bump, &has_table, &tablemin, &tablemax);
-	if (ret)
+	/* parsed once, the same module is handed to the runtime below */
+	wasmjit_init_module(&module);
+
+	if (parse_module(filename, &module,
+			 WASMJIT_PARSE_FLAGS_RAW_CODE |
+			 WASMJIT_PARSE_FLAGS_BORROW_INPUT,
+			 &buf, &size)) {
+		fprintf(stderr, "Couldn't parse module!\n");
+		wasmjit_free_module(&module);
 		return -1;
+	}
+
+	if (is_wasi_module(&module) && !create_relocatable_helper) {
+		ret = run_wasi_file(filename, &module, preopens, n_preopens,
+				    module_flags, argc - optind, &argv[optind], environ);
+		goto out;
+	}
+
+	ret = get_emscripten_runtime_parameters(filename, &module, &static_bump, &has_table, &tablemin, &tablemax, &shared_memory);
+	if (ret)
+		goto out;
 
 	if (create_relocatable_helper) {
 		struct WasmJITEmscriptenMemoryGlobals globals;
@@ -502,10 +766,19 @@ int main(int argc, char *argv[])
 		printf("DEFINE_WASM_GLOBAL(STACK_MAX, %" PRIu32 ", VALTYPE_I32, i32, 0)\n",
 		       globals.STACK_MAX);
 
-		return 0;
+		ret = 0;
+		goto out;
 	}
 
-	return run_emscripten_file(filename,
-				   static_bump, has_table, tablemin, tablemax,
-				   argc - optind, &argv[optind], environ);
+	ret = run_emscripten_file(filename, &module,
+				  static_bump, has_table, tablemin, tablemax,
+				  shared_memory,
+				  preopens, n_preopens, syscall_stats, module_flags,
+				  argc - optind, &argv[optind], environ);
+
+ out:
+	wasmjit_free_module(&module);
+	wasmjit_unload_file(buf, size);
+
+	return ret;
 }
@@ -27,8 +27,6 @@
 
 #include <wasmjit/sys.h>
 
-#define BLOCK_TERMINAL 0x0B
-#define ELSE_TERMINAL 0x05
 #define WASM_MAGIC 0x6d736100
 #define VERSION 0x1
 
@@ -47,11 +45,19 @@ enum {
 	SECTION_ID_DATA,
 };
 
+/* subsections of the "name" custom section */
+enum {
+	NAME_SUBSECTION_MODULE,
+	NAME_SUBSECTION_FUNCTIONS,
+	NAME_SUBSECTION_LOCALS,
+};
+
 int init_pstate(struct ParseState *pstate, const char *buf, size_t size)
 {
 	pstate->eof = 0;
 	pstate->input = buf;
 	pstate->amt_left = size;
+	pstate->arena = NULL;
 	return pstate->input ? 1 : 0;
 }
 
@@ -120,12 +126,92 @@ DEFINE_INT_READER(uint8_t);
 DEFINE_INT_READER(float);
 DEFINE_INT_READER(double);
 
+/*
+  Decodes a LEB128 number that terminates within the 8 bytes at input
+  without looping, returns its length in bytes or 0 if it is longer,
+  in which case value holds the low 56 bits. The caller must guarantee
+  8 readable bytes.
+*/
+static inline unsigned decode_leb_word(const char *input, uint64_t *value)
+{
+	uint64_t word, stop;
+	unsigned len;
+
+	memcpy(&word, input, sizeof(word));
+	word = uint64_t_swap_bytes(word);
+
+	/* every byte without the continuation bit ends a number */
+	stop = ~word & 0x8080808080808080ULL;
+	len = stop ? (__builtin_ctzll(stop) + 1) / 8 : 0;
+	if (len && len < 8)
+		word &= (1ULL << (len * 8)) - 1;
+	word &= 0x7f7f7f7f7f7f7f7fULL;
+
+	/* squeeze out the continuation bits, 7 -> 14 -> 28 -> 56 */
+	word = (word & 0x007f007f007f007fULL) |
+		((word & 0x7f007f007f007f00ULL) >> 1);
+	word = (word & 0x00003fff00003fffULL) |
+		((word & 0x3fff00003fff0000ULL) >> 2);
+	word = (word & 0x000000000fffffffULL) |
+		((word & 0x0fffffff00000000ULL) >> 4);
+
+	*value = word;
+	return len;
+}
+
+#define LEB_MAX_SIZE(type) ((sizeof(type) * 8 + 6) / 7)
+
+/*
+  Fast path shared by the LEB readers, returns the encoded length or 0
+  if the scalar loop has to handle it (short input or overlong number).
+*/
+static inline __attribute__((always_inline))
+unsigned decode_leb(const struct ParseState *pstate,
+		    unsigned max_size, uint64_t *value)
+{
+	unsigned len;
+
+	/* most immediates fit in a byte, keep that case a predictable
+	   branch instead of a dependency chain through the length */
+	if (pstate->amt_left && !(pstate->input[0] & 0x80)) {
+		*value = (uint8_t) pstate->input[0];
+		return 1;
+	}
+
+	if (pstate->amt_left < sizeof(uint64_t))
+		return 0;
+
+	len = decode_leb_word(pstate->input, value);
+	if (!len && max_size > 8 && pstate->amt_left >= 2 * sizeof(uint64_t)) {
+		uint64_t high;
+		len = decode_leb_word(pstate->input + 8, &high);
+		if (len) {
+			*value |= high << 56;
+			len += 8;
+		}
+	}
+
+	return len <= max_size ? len : 0;
+}
+
 #define DEFINE_ULEB_READER(type)					\
 	int read_uleb_##type(struct ParseState *pstate, type *data)	\
 	{								\
 		uint8_t byt;						\
 		unsigned int shift;					\
 									\
+		{							\
+			uint64_t value;					\
+			unsigned len;					\
+			len = decode_leb(pstate, LEB_MAX_SIZE(type), &value); \
+			if (len) {					\
+				*data = (type) value;			\
+				pstate->input += len;			\
+				pstate->amt_left -= len;		\
+				return 1;				\
+			}						\
+		}							\
+									\
 		*data = 0;						\
 		shift = 0;						\
 		while (1) {						\
@@ -153,6 +239,22 @@ DEFINE_ULEB_READER(uint64_t);
 		uint8_t byt;						\
 		unsigned int shift;					\
 									\
+		{							\
+			uint64_t value;					\
+			unsigned len;					\
+			len = decode_leb(pstate, LEB_MAX_SIZE(type), &value); \
+			if (len) {					\
+				shift = len * 7;			\
+				*data = (type) value;			\
+				if (shift < (sizeof(type) * 8) &&	\
+				    (value >> (shift - 1)) & 1)		\
+					*data |= ((~((type) 0)) << shift); \
+				pstate->input += len;			\
+				pstate->amt_left -= len;		\
+				return 1;				\
+			}						\
+		}							\
+									\
 		*data = 0;						\
 		shift = 0;						\
 		while (1) {						\
@@ -194,7 +296,7 @@ char *read_buf_internal(struct ParseState *pstate, uint32_t *buf_size,
 		return NULL;
 	}
 
-	toret = malloc(string_size + as_string);
+	toret = wasmjit_arena_alloc(pstate->arena, string_size + as_string);
 	if (!toret)
 		return NULL;
 
@@ -223,6 +325,24 @@ char *read_buffer(struct ParseState *pstate, uint32_t *buf_size)
 	return read_buf_internal(pstate, buf_size, 0);
 }
 
+static const char *borrow_buffer(struct ParseState *pstate, uint32_t *buf_size)
+{
+	const char *toret;
+	int ret;
+
+	ret = read_uleb_uint32_t(pstate, buf_size);
+	if (!ret)
+		return NULL;
+
+	toret = pstate->input;
+
+	ret = advance_parser(pstate, *buf_size);
+	if (!ret)
+		return NULL;
+
+	return toret;
+}
+
 #define FUNCTION_TYPE_ID 0x60
 
 int read_type_section(struct ParseState *pstate,
@@ -240,7 +360,9 @@ int read_type_section(struct ParseState *pstate,
 	}
 
 	type_section->types =
-	    calloc(type_section->n_types, sizeof(struct TypeSectionType));
+	    wasmjit_arena_calloc(pstate->arena,
+				 type_section->n_types,
+				 sizeof(struct TypeSectionType));
 	if (!type_section->types)
 		goto error;
 
@@ -340,6 +462,8 @@ int read_limits(struct ParseState *pstate, struct Limits *limits)
 	if (!ret)
 		return ret;
 
+	limits->shared = 0;
+
 	switch (byt) {
 	case 0x0:
 		ret = read_uleb_uint32_t(pstate, &limits->min);
@@ -349,6 +473,10 @@ int read_limits(struct ParseState *pstate, struct Limits *limits)
 		limits->max = 0;
 
 		break;
+	case 0x3:
+		/* shared, must have a maximum */
+		limits->shared = 1;
+		/* fall through */
 	case 0x1:
 		ret = read_uleb_uint32_t(pstate, &limits->min);
 		if (!ret)
@@ -381,8 +509,9 @@ int read_import_section(struct ParseState *pstate,
 	}
 
 	import_section->imports =
-	    calloc(import_section->n_imports,
-		   sizeof(struct ImportSectionImport));
+	    wasmjit_arena_calloc(pstate->arena,
+				 import_section->n_imports,
+				 sizeof(struct ImportSectionImport));
 
 	for (i = 0; i < import_section->n_imports; ++i) {
 		uint8_t ft;
@@ -422,6 +551,9 @@ int read_import_section(struct ParseState *pstate,
 			if (!ret)
 				goto error;
 
+			if (import->desc.tabletype.limits.shared)
+				goto error;
+
 			break;
 		case IMPORT_DESC_TYPE_MEM:
 			ret = read_limits(pstate, &import->desc.memtype.limits);
@@ -458,7 +590,9 @@ int read_function_section(struct ParseState *pstate,
 		uint32_t i;
 
 		function_section->typeidxs =
-		    calloc(function_section->n_typeidxs, sizeof(uint32_t));
+		    wasmjit_arena_calloc(pstate->arena,
+					 function_section->n_typeidxs,
+					 sizeof(uint32_t));
 		if (!function_section->typeidxs)
 			goto error;
 
@@ -490,8 +624,9 @@ int read_table_section(struct ParseState *pstate,
 		uint32_t i;
 
 		table_section->tables =
-		    calloc(table_section->n_tables,
-			   sizeof(struct TableSectionTable));
+		    wasmjit_arena_calloc(pstate->arena,
+					 table_section->n_tables,
+					 sizeof(struct TableSectionTable));
 		if (!table_section->tables)
 			goto error;
 
@@ -510,6 +645,9 @@ int read_table_section(struct ParseState *pstate,
 			ret = read_limits(pstate, &table->limits);
 			if (!ret)
 				goto error;
+
+			if (table->limits.shared)
+				goto error;
 		}
 	}
 
@@ -532,8 +670,9 @@ int read_memory_section(struct ParseState *pstate,
 		uint32_t i;
 
 		memory_section->memories =
-		    calloc(memory_section->n_memories,
-			   sizeof(struct MemorySectionMemory));
+		    wasmjit_arena_calloc(pstate->arena,
+					 memory_section->n_memories,
+					 sizeof(struct MemorySectionMemory));
 		if (!memory_section->memories) {
 			goto error;
 		}
@@ -611,8 +750,9 @@ int read_instruction(struct ParseState *pstate, struct Instr *instr)
 			uint32_t i;
 
 			instr->data.br_table.labelidxs =
-			    calloc(instr->data.br_table.n_labelidxs,
-				   sizeof(int));
+			    wasmjit_arena_calloc(pstate->arena,
+						 instr->data.br_table.n_labelidxs,
+						 sizeof(int));
 			if (!instr->data.br_table.labelidxs)
 				goto error;
 
@@ -797,6 +937,83 @@ int read_instruction(struct ParseState *pstate, struct Instr *instr)
 			goto error;
 
 		break;
+	case OPCODE_ATOMIC_PREFIX:
+		ret = read_uint8_t(pstate, &instr->data.atomic.opcode);
+		if (!ret)
+			goto error;
+
+		if (instr->data.atomic.opcode == OPCODE_ATOMIC_FENCE) {
+			uint8_t nullb;
+			ret = read_uint8_t(pstate, &nullb);
+			if (!ret)
+				goto error;
+
+			if (nullb)
+				goto error;
+
+			break;
+		}
+
+		if ((instr->data.atomic.opcode > OPCODE_ATOMIC_FENCE &&
+		     instr->data.atomic.opcode < OPCODE_ATOMIC_I32_LOAD) ||
+		    instr->data.atomic.opcode >= OPCODE_ATOMIC_LAST)
+			goto error;
+
+		ret = read_uleb_uint32_t(pstate, &instr->data.atomic.memarg.align);
+		if (!ret)
+			goto error;
+
+		ret = read_uleb_uint32_t(pstate, &instr->data.atomic.memarg.offset);
+		if (!ret)
+			goto error;
+
+		break;
+	case OPCODE_MISC_PREFIX: {
+		uint32_t misc_opcode;
+		uint8_t nullb;
+
+		ret = read_uleb_uint32_t(pstate, &misc_opcode);
+		if (!ret)
+			goto error;
+
+		if (misc_opcode != OPCODE_MISC_MEMORY_COPY &&
+		    misc_opcode != OPCODE_MISC_MEMORY_FILL)
+			goto error;
+
+		instr->data.misc.opcode = misc_opcode;
+
+		/* reserved memory index, memory.copy has two */
+		ret = read_uint8_t(pstate, &nullb);
+		if (!ret)
+			goto error;
+
+		if (nullb)
+			goto error;
+
+		if (misc_opcode == OPCODE_MISC_MEMORY_COPY) {
+			ret = read_uint8_t(pstate, &nullb);
+			if (!ret)
+				goto error;
+
+			if (nullb)
+				goto error;
+		}
+
+		break;
+	}
+	case OPCODE_MEMORY_SIZE:
+	case OPCODE_MEMORY_GROW: {
+		/* reserved memory index */
+		uint8_t nullb;
+		ret = read_uint8_t(pstate, &nullb);
+		if (!ret)
+			goto error;
+
+		if (nullb)
+			goto error;
+
+		break;
+	}
 	case OPCODE_I32_CONST:
 		ret = read_leb_uint32_t(pstate, &instr->data.i32_const.value);
 		if (!ret)
@@ -822,8 +1039,6 @@ int read_instruction(struct ParseState *pstate, struct Instr *instr)
 	case OPCODE_RETURN:
 	case OPCODE_DROP:
 	case OPCODE_SELECT:
-	case OPCODE_MEMORY_SIZE:
-	case OPCODE_MEMORY_GROW:
 	case OPCODE_I32_EQZ:
 	case OPCODE_I32_EQ:
 	case OPCODE_I32_NE:
@@ -962,165 +1177,348 @@ int read_instructions(struct ParseState *pstate,
 		      struct Instr **root_instructions,
 		      size_t *root_n_instructions)
 {
+	/*
+	  Instructions of every open block accumulate in one scratch
+	  vector, a block's list is copied into the arena once its
+	  terminal is read so every list is allocated exactly once.
+	 */
 	struct Instr instruction;
 	int ret;
-	size_t n_ctxts;
-	struct StackElt {
-		struct Instr **instructions;
-		size_t *n_instructions;
-		int allow_else;
-	} *stack, *new_stack;
-
-	init_instruction(&instruction);
-
-	n_ctxts = 1;
-	stack = malloc(sizeof(stack[0]));
-	if (!stack)
-		goto error;
+	struct {
+		size_t n_elts;
+		size_t capacity;
+		struct Instr *elts;
+	} scratch = { 0, 0, NULL };
+	struct {
+		size_t n_elts;
+		size_t capacity;
+		struct InstrCtx {
+			size_t start;
+			int in_else;
+		} *elts;
+	} ctxs = { 0, 0, NULL };
 
 	assert(!*root_instructions);
 	assert(!*root_n_instructions);
 
-	stack[0].instructions = root_instructions;
-	stack[0].n_instructions = root_n_instructions;
-	stack[0].allow_else = 0;
-
-	while (n_ctxts) {
-		struct Instr **instructions;
-		size_t *n_instructions;
-		int allow_else;
+	if (!wasmjit_vector_reserve(&ctxs.elts, &ctxs.capacity, 1,
+				    sizeof(ctxs.elts[0])))
+		goto error;
+	ctxs.elts[0].start = 0;
+	ctxs.elts[0].in_else = 0;
+	ctxs.n_elts = 1;
 
-		/* get item at top of stack */
-		instructions = stack[n_ctxts - 1].instructions;
-		n_instructions = stack[n_ctxts - 1].n_instructions;
-		allow_else = stack[n_ctxts - 1].allow_else;
+	while (1) {
+		init_instruction(&instruction);
 
-		/* shrink stack */
-		n_ctxts -= 1;
-		new_stack = realloc(stack, n_ctxts * sizeof(stack[0]));
-		if (!new_stack && n_ctxts)
+		ret = read_instruction(pstate, &instruction);
+		if (!ret)
 			goto error;
-		stack = new_stack;
-
-		while (1) {
-			struct Instr *next_instructions;
-			size_t new_len;
-			size_t size;
 
-			ret = read_instruction(pstate, &instruction);
-			if (!ret)
-				goto error;
+		if (instruction.opcode == BLOCK_TERMINAL ||
+		    instruction.opcode == ELSE_TERMINAL) {
+			struct InstrCtx *ctx = &ctxs.elts[ctxs.n_elts - 1];
+			struct Instr *instructions = NULL;
+			size_t n_instructions = scratch.n_elts - ctx->start;
+			struct Instr *parent;
+
+			if (n_instructions) {
+				instructions =
+				    wasmjit_arena_calloc(pstate->arena,
+							 n_instructions,
+							 sizeof(struct Instr));
+				if (!instructions)
+					goto error;
+				memcpy(instructions, &scratch.elts[ctx->start],
+				       n_instructions * sizeof(struct Instr));
+			}
+			scratch.n_elts = ctx->start;
 
-			if (instruction.opcode == BLOCK_TERMINAL) {
-				break;
-			} else if (instruction.opcode == ELSE_TERMINAL) {
-				if (!allow_else)
+			if (ctxs.n_elts == 1) {
+				if (instruction.opcode != BLOCK_TERMINAL)
 					goto error;
+				*root_instructions = instructions;
+				*root_n_instructions = n_instructions;
+				break;
+			}
 
-				/* start reading else clause,
-				   push the else clause onto the stack
-				 */
+			parent = &scratch.elts[ctx->start - 1];
 
-				/* increase stack size */
-				n_ctxts += 1;
-				new_stack = realloc(stack, n_ctxts * sizeof(stack[0]));
-				if (!new_stack)
+			if (instruction.opcode == ELSE_TERMINAL) {
+				if (parent->opcode != OPCODE_IF || ctx->in_else)
 					goto error;
-				stack = new_stack;
-
-				{
-					/* we get the else clause from our parent, we should
-					   be the previous element on the stack */
-					struct StackElt *last_stack_elt = &stack[n_ctxts - 2];
-					struct Instr *last_instr = &(*last_stack_elt->instructions)[*last_stack_elt->n_instructions - 1];
-					struct IfExtra *extra = &last_instr->data.if_;
-					assert(last_instr->opcode == OPCODE_IF);
-
-					assert(!extra->instructions_else);
-					assert(!extra->n_instructions_else);
-
-					/* push parent onto stack first, so we can pick up
-					   where we left off */
-					stack[n_ctxts - 1].instructions = &extra->instructions_else;
-					stack[n_ctxts - 1].n_instructions = &extra->n_instructions_else;
-					stack[n_ctxts - 1].allow_else = 0;
-				}
-				break;
+				parent->data.if_.instructions_then = instructions;
+				parent->data.if_.n_instructions_then = n_instructions;
+				ctx->in_else = 1;
+				continue;
 			}
 
-			new_len = *n_instructions + 1;
+			if (parent->opcode == OPCODE_IF) {
+				if (ctx->in_else) {
+					parent->data.if_.instructions_else = instructions;
+					parent->data.if_.n_instructions_else = n_instructions;
+				} else {
+					parent->data.if_.instructions_then = instructions;
+					parent->data.if_.n_instructions_then = n_instructions;
+				}
+			} else {
+				struct BlockLoopExtra *block;
 
-			if (__builtin_umull_overflow
-			    (new_len, sizeof(struct Instr), &size)) {
-				goto error;
+				assert(parent->opcode == OPCODE_BLOCK ||
+				       parent->opcode == OPCODE_LOOP);
+				block = parent->opcode == OPCODE_BLOCK
+					? &parent->data.block : &parent->data.loop;
+				block->instructions = instructions;
+				block->n_instructions = n_instructions;
 			}
 
-			next_instructions = realloc(*instructions, size);
-			if (!next_instructions) {
+			ctxs.n_elts -= 1;
+			continue;
+		}
+
+		if (!wasmjit_vector_reserve(&scratch.elts, &scratch.capacity,
+					    scratch.n_elts + 1,
+					    sizeof(scratch.elts[0])))
+			goto error;
+		scratch.elts[scratch.n_elts++] = instruction;
+
+		if (instruction.opcode == OPCODE_BLOCK ||
+		    instruction.opcode == OPCODE_LOOP ||
+		    instruction.opcode == OPCODE_IF) {
+			/* we read the beginning of a block,
+			   its body follows */
+			if (!wasmjit_vector_reserve(&ctxs.elts, &ctxs.capacity,
+						    ctxs.n_elts + 1,
+						    sizeof(ctxs.elts[0])))
 				goto error;
-			}
+			ctxs.elts[ctxs.n_elts].start = scratch.n_elts;
+			ctxs.elts[ctxs.n_elts].in_else = 0;
+			ctxs.n_elts += 1;
+		}
+	}
 
-			next_instructions[new_len - 1] = instruction;
-			init_instruction(&instruction);
+	ret = 1;
+	if (0) {
+	error:
+		ret = 0;
+	}
 
-			*instructions = next_instructions;
-			*n_instructions = new_len;
+	if (scratch.elts)
+		free(scratch.elts);
 
-			if (next_instructions[new_len - 1].opcode == OPCODE_BLOCK ||
-			    next_instructions[new_len - 1].opcode == OPCODE_LOOP ||
-			    next_instructions[new_len - 1].opcode == OPCODE_IF) {
-				/* we read the beginning of a block,
-				   we have to recurse */
-				n_ctxts += 2;
-				new_stack = realloc(stack, n_ctxts * sizeof(stack[0]));
-				if (!new_stack)
-					goto error;
-				stack = new_stack;
+	if (ctxs.elts)
+		free(ctxs.elts);
 
-				/* push parent onto stack first, so we can pick up
-				   where we left off */
-				stack[n_ctxts - 2].instructions = instructions;
-				stack[n_ctxts - 2].n_instructions = n_instructions;
-				stack[n_ctxts - 2].allow_else = allow_else;
-			}
+	return ret;
+}
 
-			if (next_instructions[new_len - 1].opcode == OPCODE_BLOCK ||
-			    next_instructions[new_len - 1].opcode == OPCODE_LOOP) {
-				struct BlockLoopExtra *block;
+static void compact_instruction(const struct Instr *instr,
+				struct CompactInstr *record)
+{
+	record->opcode = instr->opcode;
+	record->aux = 0;
+	record->a = 0;
+	record->b = 0;
 
-				block = instruction.opcode == OPCODE_BLOCK
-					? &next_instructions[new_len - 1].data.block
-					: &next_instructions[new_len - 1].data.loop;
+	switch (instr->opcode) {
+	case OPCODE_BLOCK:
+	case OPCODE_LOOP:
+		record->aux = instr->data.block.blocktype;
+		break;
+	case OPCODE_IF:
+		record->aux = instr->data.if_.blocktype;
+		break;
+	case OPCODE_BR:
+	case OPCODE_BR_IF:
+		record->a = instr->data.br.labelidx;
+		break;
+	case OPCODE_CALL:
+		record->a = instr->data.call.funcidx;
+		break;
+	case OPCODE_CALL_INDIRECT:
+		record->a = instr->data.call_indirect.typeidx;
+		break;
+	case OPCODE_GET_LOCAL:
+	case OPCODE_SET_LOCAL:
+	case OPCODE_TEE_LOCAL:
+		record->a = instr->data.get_local.localidx;
+		break;
+	case OPCODE_GET_GLOBAL:
+	case OPCODE_SET_GLOBAL:
+		record->a = instr->data.get_global.globalidx;
+		break;
+	case OPCODE_MISC_PREFIX:
+		record->aux = instr->data.misc.opcode;
+		break;
+	case OPCODE_ATOMIC_PREFIX:
+		record->aux = instr->data.atomic.opcode;
+		record->a = instr->data.atomic.memarg.align;
+		record->b = instr->data.atomic.memarg.offset;
+		break;
+	case OPCODE_I32_CONST:
+		record->a = instr->data.i32_const.value;
+		break;
+	case OPCODE_I64_CONST:
+		record->b = instr->data.i64_const.value;
+		break;
+	case OPCODE_F32_CONST:
+		memcpy(&record->a, &instr->data.f32_const.value,
+		       sizeof(record->a));
+		break;
+	case OPCODE_F64_CONST:
+		memcpy(&record->b, &instr->data.f64_const.value,
+		       sizeof(record->b));
+		break;
+	default:
+		if (instr->opcode >= OPCODE_I32_LOAD &&
+		    instr->opcode <= OPCODE_I64_STORE32) {
+			record->a = instr->data.i32_load.align;
+			record->b = instr->data.i32_load.offset;
+		}
+		break;
+	}
+}
+
+/*
+  Decodes an expression into fixed size records instead of an Instr
+  tree: one allocation for the records and one for all br_table
+  targets, and block bodies are found through the else and end
+  indices stored with their opening record.
+ */
+static int read_compact_instructions(struct ParseState *pstate,
+				     struct CompactCode *code)
+{
+	int ret;
+	struct WasmJITArena scratch_arena;
+	struct WasmJITArena *arena = pstate->arena;
+	int done = 0;
+	struct {
+		size_t n_elts;
+		size_t capacity;
+		struct CompactInstr *elts;
+	} records = { 0, 0, NULL };
+	struct {
+		size_t n_elts;
+		size_t capacity;
+		uint32_t *elts;
+	} targets = { 0, 0, NULL };
+	struct {
+		size_t n_elts;
+		size_t capacity;
+		size_t *elts;
+	} open = { 0, 0, NULL };
+
+	/* read_instruction allocates br_table targets, which are
+	   copied into the side table instead */
+	wasmjit_arena_init(&scratch_arena);
+	pstate->arena = &scratch_arena;
+
+	while (!done) {
+		struct Instr instruction;
+		struct CompactInstr *record;
+
+		init_instruction(&instruction);
+		if (!read_instruction(pstate, &instruction))
+			goto error;
 
-				assert(!block->instructions);
-				assert(!block->n_instructions);
+		if (records.n_elts >= UINT32_MAX)
+			goto error;
 
-				stack[n_ctxts - 1].instructions = &block->instructions;
-				stack[n_ctxts - 1].n_instructions = &block->n_instructions;
-				stack[n_ctxts - 1].allow_else = 0;
+		if (!wasmjit_vector_reserve(&records.elts, &records.capacity,
+					    records.n_elts + 1,
+					    sizeof(records.elts[0])))
+			goto error;
+		record = &records.elts[records.n_elts];
+		compact_instruction(&instruction, record);
+
+		switch (instruction.opcode) {
+		case OPCODE_BLOCK:
+		case OPCODE_LOOP:
+		case OPCODE_IF:
+			if (!wasmjit_vector_reserve(&open.elts, &open.capacity,
+						    open.n_elts + 1,
+						    sizeof(open.elts[0])))
+				goto error;
+			open.elts[open.n_elts++] = records.n_elts;
+			break;
+		case OPCODE_BR_TABLE: {
+			uint32_t n = instruction.data.br_table.n_labelidxs;
 
-				break;
-			} else if (next_instructions[new_len - 1].opcode == OPCODE_IF) {
-				struct IfExtra *extra = &next_instructions[new_len - 1].data.if_;
+			if (!wasmjit_vector_reserve(&targets.elts,
+						    &targets.capacity,
+						    targets.n_elts + n + 1,
+						    sizeof(targets.elts[0])))
+				goto error;
+			record->a = targets.n_elts;
+			record->b = n;
+			if (n)
+				memcpy(&targets.elts[targets.n_elts],
+				       instruction.data.br_table.labelidxs,
+				       n * sizeof(targets.elts[0]));
+			targets.elts[targets.n_elts + n] =
+				instruction.data.br_table.labelidx;
+			targets.n_elts += n + 1;
+			break;
+		}
+		case ELSE_TERMINAL: {
+			struct CompactInstr *parent;
 
-				stack[n_ctxts - 1].instructions = &extra->instructions_then;
-				stack[n_ctxts - 1].n_instructions = &extra->n_instructions_then;
-				stack[n_ctxts - 1].allow_else = 1;
-				break;
+			if (!open.n_elts)
+				goto error;
+			parent = &records.elts[open.elts[open.n_elts - 1]];
+			if (parent->opcode != OPCODE_IF || parent->a)
+				goto error;
+			parent->a = records.n_elts;
+			break;
+		}
+		case BLOCK_TERMINAL:
+			/* the end of the expression itself */
+			if (!open.n_elts)
+				done = 1;
+			else {
+				open.n_elts -= 1;
+				records.elts[open.elts[open.n_elts]].b =
+					records.n_elts;
 			}
+			break;
 		}
+
+		records.n_elts += 1;
 	}
 
-	assert(ret);
+	code->instrs = wasmjit_arena_dup(arena, records.elts,
+					 records.n_elts *
+					 sizeof(records.elts[0]));
+	if (!code->instrs)
+		goto error;
+	code->n_instrs = records.n_elts;
+
+	if (targets.n_elts) {
+		code->br_table_targets =
+			wasmjit_arena_dup(arena, targets.elts,
+					  targets.n_elts *
+					  sizeof(targets.elts[0]));
+		if (!code->br_table_targets)
+			goto error;
+	}
+
+	ret = 1;
 	if (0) {
 	error:
 		ret = 0;
 	}
 
-	if (stack)
-		free(stack);
+	pstate->arena = arena;
+	wasmjit_arena_free(&scratch_arena);
+
+	if (records.elts)
+		free(records.elts);
 
-	free_instruction(&instruction);
+	if (targets.elts)
+		free(targets.elts);
+
+	if (open.elts)
+		free(open.elts);
 
 	return ret;
 }
@@ -1138,8 +1536,9 @@ int read_global_section(struct ParseState *pstate,
 		uint32_t i;
 
 		global_section->globals =
-		    calloc(global_section->n_globals,
-			   sizeof(struct GlobalSectionGlobal));
+		    wasmjit_arena_calloc(pstate->arena,
+					 global_section->n_globals,
+					 sizeof(struct GlobalSectionGlobal));
 		if (!global_section->globals)
 			goto error;
 
@@ -1180,8 +1579,9 @@ int read_export_section(struct ParseState *pstate,
 		uint32_t i;
 
 		export_section->exports =
-		    calloc(export_section->n_exports,
-			   sizeof(struct ExportSectionExport));
+		    wasmjit_arena_calloc(pstate->arena,
+					 export_section->n_exports,
+					 sizeof(struct ExportSectionExport));
 		if (!export_section->exports)
 			goto error;
 
@@ -1229,8 +1629,9 @@ int read_element_section(struct ParseState *pstate,
 		uint32_t i;
 
 		element_section->elements =
-		    calloc(element_section->n_elements,
-			   sizeof(struct ElementSectionElement));
+		    wasmjit_arena_calloc(pstate->arena,
+					 element_section->n_elements,
+					 sizeof(struct ElementSectionElement));
 		if (!element_section->elements)
 			goto error;
 
@@ -1257,8 +1658,9 @@ int read_element_section(struct ParseState *pstate,
 				uint32_t j;
 
 				element->funcidxs =
-				    calloc(element->n_funcidxs,
-					   sizeof(uint32_t));
+				    wasmjit_arena_calloc(pstate->arena,
+							 element->n_funcidxs,
+							 sizeof(uint32_t));
 				if (!element->funcidxs)
 					goto error;
 
@@ -1280,80 +1682,190 @@ int read_element_section(struct ParseState *pstate,
 	return 0;
 }
 
+static int read_code_section_code(struct ParseState *pstate,
+				  struct CodeSectionCode *code,
+				  unsigned flags)
+{
+	int ret;
+
+	ret = read_uleb_uint32_t(pstate, &code->n_locals);
+	if (!ret)
+		goto error;
+
+	if (code->n_locals) {
+		uint32_t j;
+
+		code->locals =
+		    wasmjit_arena_calloc(pstate->arena,
+					 code->n_locals,
+					 sizeof(struct CodeSectionCodeLocal));
+		if (!code->locals)
+			goto error;
+
+		for (j = 0; j < code->n_locals; ++j) {
+			struct CodeSectionCodeLocal
+			*code_local = &code->locals[j];
+
+			ret =
+			    read_uleb_uint32_t(pstate,
+					       &code_local->
+					       count);
+			if (!ret)
+				goto error;
+
+			ret =
+			    read_uint8_t(pstate,
+					 &code_local->valtype);
+			if (!ret)
+				goto error;
+		}
+	}
+
+	if (flags & WASMJIT_PARSE_FLAGS_RAW_CODE) {
+		code->body = pstate->input;
+		code->body_size = pstate->amt_left;
+		return 1;
+	}
+
+	if (flags & WASMJIT_PARSE_FLAGS_COMPACT_CODE)
+		ret = read_compact_instructions(pstate, &code->compact);
+	else
+		ret = read_instructions(pstate,
+					&code->instructions,
+					&code->n_instructions);
+	if (!ret)
+		goto error;
+
+	/* the expression must end exactly where the entry does */
+	if (pstate->amt_left)
+		goto error;
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+/* below this much code, starting threads costs more than it saves */
+#define PARALLEL_CODE_MIN_BYTES (256 * 1024)
+
+struct ParallelCodes {
+	struct CodeSection *code_section;
+	const char **starts;
+	struct WasmJITArena *arenas;
+	unsigned flags;
+};
+
+static int read_code_section_code_worker(void *ctx, unsigned worker,
+					 size_t i)
+{
+	struct ParallelCodes *job = ctx;
+	struct CodeSectionCode *code = &job->code_section->codes[i];
+	struct ParseState pstate;
+
+	if (!init_pstate(&pstate, job->starts[i], code->size))
+		return 0;
+	pstate.arena = &job->arenas[worker];
+
+	return read_code_section_code(&pstate, code, job->flags);
+}
+
 int read_code_section(struct ParseState *pstate,
-		      struct CodeSection *code_section)
+		      struct CodeSection *code_section,
+		      unsigned flags)
 {
 	int ret;
+	const char **starts = NULL;
+	struct WasmJITArena arenas[WASMJIT_MAX_WORKERS];
+	unsigned i, n_workers = 0;
+	size_t code_bytes = 0;
 
 	ret = read_uleb_uint32_t(pstate, &code_section->n_codes);
 	if (!ret)
 		goto error;
 
 	if (code_section->n_codes) {
-		uint32_t i;
+		struct ParallelCodes job;
+		uint32_t j;
 
 		code_section->codes =
-		    calloc(code_section->n_codes,
-			   sizeof(struct CodeSectionCode));
+		    wasmjit_arena_calloc(pstate->arena,
+					 code_section->n_codes,
+					 sizeof(struct CodeSectionCode));
 		if (!code_section->codes)
 			goto error;
 
-		for (i = 0; i < code_section->n_codes; ++i) {
-			struct CodeSectionCode *code = &code_section->codes[i];
+		starts = calloc(code_section->n_codes, sizeof(starts[0]));
+		if (!starts)
+			goto error;
+
+		/* every entry is size prefixed, so find them all first
+		   and decode them independently afterwards */
+		for (j = 0; j < code_section->n_codes; ++j) {
+			struct CodeSectionCode *code = &code_section->codes[j];
 
 			ret = read_uleb_uint32_t(pstate, &code->size);
 			if (!ret)
 				goto error;
 
-			ret = read_uleb_uint32_t(pstate, &code->n_locals);
+			starts[j] = pstate->input;
+
+			ret = advance_parser(pstate, code->size);
 			if (!ret)
 				goto error;
 
-			if (code->n_locals) {
-				uint32_t j;
+			code_bytes += code->size;
+		}
 
-				code->locals =
-				    calloc(code->n_locals,
-					   sizeof(struct CodeSectionCodeLocal));
-				if (!code->locals)
-					goto error;
+		/* raw bodies only need their locals decoded */
+		n_workers = flags & WASMJIT_PARSE_FLAGS_RAW_CODE
+			? 1
+			: wasmjit_parallel_workers(code_bytes,
+						   PARALLEL_CODE_MIN_BYTES);
 
-				for (j = 0; j < code->n_locals; ++j) {
-					struct CodeSectionCodeLocal
-					*code_local = &code->locals[j];
+		for (i = 0; i < n_workers; ++i) {
+			wasmjit_arena_init(&arenas[i]);
+		}
 
-					ret =
-					    read_uleb_uint32_t(pstate,
-							       &code_local->
-							       count);
-					if (!ret)
-						goto error;
+		job.code_section = code_section;
+		job.starts = starts;
+		job.arenas = arenas;
+		job.flags = flags;
 
-					ret =
-					    read_uint8_t(pstate,
-							 &code_local->valtype);
-					if (!ret)
-						goto error;
-				}
-			}
+		if (n_workers == 1) {
+			/* allocate straight from the module */
+			job.arenas = pstate->arena;
+		}
 
-			ret =
-			    read_instructions(pstate,
-					      &code->instructions,
-					      &code->n_instructions);
-			if (!ret)
-				goto error;
+		ret = wasmjit_parallel_for(n_workers, code_section->n_codes,
+					   read_code_section_code_worker,
+					   &job);
+		if (!ret)
+			goto error;
+	}
+
+	ret = 1;
+
+	if (0) {
+	error:
+		ret = 0;
+	}
+
+	if (n_workers > 1) {
+		/* on error too, partially decoded bodies may point here */
+		for (i = 0; i < n_workers; ++i) {
+			wasmjit_arena_adopt(pstate->arena, &arenas[i]);
 		}
 	}
 
-	return 1;
+	free(starts);
 
- error:
-	return 0;
+	return ret;
 }
 
 int read_data_section(struct ParseState *pstate,
-		      struct DataSection *data_section)
+		      struct DataSection *data_section,
+		      unsigned flags)
 {
 	int ret;
 
@@ -1365,8 +1877,9 @@ int read_data_section(struct ParseState *pstate,
 		uint32_t i;
 
 		data_section->datas =
-		    calloc(data_section->n_datas,
-			   sizeof(struct DataSectionData));
+		    wasmjit_arena_calloc(pstate->arena,
+					 data_section->n_datas,
+					 sizeof(struct DataSectionData));
 		if (!data_section->datas)
 			goto error;
 
@@ -1384,7 +1897,10 @@ int read_data_section(struct ParseState *pstate,
 			if (!ret)
 				goto error;
 
-			data->buf = read_buffer(pstate, &data->buf_size);
+			if (flags & WASMJIT_PARSE_FLAGS_BORROW_INPUT)
+				data->buf = borrow_buffer(pstate, &data->buf_size);
+			else
+				data->buf = read_buffer(pstate, &data->buf_size);
 			if (!data->buf)
 				goto error;
 		}
@@ -1396,9 +1912,159 @@ int read_data_section(struct ParseState *pstate,
 	return 0;
 }
 
-int read_module(struct ParseState *pstate, struct Module *module,
-		char *why, size_t why_size)
+static int read_custom_section(struct ParseState *pstate,
+			       struct Module *module,
+			       uint32_t size, unsigned flags)
 {
+	struct ParseState section;
+	struct CustomSection *custom, **last;
+
+	if (!init_pstate(&section, pstate->input, size))
+		return 0;
+	section.arena = pstate->arena;
+
+	if (!advance_parser(pstate, size))
+		return 0;
+
+	custom = wasmjit_arena_alloc(pstate->arena, sizeof(*custom));
+	if (!custom)
+		return 0;
+
+	custom->name = read_string(&section);
+	if (!custom->name)
+		return 0;
+
+	/* the rest of the section is its payload */
+	custom->buf_size = section.amt_left;
+	if (flags & WASMJIT_PARSE_FLAGS_BORROW_INPUT) {
+		custom->buf = section.input;
+	} else {
+		custom->buf = wasmjit_arena_dup(pstate->arena, section.input,
+						section.amt_left);
+		if (section.amt_left && !custom->buf)
+			return 0;
+	}
+	custom->next = NULL;
+
+	for (last = &module->custom_sections; *last; last = &(*last)->next)
+		;
+	*last = custom;
+
+	return 1;
+}
+
+const struct CustomSection *
+wasmjit_find_custom_section(const struct Module *module, const char *name)
+{
+	const struct CustomSection *custom;
+
+	for (custom = module->custom_sections; custom; custom = custom->next) {
+		if (!strcmp(custom->name, name))
+			return custom;
+	}
+
+	return NULL;
+}
+
+/* reads the function subsection of a "name" section, if it has one */
+static int read_function_names(struct ParseState *pstate,
+			       struct FunctionNames *function_names)
+{
+	while (pstate->amt_left) {
+		uint8_t id;
+		uint32_t size, n_names, i;
+		struct ParseState sub;
+
+		if (!read_uint8_t(pstate, &id))
+			return 0;
+		if (!read_uleb_uint32_t(pstate, &size))
+			return 0;
+		if (!init_pstate(&sub, pstate->input, size))
+			return 0;
+		if (!advance_parser(pstate, size))
+			return 0;
+
+		if (id != NAME_SUBSECTION_FUNCTIONS)
+			continue;
+
+		if (!read_uleb_uint32_t(&sub, &n_names))
+			return 0;
+
+		/* each entry takes at least two bytes */
+		if (n_names > sub.amt_left / 2)
+			return 0;
+
+		function_names->names =
+			wasmjit_arena_calloc(pstate->arena, n_names,
+					     sizeof(function_names->names[0]));
+		if (n_names && !function_names->names)
+			return 0;
+
+		for (i = 0; i < n_names; ++i) {
+			struct FunctionName *name = &function_names->names[i];
+
+			if (!read_uleb_uint32_t(&sub, &name->funcidx))
+				return 0;
+
+			/* the spec requires increasing indices, which
+			   lookups rely on */
+			if (i && name->funcidx <= name[-1].funcidx)
+				return 0;
+
+			name->name = borrow_buffer(&sub, &name->name_size);
+			if (!name->name)
+				return 0;
+		}
+
+		function_names->n_names = n_names;
+		return 1;
+	}
+
+	return 1;
+}
+
+const char *wasmjit_function_name(struct Module *module, uint32_t funcidx,
+				  uint32_t *name_size)
+{
+	struct FunctionNames *function_names = &module->function_names;
+	size_t lo, hi;
+
+	if (!function_names->built) {
+		const struct CustomSection *custom;
+
+		custom = wasmjit_find_custom_section(module, "name");
+		if (custom) {
+			struct ParseState pstate;
+
+			init_pstate(&pstate, custom->buf, custom->buf_size);
+			pstate.arena = &module->arena;
+			/* a malformed name section only costs us names */
+			if (!read_function_names(&pstate, function_names))
+				function_names->n_names = 0;
+		}
+		function_names->built = 1;
+	}
+
+	lo = 0;
+	hi = function_names->n_names;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const struct FunctionName *name = &function_names->names[mid];
+
+		if (name->funcidx == funcidx) {
+			*name_size = name->name_size;
+			return name->name;
+		}
+
+		if (name->funcidx < funcidx)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return NULL;
+}
+
 #ifdef READ
 #undef READ
 #endif
@@ -1422,8 +2088,9 @@ int read_module(struct ParseState *pstate, struct Module *module,
 	}								\
 	while (0)
 
-	/* TODO: assert module is null */
-
+static int read_module_header(struct ParseState *pstate,
+			      char *why, size_t why_size)
+{
 	/* check magic */
 	{
 		uint32_t magic;
@@ -1457,6 +2124,83 @@ int read_module(struct ParseState *pstate, struct Module *module,
 
 	}
 
+	return 1;
+}
+
+static int read_section(struct ParseState *pstate, struct Module *module,
+			uint8_t id, uint32_t size, unsigned flags,
+			char *why, size_t why_size)
+{
+	switch (id) {
+	case SECTION_ID_CUSTOM:
+		READ("custom section", read_custom_section, module, size,
+		     flags);
+		break;
+	case SECTION_ID_TYPE:
+		READ("type section", read_type_section,
+		     &module->type_section);
+		break;
+	case SECTION_ID_IMPORT:
+		READ("import section", read_import_section,
+		     &module->import_section);
+		break;
+	case SECTION_ID_FUNCTION:
+		READ("function section", read_function_section,
+		     &module->function_section);
+		break;
+	case SECTION_ID_TABLE:
+		READ("table section", read_table_section,
+		     &module->table_section);
+		break;
+	case SECTION_ID_MEMORY:
+		READ("memory section", read_memory_section,
+		     &module->memory_section);
+		break;
+	case SECTION_ID_GLOBAL:
+		READ("global section", read_global_section,
+		     &module->global_section);
+		break;
+	case SECTION_ID_EXPORT:
+		READ("export section", read_export_section,
+		     &module->export_section);
+		break;
+	case SECTION_ID_START:
+		READ("start section", read_start_section,
+		     &module->start_section);
+		break;
+	case SECTION_ID_ELEMENT:
+		READ("element section", read_element_section,
+		     &module->element_section);
+		break;
+	case SECTION_ID_CODE:
+		READ("code section", read_code_section,
+		     &module->code_section, flags);
+		break;
+	case SECTION_ID_DATA:
+		READ("data section", read_data_section,
+		     &module->data_section, flags);
+		break;
+	default:
+		if (why) {
+			snprintf(why, why_size,
+				 "Unsupported wasm section: 0x%" PRIx32, id);
+		}
+		return 0;
+	}
+
+	return 1;
+}
+
+int read_module(struct ParseState *pstate, struct Module *module,
+		unsigned flags, char *why, size_t why_size)
+{
+	/* TODO: assert module is null */
+
+	pstate->arena = &module->arena;
+
+	if (!read_module_header(pstate, why, why_size))
+		return 0;
+
 	/* read sections */
 	while (1) {
 		uint8_t id;
@@ -1478,61 +2222,240 @@ int read_module(struct ParseState *pstate, struct Module *module,
 		}
 		READ("size", read_uleb_uint32_t, &size);
 
-		switch (id) {
-		case SECTION_ID_CUSTOM:
-			READ("custom section", advance_parser, size);
-			break;
-		case SECTION_ID_TYPE:
-			READ("type section", read_type_section,
-			     &module->type_section);
-			break;
-		case SECTION_ID_IMPORT:
-			READ("import section", read_import_section,
-			     &module->import_section);
-			break;
-		case SECTION_ID_FUNCTION:
-			READ("function section", read_function_section,
-			     &module->function_section);
-			break;
-		case SECTION_ID_TABLE:
-			READ("table section", read_table_section,
-			     &module->table_section);
-			break;
-		case SECTION_ID_MEMORY:
-			READ("memory section", read_memory_section,
-			     &module->memory_section);
-			break;
-		case SECTION_ID_GLOBAL:
-			READ("global section", read_global_section,
-			     &module->global_section);
-			break;
-		case SECTION_ID_EXPORT:
-			READ("export section", read_export_section,
-			     &module->export_section);
-			break;
-		case SECTION_ID_START:
-			READ("start section", read_start_section,
-			     &module->start_section);
-			break;
-		case SECTION_ID_ELEMENT:
-			READ("element section", read_element_section,
-			     &module->element_section);
-			break;
-		case SECTION_ID_CODE:
-			READ("code section", read_code_section,
-			     &module->code_section);
-			break;
-		case SECTION_ID_DATA:
-			READ("data section", read_data_section,
-			     &module->data_section);
-			break;
-		default:
-			if (why) {
-				snprintf(why, why_size,
-					 "Unsupported wasm section: 0x%" PRIx32, id);
+		if (!read_section(pstate, module, id, size, flags,
+				  why, why_size))
+			return 0;
+	}
+	return 1;
+}
+
+enum {
+	STREAM_HEADER,
+	STREAM_SECTIONS,
+	STREAM_CODES,
+};
+
+void init_module_stream(struct ModuleStream *stream, struct Module *module,
+			unsigned flags,
+			int (*on_code)(void *ctx, uint32_t codeidx,
+				       char *why, size_t why_size),
+			void *ctx)
+{
+	stream->module = module;
+	/* the buffer is reused as chunks arrive, nothing may point into it */
+	stream->flags = flags & ~WASMJIT_PARSE_FLAGS_BORROW_INPUT;
+	stream->on_code = on_code;
+	stream->ctx = ctx;
+	stream->state = STREAM_HEADER;
+	stream->n_codes_left = 0;
+	stream->section_left = 0;
+	stream->seen_code = 0;
+	stream->buf.n_elts = 0;
+	stream->buf.capacity = 0;
+	stream->buf.elts = NULL;
+}
+
+/*
+  Consumes the next complete unit of the module from pstate: the
+  header, a whole section, the start of the code section or a single
+  function body. Returns 0 if more input is needed, -1 on error.
+ */
+static int read_stream_unit(struct ModuleStream *stream,
+			    struct ParseState *pstate,
+			    char *why, size_t why_size)
+{
+	struct Module *module = stream->module;
+	struct ParseState unit;
+	uint32_t size;
+	uint8_t id;
+
+	switch (stream->state) {
+	case STREAM_HEADER:
+		if (pstate->amt_left < 2 * sizeof(uint32_t))
+			return 0;
+		if (!read_module_header(pstate, why, why_size))
+			return -1;
+		stream->state = STREAM_SECTIONS;
+		return 1;
+	case STREAM_SECTIONS:
+		if (!read_uint8_t(pstate, &id) ||
+		    !read_uleb_uint32_t(pstate, &size))
+			goto incomplete;
+
+		if (id == SECTION_ID_CODE) {
+			struct CodeSection *code_section = &module->code_section;
+			const char *start = pstate->input;
+			uint32_t n_codes;
+
+			/* on_code callers size their state by the first n_codes */
+			if (stream->seen_code)
+				goto bad_code;
+
+			if (!read_uleb_uint32_t(pstate, &n_codes))
+				goto incomplete;
+
+			stream->seen_code = 1;
+			code_section->n_codes = n_codes;
+
+			if ((size_t)(pstate->input - start) > size)
+				goto bad_code;
+
+			if (code_section->n_codes) {
+				code_section->codes =
+					wasmjit_arena_calloc(pstate->arena,
+							     code_section->n_codes,
+							     sizeof(struct CodeSectionCode));
+				if (!code_section->codes)
+					goto bad_code;
+				stream->n_codes_left = code_section->n_codes;
+				stream->section_left =
+					size - (pstate->input - start);
+				stream->state = STREAM_CODES;
+			} else if (size != (size_t)(pstate->input - start)) {
+				goto bad_code;
 			}
+
+			return 1;
+		}
+
+		if (pstate->amt_left < size)
 			return 0;
+
+		init_pstate(&unit, pstate->input, size);
+		unit.arena = pstate->arena;
+		if (!read_section(&unit, module, id, size, stream->flags,
+				  why, why_size))
+			return -1;
+
+		if (unit.amt_left) {
+			if (why)
+				snprintf(why, why_size,
+					 "Section 0x%" PRIx32 " is larger than its contents",
+					 id);
+			return -1;
 		}
+
+		advance_parser(pstate, size);
+		return 1;
+	case STREAM_CODES: {
+		struct CodeSection *code_section = &module->code_section;
+		uint32_t codeidx = code_section->n_codes - stream->n_codes_left;
+		struct CodeSectionCode *code = &code_section->codes[codeidx];
+		const char *start = pstate->input;
+
+		if (!read_uleb_uint32_t(pstate, &code->size))
+			goto incomplete;
+
+		if (code->size > stream->section_left ||
+		    (size_t)(pstate->input - start) >
+		    stream->section_left - code->size)
+			goto bad_code;
+
+		if (pstate->amt_left < code->size)
+			return 0;
+
+		init_pstate(&unit, pstate->input, code->size);
+		unit.arena = pstate->arena;
+		if (!read_code_section_code(&unit, code, stream->flags))
+			goto bad_code;
+
+		if (stream->flags & WASMJIT_PARSE_FLAGS_RAW_CODE) {
+			code->body = wasmjit_arena_dup(pstate->arena, code->body,
+						       code->body_size);
+			if (code->body_size && !code->body)
+				goto bad_code;
+		}
+
+		advance_parser(pstate, code->size);
+		stream->section_left -= pstate->input - start;
+
+		stream->n_codes_left -= 1;
+		if (!stream->n_codes_left) {
+			if (stream->section_left)
+				goto bad_code;
+			stream->state = STREAM_SECTIONS;
+		}
+
+		if (stream->on_code &&
+		    !stream->on_code(stream->ctx, codeidx, why, why_size))
+			return -1;
+
+		return 1;
 	}
+	default:
+		assert(0);
+		return -1;
+	}
+
+ incomplete:
+	if (is_eof(pstate))
+		return 0;
+	if (why)
+		snprintf(why, why_size, "Error reading section header");
+	return -1;
+
+ bad_code:
+	if (why)
+		snprintf(why, why_size, "Error reading code section");
+	return -1;
+}
+
+int feed_module_stream(struct ModuleStream *stream,
+		       const char *buf, size_t size,
+		       char *why, size_t why_size)
+{
+	size_t used = 0;
+
+	if (!wasmjit_vector_reserve(&stream->buf.elts, &stream->buf.capacity,
+				    stream->buf.n_elts + size, 1)) {
+		if (why)
+			snprintf(why, why_size, "Out of memory");
+		return 0;
+	}
+
+	memcpy(stream->buf.elts + stream->buf.n_elts, buf, size);
+	stream->buf.n_elts += size;
+
+	while (1) {
+		struct ParseState pstate;
+		int ret;
+
+		init_pstate(&pstate, stream->buf.elts + used,
+			    stream->buf.n_elts - used);
+		pstate.arena = &stream->module->arena;
+
+		ret = read_stream_unit(stream, &pstate, why, why_size);
+		if (ret < 0)
+			return 0;
+		if (!ret)
+			break;
+
+		used = pstate.input - stream->buf.elts;
+	}
+
+	/* keep only the incomplete unit, it is usually small */
+	memmove(stream->buf.elts, stream->buf.elts + used,
+		stream->buf.n_elts - used);
+	stream->buf.n_elts -= used;
+
 	return 1;
 }
+
+int finish_module_stream(struct ModuleStream *stream,
+			 char *why, size_t why_size)
+{
+	if (stream->state == STREAM_SECTIONS && !stream->buf.n_elts)
+		return 1;
+
+	if (why)
+		snprintf(why, why_size, "EOF while reading %s",
+			 stream->state == STREAM_HEADER ? "header" :
+			 stream->state == STREAM_CODES ? "code section" :
+			 "section");
+	return 0;
+}
+
+void free_module_stream(struct ModuleStream *stream)
+{
+	free(stream->buf.elts);
+}
@@ -29,14 +29,88 @@
 
 #include <wasmjit/sys.h>
 
+#define BLOCK_TERMINAL 0x0B
+#define ELSE_TERMINAL 0x05
+
 struct ParseState {
 	int eof;
 	const char *input;
 	size_t amt_left;
+	/* where decoded structures are allocated */
+	struct WasmJITArena *arena;
 };
 
+/*
+  Leave function bodies undecoded, CodeSectionCode.body then points
+  into the input buffer, which must outlive the module. The compiler
+  decodes these bodies on the fly without building an Instr tree.
+*/
+#define WASMJIT_PARSE_FLAGS_RAW_CODE 1
+/*
+  Let data segments point into the input buffer instead of copying
+  them, the input must outlive the module.
+*/
+#define WASMJIT_PARSE_FLAGS_BORROW_INPUT 2
+/*
+  Decode function bodies into CodeSectionCode.compact, a flat array
+  of fixed size records, instead of an Instr tree. Ignored along with
+  WASMJIT_PARSE_FLAGS_RAW_CODE.
+*/
+#define WASMJIT_PARSE_FLAGS_COMPACT_CODE 4
+
 int read_module(struct ParseState *pstate, struct Module *module,
-		char *why, size_t why_size);
+		unsigned flags, char *why, size_t why_size);
+
+int read_instruction(struct ParseState *pstate, struct Instr *instr);
+
+/* the first custom section called name, NULL if there is none */
+const struct CustomSection *
+wasmjit_find_custom_section(const struct Module *module, const char *name);
+
+/*
+  Name of function funcidx (imports included) from the "name" section,
+  not NUL terminated. The index is built on the first call; modules
+  that never ask for names never pay for it. Returns NULL for unnamed
+  functions.
+*/
+const char *wasmjit_function_name(struct Module *module, uint32_t funcidx,
+				  uint32_t *name_size);
+
+/*
+  Parses a module from chunks as they arrive, e.g. from a socket.
+  Sections are decoded once all of their bytes are buffered, except
+  for the code section: each function body is decoded as soon as it
+  is complete and then handed to on_code, so callers can compile it
+  while the rest of the module is still in flight. Only the
+  incomplete tail of the input is buffered.
+*/
+struct ModuleStream {
+	struct Module *module;
+	unsigned flags;
+	int (*on_code)(void *ctx, uint32_t codeidx,
+		       char *why, size_t why_size);
+	void *ctx;
+	int state;
+	uint32_t n_codes_left;
+	size_t section_left;
+	unsigned seen_code;
+	struct {
+		size_t n_elts, capacity;
+		char *elts;
+	} buf;
+};
+
+void init_module_stream(struct ModuleStream *stream, struct Module *module,
+			unsigned flags,
+			int (*on_code)(void *ctx, uint32_t codeidx,
+				       char *why, size_t why_size),
+			void *ctx);
+int feed_module_stream(struct ModuleStream *stream,
+		       const char *buf, size_t size,
+		       char *why, size_t why_size);
+int finish_module_stream(struct ModuleStream *stream,
+			 char *why, size_t why_size);
+void free_module_stream(struct ModuleStream *stream);
 
 int init_pstate(struct ParseState *pstate, const char *buf, size_t size);
 
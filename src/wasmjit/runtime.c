@@ -29,6 +29,13 @@
 
 #include <wasmjit/sys.h>
 
+#ifdef __KERNEL__
+#include <linux/uio.h>
+#else
+#include <errno.h>
+#include <sys/uio.h>
+#endif
+
 DEFINE_VECTOR_GROW(func_types, struct FuncTypeVector);
 
 
@@ -111,6 +118,23 @@ void wasmjit_free_module_inst(struct ModuleInst *module)
 	free(module);
 }
 
+void *wasmjit_get_typed_export_func(const struct ModuleInst *module_inst,
+				    const char *name,
+				    const struct FuncType *type)
+{
+	struct FuncInst *funcinst;
+
+	funcinst = wasmjit_get_export(module_inst, name,
+				      IMPORT_DESC_TYPE_FUNC).func;
+	if (!funcinst)
+		return NULL;
+
+	if (!wasmjit_typecheck_func(type, funcinst))
+		return NULL;
+
+	return funcinst->compiled_code;
+}
+
 int wasmjit_typecheck_func(const struct FuncType *type,
 			   const struct FuncInst *funcinst)
 {
@@ -139,6 +163,7 @@ int wasmjit_typecheck_memory(const struct MemoryType *type,
 	size_t msize = meminst->size / WASM_PAGE_SIZE;
 	size_t mmax = meminst->max / WASM_PAGE_SIZE;
 	return (msize >= type->limits.min &&
+		!type->limits.shared == !meminst->shared &&
 		(!type->limits.max ||
 		 (type->limits.max && mmax &&
 		  mmax <= type->limits.max)));
@@ -198,3 +223,78 @@ union ValueUnion wasmjit_invoke_function_raw(struct FuncInst *funcinst,
 #endif
 	return funcinst->invoker(values);
 }
+
+struct wasmjit_guest_iovec {
+	uint32_t iov_base;
+	uint32_t iov_len;
+};
+
+void wasmjit_free_iov(struct iovec *liov, struct iovec *fast_iov)
+{
+	if (liov != fast_iov)
+		free(liov);
+}
+
+/*
+  Builds host iovecs that point straight into linear memory, so
+  readv/writev scatter and gather without an intermediate buffer.
+  Vectors of up to WASMJIT_UIO_FASTIOV entries are converted into
+  fast_iov, so the common case never allocates. Release the result
+  with wasmjit_free_iov(). Returns a negative host errno on failure.
+*/
+long wasmjit_copy_iov(struct MemInst *meminst,
+		      uint32_t iov_user, uint32_t iov_len,
+		      struct iovec *fast_iov, struct iovec **out)
+{
+	struct iovec *liov;
+	const char *user;
+	size_t end;
+	uint32_t i;
+	int bad;
+
+	if (iov_len > WASMJIT_UIO_MAXIOV)
+		return -EINVAL;
+
+	if (__builtin_add_overflow(iov_user,
+				   (size_t) iov_len *
+				   sizeof(struct wasmjit_guest_iovec),
+				   &end) ||
+	    end > meminst->size)
+		return -EFAULT;
+
+	if (iov_len <= WASMJIT_UIO_FASTIOV) {
+		liov = fast_iov;
+	} else {
+		liov = wasmjit_alloc_vector(iov_len,
+					    sizeof(struct iovec), NULL);
+		if (!liov)
+			return -ENOMEM;
+	}
+
+	user = meminst->data + iov_user;
+
+	/* no early exit, so the bounds checks of all entries are
+	   accumulated in one pass */
+	bad = 0;
+	for (i = 0; i < iov_len; ++i) {
+		struct wasmjit_guest_iovec iov;
+
+		memcpy(&iov, user + sizeof(iov) * i, sizeof(iov));
+
+		iov.iov_base = uint32_t_swap_bytes(iov.iov_base);
+		iov.iov_len = uint32_t_swap_bytes(iov.iov_len);
+
+		bad |= (uint64_t) iov.iov_base + iov.iov_len > meminst->size;
+
+		liov[i].iov_base = meminst->data + iov.iov_base;
+		liov[i].iov_len = iov.iov_len;
+	}
+
+	if (bad) {
+		wasmjit_free_iov(liov, fast_iov);
+		return -EFAULT;
+	}
+
+	*out = liov;
+	return 0;
+}
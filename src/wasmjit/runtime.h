@@ -66,6 +66,8 @@ struct MemInst {
 	char *data;
 	size_t size;
 	size_t max; /* max of 0 means no max */
+	/* shared memories may be accessed by several threads at once */
+	unsigned shared;
 };
 
 struct GlobalInst {
@@ -149,6 +151,9 @@ enum {
 	WASMJIT_TRAP_ABORT,
 	WASMJIT_TRAP_STACK_OVERFLOW,
 	WASMJIT_TRAP_INTEGER_OVERFLOW,
+	WASMJIT_TRAP_UNALIGNED_ATOMIC,
+	WASMJIT_TRAP_INTERRUPTED,
+	WASMJIT_TRAP_UNSHARED_WAIT,
 };
 
 __attribute__ ((unused))
@@ -173,6 +178,15 @@ static const char *wasmjit_trap_reason_to_string(int reason) {
 	case WASMJIT_TRAP_STACK_OVERFLOW:
 		msg = "stack overflow";
 		break;
+	case WASMJIT_TRAP_UNALIGNED_ATOMIC:
+		msg = "unaligned atomic access";
+		break;
+	case WASMJIT_TRAP_INTERRUPTED:
+		msg = "interrupted";
+		break;
+	case WASMJIT_TRAP_UNSHARED_WAIT:
+		msg = "wait on unshared memory";
+		break;
 	default:
 		assert(0);
 		__builtin_unreachable();
@@ -186,13 +200,80 @@ struct FuncInst *wasmjit_resolve_indirect_call(const struct TableInst *tableinst
 void wasmjit_trap(int reason) __attribute__((noreturn));
 void *wasmjit_stack_top(void);
 
+/* only called for shared memories, compiled code traps on the rest */
+uint32_t wasmjit_atomic_wait(void *addr, uint64_t expected,
+			     int64_t timeout, int is64);
+uint32_t wasmjit_atomic_notify(void *addr, uint32_t count);
+
+/*
+  Guest iovec arrays, {uint32_t base, uint32_t len} in linear memory,
+  are the same for the emscripten and WASI ABIs. Limits are the
+  kernel's UIO_FASTIOV and UIO_MAXIOV.
+*/
+#define WASMJIT_UIO_FASTIOV 8
+#define WASMJIT_UIO_MAXIOV 1024
+
+struct iovec;
+
+long wasmjit_copy_iov(struct MemInst *meminst,
+		      uint32_t iov_user, uint32_t iov_len,
+		      struct iovec *fast_iov, struct iovec **out);
+void wasmjit_free_iov(struct iovec *liov, struct iovec *fast_iov);
+
 void wasmjit_free_func_inst(struct FuncInst *funcinst);
 void wasmjit_free_module_inst(struct ModuleInst *module);
 
+/* compiles a trampoline so fptr can be called as a wasm function */
+struct FuncInst *wasmjit_alloc_host_func(struct ModuleInst *module, void *fptr,
+					 wasmjit_valtype_t output, size_t n_inputs,
+					 wasmjit_valtype_t *inputs);
+
 void *wasmjit_map_code_segment(size_t code_size);
 int wasmjit_mark_code_segment_executable(void *code, size_t code_size);
 int wasmjit_unmap_code_segment(void *code, size_t code_size);
 
+/*
+  All per-thread runtime state. In user space this is a single
+  initial-exec __thread variable, in the kernel it lives in the
+  KernelThreadLocal for the current task.
+*/
+struct WasmJITThreadContext {
+	/* lowest usable stack address for compiled code */
+	void *stack_top;
+	/* innermost explicitly installed trap handler */
+	jmp_buf *jmp_buf;
+	/* saved host stack pointer of the entry frame, if any */
+	void *entry_sp;
+	volatile int interrupted;
+	/* futex word the thread sleeps on in wasmjit_atomic_wait() */
+	uint32_t wake_token;
+};
+
+struct WasmJITThreadContext *wasmjit_get_thread_context(void);
+
+/*
+  Compiled code polls the interrupt flag of the current thread context
+  on function entry and on every loop iteration, and traps with
+  WASMJIT_TRAP_INTERRUPTED once it is set. In user space on Linux a
+  thread blocked in memory.atomic.wait is woken to take it too. Both
+  functions may be called from any thread, `ctx` is the context of the
+  thread running the guest.
+  The deadline is relative to now, a deadline must be cleared before
+  its thread exits. Clearing it also drops an interrupt that was
+  raised but not yet taken, so the next call starts clean.
+*/
+void wasmjit_interrupt(struct WasmJITThreadContext *ctx);
+int wasmjit_set_deadline(struct WasmJITThreadContext *ctx, uint64_t timeout_ns);
+void wasmjit_clear_deadline(struct WasmJITThreadContext *ctx);
+
+#if !defined(__KERNEL__) && defined(__x86_64__) && defined(__ELF__)
+/* the interrupt flag is addressable as %fs:offset from compiled code */
+#define WASMJIT_INTERRUPT_FLAG_FS_RELATIVE
+uintptr_t wasmjit_interrupt_flag_fs_offset(void);
+#else
+void wasmjit_check_interrupt(void);
+#endif
+
 int wasmjit_set_stack_top(void *stack_top);
 int wasmjit_set_jmp_buf(jmp_buf *jmpbuf);
 jmp_buf *wasmjit_get_jmp_buf(void);
@@ -206,4 +287,34 @@ int wasmjit_invoke_function(struct FuncInst *funcinst,
 			    union ValueUnion *values,
 			    union ValueUnion *out);
 
+/*
+  Fast path for hosts that repeatedly call the same export:
+  wasmjit_get_typed_export_func() returns compiled_code only if the
+  export matches `type`, so the caller can cast it to the equivalent
+  C prototype and call it directly, bypassing the invoker.
+
+  Direct calls still need a trap handler. Install one once around a
+  batch of calls instead of per call:
+
+	struct WasmJITTrapContext ctx;
+	wasmjit_trap_context_install(&ctx);
+	if (!(reason = setjmp(ctx.jmpbuf))) {
+		for (...)
+			fn(...);
+	}
+	wasmjit_trap_context_uninstall(&ctx);
+*/
+
+struct WasmJITTrapContext {
+	jmp_buf jmpbuf;
+	jmp_buf *prev;
+};
+
+void *wasmjit_get_typed_export_func(const struct ModuleInst *module_inst,
+				    const char *name,
+				    const struct FuncType *type);
+
+void wasmjit_trap_context_install(struct WasmJITTrapContext *ctx);
+void wasmjit_trap_context_uninstall(struct WasmJITTrapContext *ctx);
+
 #endif
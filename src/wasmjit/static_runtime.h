@@ -115,10 +115,12 @@ void wasmjit_init_static_module(struct StaticModuleInst *smi);
    with a compiled code signature from a function with host function signature */
 
 #define CTYPE_VALTYPE_I32 uint32_t
+#define CTYPE_VALTYPE_F64 double
 #define CTYPE_VALTYPE_NULL void
 #define CTYPE(val) CTYPE_ ## val
 
 #define VALUE_MEMBER_VALTYPE_I32 i32
+#define VALUE_MEMBER_VALTYPE_F64 f64
 #define VALUE_MEMBER(val) VALUE_MEMBER_ ## val
 
 #define ITER __KMAP
@@ -136,6 +138,7 @@ void wasmjit_init_static_module(struct StaticModuleInst *smi);
 #define COMMA_1 ,
 #define COMMA_2 ,
 #define COMMA_3 ,
+#define COMMA_4 ,
 #define COMMA_IF_NOT_EMPTY(_n) CAT(COMMA_, _n)
 
 #define _DEFINE_INVOKER_VALTYPE_NULL(_module, _name, _fptr, _unused, _n, ...) \
@@ -43,19 +43,24 @@ int output_buf(struct SizedBuffer *sstack, const void *buf,
 #ifndef __KERNEL__
 
 #include <errno.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <fcntl.h>
 
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+/*
+  The file is mapped read-only rather than copied, so large data
+  segments borrowed by the parser cost no extra memory.
+*/
 char *wasmjit_load_file(const char *filename, size_t *size)
 {
-	FILE *f = NULL;
 	char *input = NULL;
 	int fd = -1, ret;
 	struct stat st;
-	size_t rets;
+	void *mapped;
 
 	fd = open(filename, O_RDONLY);
 	if (fd < 0) {
@@ -67,35 +72,22 @@ char *wasmjit_load_file(const char *filename, size_t *size)
 		goto error_exit;
 	}
 
-	f = fdopen(fd, "r");
-	if (!f) {
-		goto error_exit;
-	}
-	fd = -1;
-
-	*size = st.st_size;
-	input = malloc(st.st_size);
-	if (!input) {
+	if (!S_ISREG(st.st_mode)) {
+		errno = EINVAL;
 		goto error_exit;
 	}
 
-	rets = fread(input, sizeof(char), st.st_size, f);
-	if (rets != (size_t) st.st_size) {
+	/* mmap() refuses empty mappings */
+	mapped = mmap(NULL, st.st_size ? (size_t) st.st_size : 1,
+		      PROT_READ, MAP_PRIVATE, fd, 0);
+	if (mapped == MAP_FAILED) {
 		goto error_exit;
 	}
 
-	goto success_exit;
+	*size = st.st_size;
+	input = mapped;
 
  error_exit:
-	if (input) {
-		free(input);
-	}
-
- success_exit:
-	if (f) {
-		fclose(f);
-	}
-
 	if (fd >= 0) {
 		close(fd);
 	}
@@ -105,8 +97,91 @@ char *wasmjit_load_file(const char *filename, size_t *size)
 
 void wasmjit_unload_file(char *buf, size_t size)
 {
-	free(buf);
-	(void) size;
+	munmap(buf, size ? size : 1);
+}
+
+struct ParallelFor {
+	size_t n_items;
+	size_t next;
+	int failed;
+	int (*fn)(void *ctx, unsigned worker, size_t item);
+	void *ctx;
+};
+
+struct ParallelWorker {
+	struct ParallelFor *job;
+	unsigned worker;
+	pthread_t thread;
+};
+
+static void *parallel_for_worker(void *arg)
+{
+	struct ParallelWorker *self = arg;
+	struct ParallelFor *job = self->job;
+
+	while (!__atomic_load_n(&job->failed, __ATOMIC_RELAXED)) {
+		size_t item = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		if (item >= job->n_items)
+			break;
+		if (!job->fn(job->ctx, self->worker, item))
+			__atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+unsigned wasmjit_parallel_workers(size_t work, size_t min_work_per_worker)
+{
+	long n_cpus;
+	size_t n_workers;
+
+	n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n_cpus < 1)
+		n_cpus = 1;
+
+	n_workers = min_work_per_worker ? work / min_work_per_worker : work;
+	n_workers = MMIN(n_workers, (size_t) n_cpus);
+	n_workers = MMIN(n_workers, WASMJIT_MAX_WORKERS);
+
+	return n_workers ? n_workers : 1;
+}
+
+int wasmjit_parallel_for(unsigned n_workers, size_t n_items,
+			 int (*fn)(void *ctx, unsigned worker, size_t item),
+			 void *ctx)
+{
+	struct ParallelFor job;
+	struct ParallelWorker workers[WASMJIT_MAX_WORKERS];
+	unsigned i, n_started;
+
+	job.n_items = n_items;
+	job.next = 0;
+	job.failed = 0;
+	job.fn = fn;
+	job.ctx = ctx;
+
+	n_workers = MMIN(n_workers, WASMJIT_MAX_WORKERS);
+	if (n_workers > n_items)
+		n_workers = n_items;
+
+	/* if a thread can't be started the others pick up its share */
+	for (n_started = 1; n_started < n_workers; ++n_started) {
+		workers[n_started].job = &job;
+		workers[n_started].worker = n_started;
+		if (pthread_create(&workers[n_started].thread, NULL,
+				   parallel_for_worker, &workers[n_started]))
+			break;
+	}
+
+	workers[0].job = &job;
+	workers[0].worker = 0;
+	parallel_for_worker(&workers[0]);
+
+	for (i = 1; i < n_started; ++i) {
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	return !job.failed;
 }
 
 #else
@@ -133,4 +208,27 @@ void wasmjit_unload_file(char *buf, size_t size)
 	(void) size;
 }
 
+unsigned wasmjit_parallel_workers(size_t work, size_t min_work_per_worker)
+{
+	(void) work;
+	(void) min_work_per_worker;
+	return 1;
+}
+
+int wasmjit_parallel_for(unsigned n_workers, size_t n_items,
+			 int (*fn)(void *ctx, unsigned worker, size_t item),
+			 void *ctx)
+{
+	size_t i;
+
+	(void) n_workers;
+
+	for (i = 0; i < n_items; ++i) {
+		if (!fn(ctx, 0, i))
+			return 0;
+	}
+
+	return 1;
+}
+
 #endif
@@ -127,6 +127,19 @@ int output_buf(struct SizedBuffer *sstack, const void *buf,
 char *wasmjit_load_file(const char *filename, size_t *size);
 void wasmjit_unload_file(char *buf, size_t size);
 
+/*
+  Runs fn(ctx, worker, item) for every item in [0, n_items) on up to
+  n_workers threads, the calling thread is worker 0. Stops handing out
+  items after the first failure and returns 0 if any call failed.
+  wasmjit_parallel_workers() suggests a worker count for an amount of
+  work, it is always 1 where threads are unavailable.
+*/
+#define WASMJIT_MAX_WORKERS 16
+unsigned wasmjit_parallel_workers(size_t work, size_t min_work_per_worker);
+int wasmjit_parallel_for(unsigned n_workers, size_t n_items,
+			 int (*fn)(void *ctx, unsigned worker, size_t item),
+			 void *ctx);
+
 #define __KMAP0(to,m,...)
 #define __KMAP1(to,m,t,...) m(to,1,t)
 #define __KMAP2(to,m,t,...) m(to,2,t), __KMAP1(to,m,__VA_ARGS__)
@@ -134,6 +147,9 @@ void wasmjit_unload_file(char *buf, size_t size);
 #define __KMAP4(to,m,t,...) m(to,4,t), __KMAP3(to,m,__VA_ARGS__)
 #define __KMAP5(to,m,t,...) m(to,5,t), __KMAP4(to,m,__VA_ARGS__)
 #define __KMAP6(to,m,t,...) m(to,6,t), __KMAP5(to,m,__VA_ARGS__)
+#define __KMAP7(to,m,t,...) m(to,7,t), __KMAP6(to,m,__VA_ARGS__)
+#define __KMAP8(to,m,t,...) m(to,8,t), __KMAP7(to,m,__VA_ARGS__)
+#define __KMAP9(to,m,t,...) m(to,9,t), __KMAP8(to,m,__VA_ARGS__)
 #define __KMAP(n,...) __KMAP##n(n, __VA_ARGS__)
 
 #define MMIN(x, y) (((x) < (y)) ? (x) : (y))
@@ -0,0 +1,1020 @@
+/* -*-mode:c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+  Copyright (c) 2018 Rian Hunter
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+#include <wasmjit/validate.h>
+
+#include <wasmjit/ast.h>
+#include <wasmjit/parse.h>
+#include <wasmjit/vector.h>
+
+#include <wasmjit/sys.h>
+
+/* an operand of unknown type, only popped from unreachable code */
+#define VALTYPE_UNKNOWN 0
+
+#define MAX_PAGES 0x10000
+
+#define INVALID(...)						\
+	do {							\
+		if (validator->why)				\
+			snprintf(validator->why,		\
+				 validator->why_size,		\
+				 __VA_ARGS__);			\
+		goto error;					\
+	}							\
+	while (0)
+
+static int is_valtype(unsigned type)
+{
+	return (type == VALTYPE_I32 ||
+		type == VALTYPE_I64 ||
+		type == VALTYPE_F32 ||
+		type == VALTYPE_F64);
+}
+
+static const char *type_repr(unsigned type)
+{
+	if (type == VALTYPE_UNKNOWN)
+		return "any";
+	if (type == VALTYPE_NULL)
+		return "nothing";
+	return wasmjit_valtype_repr(type);
+}
+
+static int push_operand(struct FunctionValidator *validator,
+			wasmjit_valtype_t type)
+{
+	if (!wasmjit_vector_reserve(&validator->operands.elts,
+				    &validator->operands.capacity,
+				    validator->operands.n_elts + 1,
+				    sizeof(validator->operands.elts[0])))
+		INVALID("out of memory");
+
+	validator->operands.elts[validator->operands.n_elts++] = type;
+	return 1;
+
+ error:
+	return 0;
+}
+
+static int pop_operand(struct FunctionValidator *validator,
+		       wasmjit_valtype_t expected,
+		       wasmjit_valtype_t *actual)
+{
+	struct ValidatorFrame *frame =
+		&validator->frames.elts[validator->frames.n_elts - 1];
+	wasmjit_valtype_t type;
+
+	if (validator->operands.n_elts == frame->height) {
+		if (!frame->unreachable)
+			INVALID("type mismatch: expected %s but the stack is empty",
+				type_repr(expected));
+		type = VALTYPE_UNKNOWN;
+	} else {
+		type = validator->operands.elts[--validator->operands.n_elts];
+	}
+
+	if (expected != VALTYPE_UNKNOWN && type != VALTYPE_UNKNOWN &&
+	    type != expected)
+		INVALID("type mismatch: expected %s, got %s",
+			type_repr(expected), type_repr(type));
+
+	if (actual)
+		*actual = type;
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+static int push_frame(struct FunctionValidator *validator,
+		      uint8_t opcode, uint8_t blocktype)
+{
+	struct ValidatorFrame *frame;
+
+	if (blocktype != VALTYPE_NULL && !is_valtype(blocktype))
+		INVALID("invalid block type 0x%x", blocktype);
+
+	if (!wasmjit_vector_reserve(&validator->frames.elts,
+				    &validator->frames.capacity,
+				    validator->frames.n_elts + 1,
+				    sizeof(validator->frames.elts[0])))
+		INVALID("out of memory");
+
+	frame = &validator->frames.elts[validator->frames.n_elts++];
+	frame->opcode = opcode;
+	frame->blocktype = blocktype;
+	frame->unreachable = 0;
+	frame->height = validator->operands.n_elts;
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+/* checks that the frame's body left exactly its result on the stack */
+static int check_frame_results(struct FunctionValidator *validator)
+{
+	struct ValidatorFrame *frame =
+		&validator->frames.elts[validator->frames.n_elts - 1];
+
+	if (frame->blocktype != VALTYPE_NULL &&
+	    !pop_operand(validator, frame->blocktype, NULL))
+		return 0;
+
+	if (validator->operands.n_elts != frame->height)
+		INVALID("type mismatch: %zu extra values at end of block",
+			validator->operands.n_elts - frame->height);
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+static void set_unreachable(struct FunctionValidator *validator)
+{
+	struct ValidatorFrame *frame =
+		&validator->frames.elts[validator->frames.n_elts - 1];
+
+	validator->operands.n_elts = frame->height;
+	frame->unreachable = 1;
+}
+
+/* branching to a loop restarts it, otherwise it produces the result */
+static int label_type(struct FunctionValidator *validator,
+		      uint32_t labelidx, wasmjit_valtype_t *type)
+{
+	struct ValidatorFrame *frame;
+
+	if (labelidx >= validator->frames.n_elts)
+		INVALID("unknown label %" PRIu32, labelidx);
+
+	frame = &validator->frames.elts[validator->frames.n_elts - 1 - labelidx];
+	*type = frame->opcode == OPCODE_LOOP ? VALTYPE_NULL : frame->blocktype;
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+static int pop_call(struct FunctionValidator *validator,
+		    const struct FuncType *ft)
+{
+	size_t i;
+
+	for (i = ft->n_inputs; i > 0; --i) {
+		if (!pop_operand(validator, ft->input_types[i - 1], NULL))
+			return 0;
+	}
+
+	if (FUNC_TYPE_N_OUTPUTS(ft) &&
+	    !push_operand(validator, FUNC_TYPE_OUTPUT_TYPES(ft)[0]))
+		return 0;
+
+	return 1;
+}
+
+static int check_memarg(struct FunctionValidator *validator,
+			const struct LoadStoreExtra *memarg,
+			unsigned size_log2, int exact)
+{
+	if (!validator->module_types->n_memorytypes)
+		INVALID("unknown memory 0");
+
+	if (exact ? memarg->align != size_log2 : memarg->align > size_log2)
+		INVALID("alignment 2**%" PRIu32 " invalid for a %u byte access",
+			memarg->align, 1U << size_log2);
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+/*
+  operand and result types of the instructions that only pop and push
+  values, returns 0 if the opcode is not one of them
+ */
+static int numeric_type(uint8_t opcode, wasmjit_valtype_t *in1,
+			wasmjit_valtype_t *in2, wasmjit_valtype_t *out)
+{
+	static const struct {
+		uint8_t first, last, in1, in2, out;
+	} ranges[] = {
+		{OPCODE_I32_EQZ, OPCODE_I32_EQZ,
+		 VALTYPE_I32, VALTYPE_NULL, VALTYPE_I32},
+		{OPCODE_I32_EQ, OPCODE_I32_GE_U,
+		 VALTYPE_I32, VALTYPE_I32, VALTYPE_I32},
+		{OPCODE_I64_EQZ, OPCODE_I64_EQZ,
+		 VALTYPE_I64, VALTYPE_NULL, VALTYPE_I32},
+		{OPCODE_I64_EQ, OPCODE_I64_GE_U,
+		 VALTYPE_I64, VALTYPE_I64, VALTYPE_I32},
+		{OPCODE_F32_EQ, OPCODE_F32_GE,
+		 VALTYPE_F32, VALTYPE_F32, VALTYPE_I32},
+		{OPCODE_F64_EQ, OPCODE_F64_GE,
+		 VALTYPE_F64, VALTYPE_F64, VALTYPE_I32},
+		{OPCODE_I32_CLZ, OPCODE_I32_POPCNT,
+		 VALTYPE_I32, VALTYPE_NULL, VALTYPE_I32},
+		{OPCODE_I32_ADD, OPCODE_I32_ROTR,
+		 VALTYPE_I32, VALTYPE_I32, VALTYPE_I32},
+		{OPCODE_I64_CLZ, OPCODE_I64_POPCNT,
+		 VALTYPE_I64, VALTYPE_NULL, VALTYPE_I64},
+		{OPCODE_I64_ADD, OPCODE_I64_ROTR,
+		 VALTYPE_I64, VALTYPE_I64, VALTYPE_I64},
+		{OPCODE_F32_ABS, OPCODE_F32_SQRT,
+		 VALTYPE_F32, VALTYPE_NULL, VALTYPE_F32},
+		{OPCODE_F32_ADD, OPCODE_F32_COPYSIGN,
+		 VALTYPE_F32, VALTYPE_F32, VALTYPE_F32},
+		{OPCODE_F64_ABS, OPCODE_F64_SQRT,
+		 VALTYPE_F64, VALTYPE_NULL, VALTYPE_F64},
+		{OPCODE_F64_ADD, OPCODE_F64_COPYSIGN,
+		 VALTYPE_F64, VALTYPE_F64, VALTYPE_F64},
+		{OPCODE_I32_WRAP_I64, OPCODE_I32_WRAP_I64,
+		 VALTYPE_I64, VALTYPE_NULL, VALTYPE_I32},
+		{OPCODE_I32_TRUNC_S_F32, OPCODE_I32_TRUNC_U_F32,
+		 VALTYPE_F32, VALTYPE_NULL, VALTYPE_I32},
+		{OPCODE_I32_TRUNC_S_F64, OPCODE_I32_TRUNC_U_F64,
+		 VALTYPE_F64, VALTYPE_NULL, VALTYPE_I32},
+		{OPCODE_I64_EXTEND_S_I32, OPCODE_I64_EXTEND_U_I32,
+		 VALTYPE_I32, VALTYPE_NULL, VALTYPE_I64},
+		{OPCODE_I64_TRUNC_S_F32, OPCODE_I64_TRUNC_U_F32,
+		 VALTYPE_F32, VALTYPE_NULL, VALTYPE_I64},
+		{OPCODE_I64_TRUNC_S_F64, OPCODE_I64_TRUNC_U_F64,
+		 VALTYPE_F64, VALTYPE_NULL, VALTYPE_I64},
+		{OPCODE_F32_CONVERT_S_I32, OPCODE_F32_CONVERT_U_I32,
+		 VALTYPE_I32, VALTYPE_NULL, VALTYPE_F32},
+		{OPCODE_F32_CONVERT_U_I64, OPCODE_F32_CONVERT_S_I64,
+		 VALTYPE_I64, VALTYPE_NULL, VALTYPE_F32},
+		{OPCODE_F32_DEMOTE_F64, OPCODE_F32_DEMOTE_F64,
+		 VALTYPE_F64, VALTYPE_NULL, VALTYPE_F32},
+		{OPCODE_F64_CONVERT_S_I32, OPCODE_F64_CONVERT_U_I32,
+		 VALTYPE_I32, VALTYPE_NULL, VALTYPE_F64},
+		{OPCODE_F64_CONVERT_U_I64, OPCODE_F64_CONVERT_S_I64,
+		 VALTYPE_I64, VALTYPE_NULL, VALTYPE_F64},
+		{OPCODE_F64_PROMOTE_F32, OPCODE_F64_PROMOTE_F32,
+		 VALTYPE_F32, VALTYPE_NULL, VALTYPE_F64},
+		{OPCODE_I32_REINTERPRET_F32, OPCODE_I32_REINTERPRET_F32,
+		 VALTYPE_F32, VALTYPE_NULL, VALTYPE_I32},
+		{OPCODE_I64_REINTERPRET_F64, OPCODE_I64_REINTERPRET_F64,
+		 VALTYPE_F64, VALTYPE_NULL, VALTYPE_I64},
+		{OPCODE_F32_REINTERPRET_I32, OPCODE_F32_REINTERPRET_I32,
+		 VALTYPE_I32, VALTYPE_NULL, VALTYPE_F32},
+		{OPCODE_F64_REINTERPRET_I64, OPCODE_F64_REINTERPRET_I64,
+		 VALTYPE_I64, VALTYPE_NULL, VALTYPE_F64},
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof(ranges) / sizeof(ranges[0]); ++i) {
+		if (opcode >= ranges[i].first && opcode <= ranges[i].last) {
+			*in1 = ranges[i].in1;
+			*in2 = ranges[i].in2;
+			*out = ranges[i].out;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* access size (log2) of each memory instruction from i32.load onward */
+static const uint8_t memory_size_log2[] = {
+	2, 3, 2, 3, 0, 0, 1, 1, 0, 0, 1, 1, 2, 2,
+	2, 3, 2, 3, 0, 1, 0, 1, 2,
+};
+
+/* value type loaded or stored by each memory instruction */
+static const uint8_t memory_valtype[] = {
+	VALTYPE_I32, VALTYPE_I64, VALTYPE_F32, VALTYPE_F64,
+	VALTYPE_I32, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32,
+	VALTYPE_I64, VALTYPE_I64, VALTYPE_I64, VALTYPE_I64,
+	VALTYPE_I64, VALTYPE_I64,
+	VALTYPE_I32, VALTYPE_I64, VALTYPE_F32, VALTYPE_F64,
+	VALTYPE_I32, VALTYPE_I32, VALTYPE_I64, VALTYPE_I64, VALTYPE_I64,
+};
+
+/* same as above for the seven variants of the atomic operations */
+static const uint8_t atomic_size_log2[] = {2, 3, 0, 1, 0, 1, 2};
+static const uint8_t atomic_valtype[] = {
+	VALTYPE_I32, VALTYPE_I64, VALTYPE_I32, VALTYPE_I32,
+	VALTYPE_I64, VALTYPE_I64, VALTYPE_I64,
+};
+
+static int validate_atomic(struct FunctionValidator *validator,
+			   const struct AtomicExtra *extra)
+{
+	uint8_t op = extra->opcode;
+	unsigned variant;
+	wasmjit_valtype_t type;
+
+	switch (op) {
+	case OPCODE_ATOMIC_FENCE:
+		return 1;
+	case OPCODE_ATOMIC_NOTIFY:
+		if (!check_memarg(validator, &extra->memarg, 2, 1) ||
+		    !pop_operand(validator, VALTYPE_I32, NULL) ||
+		    !pop_operand(validator, VALTYPE_I32, NULL))
+			return 0;
+		return push_operand(validator, VALTYPE_I32);
+	case OPCODE_ATOMIC_I32_WAIT:
+	case OPCODE_ATOMIC_I64_WAIT:
+		type = op == OPCODE_ATOMIC_I64_WAIT ? VALTYPE_I64 : VALTYPE_I32;
+		if (!check_memarg(validator, &extra->memarg,
+				  op == OPCODE_ATOMIC_I64_WAIT ? 3 : 2, 1) ||
+		    !pop_operand(validator, VALTYPE_I64, NULL) ||
+		    !pop_operand(validator, type, NULL) ||
+		    !pop_operand(validator, VALTYPE_I32, NULL))
+			return 0;
+		return push_operand(validator, VALTYPE_I32);
+	}
+
+	if (op >= OPCODE_ATOMIC_I32_LOAD && op < OPCODE_ATOMIC_I32_STORE) {
+		variant = op - OPCODE_ATOMIC_I32_LOAD;
+		if (!check_memarg(validator, &extra->memarg,
+				  atomic_size_log2[variant], 1) ||
+		    !pop_operand(validator, VALTYPE_I32, NULL))
+			return 0;
+		return push_operand(validator, atomic_valtype[variant]);
+	}
+
+	if (op >= OPCODE_ATOMIC_I32_STORE && op < OPCODE_ATOMIC_RMW_ADD) {
+		variant = op - OPCODE_ATOMIC_I32_STORE;
+		return (check_memarg(validator, &extra->memarg,
+				     atomic_size_log2[variant], 1) &&
+			pop_operand(validator, atomic_valtype[variant], NULL) &&
+			pop_operand(validator, VALTYPE_I32, NULL));
+	}
+
+	if (op >= OPCODE_ATOMIC_RMW_ADD && op < OPCODE_ATOMIC_LAST) {
+		variant = (op - OPCODE_ATOMIC_RMW_ADD) % 7;
+		type = atomic_valtype[variant];
+		if (!check_memarg(validator, &extra->memarg,
+				  atomic_size_log2[variant], 1) ||
+		    !pop_operand(validator, type, NULL) ||
+		    (op >= OPCODE_ATOMIC_RMW_CMPXCHG &&
+		     !pop_operand(validator, type, NULL)) ||
+		    !pop_operand(validator, VALTYPE_I32, NULL))
+			return 0;
+		return push_operand(validator, type);
+	}
+
+	INVALID("unknown atomic opcode 0x%x", op);
+
+ error:
+	return 0;
+}
+
+int wasmjit_validate_instruction(struct FunctionValidator *validator,
+				 const struct Instr *instr)
+{
+	struct ValidatorFrame *frame;
+	wasmjit_valtype_t in1, in2, out, type, type2;
+
+	if (!validator->frames.n_elts)
+		INVALID("instruction after the end of the function");
+
+	frame = &validator->frames.elts[validator->frames.n_elts - 1];
+
+	switch (instr->opcode) {
+	case ELSE_TERMINAL:
+		if (frame->opcode != OPCODE_IF)
+			INVALID("else without matching if");
+		if (!check_frame_results(validator))
+			goto error;
+		/* marks the frame as being in its else arm */
+		frame->opcode = ELSE_TERMINAL;
+		frame->unreachable = 0;
+		break;
+	case BLOCK_TERMINAL:
+		if (frame->opcode == OPCODE_IF && frame->blocktype != VALTYPE_NULL)
+			INVALID("type mismatch: if without else must not produce a value");
+		if (!check_frame_results(validator))
+			goto error;
+		type = frame->blocktype;
+		validator->frames.n_elts -= 1;
+		/* the function body's own end leaves the result for return */
+		if (validator->frames.n_elts && type != VALTYPE_NULL &&
+		    !push_operand(validator, type))
+			goto error;
+		break;
+	case OPCODE_UNREACHABLE:
+		set_unreachable(validator);
+		break;
+	case OPCODE_NOP:
+		break;
+	case OPCODE_BLOCK:
+	case OPCODE_LOOP:
+		if (!push_frame(validator, instr->opcode,
+				instr->data.block.blocktype))
+			goto error;
+		break;
+	case OPCODE_IF:
+		if (!pop_operand(validator, VALTYPE_I32, NULL) ||
+		    !push_frame(validator, instr->opcode,
+				instr->data.if_.blocktype))
+			goto error;
+		break;
+	case OPCODE_BR:
+		if (!label_type(validator, instr->data.br.labelidx, &type) ||
+		    (type != VALTYPE_NULL && !pop_operand(validator, type, NULL)))
+			goto error;
+		set_unreachable(validator);
+		break;
+	case OPCODE_BR_IF:
+		if (!pop_operand(validator, VALTYPE_I32, NULL) ||
+		    !label_type(validator, instr->data.br_if.labelidx, &type))
+			goto error;
+		if (type != VALTYPE_NULL &&
+		    (!pop_operand(validator, type, NULL) ||
+		     !push_operand(validator, type)))
+			goto error;
+		break;
+	case OPCODE_BR_TABLE: {
+		uint32_t i;
+
+		if (!pop_operand(validator, VALTYPE_I32, NULL) ||
+		    !label_type(validator, instr->data.br_table.labelidx, &type))
+			goto error;
+
+		for (i = 0; i < instr->data.br_table.n_labelidxs; ++i) {
+			if (!label_type(validator,
+					instr->data.br_table.labelidxs[i],
+					&type2))
+				goto error;
+			if (type2 != type)
+				INVALID("type mismatch: br_table targets disagree");
+		}
+
+		if (type != VALTYPE_NULL && !pop_operand(validator, type, NULL))
+			goto error;
+		set_unreachable(validator);
+		break;
+	}
+	case OPCODE_RETURN:
+		type = validator->type->output_type;
+		if (type != VALTYPE_NULL && !pop_operand(validator, type, NULL))
+			goto error;
+		set_unreachable(validator);
+		break;
+	case OPCODE_CALL:
+		if (instr->data.call.funcidx >=
+		    validator->module_types->n_functypes)
+			INVALID("unknown function %" PRIu32,
+				instr->data.call.funcidx);
+		if (!pop_call(validator,
+			      &validator->module_types->functypes[instr->data.call.funcidx]))
+			goto error;
+		break;
+	case OPCODE_CALL_INDIRECT:
+		if (!validator->module_types->n_tabletypes)
+			INVALID("unknown table 0");
+		if (instr->data.call_indirect.typeidx >= validator->n_func_types)
+			INVALID("unknown type %" PRIu32,
+				instr->data.call_indirect.typeidx);
+		if (!pop_operand(validator, VALTYPE_I32, NULL) ||
+		    !pop_call(validator,
+			      &validator->func_types[instr->data.call_indirect.typeidx]))
+			goto error;
+		break;
+	case OPCODE_DROP:
+		if (!pop_operand(validator, VALTYPE_UNKNOWN, NULL))
+			goto error;
+		break;
+	case OPCODE_SELECT:
+		if (!pop_operand(validator, VALTYPE_I32, NULL) ||
+		    !pop_operand(validator, VALTYPE_UNKNOWN, &type) ||
+		    !pop_operand(validator, type, &type2) ||
+		    !push_operand(validator,
+				  type == VALTYPE_UNKNOWN ? type2 : type))
+			goto error;
+		break;
+	case OPCODE_GET_LOCAL:
+	case OPCODE_SET_LOCAL:
+	case OPCODE_TEE_LOCAL:
+		if (instr->data.get_local.localidx >= validator->n_locals)
+			INVALID("unknown local %" PRIu32,
+				instr->data.get_local.localidx);
+		type = validator->locals[instr->data.get_local.localidx];
+		if (instr->opcode != OPCODE_GET_LOCAL &&
+		    !pop_operand(validator, type, NULL))
+			goto error;
+		if (instr->opcode != OPCODE_SET_LOCAL &&
+		    !push_operand(validator, type))
+			goto error;
+		break;
+	case OPCODE_GET_GLOBAL:
+	case OPCODE_SET_GLOBAL: {
+		const struct GlobalType *global;
+
+		if (instr->data.get_global.globalidx >=
+		    validator->module_types->n_globaltypes)
+			INVALID("unknown global %" PRIu32,
+				instr->data.get_global.globalidx);
+		global = &validator->module_types->globaltypes[instr->data.get_global.globalidx];
+
+		if (instr->opcode == OPCODE_GET_GLOBAL) {
+			if (!push_operand(validator, global->valtype))
+				goto error;
+		} else {
+			if (!global->mut)
+				INVALID("global %" PRIu32 " is immutable",
+					instr->data.set_global.globalidx);
+			if (!pop_operand(validator, global->valtype, NULL))
+				goto error;
+		}
+		break;
+	}
+	case OPCODE_I32_LOAD:
+	case OPCODE_I64_LOAD:
+	case OPCODE_F32_LOAD:
+	case OPCODE_F64_LOAD:
+	case OPCODE_I32_LOAD8_S:
+	case OPCODE_I32_LOAD8_U:
+	case OPCODE_I32_LOAD16_S:
+	case OPCODE_I32_LOAD16_U:
+	case OPCODE_I64_LOAD8_S:
+	case OPCODE_I64_LOAD8_U:
+	case OPCODE_I64_LOAD16_S:
+	case OPCODE_I64_LOAD16_U:
+	case OPCODE_I64_LOAD32_S:
+	case OPCODE_I64_LOAD32_U: {
+		unsigned i = instr->opcode - OPCODE_I32_LOAD;
+
+		if (!check_memarg(validator, &instr->data.i32_load,
+				  memory_size_log2[i], 0) ||
+		    !pop_operand(validator, VALTYPE_I32, NULL) ||
+		    !push_operand(validator, memory_valtype[i]))
+			goto error;
+		break;
+	}
+	case OPCODE_I32_STORE:
+	case OPCODE_I64_STORE:
+	case OPCODE_F32_STORE:
+	case OPCODE_F64_STORE:
+	case OPCODE_I32_STORE8:
+	case OPCODE_I32_STORE16:
+	case OPCODE_I64_STORE8:
+	case OPCODE_I64_STORE16:
+	case OPCODE_I64_STORE32: {
+		unsigned i = instr->opcode - OPCODE_I32_LOAD;
+
+		if (!check_memarg(validator, &instr->data.i32_store,
+				  memory_size_log2[i], 0) ||
+		    !pop_operand(validator, memory_valtype[i], NULL) ||
+		    !pop_operand(validator, VALTYPE_I32, NULL))
+			goto error;
+		break;
+	}
+	case OPCODE_MEMORY_SIZE:
+	case OPCODE_MEMORY_GROW:
+		if (!validator->module_types->n_memorytypes)
+			INVALID("unknown memory 0");
+		if ((instr->opcode == OPCODE_MEMORY_GROW &&
+		     !pop_operand(validator, VALTYPE_I32, NULL)) ||
+		    !push_operand(validator, VALTYPE_I32))
+			goto error;
+		break;
+	case OPCODE_I32_CONST:
+		if (!push_operand(validator, VALTYPE_I32))
+			goto error;
+		break;
+	case OPCODE_I64_CONST:
+		if (!push_operand(validator, VALTYPE_I64))
+			goto error;
+		break;
+	case OPCODE_F32_CONST:
+		if (!push_operand(validator, VALTYPE_F32))
+			goto error;
+		break;
+	case OPCODE_F64_CONST:
+		if (!push_operand(validator, VALTYPE_F64))
+			goto error;
+		break;
+	case OPCODE_MISC_PREFIX:
+		/* memory.copy and memory.fill both take three i32s */
+		if (!validator->module_types->n_memorytypes)
+			INVALID("unknown memory 0");
+		if (!pop_operand(validator, VALTYPE_I32, NULL) ||
+		    !pop_operand(validator, VALTYPE_I32, NULL) ||
+		    !pop_operand(validator, VALTYPE_I32, NULL))
+			goto error;
+		break;
+	case OPCODE_ATOMIC_PREFIX:
+		if (!validate_atomic(validator, &instr->data.atomic))
+			goto error;
+		break;
+	default:
+		if (!numeric_type(instr->opcode, &in1, &in2, &out))
+			INVALID("unknown opcode 0x%x", instr->opcode);
+		if ((in2 != VALTYPE_NULL && !pop_operand(validator, in2, NULL)) ||
+		    !pop_operand(validator, in1, NULL) ||
+		    !push_operand(validator, out))
+			goto error;
+		break;
+	}
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+int wasmjit_validator_done(const struct FunctionValidator *validator)
+{
+	return !validator->frames.n_elts;
+}
+
+int wasmjit_validator_init(struct FunctionValidator *validator,
+			   const struct FuncType *func_types,
+			   size_t n_func_types,
+			   const struct ModuleTypes *module_types,
+			   const struct FuncType *type,
+			   const struct CodeSectionCode *code,
+			   char *why, size_t why_size)
+{
+	size_t i, n_locals;
+
+	memset(validator, 0, sizeof(*validator));
+	validator->func_types = func_types;
+	validator->n_func_types = n_func_types;
+	validator->module_types = module_types;
+	validator->type = type;
+	validator->why = why;
+	validator->why_size = why_size;
+
+	n_locals = type->n_inputs;
+	for (i = 0; i < code->n_locals; ++i) {
+		if (!is_valtype(code->locals[i].valtype))
+			INVALID("invalid local type 0x%x",
+				code->locals[i].valtype);
+		if (code->locals[i].count > UINT32_MAX - n_locals)
+			INVALID("too many locals");
+		n_locals += code->locals[i].count;
+	}
+
+	validator->locals = malloc(n_locals);
+	if (n_locals && !validator->locals)
+		INVALID("out of memory");
+	validator->n_locals = n_locals;
+
+	memcpy(validator->locals, type->input_types, type->n_inputs);
+	n_locals = type->n_inputs;
+	for (i = 0; i < code->n_locals; ++i) {
+		memset(validator->locals + n_locals, code->locals[i].valtype,
+		       code->locals[i].count);
+		n_locals += code->locals[i].count;
+	}
+
+	/* the body is a block whose label is the function's return */
+	if (!push_frame(validator, OPCODE_BLOCK, type->output_type))
+		goto error;
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+void wasmjit_validator_free(struct FunctionValidator *validator)
+{
+	free(validator->locals);
+	free(validator->operands.elts);
+	free(validator->frames.elts);
+}
+
+#undef INVALID
+#define INVALID(...)					\
+	do {						\
+		if (why)				\
+			snprintf(why, why_size,		\
+				 __VA_ARGS__);		\
+		goto error;				\
+	}						\
+	while (0)
+
+static int valid_limits(const struct Limits *limits, uint32_t max_min)
+{
+	if (limits->min > max_min || limits->max > max_min)
+		return 0;
+	/* a max of zero means there is no maximum */
+	if (limits->max && limits->min > limits->max)
+		return 0;
+	if (limits->shared && !limits->max)
+		return 0;
+	return 1;
+}
+
+/*
+  constant expressions may only be a single constant or read an
+  imported immutable global
+ */
+static int valid_constant_expression(const struct Module *module,
+				     size_t n_imported_globals,
+				     unsigned valtype,
+				     size_t n_instructions,
+				     const struct Instr *instructions)
+{
+	if (n_instructions != 1)
+		return 0;
+
+	switch (instructions[0].opcode) {
+	case OPCODE_I32_CONST:
+		return valtype == VALTYPE_I32;
+	case OPCODE_I64_CONST:
+		return valtype == VALTYPE_I64;
+	case OPCODE_F32_CONST:
+		return valtype == VALTYPE_F32;
+	case OPCODE_F64_CONST:
+		return valtype == VALTYPE_F64;
+	case OPCODE_GET_GLOBAL: {
+		uint32_t globalidx = instructions[0].data.get_global.globalidx;
+		size_t i;
+
+		if (globalidx >= n_imported_globals)
+			return 0;
+
+		for (i = 0; i < module->import_section.n_imports; ++i) {
+			const struct ImportSectionImport *import =
+				&module->import_section.imports[i];
+			if (import->desc_type != IMPORT_DESC_TYPE_GLOBAL)
+				continue;
+			if (!globalidx--)
+				return (!import->desc.globaltype.mut &&
+					import->desc.globaltype.valtype == valtype);
+		}
+
+		return 0;
+	}
+	default:
+		return 0;
+	}
+}
+
+static uint32_t hash_name(const char *name)
+{
+	/* FNV-1a */
+	uint32_t hash = 2166136261U;
+
+	while (*name) {
+		hash ^= (uint8_t) *name++;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+static int unique_export_names(const struct ExportSection *export_section,
+			       char *why, size_t why_size)
+{
+	size_t n_buckets = 1, i;
+	uint32_t *buckets = NULL;
+	int ret;
+
+	while (n_buckets < 2 * (size_t) export_section->n_exports)
+		n_buckets <<= 1;
+
+	/* entries are export index + 1, zero is an empty slot */
+	buckets = calloc(n_buckets, sizeof(buckets[0]));
+	if (!buckets)
+		INVALID("out of memory");
+
+	for (i = 0; i < export_section->n_exports; ++i) {
+		const char *name = export_section->exports[i].name;
+		size_t slot = hash_name(name) & (n_buckets - 1);
+
+		while (buckets[slot]) {
+			if (!strcmp(export_section->exports[buckets[slot] - 1].name,
+				    name))
+				INVALID("duplicate export name \"%s\"", name);
+			slot = (slot + 1) & (n_buckets - 1);
+		}
+
+		buckets[slot] = i + 1;
+	}
+
+	ret = 1;
+
+	if (0) {
+	error:
+		ret = 0;
+	}
+
+	free(buckets);
+
+	return ret;
+}
+
+static int valid_func_type(const struct FuncType *type)
+{
+	size_t i;
+
+	for (i = 0; i < type->n_inputs; ++i) {
+		if (!is_valtype(type->input_types[i]))
+			return 0;
+	}
+
+	return (type->output_type == VALTYPE_NULL ||
+		is_valtype(type->output_type));
+}
+
+int wasmjit_validate_module(const struct Module *module,
+			    char *why, size_t why_size)
+{
+	uint32_t i, j;
+	size_t n_funcs = 0, n_tables = 0, n_mems = 0, n_globals = 0;
+	size_t n_imported_globals;
+	const struct FuncType *start_type = NULL;
+
+	for (i = 0; i < module->type_section.n_types; ++i) {
+		if (!valid_func_type(&module->type_section.types[i]))
+			INVALID("type %" PRIu32 " has an invalid value type", i);
+	}
+
+	for (i = 0; i < module->import_section.n_imports; ++i) {
+		const struct ImportSectionImport *import =
+			&module->import_section.imports[i];
+
+		switch (import->desc_type) {
+		case IMPORT_DESC_TYPE_FUNC:
+			if (import->desc.functypeidx >= module->type_section.n_types)
+				INVALID("import %" PRIu32 " has unknown type %" PRIu32,
+					i, import->desc.functypeidx);
+			if (n_funcs == module->start_section.funcidx)
+				start_type = &module->type_section.types[import->desc.functypeidx];
+			n_funcs += 1;
+			break;
+		case IMPORT_DESC_TYPE_TABLE:
+			if (import->desc.tabletype.elemtype != ELEMTYPE_ANYFUNC ||
+			    !valid_limits(&import->desc.tabletype.limits,
+					  UINT32_MAX))
+				INVALID("import %" PRIu32 " has an invalid table type", i);
+			n_tables += 1;
+			break;
+		case IMPORT_DESC_TYPE_MEM:
+			if (!valid_limits(&import->desc.memtype.limits, MAX_PAGES))
+				INVALID("import %" PRIu32 " has invalid memory limits", i);
+			n_mems += 1;
+			break;
+		case IMPORT_DESC_TYPE_GLOBAL:
+			n_globals += 1;
+			break;
+		default:
+			INVALID("import %" PRIu32 " has an invalid kind", i);
+		}
+	}
+	n_imported_globals = n_globals;
+
+	if (module->function_section.n_typeidxs !=
+	    module->code_section.n_codes)
+		INVALID("%" PRIu32 " functions declared but %" PRIu32 " bodies defined",
+			module->function_section.n_typeidxs,
+			module->code_section.n_codes);
+
+	for (i = 0; i < module->function_section.n_typeidxs; ++i) {
+		uint32_t typeidx = module->function_section.typeidxs[i];
+		if (typeidx >= module->type_section.n_types)
+			INVALID("function %zu has unknown type %" PRIu32,
+				n_funcs, typeidx);
+		if (n_funcs == module->start_section.funcidx)
+			start_type = &module->type_section.types[typeidx];
+		n_funcs += 1;
+	}
+
+	for (i = 0; i < module->table_section.n_tables; ++i) {
+		if (module->table_section.tables[i].elemtype != ELEMTYPE_ANYFUNC ||
+		    !valid_limits(&module->table_section.tables[i].limits,
+				  UINT32_MAX))
+			INVALID("table %zu has an invalid type", n_tables);
+		n_tables += 1;
+	}
+
+	for (i = 0; i < module->memory_section.n_memories; ++i) {
+		if (!valid_limits(&module->memory_section.memories[i].memtype.limits,
+				  MAX_PAGES))
+			INVALID("memory %zu has invalid limits", n_mems);
+		n_mems += 1;
+	}
+
+	if (n_tables > 1)
+		INVALID("multiple tables");
+
+	if (n_mems > 1)
+		INVALID("multiple memories");
+
+	for (i = 0; i < module->global_section.n_globals; ++i) {
+		const struct GlobalSectionGlobal *global =
+			&module->global_section.globals[i];
+		if (!valid_constant_expression(module, n_imported_globals,
+					       global->type.valtype,
+					       global->n_instructions,
+					       global->instructions))
+			INVALID("global %zu has an invalid initializer",
+				n_globals);
+		n_globals += 1;
+	}
+
+	for (i = 0; i < module->export_section.n_exports; ++i) {
+		const struct ExportSectionExport *export =
+			&module->export_section.exports[i];
+		size_t n;
+
+		switch (export->idx_type) {
+		case IMPORT_DESC_TYPE_FUNC:
+			n = n_funcs;
+			break;
+		case IMPORT_DESC_TYPE_TABLE:
+			n = n_tables;
+			break;
+		case IMPORT_DESC_TYPE_MEM:
+			n = n_mems;
+			break;
+		case IMPORT_DESC_TYPE_GLOBAL:
+			n = n_globals;
+			break;
+		default:
+			INVALID("export \"%s\" has an invalid kind", export->name);
+		}
+
+		if (export->idx >= n)
+			INVALID("export \"%s\" refers to unknown %s %" PRIu32,
+				export->name, wasmjit_desc_repr(export->idx_type),
+				export->idx);
+	}
+
+	if (!unique_export_names(&module->export_section, why, why_size))
+		goto error;
+
+	if (module->start_section.has_start) {
+		if (!start_type)
+			INVALID("unknown start function %" PRIu32,
+				module->start_section.funcidx);
+		if (start_type->n_inputs ||
+		    start_type->output_type != VALTYPE_NULL)
+			INVALID("start function must have type [] -> []");
+	}
+
+	for (i = 0; i < module->element_section.n_elements; ++i) {
+		const struct ElementSectionElement *element =
+			&module->element_section.elements[i];
+
+		if (element->tableidx >= n_tables)
+			INVALID("element segment %" PRIu32 " refers to unknown table %" PRIu32,
+				i, element->tableidx);
+
+		if (!valid_constant_expression(module, n_imported_globals,
+					       VALTYPE_I32,
+					       element->n_instructions,
+					       element->instructions))
+			INVALID("element segment %" PRIu32 " has an invalid offset", i);
+
+		for (j = 0; j < element->n_funcidxs; ++j) {
+			if (element->funcidxs[j] >= n_funcs)
+				INVALID("element segment %" PRIu32 " refers to unknown function %" PRIu32,
+					i, element->funcidxs[j]);
+		}
+	}
+
+	for (i = 0; i < module->data_section.n_datas; ++i) {
+		const struct DataSectionData *data =
+			&module->data_section.datas[i];
+
+		if (data->memidx >= n_mems)
+			INVALID("data segment %" PRIu32 " refers to unknown memory %" PRIu32,
+				i, data->memidx);
+
+		if (!valid_constant_expression(module, n_imported_globals,
+					       VALTYPE_I32,
+					       data->n_instructions,
+					       data->instructions))
+			INVALID("data segment %" PRIu32 " has an invalid offset", i);
+	}
+
+	return 1;
+
+ error:
+	return 0;
+}
@@ -0,0 +1,79 @@
+/* -*-mode:c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+  Copyright (c) 2018 Rian Hunter
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+#ifndef __WASMJIT__VALIDATE_H__
+#define __WASMJIT__VALIDATE_H__
+
+#include <wasmjit/ast.h>
+#include <wasmjit/compile.h>
+
+#include <wasmjit/sys.h>
+
+/*
+  Type checks a function body as it is decoded, one instruction at a
+  time, following the validation algorithm from the appendix of the
+  WebAssembly spec. Feed it every instruction of the flat sequence
+  (including the ELSE_TERMINAL and BLOCK_TERMINAL markers) until
+  wasmjit_validator_done() returns true.
+ */
+struct FunctionValidator {
+	const struct FuncType *func_types;
+	size_t n_func_types;
+	const struct ModuleTypes *module_types;
+	const struct FuncType *type;
+	size_t n_locals;
+	wasmjit_valtype_t *locals;
+	struct {
+		size_t n_elts, capacity;
+		wasmjit_valtype_t *elts;
+	} operands;
+	struct {
+		size_t n_elts, capacity;
+		struct ValidatorFrame {
+			uint8_t opcode;
+			uint8_t blocktype;
+			int unreachable;
+			size_t height;
+		} *elts;
+	} frames;
+	char *why;
+	size_t why_size;
+};
+
+int wasmjit_validator_init(struct FunctionValidator *validator,
+			   const struct FuncType *func_types,
+			   size_t n_func_types,
+			   const struct ModuleTypes *module_types,
+			   const struct FuncType *type,
+			   const struct CodeSectionCode *code,
+			   char *why, size_t why_size);
+int wasmjit_validate_instruction(struct FunctionValidator *validator,
+				 const struct Instr *instr);
+int wasmjit_validator_done(const struct FunctionValidator *validator);
+void wasmjit_validator_free(struct FunctionValidator *validator);
+
+int wasmjit_validate_module(const struct Module *module,
+			    char *why, size_t why_size);
+
+#endif
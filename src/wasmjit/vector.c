@@ -48,3 +48,32 @@ int wasmjit_vector_set_size(void *elts_, size_t *n_elts, size_t new_n_elts,
 	free(*elts);
 	return 0;
 }
+
+int wasmjit_vector_reserve(void *elts_, size_t *capacity, size_t n_elts,
+			   size_t elt_size)
+{
+	void **elts = (void **)elts_;
+	void *newelts;
+	size_t new_capacity, total_elt_size;
+
+	if (n_elts <= *capacity)
+		return 1;
+
+	new_capacity = *capacity ? *capacity : 16;
+	while (new_capacity < n_elts) {
+		if (__builtin_umull_overflow(new_capacity, 2, &new_capacity))
+			return 0;
+	}
+
+	if (__builtin_umull_overflow(new_capacity, elt_size, &total_elt_size))
+		return 0;
+
+	newelts = realloc(*elts, total_elt_size);
+	if (!newelts)
+		return 0;
+
+	*elts = newelts;
+	*capacity = new_capacity;
+
+	return 1;
+}
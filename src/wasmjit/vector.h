@@ -28,6 +28,8 @@
 #include <wasmjit/sys.h>
 
 int wasmjit_vector_set_size(void *, size_t *, size_t, size_t);
+/* grows capacity geometrically, unlike set_size it keeps *elts on failure */
+int wasmjit_vector_reserve(void *, size_t *, size_t, size_t);
 
 #define DEFINE_ANON_VECTOR(type) \
 	struct {		 \
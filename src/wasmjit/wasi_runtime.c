@@ -0,0 +1,1508 @@
+/* -*-mode:c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+  Copyright (c) 2018 Rian Hunter
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+/* For O_PATH */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <wasmjit/wasi_runtime.h>
+
+#include <wasmjit/emscripten_runtime.h>
+#include <wasmjit/emscripten_runtime_sys.h>
+#include <wasmjit/runtime.h>
+#include <wasmjit/util.h>
+#include <wasmjit/sys.h>
+
+/* the kernel names the struct stat syscalls differently */
+#ifdef __KERNEL__
+#define sys_fstat sys_newfstat
+#define sys_fstatat sys_newfstatat
+#endif
+
+enum {
+#define ERRNO(name, value) WASI_ ## name = value,
+#include <wasmjit/wasi_runtime_errno_def.h>
+#undef ERRNO
+	WASI_ENOTCAPABLE = 76,
+};
+
+enum {
+	WASI_CLOCK_REALTIME,
+	WASI_CLOCK_MONOTONIC,
+	WASI_CLOCK_PROCESS_CPUTIME_ID,
+	WASI_CLOCK_THREAD_CPUTIME_ID,
+};
+
+enum {
+	WASI_FILETYPE_UNKNOWN,
+	WASI_FILETYPE_BLOCK_DEVICE,
+	WASI_FILETYPE_CHARACTER_DEVICE,
+	WASI_FILETYPE_DIRECTORY,
+	WASI_FILETYPE_REGULAR_FILE,
+	WASI_FILETYPE_SOCKET_DGRAM,
+	WASI_FILETYPE_SOCKET_STREAM,
+	WASI_FILETYPE_SYMBOLIC_LINK,
+};
+
+enum {
+	WASI_WHENCE_SET,
+	WASI_WHENCE_CUR,
+	WASI_WHENCE_END,
+};
+
+#define WASI_FDFLAGS_APPEND 1
+#define WASI_FDFLAGS_DSYNC 2
+#define WASI_FDFLAGS_NONBLOCK 4
+#define WASI_FDFLAGS_RSYNC 8
+#define WASI_FDFLAGS_SYNC 16
+
+#define WASI_OFLAGS_CREAT 1
+#define WASI_OFLAGS_DIRECTORY 2
+#define WASI_OFLAGS_EXCL 4
+#define WASI_OFLAGS_TRUNC 8
+
+#define WASI_LOOKUPFLAGS_SYMLINK_FOLLOW 1
+
+#define WASI_RIGHTS_FD_READ (1 << 1)
+#define WASI_RIGHTS_FD_SEEK (1 << 2)
+#define WASI_RIGHTS_FD_TELL (1 << 5)
+#define WASI_RIGHTS_FD_WRITE (1 << 6)
+#define WASI_RIGHTS_ALL ((1 << 30) - 1)
+
+#define WASI_PREOPENTYPE_DIR 0
+
+enum {
+	WASI_EVENTTYPE_CLOCK,
+	WASI_EVENTTYPE_FD_READ,
+	WASI_EVENTTYPE_FD_WRITE,
+};
+
+#define WASI_SUBCLOCKFLAGS_ABSTIME 1
+
+#define WASI_EVENTRWFLAGS_HANGUP 1
+
+#define WASI_SUBSCRIPTION_SIZE 48
+#define WASI_EVENT_SIZE 32
+#define WASI_DIRENT_SIZE 24
+
+static struct WASIContext *wasi_get_context(struct FuncInst *funcinst)
+{
+	return funcinst->module_inst->private_data;
+}
+
+static uint32_t wasi_errno(long ret)
+{
+	static const uint8_t to_wasi_errno[] = {
+#define ERRNO(name, value) [name] = value,
+#include <wasmjit/wasi_runtime_errno_def.h>
+#undef ERRNO
+	};
+
+	if (ret >= 0)
+		return 0;
+
+	ret = -ret;
+	if ((unsigned long) ret >= sizeof(to_wasi_errno) ||
+	    !to_wasi_errno[ret])
+		return WASI_EINVAL;
+
+	return to_wasi_errno[ret];
+}
+
+static int wasi_check_range(struct WASIContext *ctx,
+			    uint32_t ptr, size_t len)
+{
+	size_t end;
+
+	if (!ctx->meminst)
+		return 0;
+	if (__builtin_add_overflow(ptr, len, &end))
+		return 0;
+	return end <= ctx->meminst->size;
+}
+
+static uint32_t wasi_copy_to_user(struct WASIContext *ctx, uint32_t ptr,
+				  const void *src, size_t len)
+{
+	if (!wasi_check_range(ctx, ptr, len))
+		return WASI_EFAULT;
+	memcpy(ctx->meminst->data + ptr, src, len);
+	return 0;
+}
+
+static uint32_t wasi_store_u32(struct WASIContext *ctx, uint32_t ptr,
+			       uint32_t val)
+{
+	val = uint32_t_swap_bytes(val);
+	return wasi_copy_to_user(ctx, ptr, &val, sizeof(val));
+}
+
+static uint32_t wasi_store_u64(struct WASIContext *ctx, uint32_t ptr,
+			       uint64_t val)
+{
+	val = uint64_t_swap_bytes(val);
+	return wasi_copy_to_user(ctx, ptr, &val, sizeof(val));
+}
+
+static uint16_t wasi_load_u16(const char *src)
+{
+	uint16_t val;
+
+	memcpy(&val, src, sizeof(val));
+	return uint16_t_swap_bytes(val);
+}
+
+static uint32_t wasi_load_u32(const char *src)
+{
+	uint32_t val;
+
+	memcpy(&val, src, sizeof(val));
+	return uint32_t_swap_bytes(val);
+}
+
+static uint64_t wasi_load_u64(const char *src)
+{
+	uint64_t val;
+
+	memcpy(&val, src, sizeof(val));
+	return uint64_t_swap_bytes(val);
+}
+
+static int wasi_host_fd(struct WASIContext *ctx, uint32_t fd)
+{
+	if (fd >= ctx->n_fds)
+		return -1;
+	return ctx->fds[fd].host_fd;
+}
+
+/* lowest free guest fd, like POSIX */
+static long wasi_alloc_fd(struct WASIContext *ctx)
+{
+	uint32_t i;
+
+	for (i = 0; i < ctx->n_fds; ++i) {
+		if (ctx->fds[i].host_fd < 0)
+			return i;
+	}
+
+	if (ctx->n_fds == WASMJIT_WASI_MAX_FDS)
+		return -1;
+
+	return ctx->n_fds++;
+}
+
+/*
+  Copies a path argument into ctx->path and normalizes it lexically,
+  leaving no "." or ".." components. Absolute paths and ".." that
+  would climb above the directory fd are refused, symlinks are kept
+  below it by wasmjit_emscripten_openat_beneath(), so a guest can
+  only reach what is below its preopens.
+*/
+static uint32_t wasi_get_path(struct WASIContext *ctx,
+			      uint32_t fd, uint32_t path, uint32_t path_len,
+			      int *dirfd)
+{
+	size_t i, n, clen;
+
+	*dirfd = wasi_host_fd(ctx, fd);
+	if (*dirfd < 0)
+		return WASI_EBADF;
+
+	if (!wasi_check_range(ctx, path, path_len))
+		return WASI_EFAULT;
+
+	if (path_len >= sizeof(ctx->path))
+		return WASI_ENAMETOOLONG;
+
+	memcpy(ctx->path, ctx->meminst->data + path, path_len);
+	ctx->path[path_len] = '\0';
+
+	if (memchr(ctx->path, '\0', path_len))
+		return WASI_EINVAL;
+
+	if (ctx->path[0] == '/')
+		return WASI_ENOTCAPABLE;
+
+	/* the output never overtakes the input, so this works in place */
+	n = 0;
+	for (i = 0; i < path_len; i += clen) {
+		const char *comp = ctx->path + i;
+
+		if (comp[0] == '/') {
+			clen = 1;
+			continue;
+		}
+
+		for (clen = 0; i + clen < path_len && comp[clen] != '/'; ++clen)
+			;
+
+		if (clen == 1 && comp[0] == '.')
+			continue;
+
+		if (clen == 2 && comp[0] == '.' && comp[1] == '.') {
+			if (!n)
+				return WASI_ENOTCAPABLE;
+			while (n && ctx->path[--n] != '/')
+				;
+			continue;
+		}
+
+		if (n)
+			ctx->path[n++] = '/';
+		memmove(ctx->path + n, comp, clen);
+		n += clen;
+	}
+
+	if (!n)
+		ctx->path[n++] = '.';
+	ctx->path[n] = '\0';
+
+	return 0;
+}
+
+/*
+  Like wasi_get_path() but opens the directory holding the last
+  component, for the calls that work on a name within it. *name
+  points into ctx->path.
+*/
+static uint32_t wasi_open_parent(struct WASIContext *ctx,
+				 uint32_t fd, uint32_t path, uint32_t path_len,
+				 int *parent_fd, const char **name)
+{
+	int dirfd;
+	long ret;
+
+	ret = wasi_get_path(ctx, fd, path, path_len, &dirfd);
+	if (ret)
+		return ret;
+
+	ret = wasmjit_emscripten_open_parent_beneath(dirfd, ctx->path,
+						     ctx->path, name);
+	if (ret < 0)
+		return wasi_errno(ret);
+
+	*parent_fd = ret;
+	return 0;
+}
+
+static uint8_t wasi_filetype(int host_fd, unsigned long mode)
+{
+	if (S_ISREG(mode))
+		return WASI_FILETYPE_REGULAR_FILE;
+	if (S_ISDIR(mode))
+		return WASI_FILETYPE_DIRECTORY;
+	if (S_ISCHR(mode))
+		return WASI_FILETYPE_CHARACTER_DEVICE;
+	if (S_ISBLK(mode))
+		return WASI_FILETYPE_BLOCK_DEVICE;
+	if (S_ISLNK(mode))
+		return WASI_FILETYPE_SYMBOLIC_LINK;
+	if (S_ISSOCK(mode)) {
+		int type;
+		socklen_t len = sizeof(type);
+
+		if (host_fd >= 0 &&
+		    sys_getsockopt(host_fd, SOL_SOCKET, SO_TYPE,
+				   &type, &len) >= 0 &&
+		    type == SOCK_DGRAM)
+			return WASI_FILETYPE_SOCKET_DGRAM;
+		return WASI_FILETYPE_SOCKET_STREAM;
+	}
+	return WASI_FILETYPE_UNKNOWN;
+}
+
+/* the nanosecond part of the struct stat timestamps is named per platform */
+#if defined(__KERNEL__)
+#define WASI_STAT_NSEC(st, x) ((st)->st_ ## x ## time_nsec)
+#elif defined(__APPLE__)
+#define WASI_STAT_NSEC(st, x) ((st)->st_ ## x ## timespec.tv_nsec)
+#else
+#define WASI_STAT_NSEC(st, x) ((st)->st_ ## x ## tim.tv_nsec)
+#endif
+
+#define WASI_STAT_TIMESTAMP(st, x)					\
+	((uint64_t) (st)->st_ ## x ## time * UINT64_C(1000000000) +	\
+	 WASI_STAT_NSEC(st, x))
+
+static uint32_t wasi_store_filestat(struct WASIContext *ctx, uint32_t buf,
+				    int host_fd, const struct stat *st)
+{
+	char out[64];
+
+	memset(out, 0, sizeof(out));
+	encode_le_uint64_t(st->st_dev, out + 0);
+	encode_le_uint64_t(st->st_ino, out + 8);
+	out[16] = wasi_filetype(host_fd, st->st_mode);
+	encode_le_uint64_t(st->st_nlink, out + 24);
+	encode_le_uint64_t(st->st_size, out + 32);
+	encode_le_uint64_t(WASI_STAT_TIMESTAMP(st, a), out + 40);
+	encode_le_uint64_t(WASI_STAT_TIMESTAMP(st, m), out + 48);
+	encode_le_uint64_t(WASI_STAT_TIMESTAMP(st, c), out + 56);
+
+	return wasi_copy_to_user(ctx, buf, out, sizeof(out));
+}
+
+static size_t wasi_count_strings(char **strs)
+{
+	size_t n = 0;
+
+	if (strs) {
+		while (strs[n])
+			n++;
+	}
+
+	return n;
+}
+
+static uint32_t wasi_strings_sizes_get(struct WASIContext *ctx,
+				       char **strs, size_t n,
+				       uint32_t count_ptr, uint32_t size_ptr)
+{
+	size_t i, size = 0;
+	uint32_t ret;
+
+	for (i = 0; i < n; ++i)
+		size += strlen(strs[i]) + 1;
+
+	if (size > UINT32_MAX)
+		return WASI_E2BIG;
+
+	ret = wasi_store_u32(ctx, count_ptr, n);
+	if (ret)
+		return ret;
+
+	return wasi_store_u32(ctx, size_ptr, size);
+}
+
+static uint32_t wasi_strings_get(struct WASIContext *ctx,
+				 char **strs, size_t n,
+				 uint32_t ptrs, uint32_t buf)
+{
+	size_t i;
+	uint32_t ret;
+
+	for (i = 0; i < n; ++i) {
+		size_t len = strlen(strs[i]) + 1;
+
+		ret = wasi_store_u32(ctx, ptrs + i * 4, buf);
+		if (ret)
+			return ret;
+
+		ret = wasi_copy_to_user(ctx, buf, strs[i], len);
+		if (ret)
+			return ret;
+
+		buf += len;
+	}
+
+	return 0;
+}
+
+uint32_t wasmjit_wasi_args_get(uint32_t argv, uint32_t argv_buf,
+			       struct FuncInst *funcinst)
+{
+	struct WASIContext *ctx = wasi_get_context(funcinst);
+
+	return wasi_strings_get(ctx, ctx->argv, ctx->argc, argv, argv_buf);
+}
+
+uint32_t wasmjit_wasi_args_sizes_get(uint32_t argc, uint32_t argv_buf_size,
+				     struct FuncInst *funcinst)
+{
+	struct WASIContext *ctx = wasi_get_context(funcinst);
+
+	return wasi_strings_sizes_get(ctx, ctx->argv, ctx->argc,
+				      argc, argv_buf_size);
+}
+
+uint32_t wasmjit_wasi_environ_get(uint32_t environ, uint32_t environ_buf,
+				  struct FuncInst *funcinst)
+{
+	struct WASIContext *ctx = wasi_get_context(funcinst);
+
+	return wasi_strings_get(ctx, ctx->envp, wasi_count_strings(ctx->envp),
+				environ, environ_buf);
+}
+
+uint32_t wasmjit_wasi_environ_sizes_get(uint32_t environc,
+					uint32_t environ_buf_size,
+					struct FuncInst *funcinst)
+{
+	struct WASIContext *ctx = wasi_get_context(funcinst);
+
+	return wasi_strings_sizes_get(ctx, ctx->envp,
+				      wasi_count_strings(ctx->envp),
+				      environc, environ_buf_size);
+}
+
+static long wasi_clock_id(uint32_t id)
+{
+	switch (id) {
+	case WASI_CLOCK_REALTIME:
+		return CLOCK_REALTIME;
+	case WASI_CLOCK_MONOTONIC:
+		return CLOCK_MONOTONIC;
+	case WASI_CLOCK_PROCESS_CPUTIME_ID:
+		return CLOCK_PROCESS_CPUTIME_ID;
+	case WASI_CLOCK_THREAD_CPUTIME_ID:
+		return CLOCK_THREAD_CPUTIME_ID;
+	default:
+		return -1;
+	}
+}
+
+uint32_t wasmjit_wasi_clock_res_get(uint32_t id, uint32_t resolution,
+				    struct FuncInst *funcinst)
+{
+	struct timespec ts;
+	long clock, ret;
+
+	clock = wasi_clock_id(id);
+	if (clock < 0)
+		return WASI_EINVAL;
+
+	ret = sys_clock_getres(clock, &ts);
+	if (ret < 0)
+		return wasi_errno(ret);
+
+	return wasi_store_u64(wasi_get_context(funcinst), resolution,
+			      ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec);
+}
+
+uint32_t wasmjit_wasi_clock_time_get(uint32_t id, uint64_t precision,
+				     uint32_t time,
+				     struct FuncInst *funcinst)
+{
+	struct timespec ts;
+	long clock, ret;
+
+	(void) precision;
+
+	clock = wasi_clock_id(id);
+	if (clock < 0)
+		return WASI_EINVAL;
+
+	ret = sys_clock_gettime(clock, &ts);
+	if (ret < 0)
+		return wasi_errno(ret);
+
+	return wasi_store_u64(wasi_get_context(funcinst), time,
+			      ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec);
+}
+
+uint32_t wasmjit_wasi_fd_close(uint32_t fd, struct FuncInst *funcinst)
+{
+	struct WASIContext *ctx = wasi_get_context(funcinst);
+	int host_fd;
+
+	host_fd = wasi_host_fd(ctx, fd);
+	if (host_fd < 0)
+		return WASI_EBADF;
+
+	ctx->fds[fd].host_fd = -1;
+	ctx->fds[fd].preopen = -1;
+
+	/* the host keeps its own stdio */
+	if (ctx->fds[fd].stdio) {
+		ctx->fds[fd].stdio = 0;
+		return 0;
+	}
+
+	return wasi_errno(sys_close(host_fd));
+}
+
+uint32_t wasmjit_wasi_fd_fdstat_get(uint32_t fd, uint32_t buf,
+				    struct FuncInst *funcinst)
+{
+	struct WASIContext *ctx = wasi_get_context(funcinst);
+	struct stat st;
+	char out[24];
+	uint16_t flags;
+	uint64_t rights;
+	int host_fd;
+	long ret;
+
+	host_fd = wasi_host_fd(ctx, fd);
+	if (host_fd < 0)
+		return WASI_EBADF;
+
+	ret = sys_fstat(host_fd, &st);
+	if (ret < 0)
+		return wasi_errno(ret);
+
+	ret = sys_fcntl(host_fd, F_GETFL, 0);
+	if (ret < 0)
+		return wasi_errno(ret);
+
+	flags = 0;
+	if (ret & O_APPEND)
+		flags |= WASI_FDFLAGS_APPEND;
+	if (ret & O_NONBLOCK)
+		flags |= WASI_FDFLAGS_NONBLOCK;
+
+	/* rights are not enforced, but libc tells ttys apart by the
+	   lack of seek rights */
+	rights = WASI_RIGHTS_ALL;
+	if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode) &&
+	    !S_ISBLK(st.st_mode))
+		rights &= ~(uint64_t) (WASI_RIGHTS_FD_SEEK | WASI_RIGHTS_FD_TELL);
+
+	memset(out, 0, sizeof(out));
+	out[0] = wasi_filetype(host_fd, st.st_mode);
+	flags = uint16_t_swap_bytes(flags);
+	memcpy(out + 2, &flags, sizeof(flags));
+	encode_le_uint64_t(rights, out + 8);
+	encode_le_uint64_t(WASI_RIGHTS_ALL, out + 16);
+
+	return wasi_copy_to_user(ctx, buf, out, sizeof(out));
+}
+
+uint32_t wasmjit_wasi_fd_fdstat_set_flags(uint32_t fd, uint32_t flags,
+					  struct FuncInst *funcinst)
+{
+	struct WASIContext *ctx = wasi_get_context(funcinst);
+	int host_fd, oflags;
+
+	host_fd = wasi_host_fd(ctx, fd);
+	if (host_fd < 0)
+		return WASI_EBADF;
+
+	/* the sync flags can only be chosen at open */
+	if (flags & ~(WASI_FDFLAGS_APPEND | WASI_FDFLAGS_NONBLOCK))
+		return WASI_ENOTSUP;
+
+	oflags = 0;
+	if (flags & WASI_FDFLAGS_APPEND)
+		oflags |= O_APPEND;
+	if (flags & WASI_FDFLAGS_NONBLOCK)
+		oflags |= O_NONBLOCK;
+
+	return wasi_errno(sys_fcntl(host_fd, F_SETFL, oflags));
+}
+
+uint32_t wasmjit_wasi_fd_filestat_get(uint32_t fd, uint32_t buf,
+				      struct FuncInst *funcinst)
+{
+	struct WASIContext *ctx = wasi_get_context(funcinst);
+	struct stat st;
+	int host_fd;
+	long ret;
+
+	host_fd = wasi_host_fd(ctx, fd);
+	if (host_fd < 0)
+		return WASI_EBADF;
+
+	ret = sys_fstat(host_fd, &st);
+	if (ret < 0)
+		return wasi_errno(ret);
+
+	return wasi_store_filestat(ctx, buf, host_fd, &st);
+}
+
+uint32_t wasmjit_wasi_fd_prestat_get(uint32_t fd, uint32_t buf,
+				     struct FuncInst *funcinst)
+{
+	struct WASIContext *ctx = wasi_get_context(funcinst);
+	struct WASIPreopen *preopen;
+	char out[8];
+	uint32_t len;
+
+	if (wasi_host_fd(ctx, fd) < 0 || ctx->fds[fd].preopen < 0)
+		return WASI_EBADF;
+
+	preopen = &ctx->preopens[ctx->fds[fd].preopen];
+
+	memset(out, 0, sizeof(out));
+	out[0] = WASI_PREOPENTYPE_DIR;
+	len = uint32_t_swap_bytes(preopen->guest_path_len);
+	memcpy(out + 4, &len, sizeof(len));
+
+	return wasi_copy_to_user(ctx, buf, out, sizeof(out));
+}
+
+uint32_t wasmjit_wasi_fd_prestat_dir_name(uint32_t fd, uint32_t path,
+					  uint32_t path_len,
+					  struct FuncInst *funcinst)
+{
+	struct WASIContext *ctx = wasi_get_context(funcinst);
+	struct WASIPreopen *preopen;
+
+	if (wasi_host_fd(ctx, fd) < 0 || ctx->fds[fd].preopen < 0)
+		return WASI_EBADF;
+
+	preopen = &ctx->preopens[ctx->fds[fd].preopen];
+	if (path_len < preopen->guest_path_len)
+		return WASI_ENAMETOOLONG;
+
+	return wasi_copy_to_user(ctx, path, preopen->guest_path,
+				 preopen->guest_path_len);
+}
+
+uint32_t wasmjit_wasi_fd_read(uint32_t fd, uint32_t iovs, uint32_t iovs_len,
+			      uint32_t nread, struct FuncInst *funcinst)
+{
+	struct WASIContext *ctx = wasi_get_context(funcinst);
+	struct iovec fast_iov[WASMJIT_UIO_FASTIOV], *liov;
+	int host_fd;
+	long ret;
+
+	host_fd = wasi_host_fd(ctx, fd);
+	if (host_fd < 0)
+		return WASI_EBADF;
+
+	if (!wasi_check_range(ctx, nread, 4))
+		return WASI_EFAULT;
+
+	ret = wasmjit_copy_iov(ctx->meminst, iovs, iovs_len, fast_iov, &liov);
+	if (ret)
+		return wasi_errno(ret);
+
+	ret = sys_readv(host_fd, liov, iovs_len);
+	wasmjit_free_iov(liov, fast_iov);
+	if (ret < 0)
+		return wasi_errno(ret);
+
+	return wasi_store_u32(ctx, nread, ret);
+}
+
+uint32_t wasmjit_wasi_fd_write(uint32_t fd, uint32_t iovs, uint32_t iovs_len,
+			       uint32_t nwritten, struct FuncInst *funcinst)
+{
+	struct WASIContext *ctx = wasi_get_context(funcinst);
+	struct iovec fast_iov[WASMJIT_UIO_FASTIOV], *liov;
+	int host_fd;
+	long ret;
+
+	host_fd = wasi_host_fd(ctx, fd);
+	if (host_fd < 0)
+		return WASI_EBADF;
+
+	if (!wasi_check_range(ctx, nwritten, 4))
+		return WASI_EFAULT;
+
+	ret = wasmjit_copy_iov(ctx->meminst, iovs, iovs_len, fast_iov, &liov);
+	if (ret)
+		return wasi_errno(ret);
+
+	ret = sys_writev(host_fd, liov, iovs_len);
+	wasmjit_free_iov(liov, fast_iov);
+	if (ret < 0)
+		return wasi_errno(ret);
+
+	return wasi_store_u32(ctx, nwritten, ret);
+}
+
+#if defined(__KERNEL__) || defined(__linux__)
+
+/* no vectored positional I/O in the syscall table, so one call per
+   buffer, stopping at the first short transfer */
+static long wasi_positional_io(int host_fd, struct iovec *liov,
+			       uint32_t iovs_len, uint64_t offset,
+			       int write)
+{
+	size_t total = 0;
+	uint32_t i;
+
+	for (i = 0; i < iovs_len; ++i) {
+		long ret;
+
+		if (write)
+			ret = sys_pwrite64(host_fd, liov[i].iov_base,
+					   liov[i].iov_len, offset + total);
+		else
+			ret = sys_pread64(host_fd, liov[i].iov_base,
+					  liov[i].iov_len, offset + total);
+		if (ret < 0)
+			return total ? (long) total : ret;
+
+		total += ret;
+		if ((size_t) ret < liov[i].iov_len)
+			break;
+	}
+
+	return total;
+}
+
+#else
+
+static long wasi_positional_io(int host_fd, struct iovec *liov,
+			       uint32_t iovs_len, uint64_t offset,
+			       int write)
+{
+	(void) host_fd;
+	(void) liov;
+	(void) iovs_len;
+	(void) offset;
+	(void) write;
+	return -ENOSYS;
+}
+
+#endif
+
+static uint32_t wasi_fd_pio(struct FuncInst *funcinst, uint32_t fd,
+			    uint32_t iovs, uint32_t iovs_len,
+			    uint64_t offset, uint32_t nbytes, int write)
+{
+	struct WASIContext *ctx = wasi_get_context(funcinst);
+	struct iovec fast_iov[WASMJIT_UIO_FASTIOV], *liov;
+	int host_fd;
+	long ret;
+
+	host_fd = wasi_host_fd(ctx, fd);
+	if (host_fd < 0)
+		return WASI_EBADF;
+
+	if (!wasi_check_range(ctx, nbytes, 4))
+		return WASI_EFAULT;
+
+	if (offset > INT64_MAX)
+		return WASI_EINVAL;
+
+	ret = wasmjit_copy_iov(ctx->meminst, iovs, iovs_len, fast_iov, &liov);
+	if (ret)
+		return wasi_errno(ret);
+
+	ret = wasi_positional_io(host_fd, liov, iovs_len, offset, write);
+	wasmjit_free_iov(liov, fast_iov);
+	if (ret < 0)
+		return wasi_errno(ret);
+
+	return wasi_store_u32(ctx, nbytes, ret);
+}
+
+uint32_t wasmjit_wasi_fd_pread(uint32_t fd, uint32_t iovs, uint32_t iovs_len,
+			       uint64_t offset, uint32_t nread,
+			       struct FuncInst *funcinst)
+{
+	return wasi_fd_pio(funcinst, fd, iovs, iovs_len, offset, nread, 0);
+}
+
+uint32_t wasmjit_wasi_fd_pwrite(uint32_t fd, uint32_t iovs, uint32_t iovs_len,
+				uint64_t offset, uint32_t nwritten,
+				struct FuncInst *funcinst)
+{
+	return wasi_fd_pio(funcinst, fd, iovs, iovs_len, offset, nwritten, 1);
+}
+
+uint32_t wasmjit_wasi_fd_seek(uint32_t fd, uint64_t offset, uint32_t whence,
+			      uint32_t newoffset, struct FuncInst *funcinst)
+{
+	struct WASIContext *ctx = wasi_get_context(funcinst);
+	int host_fd, lwhence;
+	long ret;
+
+	host_fd = wasi_host_fd(ctx, fd);
+	if (host_fd < 0)
+		return WASI_EBADF;
+
+	switch (whence) {
+	case WASI_WHENCE_SET:
+		lwhence = SEEK_SET;
+		break;
+	case WASI_WHENCE_CUR:
+		lwhence = SEEK_CUR;
+		break;
+	case WASI_WHENCE_END:
+		lwhence = SEEK_END;
+		break;
+	default:
+		return WASI_EINVAL;
+	}
+
+	if (!wasi_check_range(ctx, newoffset, 8))
+		return WASI_EFAULT;
+
+	ret = sys_lseek(host_fd, (int64_t) offset, lwhence);
+	if (ret < 0)
+		return wasi_errno(ret);
+
+	return wasi_store_u64(ctx, newoffset, ret);
+}
+
+uint32_t wasmjit_wasi_fd_tell(uint32_t fd, uint32_t offset,
+			      struct FuncInst *funcinst)
+{
+	return wasmjit_wasi_fd_seek(fd, 0, WASI_WHENCE_CUR, offset, funcinst);
+}
+
+uint32_t wasmjit_wasi_fd_sync(uint32_t fd, struct FuncInst *funcinst)
+{
+	int host_fd;
+
+	host_fd = wasi_host_fd(wasi_get_context(funcinst), fd);
+	if (host_fd < 0)
+		return WASI_EBADF;
+
+	return wasi_errno(sys_fsync(host_fd));
+}
+
+#if defined(__KERNEL__) || defined(__linux__)
+
+static uint8_t wasi_dirent_type(unsigned char type)
+{
+	switch (type) {
+	case DT_BLK:
+		return WASI_FILETYPE_BLOCK_DEVICE;
+	case DT_CHR:
+		return WASI_FILETYPE_CHARACTER_DEVICE;
+	case DT_DIR:
+		return WASI_FILETYPE_DIRECTORY;
+	case DT_REG:
+		return WASI_FILETYPE_REGULAR_FILE;
+	case DT_LNK:
+		return WASI_FILETYPE_SYMBOLIC_LINK;
+	case DT_SOCK:
+		return WASI_FILETYPE_SOCKET_STREAM;
+	default:
+		return WASI_FILETYPE_UNKNOWN;
+	}
+}
+
+#define WASI_GETDENTS_SIZE 4096
+
+/*
+  Cookies are the host's d_off values, so each call seeks to where
+  the guest left off. The last entry is truncated if it doesn't fit,
+  a bufused short of buf_len tells the guest the listing has ended.
+*/
+uint32_t wasmjit_wasi_fd_readdir(uint32_t fd, uint32_t buf, uint32_t buf_len,
+				 uint64_t cookie, uint32_t bufused,
+				 struct FuncInst *funcinst)
+{
+	struct WASIContext *ctx = wasi_get_context(funcinst);
+	char *dents, *dst;
+	uint32_t used;
+	int host_fd;
+	long ret;
+
+	host_fd = wasi_host_fd(ctx, fd);
+	if (host_fd < 0)
+		return WASI_EBADF;
+
+	if (!wasi_check_range(ctx, buf, buf_len) ||
+	    !wasi_check_range(ctx, bufused, 4))
+		return WASI_EFAULT;
+
+	if (cookie > INT64_MAX)
+		return WASI_EINVAL;
+
+	ret = sys_lseek(host_fd, cookie, SEEK_SET);
+	if (ret < 0)
+		return wasi_errno(ret);
+
+	dents = malloc(WASI_GETDENTS_SIZE);
+	if (!dents)
+		return WASI_ENOMEM;
+
+	dst = ctx->meminst->data + buf;
+	used = 0;
+	while (used < buf_len) {
+		long off;
+
+		ret = sys_getdents64(host_fd, (sys_dirent64_t *) dents,
+				     WASI_GETDENTS_SIZE);
+		if (ret <= 0)
+			break;
+
+		for (off = 0; off < ret && used < buf_len;) {
+			sys_dirent64_t *d = (sys_dirent64_t *) (dents + off);
+			char out[WASI_DIRENT_SIZE];
+			size_t namlen, n;
+			uint32_t le_namlen;
+
+			namlen = strlen(d->d_name);
+
+			memset(out, 0, sizeof(out));
+			encode_le_uint64_t(d->d_off, out + 0);
+			encode_le_uint64_t(d->d_ino, out + 8);
+			le_namlen = uint32_t_swap_bytes(namlen);
+			memcpy(out + 16, &le_namlen, sizeof(le_namlen));
+			out[20] = wasi_dirent_type(d->d_type);
+
+			n = MMIN(sizeof(out), buf_len - used);
+			memcpy(dst + used, out, n);
+			used += n;
+
+			n = MMIN(namlen, buf_len - used);
+			memcpy(dst + used, d->d_name, n);
+			used += n;
+
+			off += d->d_reclen;
+		}
+	}
+
+	free(dents);
+
+	if (ret < 0)
+		return wasi_errno(ret);
+
+	return wasi_store_u32(ctx, bufused, used);
+}
+
+#else
+
+uint32_t wasmjit_wasi_fd_readdir(uint32_t fd, uint32_t buf, uint32_t buf_len,
+				 uint64_t cookie, uint32_t bufused,
+				 struct FuncInst *funcinst)
+{
+	(void) fd;
+	(void) buf;
+	(void) buf_len;
+	(void) cookie;
+	(void) bufused;
+	(void) funcinst;
+	return WASI_ENOSYS;
+}
+
+#endif
+
+uint32_t wasmjit_wasi_path_open(uint32_t fd, uint32_t dirflags,
+				uint32_t path, uint32_t path_len,
+				uint32_t oflags, uint64_t fs_rights_base,
+				uint64_t fs_rights_inheriting,
+				uint32_t fdflags, uint32_t opened_fd,
+				struct FuncInst *funcinst)
+{
+	struct WASIContext *ctx = wasi_get_context(funcinst);
+	int dirfd, flags;
+	long ret, guest_fd;
+
+	(void) fs_rights_inheriting;
+
+	ret = wasi_get_path(ctx, fd, path, path_len, &dirfd);
+	if (ret)
+		return ret;
+
+	if (!wasi_check_range(ctx, opened_fd, 4))
+		return WASI_EFAULT;
+
+	if ((fs_rights_base & WASI_RIGHTS_FD_READ) &&
+	    (fs_rights_base & WASI_RIGHTS_FD_WRITE))
+		flags = O_RDWR;
+	else if (fs_rights_base & WASI_RIGHTS_FD_WRITE)
+		flags = O_WRONLY;
+	else
+		flags = O_RDONLY;
+
+	flags |= O_CLOEXEC;
+	if (!(dirflags & WASI_LOOKUPFLAGS_SYMLINK_FOLLOW))
+		flags |= O_NOFOLLOW;
+	if (oflags & WASI_OFLAGS_CREAT)
+		flags |= O_CREAT;
+	if (oflags & WASI_OFLAGS_DIRECTORY)
+		flags |= O_DIRECTORY;
+	if (oflags & WASI_OFLAGS_EXCL)
+		flags |= O_EXCL;
+	if (oflags & WASI_OFLAGS_TRUNC)
+		flags |= O_TRUNC;
+	if (fdflags & WASI_FDFLAGS_APPEND)
+		flags |= O_APPEND;
+	if (fdflags & WASI_FDFLAGS_NONBLOCK)
+		flags |= O_NONBLOCK;
+	if (fdflags & (WASI_FDFLAGS_SYNC | WASI_FDFLAGS_RSYNC))
+		flags |= O_SYNC;
+#ifdef O_DSYNC
+	else if (fdflags & WASI_FDFLAGS_DSYNC)
+		flags |= O_DSYNC;
+#endif
+
+	guest_fd = wasi_alloc_fd(ctx);
+	if (guest_fd < 0)
+		return WASI_EMFILE;
+
+	ret = wasmjit_emscripten_openat_beneath(dirfd, ctx->path, flags, 0666);
+	if (ret < 0)
+		return wasi_errno(ret);
+
+	ctx->fds[guest_fd].host_fd = ret;
+	ctx->fds[guest_fd].preopen = -1;
+
+	return wasi_store_u32(ctx, opened_fd, guest_fd);
+}
+
+/* only for fstat(), O_PATH also works for files the guest cannot read */
+#ifdef O_PATH
+#define WASI_STAT_FLAGS (O_PATH | O_CLOEXEC)
+#else
+#define WASI_STAT_FLAGS (O_RDONLY | O_CLOEXEC)
+#endif
+
+uint32_t wasmjit_wasi_path_filestat_get(uint32_t fd, uint32_t flags,
+					uint32_t path, uint32_t path_len,
+					uint32_t buf,
+					struct FuncInst *funcinst)
+{
+	struct WASIContext *ctx = wasi_get_context(funcinst);
+	struct stat st;
+	const char *name;
+	int dirfd;
+	long ret, host_fd;
+
+	ret = wasi_get_path(ctx, fd, path, path_len, &dirfd);
+	if (ret)
+		return ret;
+
+	if (flags & WASI_LOOKUPFLAGS_SYMLINK_FOLLOW) {
+		host_fd = wasmjit_emscripten_openat_beneath(dirfd, ctx->path,
+							    WASI_STAT_FLAGS, 0);
+		if (host_fd < 0)
+			return wasi_errno(host_fd);
+		ret = sys_fstat(host_fd, &st);
+	} else {
+		host_fd = wasmjit_emscripten_open_parent_beneath(dirfd, ctx->path,
+								 ctx->path,
+								 &name);
+		if (host_fd < 0)
+			return wasi_errno(host_fd);
+		ret = sys_fstatat(host_fd, name, &st, AT_SYMLINK_NOFOLLOW);
+	}
+	sys_close(host_fd);
+	if (ret < 0)
+		return wasi_errno(ret);
+
+	return wasi_store_filestat(ctx, buf, -1, &st);
+}
+
+uint32_t wasmjit_wasi_path_unlink_file(uint32_t fd, uint32_t path,
+				       uint32_t path_len,
+				       struct FuncInst *funcinst)
+{
+	struct WASIContext *ctx = wasi_get_context(funcinst);
+	const char *name;
+	int host_fd;
+	long ret;
+
+	ret = wasi_open_parent(ctx, fd, path, path_len, &host_fd, &name);
+	if (ret)
+		return ret;
+
+	ret = sys_unlinkat(host_fd, name, 0);
+	sys_close(host_fd);
+
+	return wasi_errno(ret);
+}
+
+uint32_t wasmjit_wasi_path_create_directory(uint32_t fd, uint32_t path,
+					    uint32_t path_len,
+					    struct FuncInst *funcinst)
+{
+	struct WASIContext *ctx = wasi_get_context(funcinst);
+	const char *name;
+	int host_fd;
+	long ret;
+
+	ret = wasi_open_parent(ctx, fd, path, path_len, &host_fd, &name);
+	if (ret)
+		return ret;
+
+	ret = sys_mkdirat(host_fd, name, 0777);
+	sys_close(host_fd);
+
+	return wasi_errno(ret);
+}
+
+uint32_t wasmjit_wasi_path_remove_directory(uint32_t fd, uint32_t path,
+					    uint32_t path_len,
+					    struct FuncInst *funcinst)
+{
+	struct WASIContext *ctx = wasi_get_context(funcinst);
+	const char *name;
+	int host_fd;
+	long ret;
+
+	ret = wasi_open_parent(ctx, fd, path, path_len, &host_fd, &name);
+	if (ret)
+		return ret;
+
+	ret = sys_unlinkat(host_fd, name, AT_REMOVEDIR);
+	sys_close(host_fd);
+
+	return wasi_errno(ret);
+}
+
+uint32_t wasmjit_wasi_path_rename(uint32_t fd, uint32_t old_path,
+				  uint32_t old_path_len, uint32_t new_fd,
+				  uint32_t new_path, uint32_t new_path_len,
+				  struct FuncInst *funcinst)
+{
+	struct WASIContext *ctx = wasi_get_context(funcinst);
+	const char *name;
+	char *old_name;
+	int old_dirfd, new_dirfd;
+	size_t len;
+	long ret;
+
+	ret = wasi_open_parent(ctx, fd, old_path, old_path_len,
+			       &old_dirfd, &name);
+	if (ret)
+		return ret;
+
+	/* ctx->path is about to hold the new path */
+	len = strlen(name) + 1;
+	old_name = malloc(len);
+	if (!old_name) {
+		ret = WASI_ENOMEM;
+		goto error;
+	}
+	memcpy(old_name, name, len);
+
+	ret = wasi_open_parent(ctx, new_fd, new_path, new_path_len,
+			       &new_dirfd, &name);
+	if (ret)
+		goto error;
+
+	ret = wasi_errno(sys_renameat(old_dirfd, old_name, new_dirfd, name));
+	sys_close(new_dirfd);
+
+ error:
+	free(old_name);
+	sys_close(old_dirfd);
+
+	return ret;
+}
+
+struct wasi_subscription {
+	uint64_t userdata;
+	/* clocks only, relative to the start of the call */
+	uint64_t timeout;
+	uint16_t error;
+	uint8_t type;
+};
+
+static void wasi_store_event(struct WASIContext *ctx, uint32_t out,
+			     const struct wasi_subscription *sub,
+			     uint16_t error, uint16_t flags)
+{
+	char event[WASI_EVENT_SIZE];
+
+	memset(event, 0, sizeof(event));
+	encode_le_uint64_t(sub->userdata, event + 0);
+	error = uint16_t_swap_bytes(error);
+	memcpy(event + 8, &error, sizeof(error));
+	event[10] = sub->type;
+	flags = uint16_t_swap_bytes(flags);
+	memcpy(event + 24, &flags, sizeof(flags));
+
+	memcpy(ctx->meminst->data + out, event, sizeof(event));
+}
+
+/*
+  Fd subscriptions become one poll() set and the earliest clock its
+  timeout, in milliseconds like poll() itself. Subscriptions that
+  can't be polled are reported as events with an error right away.
+*/
+uint32_t wasmjit_wasi_poll_oneoff(uint32_t in, uint32_t out,
+				  uint32_t nsubscriptions, uint32_t nevents,
+				  struct FuncInst *funcinst)
+{
+	struct WASIContext *ctx = wasi_get_context(funcinst);
+	struct wasi_subscription *subs = NULL;
+	struct pollfd *fds = NULL;
+	uint64_t timeout;
+	uint32_t i, n, nerrors;
+	int poll_timeout;
+	long ret;
+
+	if (!nsubscriptions)
+		return WASI_EINVAL;
+
+	if (!wasi_check_range(ctx, in,
+			      (size_t) nsubscriptions * WASI_SUBSCRIPTION_SIZE) ||
+	    !wasi_check_range(ctx, out,
+			      (size_t) nsubscriptions * WASI_EVENT_SIZE) ||
+	    !wasi_check_range(ctx, nevents, 4))
+		return WASI_EFAULT;
+
+	subs = wasmjit_alloc_vector(nsubscriptions, sizeof(*subs), NULL);
+	fds = wasmjit_alloc_vector(nsubscriptions, sizeof(*fds), NULL);
+	if (!subs || !fds) {
+		ret = WASI_ENOMEM;
+		goto error;
+	}
+
+	timeout = UINT64_MAX;
+	nerrors = 0;
+	for (i = 0; i < nsubscriptions; ++i) {
+		const char *src = ctx->meminst->data + in +
+			(size_t) i * WASI_SUBSCRIPTION_SIZE;
+		struct wasi_subscription *sub = &subs[i];
+
+		sub->userdata = wasi_load_u64(src + 0);
+		sub->type = src[8];
+		sub->error = 0;
+		fds[i].fd = -1;
+		fds[i].events = 0;
+		fds[i].revents = 0;
+
+		switch (sub->type) {
+		case WASI_EVENTTYPE_CLOCK: {
+			struct timespec ts;
+			uint64_t now;
+			long clock;
+
+			sub->timeout = wasi_load_u64(src + 24);
+
+			if (!(wasi_load_u16(src + 40) &
+			      WASI_SUBCLOCKFLAGS_ABSTIME))
+				break;
+
+			clock = wasi_clock_id(wasi_load_u32(src + 16));
+			if (clock < 0) {
+				sub->error = WASI_EINVAL;
+				break;
+			}
+
+			ret = sys_clock_gettime(clock, &ts);
+			if (ret < 0) {
+				sub->error = wasi_errno(ret);
+				break;
+			}
+
+			now = ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+			sub->timeout = sub->timeout > now
+				? sub->timeout - now
+				: 0;
+			break;
+		}
+		case WASI_EVENTTYPE_FD_READ:
+		case WASI_EVENTTYPE_FD_WRITE:
+			fds[i].fd = wasi_host_fd(ctx, wasi_load_u32(src + 16));
+			if (fds[i].fd < 0) {
+				sub->error = WASI_EBADF;
+				break;
+			}
+			fds[i].events = sub->type == WASI_EVENTTYPE_FD_READ
+				? POLLIN
+				: POLLOUT;
+			break;
+		default:
+			sub->error = WASI_EINVAL;
+			break;
+		}
+
+		if (sub->error)
+			nerrors++;
+		else if (sub->type == WASI_EVENTTYPE_CLOCK &&
+			 sub->timeout < timeout)
+			timeout = sub->timeout;
+	}
+
+	if (nerrors)
+		poll_timeout = 0;
+	else if (timeout == UINT64_MAX)
+		poll_timeout = -1;
+	else if (timeout / 1000000 >= INT_MAX)
+		poll_timeout = INT_MAX;
+	else
+		poll_timeout = (timeout + 999999) / 1000000;
+
+	ret = sys_poll(fds, nsubscriptions, poll_timeout);
+	if (ret < 0) {
+		ret = wasi_errno(ret);
+		goto error;
+	}
+
+	n = 0;
+	for (i = 0; i < nsubscriptions; ++i) {
+		struct wasi_subscription *sub = &subs[i];
+		uint32_t dst = out + n * WASI_EVENT_SIZE;
+
+		if (sub->error) {
+			wasi_store_event(ctx, dst, sub, sub->error, 0);
+		} else if (sub->type == WASI_EVENTTYPE_CLOCK) {
+			/* only the clock poll() waited for has fired */
+			if (ret || nerrors || sub->timeout != timeout)
+				continue;
+			wasi_store_event(ctx, dst, sub, 0, 0);
+		} else if (fds[i].revents & POLLNVAL) {
+			wasi_store_event(ctx, dst, sub, WASI_EBADF, 0);
+		} else if (fds[i].revents) {
+			wasi_store_event(ctx, dst, sub, 0,
+					 fds[i].revents & POLLHUP
+					 ? WASI_EVENTRWFLAGS_HANGUP
+					 : 0);
+		} else {
+			continue;
+		}
+		n++;
+	}
+
+	ret = wasi_store_u32(ctx, nevents, n);
+
+ error:
+	free(fds);
+	free(subs);
+
+	return ret;
+}
+
+void wasmjit_wasi_proc_exit(uint32_t code, struct FuncInst *funcinst)
+{
+	struct WASIContext *ctx = wasi_get_context(funcinst);
+
+	/* unwinds to wasmjit_wasi_start() */
+	ctx->exited = 1;
+	ctx->exit_code = code;
+	wasmjit_trap(WASMJIT_TRAP_ABORT);
+}
+
+uint32_t wasmjit_wasi_random_get(uint32_t buf, uint32_t buf_len,
+				 struct FuncInst *funcinst)
+{
+	struct WASIContext *ctx = wasi_get_context(funcinst);
+
+	if (!wasi_check_range(ctx, buf, buf_len))
+		return WASI_EFAULT;
+
+#if defined(__KERNEL__) || defined(__linux__)
+	while (buf_len) {
+		long ret;
+
+		ret = sys_getrandom(ctx->meminst->data + buf, buf_len, 0);
+		if (ret < 0)
+			return wasi_errno(ret);
+
+		buf += ret;
+		buf_len -= ret;
+	}
+
+	return 0;
+#else
+	return WASI_ENOSYS;
+#endif
+}
+
+uint32_t wasmjit_wasi_sched_yield(struct FuncInst *funcinst)
+{
+	(void) funcinst;
+	return 0;
+}
+
+struct WASIContext *wasmjit_wasi_get_context(struct ModuleInst *module_inst)
+{
+	return module_inst->private_data;
+}
+
+int wasmjit_wasi_init(struct WASIContext *ctx,
+		      int argc, char **argv, char **envp)
+{
+	size_t i;
+
+	ctx->meminst = NULL;
+	ctx->argc = argc;
+	ctx->argv = argv;
+	ctx->envp = envp;
+	ctx->exited = 0;
+	ctx->exit_code = 0;
+	ctx->n_preopens = 0;
+
+	for (i = 0; i < WASMJIT_WASI_MAX_FDS; ++i) {
+		ctx->fds[i].host_fd = -1;
+		ctx->fds[i].preopen = -1;
+		ctx->fds[i].stdio = 0;
+	}
+
+	/* stdio is shared with the host */
+	for (i = 0; i < 3; ++i) {
+		ctx->fds[i].host_fd = i;
+		ctx->fds[i].stdio = 1;
+	}
+	ctx->n_fds = 3;
+
+	return 0;
+}
+
+int wasmjit_wasi_preopen(struct WASIContext *ctx,
+			 const char *guest_path,
+			 const char *host_path)
+{
+	struct WASIPreopen *preopen;
+	size_t len;
+	long guest_fd, ret;
+
+	if (ctx->n_preopens == WASMJIT_WASI_MAX_PREOPENS)
+		return -1;
+
+	len = strlen(guest_path);
+	if (len >= sizeof(preopen->guest_path))
+		return -1;
+
+	guest_fd = wasi_alloc_fd(ctx);
+	if (guest_fd < 0)
+		return -1;
+
+	ret = sys_openat(AT_FDCWD, host_path,
+			 O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+	if (ret < 0)
+		return -1;
+
+	preopen = &ctx->preopens[ctx->n_preopens];
+	memcpy(preopen->guest_path, guest_path, len + 1);
+	preopen->guest_path_len = len;
+
+	ctx->fds[guest_fd].host_fd = ret;
+	ctx->fds[guest_fd].preopen = ctx->n_preopens++;
+
+	return 0;
+}
+
+int wasmjit_wasi_start(struct WASIContext *ctx,
+		       struct MemInst *meminst,
+		       struct FuncInst *start_inst)
+{
+	int ret;
+
+	if (start_inst->type.n_inputs != 0 ||
+	    start_inst->type.output_type != VALTYPE_NULL)
+		return -1;
+
+	ctx->meminst = meminst;
+	ctx->exited = 0;
+
+	ret = wasmjit_invoke_function(start_inst, NULL, NULL);
+
+	if (ctx->exited)
+		return 0xff & ctx->exit_code;
+
+	if (ret > 0)
+		return WASMJIT_ENCODE_TRAP_ERROR(ret);
+
+	return ret;
+}
+
+void wasmjit_wasi_cleanup(struct ModuleInst *module_inst)
+{
+	struct WASIContext *ctx = wasmjit_wasi_get_context(module_inst);
+	uint32_t i;
+
+	for (i = 0; i < ctx->n_fds; ++i) {
+		if (ctx->fds[i].host_fd >= 0 && !ctx->fds[i].stdio)
+			sys_close(ctx->fds[i].host_fd);
+		ctx->fds[i].host_fd = -1;
+		ctx->fds[i].preopen = -1;
+		ctx->fds[i].stdio = 0;
+	}
+	ctx->n_fds = 0;
+}
@@ -0,0 +1,148 @@
+/* -*-mode:c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+  Copyright (c) 2018 Rian Hunter
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+#ifndef __WASMJIT__WASI_RUNTIME_H__
+#define __WASMJIT__WASI_RUNTIME_H__
+
+#include <wasmjit/runtime.h>
+#include <wasmjit/util.h>
+#include <wasmjit/sys.h>
+
+enum {
+	WASMJIT_WASI_MAX_FDS = 1024,
+	WASMJIT_WASI_MAX_PREOPENS = 8,
+	WASMJIT_WASI_PREOPEN_PATH_MAX = 256,
+	WASMJIT_WASI_PATH_MAX = 4096,
+};
+
+/*
+  Guest fds index this table rather than naming host fds, so a guest
+  can only use what it was given or opened itself. Preopens record
+  which entry of WASIContext.preopens they are for fd_prestat_get().
+  Stdio entries borrow the host's own fds and never close them.
+ */
+struct WASIFd {
+	int host_fd;
+	int preopen;
+	int stdio;
+};
+
+struct WASIPreopen {
+	size_t guest_path_len;
+	char guest_path[WASMJIT_WASI_PREOPEN_PATH_MAX];
+};
+
+struct WASIContext {
+	/* the instance's exported memory, bound by wasmjit_wasi_start() */
+	struct MemInst *meminst;
+	int argc;
+	char **argv;
+	char **envp;
+	int exited;
+	uint32_t exit_code;
+	size_t n_preopens;
+	struct WASIPreopen preopens[WASMJIT_WASI_MAX_PREOPENS];
+	uint32_t n_fds;
+	struct WASIFd fds[WASMJIT_WASI_MAX_FDS];
+	char path[WASMJIT_WASI_PATH_MAX];
+};
+
+#define CTYPE_VALTYPE_I32 uint32_t
+#define CTYPE_VALTYPE_I64 uint64_t
+#define CTYPE_VALTYPE_NULL void
+#define CTYPE(val) CTYPE_ ## val
+
+#define __PARAM(to, n, t) CTYPE(t)
+
+#define COMMA_0
+#define COMMA_1 ,
+#define COMMA_2 ,
+#define COMMA_3 ,
+#define COMMA_4 ,
+#define COMMA_5 ,
+#define COMMA_6 ,
+#define COMMA_9 ,
+#define COMMA_IF_NOT_EMPTY(_n) CAT(COMMA_, _n)
+
+#define DEFINE_WASM_FUNCTION(_name, _fptr, _output, _n, ...)		\
+	CTYPE(_output)  wasmjit_wasi_ ## _name(__KMAP(_n, __PARAM, ##__VA_ARGS__) COMMA_IF_NOT_EMPTY(_n) struct FuncInst *);
+
+#define START_MODULE()
+#define END_MODULE()
+#define START_FUNCTION_DEFS()
+#define END_FUNCTION_DEFS()
+#define START_TABLE_DEFS()
+#define END_TABLE_DEFS()
+#define START_MEMORY_DEFS()
+#define END_MEMORY_DEFS()
+#define START_GLOBAL_DEFS()
+#define END_GLOBAL_DEFS()
+
+#include <wasmjit/wasi_runtime_def.h>
+
+#undef COMMA_0
+#undef COMMA_1
+#undef COMMA_2
+#undef COMMA_3
+#undef COMMA_4
+#undef COMMA_5
+#undef COMMA_6
+#undef COMMA_9
+#undef COMMA_IF_NOT_EMPTY
+#undef START_MODULE
+#undef END_MODULE
+#undef DEFINE_WASM_FUNCTION
+#undef START_TABLE_DEFS
+#undef END_TABLE_DEFS
+#undef START_MEMORY_DEFS
+#undef END_MEMORY_DEFS
+#undef START_GLOBAL_DEFS
+#undef END_GLOBAL_DEFS
+#undef START_FUNCTION_DEFS
+#undef END_FUNCTION_DEFS
+
+#undef __PARAM
+#undef CTYPE
+#undef CTYPE_VALTYPE_I32
+#undef CTYPE_VALTYPE_I64
+#undef CTYPE_VALTYPE_NULL
+
+struct WASIContext *wasmjit_wasi_get_context(struct ModuleInst *);
+void wasmjit_wasi_cleanup(struct ModuleInst *);
+
+int wasmjit_wasi_init(struct WASIContext *ctx,
+		      int argc, char **argv, char **envp);
+int wasmjit_wasi_preopen(struct WASIContext *ctx,
+			 const char *guest_path,
+			 const char *host_path);
+
+/*
+  Binds meminst and runs _start. Returns the guest's exit code, or a
+  trap encoded with WASMJIT_ENCODE_TRAP_ERROR().
+ */
+int wasmjit_wasi_start(struct WASIContext *ctx,
+		       struct MemInst *meminst,
+		       struct FuncInst *start_inst);
+
+#endif
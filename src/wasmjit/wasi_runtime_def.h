@@ -0,0 +1,78 @@
+/* -*-mode:c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+  Copyright (c) 2018 Rian Hunter
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+#define CURRENT_MODULE wasi_snapshot_preview1
+
+START_MODULE()
+
+START_TABLE_DEFS()
+END_TABLE_DEFS()
+
+START_MEMORY_DEFS()
+END_MEMORY_DEFS()
+
+START_GLOBAL_DEFS()
+END_GLOBAL_DEFS()
+
+#define DEFINE_WASI_FUNCTION(_name, _output, _n, ...)			\
+	DEFINE_WASM_FUNCTION(_name, &(wasmjit_wasi_ ## _name), _output, _n, ##__VA_ARGS__)
+
+START_FUNCTION_DEFS()
+DEFINE_WASI_FUNCTION(args_get, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(args_sizes_get, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(environ_get, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(environ_sizes_get, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(clock_res_get, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(clock_time_get, VALTYPE_I32, 3, VALTYPE_I32, VALTYPE_I64, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(fd_close, VALTYPE_I32, 1, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(fd_fdstat_get, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(fd_fdstat_set_flags, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(fd_filestat_get, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(fd_prestat_get, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(fd_prestat_dir_name, VALTYPE_I32, 3, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(fd_read, VALTYPE_I32, 4, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(fd_readdir, VALTYPE_I32, 5, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32, VALTYPE_I64, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(fd_write, VALTYPE_I32, 4, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(fd_pread, VALTYPE_I32, 5, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32, VALTYPE_I64, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(fd_pwrite, VALTYPE_I32, 5, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32, VALTYPE_I64, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(fd_seek, VALTYPE_I32, 4, VALTYPE_I32, VALTYPE_I64, VALTYPE_I32, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(fd_sync, VALTYPE_I32, 1, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(fd_tell, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(path_create_directory, VALTYPE_I32, 3, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(path_open, VALTYPE_I32, 9, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32, VALTYPE_I64, VALTYPE_I64, VALTYPE_I32, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(path_filestat_get, VALTYPE_I32, 5, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(path_remove_directory, VALTYPE_I32, 3, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(path_rename, VALTYPE_I32, 6, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(path_unlink_file, VALTYPE_I32, 3, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(poll_oneoff, VALTYPE_I32, 4, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(proc_exit, VALTYPE_NULL, 1, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(random_get, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
+DEFINE_WASI_FUNCTION(sched_yield, VALTYPE_I32, 0)
+END_FUNCTION_DEFS()
+
+END_MODULE()
+
+#undef DEFINE_WASI_FUNCTION
+
+#undef CURRENT_MODULE
@@ -0,0 +1,251 @@
+/* -*-mode:c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+  Copyright (c) 2018 Rian Hunter
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+/* the errno values of wasi_snapshot_preview1, 0 is success */
+
+#ifdef E2BIG
+ERRNO(E2BIG, 1)
+#endif
+#ifdef EACCES
+ERRNO(EACCES, 2)
+#endif
+#ifdef EADDRINUSE
+ERRNO(EADDRINUSE, 3)
+#endif
+#ifdef EADDRNOTAVAIL
+ERRNO(EADDRNOTAVAIL, 4)
+#endif
+#ifdef EAFNOSUPPORT
+ERRNO(EAFNOSUPPORT, 5)
+#endif
+#ifdef EAGAIN
+ERRNO(EAGAIN, 6)
+#endif
+#ifdef EALREADY
+ERRNO(EALREADY, 7)
+#endif
+#ifdef EBADF
+ERRNO(EBADF, 8)
+#endif
+#ifdef EBADMSG
+ERRNO(EBADMSG, 9)
+#endif
+#ifdef EBUSY
+ERRNO(EBUSY, 10)
+#endif
+#ifdef ECANCELED
+ERRNO(ECANCELED, 11)
+#endif
+#ifdef ECHILD
+ERRNO(ECHILD, 12)
+#endif
+#ifdef ECONNABORTED
+ERRNO(ECONNABORTED, 13)
+#endif
+#ifdef ECONNREFUSED
+ERRNO(ECONNREFUSED, 14)
+#endif
+#ifdef ECONNRESET
+ERRNO(ECONNRESET, 15)
+#endif
+#ifdef EDEADLK
+ERRNO(EDEADLK, 16)
+#endif
+#ifdef EDESTADDRREQ
+ERRNO(EDESTADDRREQ, 17)
+#endif
+#ifdef EDOM
+ERRNO(EDOM, 18)
+#endif
+#ifdef EDQUOT
+ERRNO(EDQUOT, 19)
+#endif
+#ifdef EEXIST
+ERRNO(EEXIST, 20)
+#endif
+#ifdef EFAULT
+ERRNO(EFAULT, 21)
+#endif
+#ifdef EFBIG
+ERRNO(EFBIG, 22)
+#endif
+#ifdef EHOSTUNREACH
+ERRNO(EHOSTUNREACH, 23)
+#endif
+#ifdef EIDRM
+ERRNO(EIDRM, 24)
+#endif
+#ifdef EILSEQ
+ERRNO(EILSEQ, 25)
+#endif
+#ifdef EINPROGRESS
+ERRNO(EINPROGRESS, 26)
+#endif
+#ifdef EINTR
+ERRNO(EINTR, 27)
+#endif
+#ifdef EINVAL
+ERRNO(EINVAL, 28)
+#endif
+#ifdef EIO
+ERRNO(EIO, 29)
+#endif
+#ifdef EISCONN
+ERRNO(EISCONN, 30)
+#endif
+#ifdef EISDIR
+ERRNO(EISDIR, 31)
+#endif
+#ifdef ELOOP
+ERRNO(ELOOP, 32)
+#endif
+#ifdef EMFILE
+ERRNO(EMFILE, 33)
+#endif
+#ifdef EMLINK
+ERRNO(EMLINK, 34)
+#endif
+#ifdef EMSGSIZE
+ERRNO(EMSGSIZE, 35)
+#endif
+#ifdef EMULTIHOP
+ERRNO(EMULTIHOP, 36)
+#endif
+#ifdef ENAMETOOLONG
+ERRNO(ENAMETOOLONG, 37)
+#endif
+#ifdef ENETDOWN
+ERRNO(ENETDOWN, 38)
+#endif
+#ifdef ENETRESET
+ERRNO(ENETRESET, 39)
+#endif
+#ifdef ENETUNREACH
+ERRNO(ENETUNREACH, 40)
+#endif
+#ifdef ENFILE
+ERRNO(ENFILE, 41)
+#endif
+#ifdef ENOBUFS
+ERRNO(ENOBUFS, 42)
+#endif
+#ifdef ENODEV
+ERRNO(ENODEV, 43)
+#endif
+#ifdef ENOENT
+ERRNO(ENOENT, 44)
+#endif
+#ifdef ENOEXEC
+ERRNO(ENOEXEC, 45)
+#endif
+#ifdef ENOLCK
+ERRNO(ENOLCK, 46)
+#endif
+#ifdef ENOLINK
+ERRNO(ENOLINK, 47)
+#endif
+#ifdef ENOMEM
+ERRNO(ENOMEM, 48)
+#endif
+#ifdef ENOMSG
+ERRNO(ENOMSG, 49)
+#endif
+#ifdef ENOPROTOOPT
+ERRNO(ENOPROTOOPT, 50)
+#endif
+#ifdef ENOSPC
+ERRNO(ENOSPC, 51)
+#endif
+#ifdef ENOSYS
+ERRNO(ENOSYS, 52)
+#endif
+#ifdef ENOTCONN
+ERRNO(ENOTCONN, 53)
+#endif
+#ifdef ENOTDIR
+ERRNO(ENOTDIR, 54)
+#endif
+#ifdef ENOTEMPTY
+ERRNO(ENOTEMPTY, 55)
+#endif
+#ifdef ENOTRECOVERABLE
+ERRNO(ENOTRECOVERABLE, 56)
+#endif
+#ifdef ENOTSOCK
+ERRNO(ENOTSOCK, 57)
+#endif
+#ifdef ENOTSUP
+ERRNO(ENOTSUP, 58)
+#endif
+#ifdef ENOTTY
+ERRNO(ENOTTY, 59)
+#endif
+#ifdef ENXIO
+ERRNO(ENXIO, 60)
+#endif
+#ifdef EOVERFLOW
+ERRNO(EOVERFLOW, 61)
+#endif
+#ifdef EOWNERDEAD
+ERRNO(EOWNERDEAD, 62)
+#endif
+#ifdef EPERM
+ERRNO(EPERM, 63)
+#endif
+#ifdef EPIPE
+ERRNO(EPIPE, 64)
+#endif
+#ifdef EPROTO
+ERRNO(EPROTO, 65)
+#endif
+#ifdef EPROTONOSUPPORT
+ERRNO(EPROTONOSUPPORT, 66)
+#endif
+#ifdef EPROTOTYPE
+ERRNO(EPROTOTYPE, 67)
+#endif
+#ifdef ERANGE
+ERRNO(ERANGE, 68)
+#endif
+#ifdef EROFS
+ERRNO(EROFS, 69)
+#endif
+#ifdef ESPIPE
+ERRNO(ESPIPE, 70)
+#endif
+#ifdef ESRCH
+ERRNO(ESRCH, 71)
+#endif
+#ifdef ESTALE
+ERRNO(ESTALE, 72)
+#endif
+#ifdef ETIMEDOUT
+ERRNO(ETIMEDOUT, 73)
+#endif
+#ifdef ETXTBSY
+ERRNO(ETXTBSY, 74)
+#endif
+#ifdef EXDEV
+ERRNO(EXDEV, 75)
+#endif